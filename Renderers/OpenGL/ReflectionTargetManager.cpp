@@ -0,0 +1,234 @@
+// Reflection render target manager.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include "ReflectionTargetManager.h"
+
+#include <Resources/FrameBuffer.h>
+#include <Scene/WaterNode.h>
+#include <Scene/HeightMapView.h>
+
+#include <math.h>
+
+using namespace OpenEngine::Resources;
+using namespace OpenEngine::Scene;
+
+namespace OpenEngine {
+    namespace Renderers {
+        namespace OpenGL {
+
+            // The fractions of the viewport's width and height a
+            // reflection can have.
+            static const float scales[ReflectionTargetManager::SCALE_STEPS] = 
+                { 1.0f, 0.75f, 0.5f, 0.375f, 0.25f };
+
+            ReflectionTargetManager::ReflectionTargetManager()
+                : frame(0), staleFrames(DEFAULT_STALE_FRAMES), 
+                  pixelBudget(1024 * 768), refreshInterval(1) {
+                SetStaticThreshold(0.01f, 0.002f);
+            }
+
+            ReflectionTargetManager::~ReflectionTargetManager(){
+                for (unsigned int i = 0; i < targets.size(); ++i)
+                    delete targets[i].fbo;
+            }
+
+            void ReflectionTargetManager::SetStaticThreshold(const float distance, const float angle){
+                staticDistance = distance;
+                staticCosAngle = cos(angle);
+            }
+
+            bool ReflectionTargetManager::Update(WaterNode* node, const HeightMapView& view, 
+                                                 Vector<3, float> lightDir, RenderingEventArg& arg){
+                std::map<WaterNode*, WaterState>::iterator itr = Mark(node);
+                if (itr == waters.end()){
+                    WaterState init;
+                    init.fbo = NULL;
+                    init.scaleStep = -1;
+                    init.framesSinceRefresh = 0;
+                    init.lastFrame = frame;
+                    itr = waters.insert(std::make_pair(node, init)).first;
+                }
+                WaterState& state = itr->second;
+
+                // Find the wanted number of pixels.
+                float viewportPixels = float(arg.canvas.GetWidth()) * float(arg.canvas.GetHeight());
+                float pixels = viewportPixels * CalcCoverage(node, view);
+                if (pixels > pixelBudget)
+                    pixels = pixelBudget;
+
+                // Pick the smallest step that holds them. Only step
+                // down when well below the current step, so the
+                // target doesn't flip back and forth.
+                int step = 0;
+                while (step + 1 < SCALE_STEPS && 
+                       scales[step+1] * scales[step+1] * viewportPixels >= pixels)
+                    ++step;
+                if (state.scaleStep >= 0 && step > state.scaleStep){
+                    float next = scales[state.scaleStep+1];
+                    if (pixels > 0.8f * next * next * viewportPixels)
+                        step = state.scaleStep;
+                }
+                // Respect the budget even at the largest step.
+                while (step + 1 < SCALE_STEPS && 
+                       scales[step] * scales[step] * viewportPixels > pixelBudget)
+                    ++step;
+
+                // The size also changes with the viewport.
+                bool changed = false;
+                Vector<2, int> dim(int(arg.canvas.GetWidth() * scales[step]),
+                                   int(arg.canvas.GetHeight() * scales[step]));
+                if (step != state.scaleStep || state.fbo == NULL || state.fbo->GetDimension() != dim){
+                    FrameBuffer* fbo = GetTarget(node, dim, arg);
+                    changed = fbo != state.fbo;
+                    state.fbo = fbo;
+                    state.scaleStep = step;
+                    node->SetReflectionFbo(fbo);
+                }
+
+                // Decide if the reflection needs to be rendered.
+                Vector<3, float> viewPos = view.GetPosition();
+                Vector<3, float> viewDir = view.GetForward();
+                bool isStatic = !changed &&
+                    (viewPos - state.viewPos).GetLength() < staticDistance &&
+                    viewDir * state.viewDir > staticCosAngle &&
+                    lightDir.GetNormalize() * state.lightDir > staticCosAngle;
+
+                if (isStatic && state.framesSinceRefresh + 1 < refreshInterval){
+                    ++state.framesSinceRefresh;
+                    return false;
+                }
+
+                state.viewPos = viewPos;
+                state.viewDir = viewDir;
+                state.lightDir = lightDir.GetNormalize();
+                state.framesSinceRefresh = 0;
+                return true;
+            }
+
+            void ReflectionTargetManager::Touch(WaterNode* node){
+                Mark(node);
+            }
+
+            std::map<WaterNode*, ReflectionTargetManager::WaterState>::iterator 
+            ReflectionTargetManager::Mark(WaterNode* node){
+                std::map<WaterNode*, WaterState>::iterator itr = waters.find(node);
+                if (itr == waters.end()) return itr;
+                if (itr->second.fbo != node->GetReflectionFbo()){
+                    // A new node at the address of a deleted one, it
+                    // has it's own frame buffer.
+                    DeleteTarget(itr->second.fbo);
+                    waters.erase(itr);
+                    return waters.end();
+                }
+                if (itr->second.lastFrame == frame){
+                    // Seen twice, so this is the next frame.
+                    ++frame;
+                    ReleaseStale();
+                }
+                itr->second.lastFrame = frame;
+                return itr;
+            }
+
+            void ReflectionTargetManager::Release(WaterNode* node){
+                std::map<WaterNode*, WaterState>::iterator itr = waters.find(node);
+                if (itr == waters.end()) return;
+                DeleteTarget(itr->second.fbo);
+                waters.erase(itr);
+            }
+
+            void ReflectionTargetManager::ReleaseStale(){
+                std::map<WaterNode*, WaterState>::iterator itr = waters.begin();
+                while (itr != waters.end()){
+                    if (frame - itr->second.lastFrame > staleFrames){
+                        DeleteTarget(itr->second.fbo);
+                        waters.erase(itr++);
+                    }else
+                        ++itr;
+                }
+            }
+
+            void ReflectionTargetManager::DeleteTarget(FrameBuffer* fbo){
+                for (unsigned int i = 0; i < targets.size(); ++i)
+                    if (targets[i].fbo == fbo){
+                        delete fbo;
+                        targets.erase(targets.begin() + i);
+                        return;
+                    }
+            }
+
+            float ReflectionTargetManager::CalcCoverage(WaterNode* node, const HeightMapView& view) const{
+                // Project the rim of the water disc and use the
+                // screen space bounding rectangle.
+                const int samples = 16;
+                Vector<3, float> center = node->GetCenter();
+                float radius = node->GetDiameter();
+                Vector<2, float> min(1.0f), max(-1.0f);
+                for (int i = 0; i < samples; ++i){
+                    float angle = 2 * 3.14159f * i / samples;
+                    Vector<3, float> p = center + Vector<3, float>(radius * cos(angle), 0, radius * sin(angle));
+                    Vector<2, float> ndc;
+                    // Part of the disc is behind the camera, so it
+                    // can cover the whole screen.
+                    if (!view.Project(p, ndc)) return 1.0f;
+                    for (int c = 0; c < 2; ++c){
+                        min[c] = ndc[c] < min[c] ? ndc[c] : min[c];
+                        max[c] = ndc[c] > max[c] ? ndc[c] : max[c];
+                    }
+                }
+                float coverage = 1.0f;
+                for (int c = 0; c < 2; ++c){
+                    float lo = min[c] < -1 ? -1 : min[c];
+                    float hi = max[c] > 1 ? 1 : max[c];
+                    coverage *= hi > lo ? (hi - lo) / 2 : 0;
+                }
+                return coverage;
+            }
+
+            FrameBuffer* ReflectionTargetManager::GetTarget(WaterNode* node, Vector<2, int> dim, RenderingEventArg& arg){
+                // Release the nodes current target
+                Target* target = NULL;
+                for (unsigned int i = 0; i < targets.size(); ++i){
+                    if (targets[i].user == node)
+                        targets[i].user = NULL;
+                    if (targets[i].user == NULL && targets[i].fbo->GetDimension() == dim)
+                        target = &targets[i];
+                }
+
+                if (target == NULL){
+                    EvictTargets(arg);
+                    Target t;
+                    t.fbo = new FrameBuffer(dim, 1, false);
+                    arg.renderer.BindFrameBuffer(t.fbo);
+                    targets.push_back(t);
+                    target = &targets.back();
+                }
+                target->user = node;
+                return target->fbo;
+            }
+
+            void ReflectionTargetManager::EvictTargets(RenderingEventArg& arg){
+                std::vector<Target>::iterator itr = targets.begin();
+                while (itr != targets.end()){
+                    bool fits = false;
+                    for (int step = 0; step < SCALE_STEPS && !fits; ++step){
+                        Vector<2, int> dim(int(arg.canvas.GetWidth() * scales[step]),
+                                           int(arg.canvas.GetHeight() * scales[step]));
+                        fits = itr->fbo->GetDimension() == dim;
+                    }
+                    if (itr->user == NULL && !fits){
+                        delete itr->fbo;
+                        itr = targets.erase(itr);
+                    }else
+                        ++itr;
+                }
+            }
+
+        }
+    }
+}
@@ -0,0 +1,163 @@
+// Reflection render target manager.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _REFLECTION_TARGET_MANAGER_H_
+#define _REFLECTION_TARGET_MANAGER_H_
+
+#include <Math/Vector.h>
+#include <Renderers/IRenderer.h>
+
+#include <map>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Resources {
+        class FrameBuffer;
+    }
+    namespace Scene {
+        class WaterNode;
+        class HeightMapView;
+    }
+namespace Renderers {
+namespace OpenGL {
+
+using namespace OpenEngine::Math;
+
+/**
+ * Picks and caches the frame buffers water reflections are rendered
+ * into.
+ *
+ * The size of a reflection is chosen from the part of the screen the
+ * water covers, limited by a pixel budget. Sizes are taken from a
+ * fixed ladder of fractions of the viewport, so only a handful of
+ * frame buffers are ever created and they are reused across frames
+ * and water nodes.
+ *
+ * When the camera and sun are nearly static the reflection is only
+ * refreshed every n'th frame.
+ *
+ * The manager owns the frame buffers it creates. Unused frame
+ * buffers that don't fit the viewport any more are deleted when a
+ * new one is needed. A water node that hasn't been updated for a
+ * number of frames, because it was removed from the scene or
+ * deleted, is forgotten and it's frame buffer deleted. Nodes can
+ * also be released explicitly.
+ */
+class ReflectionTargetManager {
+public:
+    static const int SCALE_STEPS = 5;
+    static const unsigned int DEFAULT_STALE_FRAMES = 120;
+
+protected:
+    struct Target {
+        Resources::FrameBuffer* fbo;
+        Scene::WaterNode* user;
+    };
+
+    struct WaterState {
+        Resources::FrameBuffer* fbo;
+        int scaleStep;
+        Vector<3, float> viewPos;
+        Vector<3, float> viewDir;
+        Vector<3, float> lightDir;
+        unsigned int framesSinceRefresh;
+        unsigned int lastFrame;
+    };
+
+    std::vector<Target> targets;
+    std::map<Scene::WaterNode*, WaterState> waters;
+    // Counts the frames, which start when a node is updated again.
+    unsigned int frame;
+    unsigned int staleFrames;
+
+    unsigned int pixelBudget;
+    unsigned int refreshInterval;
+    float staticDistance;
+    float staticCosAngle;
+
+public:
+    ReflectionTargetManager();
+    ~ReflectionTargetManager();
+
+    /**
+     * The maximum number of pixels in a reflection.
+     */
+    void SetPixelBudget(const unsigned int pixels) { pixelBudget = pixels; }
+    unsigned int GetPixelBudget() const { return pixelBudget; }
+
+    /**
+     * Refresh the reflection every interval'th frame while the
+     * camera and sun are static. 1 refreshes every frame.
+     */
+    void SetRefreshInterval(const unsigned int interval) { refreshInterval = interval < 1 ? 1 : interval; }
+    unsigned int GetRefreshInterval() const { return refreshInterval; }
+
+    /**
+     * The camera is considered static if it moved less than distance
+     * and turned less than angle radians since the reflection was
+     * last rendered. The same angle is used for the sun.
+     */
+    void SetStaticThreshold(const float distance, const float angle);
+
+    /**
+     * Forget the water nodes that haven't been updated for the
+     * number of frames and delete their frame buffers.
+     */
+    void SetStaleFrames(const unsigned int frames) { staleFrames = frames; }
+    unsigned int GetStaleFrames() const { return staleFrames; }
+
+    /**
+     * Fits the reflection frame buffer of the water node to the
+     * current view and sets it on the node.
+     *
+     * @return True if the reflection should be rendered this frame.
+     */
+    bool Update(Scene::WaterNode* node, const Scene::HeightMapView& view, 
+                Vector<3, float> lightDir, RenderingEventArg& arg);
+    /**
+     * Keeps the water node and it's frame buffer alive for a frame
+     * where it isn't updated, fx. because it isn't visible.
+     */
+    void Touch(Scene::WaterNode* node);
+    /**
+     * Forgets the water node and deletes it's frame buffer. The
+     * node isn't touched, so it may already be deleted, but if it
+     * isn't it must not be rendered until it is updated again.
+     */
+    void Release(Scene::WaterNode* node);
+
+protected:
+    /**
+     * Returns the fraction of the screen covered by the water disc.
+     */
+    float CalcCoverage(Scene::WaterNode* node, const Scene::HeightMapView& view) const;
+    Resources::FrameBuffer* GetTarget(Scene::WaterNode* node, Vector<2, int> dim, RenderingEventArg& arg);
+    /**
+     * Deletes the targets without a user whose size is not on the
+     * ladder of the viewport.
+     */
+    void EvictTargets(RenderingEventArg& arg);
+    void DeleteTarget(Resources::FrameBuffer* fbo);
+    /**
+     * Marks the node as seen this frame and returns it's state, or
+     * end if the node is new.
+     */
+    std::map<Scene::WaterNode*, WaterState>::iterator Mark(Scene::WaterNode* node);
+    /**
+     * Releases the nodes that haven't been updated for the stale
+     * frames.
+     */
+    void ReleaseStale();
+};
+
+}
+}
+}
+
+#endif
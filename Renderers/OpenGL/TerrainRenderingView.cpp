@@ -13,15 +13,19 @@
 #include <Resources/FrameBuffer.h>
 #include <Scene/GrassNode.h>
 #include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapBintree.h>
+#include <Scene/HeightMapWorldNode.h>
 #include <Scene/SunNode.h>
 #include <Scene/SkySphereNode.h>
 #include <Scene/WaterNode.h>
 #include <Math/Vector.h>
 #include <Geometry/GeometrySet.h>
+#include <Display/IViewingVolume.h>
 
 #include <Logging/Logger.h>
 
 using namespace OpenEngine::Geometry;
+using namespace OpenEngine::Display;
 
 namespace OpenEngine {
     namespace Renderers {
@@ -30,12 +34,53 @@ namespace OpenEngine {
             using namespace OpenEngine::Scene;
             
             TerrainRenderingView::TerrainRenderingView()
-                : RenderingView() {
+                : RenderingView(), reflectionPass(false), 
+                  reflectionLODBias(1), reflectionGrass(false) {
 
                 lightDir = Vector<3, float>(1,1,1).GetNormalize();
             }
 
+            TerrainRenderingView::~TerrainRenderingView() {
+                std::map<LODContextKey, HeightMapLODContext*>::iterator itr;
+                for (itr = lodContexts.begin(); itr != lodContexts.end(); ++itr)
+                    delete itr->second;
+                for (itr = reflectionContexts.begin(); itr != reflectionContexts.end(); ++itr)
+                    delete itr->second;
+            }
+
+            HeightMapLODContext* TerrainRenderingView::GetLODContext(HeightMapNode* node, IViewingVolume* view) {
+                return GetLODContext(lodContexts, node, view);
+            }
+
+            HeightMapLODContext* TerrainRenderingView::GetLODContext(std::map<LODContextKey, HeightMapLODContext*>& contexts,
+                                                                     HeightMapNode* node, IViewingVolume* view) {
+                LODContextKey key(node, view);
+                std::map<LODContextKey, HeightMapLODContext*>::iterator itr = contexts.find(key);
+                if (itr != contexts.end())
+                    return itr->second;
+                HeightMapLODContext* context = new HeightMapLODContext();
+                contexts[key] = context;
+                return context;
+            }
+
+            void TerrainRenderingView::RemoveLODContexts(std::map<LODContextKey, HeightMapLODContext*>& contexts,
+                                                         HeightMapNode* node) {
+                std::map<LODContextKey, HeightMapLODContext*>::iterator itr =
+                    contexts.lower_bound(LODContextKey(node, NULL));
+                while (itr != contexts.end() && itr->first.first == node){
+                    delete itr->second;
+                    contexts.erase(itr++);
+                }
+            }
+
             void TerrainRenderingView::VisitGrassNode(GrassNode* node) {
+                // The grass isn't drawn until it's heightmap is ready.
+                if ((reflectionPass && !reflectionGrass) ||
+                    (!node->IsSetup() && !node->Setup(*arg))){
+                    node->VisitSubNodes(*this);
+                    return;
+                }
+
                 if (currentRenderState->IsOptionDisabled(RenderStateNode::BACKFACE))
                     glDisable(GL_CULL_FACE);
 
@@ -76,27 +121,118 @@ namespace OpenEngine {
             }
             
             void TerrainRenderingView::VisitHeightMapNode(HeightMapNode* node) {
+                if (node->IsLoading()){
+                    // Nothing to draw until the heightmap is built
+                    // and uploaded, a slice per frame.
+                    if (!reflectionPass)
+                        node->ContinueAsyncLoad(*arg);
+                    node->VisitSubNodes(*this);
+                    return;
+                }
+
+                HeightMapClipmap* clipmap = node->GetClipmap();
+                if (clipmap != NULL){
+                    // The mirrored view has the same position in the
+                    // plane, so the reflection pass reuses the rings.
+                    ApplyGeometrySet(GeometrySetPtr());
+                    IViewingVolume* view = arg->canvas.GetViewingVolume();
+                    clipmap->Update(view->GetPosition());
+
+                    IShaderResourcePtr shader = node->GetLandscapeShader();
+                    bool shaded = this->renderShader && shader;
+                    if (shaded){
+                        // The clipmap doesn't geomorph, like the
+                        // bintree.
+                        shader->SetUniform("lightDir", lightDir);
+                        shader->SetUniform("viewPos", view->GetPosition());
+                        shader->SetUniform("baseDistance", 0.0f);
+                        shader->SetUniform("invIncDistance", 0.0f);
+                        shader->ApplyShader();
+                    }
+
+                    clipmap->Render(*arg, shaded);
+
+                    if (shader){
+                        shader->ReleaseShader();
+                        this->currentShader.reset();
+                    }
+
+                    node->VisitSubNodes(*this);
+                    return;
+                }
+
                 bool bufferSupport = arg->renderer.BufferSupport();
                 
                 GeometrySetPtr geom = node->GetGeometrySet();
                 this->ApplyGeometrySet(geom);
 
+                IViewingVolume* view = arg->canvas.GetViewingVolume();
+
+                HeightMapBintree* bintree = node->GetBintree();
+                if (bintree != NULL){
+                    // The reflection reuses the main view's
+                    // triangulation.
+                    if (!reflectionPass)
+                        bintree->Update(view->GetPosition());
+
+                    IShaderResourcePtr shader = node->GetLandscapeShader();
+                    if (this->renderShader && shader){
+                        // The bintree is at full detail wherever it
+                        // is split, so disable geomorphing.
+                        shader->SetUniform("lightDir", lightDir);
+                        shader->SetUniform("viewPos", view->GetPosition());
+                        shader->SetUniform("baseDistance", 0.0f);
+                        shader->SetUniform("invIncDistance", 0.0f);
+                        shader->ApplyShader();
+                    }
+
+                    if (bufferSupport) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+                    node->ApplyPackedNormals();
+                    bintree->Render();
+                    node->ReleasePackedNormals();
+
+                    if (shader){
+                        shader->ReleaseShader();
+                        this->currentShader.reset();
+                    }
+
+                    node->VisitSubNodes(*this);
+                    return;
+                }
+
+                HeightMapLODContext* context;
+                if (reflectionPass){
+                    // Cull against the mirrored view with the
+                    // reflection LOD bias.
+                    context = GetLODContext(reflectionContexts, node, view);
+                    context->SetLODBias(reflectionLODBias);
+                    node->CalcLOD(*context, reflectionView);
+                }else{
+                    context = GetLODContext(node, view);
+                    node->CalcLOD(*context, view);
+                }
+
                 IShaderResourcePtr shader = node->GetLandscapeShader();
                 if (this->renderShader && shader){
-                    // Setup uniforms
+                    // Setup uniforms. Geomorph using the position and
+                    // distances the rendered LODs were calculated
+                    // from.
+                    const HeightMapLODPacket& packet = context->GetFrontPacket();
                     shader->SetUniform("lightDir", lightDir);
-                    shader->SetUniform("viewPos", arg->canvas.GetViewingVolume()->GetPosition());
+                    shader->SetUniform("viewPos", packet.view.GetPosition());
+                    shader->SetUniform("baseDistance", packet.baseDistance);
+                    shader->SetUniform("invIncDistance", packet.invIncDistance);
 
                     shader->ApplyShader();
                 }
 
-                node->CalcLOD(arg->canvas.GetViewingVolume());
-                
                 IndicesPtr indices = node->GetIndices();
                 if (bufferSupport) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices->GetID());
 
                 // Replace with a patch iterator
-                node->Render(*arg);
+                node->ApplyPackedNormals();
+                node->Render(*context, *arg);
+                node->ReleasePackedNormals();
 
                 if (shader){
                     shader->ReleaseShader();
@@ -105,12 +241,60 @@ namespace OpenEngine {
                 
                 if (bufferSupport) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-                if (renderTangent)
+                if (renderTangent && !reflectionPass)
                     node->RenderBoundingGeometry();
 
                 node->VisitSubNodes(*this);
             }
 
+            void TerrainRenderingView::VisitHeightMapWorldNode(HeightMapWorldNode* node) {
+                IViewingVolume* view = arg->canvas.GetViewingVolume();
+
+                if (!reflectionPass){
+                    // Page the tiles around the viewer, and forget
+                    // the contexts of the tiles that were dropped.
+                    node->Update(*arg, view->GetPosition());
+                    const std::vector<HeightMapNode*>& unloaded = node->GetUnloadedTiles();
+                    for (unsigned int i = 0; i < unloaded.size(); ++i){
+                        RemoveLODContexts(lodContexts, unloaded[i]);
+                        RemoveLODContexts(reflectionContexts, unloaded[i]);
+                    }
+                    node->ClearUnloadedTiles();
+                }
+
+                // The tiles only agree on the LOD of their borders
+                // if they scale their LOD distances alike, so give
+                // them all the scale of the world's controller.
+                float scale = node->GetLODController().GetDistanceScale();
+                for (int i = 0; i < node->GetNumberOfLoadedTiles(); ++i){
+                    HeightMapNode* tile = node->GetLoadedTile(i);
+                    if (!tile->IsReady() || tile->GetClipmap() || tile->GetBintree()) continue;
+                    HeightMapLODContext* context = reflectionPass ?
+                        GetLODContext(reflectionContexts, tile, view) : GetLODContext(tile, view);
+                    context->GetController().SetDistanceScale(scale);
+                }
+
+                node->VisitSubNodes(*this);
+
+                // Fill the holes of the tiles that are still loading.
+                ApplyGeometrySet(GeometrySetPtr());
+                node->RenderFillIn(*arg);
+
+                if (!reflectionPass){
+                    // Drive the controller with the totals of all
+                    // tiles, the scale is used from the next frame.
+                    unsigned int triangles = 0, cullTime = 0;
+                    for (int i = 0; i < node->GetNumberOfLoadedTiles(); ++i){
+                        HeightMapNode* tile = node->GetLoadedTile(i);
+                        if (!tile->IsReady() || tile->GetClipmap() || tile->GetBintree()) continue;
+                        const HeightMapLODPacket& packet = GetLODContext(tile, view)->GetFrontPacket();
+                        triangles += packet.triangles;
+                        cullTime += packet.cullTime;
+                    }
+                    node->GetLODController().Update(triangles, cullTime);
+                }
+            }
+
             void TerrainRenderingView::VisitSunNode(SunNode* node) {
                 lightDir = node->GetPos().GetNormalize();
 
@@ -158,47 +342,10 @@ namespace OpenEngine {
             void TerrainRenderingView::VisitWaterNode(WaterNode* node) {
                 IShaderResourcePtr shader = node->GetWaterShader();
                 if (shader != NULL){
-                    FrameBuffer* reflection = node->GetReflectionFbo();
-                    Vector<2, int> refDim = reflection->GetDimension();
+                    if (!reflectionPass)
+                        RenderReflection(node);
 
-                    // setup water clipping plane
-                    double plane[4] = {0.0, -1.0, 0.0, 0.0}; //water at y~~0
-                    glEnable(GL_CLIP_PLANE0);
-                    glClipPlane(GL_CLIP_PLANE0, plane);
-                    
-                    glViewport(0, 0, refDim[0], refDim[1]);
-
-                    // store previous frame buffer
-                    GLint prevFbo;
-                    glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &prevFbo);
-                    
-                    // Render reflection
-                    
-                    // Enable frame buffer
-                    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, reflection->GetID());
-                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-                    
-                    glCullFace(GL_FRONT);
-                    
-                    glPushMatrix();
-
-                    glScalef(1, -1, 1);
-                    glTranslatef(0, -2, 0);
-                    
-                    // Render scene
-                    node->VisitSubNodes(*this);
-                    
-                    glPopMatrix();
-                    glCullFace(GL_BACK);
-
-                    // Restore the previous frame buffer
-                    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, prevFbo);
-                    glDisable(GL_CLIP_PLANE0);
-                    
-                    // Reset viewport
-                    glViewport(0, 0, arg->canvas.GetWidth(), arg->canvas.GetHeight());
-                    
-                    // Render reflection
+                    // Render the scene
                     node->VisitSubNodes(*this);
 
                     ApplyGeometrySet(GeometrySetPtr());
@@ -270,6 +417,75 @@ namespace OpenEngine {
                 }
             }
             
+            void TerrainRenderingView::RenderReflection(WaterNode* node) {
+                IViewingVolume* view = arg->canvas.GetViewingVolume();
+                float waterHeight = node->GetCenter()[1];
+
+                // Nothing is reflected when the camera is below the
+                // water or the water isn't visible, but the target
+                // is kept while the water is in the scene.
+                HeightMapView mainView(view);
+                float radius = node->GetDiameter();
+                Vector<3, float> discMin = node->GetCenter() - Vector<3, float>(radius, 0, radius);
+                Vector<3, float> discMax = node->GetCenter() + Vector<3, float>(radius, 0, radius);
+                if (mainView.GetPosition()[1] < waterHeight ||
+                    !mainView.IsVisible(discMin, discMax)){
+                    reflectionTargets.Touch(node);
+                    return;
+                }
+
+                // Fit the reflection target to the water and skip
+                // the pass if the old reflection can be reused.
+                bool refresh = reflectionTargets.Update(node, mainView, lightDir, *arg);
+                FrameBuffer* reflection = node->GetReflectionFbo();
+                node->GetWaterShader()->SetTexture("reflection", reflection->GetTexAttachment(0));
+                if (!refresh) return;
+
+                reflectionView = mainView;
+                reflectionView.Mirror(waterHeight);
+
+                Vector<2, int> refDim = reflection->GetDimension();
+
+                // setup water clipping plane, keeping what is above
+                // the water after mirroring.
+                double plane[4] = {0.0, -1.0, 0.0, waterHeight};
+                glEnable(GL_CLIP_PLANE0);
+                glClipPlane(GL_CLIP_PLANE0, plane);
+
+                glViewport(0, 0, refDim[0], refDim[1]);
+
+                // store previous frame buffer
+                GLint prevFbo;
+                glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &prevFbo);
+
+                // Enable frame buffer
+                glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, reflection->GetID());
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+                glCullFace(GL_FRONT);
+
+                // Mirror in the water plane
+                glPushMatrix();
+                glTranslatef(0, waterHeight, 0);
+                glScalef(1, -1, 1);
+                glTranslatef(0, -waterHeight, 0);
+
+                // Render scene
+                reflectionPass = true;
+                node->VisitSubNodes(*this);
+                reflectionPass = false;
+
+                glPopMatrix();
+                glCullFace(GL_BACK);
+
+                // Restore the previous frame buffer
+                glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, prevFbo);
+                glDisable(GL_CLIP_PLANE0);
+
+                // Reset viewport
+                glViewport(0, 0, arg->canvas.GetWidth(), arg->canvas.GetHeight());
+            }
+
             void TerrainRenderingView::VisitSkySphereNode(SkySphereNode* node){
                 IShaderResourcePtr atm = node->GetAtmostphereShader();
 
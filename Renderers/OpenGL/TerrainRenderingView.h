@@ -12,12 +12,17 @@
 
 #include <Renderers/OpenGL/RenderingView.h>
 #include <Display/Viewport.h>
+#include <Renderers/OpenGL/ReflectionTargetManager.h>
 
 #include <Scene/GrassNode.h>
 #include <Scene/WaterNode.h>
 #include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapWorldNode.h>
 #include <Scene/SunNode.h>
 #include <Scene/SkySphereNode.h>
+#include <Scene/HeightMapLODContext.h>
+
+#include <map>
 
 namespace OpenEngine {
 namespace Renderers {
@@ -28,16 +33,67 @@ using namespace OpenEngine::Renderers;
  class TerrainRenderingView : public RenderingView {
  protected:
      Vector<3, float> lightDir;
+
+     // A LOD context for each heightmap and viewing volume pair, so
+     // views don't overwrite each others LODs.
+     typedef std::pair<HeightMapNode*, Display::IViewingVolume*> LODContextKey;
+     std::map<LODContextKey, HeightMapLODContext*> lodContexts;
+     std::map<LODContextKey, HeightMapLODContext*> reflectionContexts;
+
+     // Reflection pass state and settings.
+     bool reflectionPass;
+     HeightMapView reflectionView;
+     float reflectionLODBias;
+     bool reflectionGrass;
+     ReflectionTargetManager reflectionTargets;
      
  public:
      TerrainRenderingView();
+     ~TerrainRenderingView();
+
+     /**
+      * Returns the LOD context used to render the heightmap from the
+      * viewing volume. Can be used to set a LOD bias or pipeline the
+      * LOD calculation for a specific view.
+      */
+     HeightMapLODContext* GetLODContext(HeightMapNode* node, Display::IViewingVolume* view);
+
+     /**
+      * Sets the LOD bias used for heightmaps in water reflections.
+      */
+     void SetReflectionLODBias(const float bias) { reflectionLODBias = bias; }
+     float GetReflectionLODBias() const { return reflectionLODBias; }
+     /**
+      * Enable or disable rendering grass in water reflections.
+      */
+     void SetReflectionGrass(const bool grass) { reflectionGrass = grass; }
+     bool GetReflectionGrass() const { return reflectionGrass; }
+     /**
+      * The manager sizing and caching the reflection frame buffers.
+      */
+     ReflectionTargetManager& GetReflectionTargets() { return reflectionTargets; }
      
      void VisitGrassNode(GrassNode* node);
      void VisitHeightMapNode(HeightMapNode* node);
+     void VisitHeightMapWorldNode(HeightMapWorldNode* node);
      void VisitSunNode(SunNode* node);
      void VisitWaterNode(WaterNode* node);
      void VisitSkySphereNode(SkySphereNode* node);
 
+ protected:
+     HeightMapLODContext* GetLODContext(std::map<LODContextKey, HeightMapLODContext*>& contexts,
+                                        HeightMapNode* node, Display::IViewingVolume* view);
+     /**
+      * Deletes the contexts of a heightmap that has been deleted.
+      */
+     void RemoveLODContexts(std::map<LODContextKey, HeightMapLODContext*>& contexts,
+                            HeightMapNode* node);
+     /**
+      * Renders the reflection of the water nodes subtree into it's
+      * reflection frame buffer.
+      */
+     void RenderReflection(WaterNode* node);
+
  };
 
 }
@@ -35,6 +35,7 @@ namespace OpenEngine {
             heightmap = NULL;
             gridDim = straws = 0;
             elapsedTime = 0;
+            isSetup = false;
             grassGeom = CreateGrassObject();
         }
 
@@ -44,13 +45,25 @@ namespace OpenEngine {
               heightmap(heightmap),
               gridDim(gridDimension),
               straws(straws),
-              quadsPrObject(quadsPrObject) {
+              quadsPrObject(quadsPrObject),
+              isSetup(false) {
 
             grassGeom = CreateGrassObject();
         }
         
         void GrassNode::Handle(RenderingEventArg arg){
+            Setup(arg);
+        }
+
+        bool GrassNode::Setup(RenderingEventArg arg){
+            if (isSetup) return true;
+
             if (grassShader){
+                // The heightmap's textures are replaced while it
+                // loads.
+                if (heightmap == NULL || !heightmap->IsReady())
+                    return false;
+
                 float widthScale = heightmap->GetWidthScale();
 
                 ITexture2DPtr tex = heightmap->GetHeightMap();
@@ -71,6 +84,8 @@ namespace OpenEngine {
                 grassShader->SetUniform("invGridDim", 1.0f / float(gridDim));
 
                 grassShader->Load();
+                // The grass shares the heightmap's normal map.
+                grassShader->SetUniform("normalMapEncoding", (int)heightmap->GetNormalMapFormat());
 
                 grassShader->GetTexture("grassTex", tex);
                 tex->Load();
@@ -90,6 +105,9 @@ namespace OpenEngine {
                 arg.renderer.LoadTexture(tex);
                 tex->Unload();
             }
+
+            isSetup = true;
+            return true;
         }
 
         void GrassNode::Handle(Core::ProcessEventArg arg){
@@ -54,6 +54,7 @@ namespace OpenEngine {
             int quadsPrObject;
 
             unsigned int elapsedTime;
+            bool isSetup;
 
         public:
             GrassNode();
@@ -63,6 +64,18 @@ namespace OpenEngine {
             void Handle(RenderingEventArg arg);
             void Handle(Core::ProcessEventArg arg);
 
+            /**
+             * Sets up the grass shader with the heightmap's textures
+             * once the heightmap is ready. Called when the rendering
+             * is initialized and then every frame by the rendering
+             * view until it succeeds, since an asynchronously loaded
+             * heightmap isn't ready at initialization.
+             *
+             * @return True if the grass is set up.
+             */
+            bool Setup(RenderingEventArg arg);
+            bool IsSetup() const { return isSetup; }
+
             inline int GetGridDimension() const { return gridDim; }
             inline Resources::IShaderResourcePtr GetGrassShader() const { return grassShader; }
             inline Geometry::GeometrySetPtr GetGrassGeometry() const { return grassGeom; }
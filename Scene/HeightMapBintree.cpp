@@ -0,0 +1,553 @@
+// Heightfield right triangle bintree.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapBintree.h>
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPatch.h>
+#include <Utils/Timer.h>
+#include <Meta/OpenGL.h>
+
+#include <algorithm>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        const float HeightMapBintree::RECOMPUTE_SLACK = 0.1f;
+
+        HeightMapBintree::HeightMapBintree(HeightMapNode* node, int budget)
+            : node(node), width(0), depth(0), initialized(false), triangles(0),
+              rebuildQueues(true), travel(0), budget(budget), tolerance(0),
+              maxOperations(2048), splits(0), merges(0), reprioritized(0),
+              updateTime(0) {
+        }
+
+        HeightMapBintree::~HeightMapBintree(){
+        }
+
+        void HeightMapBintree::Update(const Vector<3, float> position){
+            Utils::Timer timer;
+            timer.Start();
+
+            if (!initialized)
+                Initialize();
+
+            splits = merges = reprioritized = 0;
+
+            if (rebuildQueues){
+                // Reprioritize the whole triangulation.
+                viewPosition = position;
+                splitQueue.clear();
+                mergeQueue.clear();
+                scheduleQueue.clear();
+                for (unsigned int i = 0; i < roots.size(); ++i)
+                    BuildQueues(roots[i]);
+                rebuildQueues = false;
+            }else{
+                travel += (position - viewPosition).GetLength();
+                viewPosition = position;
+                ReprioritizeDue();
+            }
+
+            int ops = 0;
+            while (ops < maxOperations){
+                // Drop the entries that are no longer valid.
+                while (!splitQueue.empty()){
+                    int t = splitQueue.front().second;
+                    if (nodes[t].used && IsLeaf(t) && IsSplittable(t) && nodes[t].priority == splitQueue.front().first)
+                        break;
+                    std::pop_heap(splitQueue.begin(), splitQueue.end());
+                    splitQueue.pop_back();
+                }
+                while (!mergeQueue.empty()){
+                    int t = mergeQueue.front().second;
+                    if (nodes[t].used && IsMergeable(t) && Representative(t) == t && nodes[t].priority == mergeQueue.front().first)
+                        break;
+                    std::pop_heap(mergeQueue.begin(), mergeQueue.end(), std::greater<QueueEntry>());
+                    mergeQueue.pop_back();
+                }
+
+                bool canSplit = !splitQueue.empty() && splitQueue.front().first > tolerance;
+                bool canMerge = !mergeQueue.empty();
+
+                if (triangles > budget || !canSplit){
+                    // Coarsen if over budget or below the tolerance.
+                    if (canMerge && (triangles > budget || mergeQueue.front().first < tolerance)){
+                        int t = mergeQueue.front().second;
+                        std::pop_heap(mergeQueue.begin(), mergeQueue.end(), std::greater<QueueEntry>());
+                        mergeQueue.pop_back();
+                        Merge(t);
+                        ++ops;
+                        continue;
+                    }
+                    break;
+                }
+
+                if (triangles + CalcSplitCost(splitQueue.front().second) > budget){
+                    // Without room for the split and the splits it
+                    // forces, trade the least important diamond for
+                    // the most important triangle.
+                    if (canMerge && mergeQueue.front().first < splitQueue.front().first){
+                        int t = mergeQueue.front().second;
+                        std::pop_heap(mergeQueue.begin(), mergeQueue.end(), std::greater<QueueEntry>());
+                        mergeQueue.pop_back();
+                        Merge(t);
+                        ++ops;
+                        continue;
+                    }
+                    break;
+                }
+
+                int t = splitQueue.front().second;
+                std::pop_heap(splitQueue.begin(), splitQueue.end());
+                splitQueue.pop_back();
+                Split(t);
+                ++ops;
+            }
+
+            CompactQueues();
+            updateTime = timer.GetElapsedIntervals(1);
+        }
+
+        void HeightMapBintree::Invalidate(int xStart, int zStart, int xEnd, int zEnd){
+            if (!initialized) return;
+
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            int patchesX = (width - 1) / squares;
+            int patchesZ = (depth - 1) / squares;
+
+            // The patches containing the area and the edges they
+            // share with their neighbours.
+            int pxStart = (xStart - 1) / squares, pxEnd = xEnd / squares;
+            int pzStart = (zStart - 1) / squares, pzEnd = zEnd / squares;
+            pxStart = pxStart < 0 ? 0 : pxStart;
+            pzStart = pzStart < 0 ? 0 : pzStart;
+            pxEnd = pxEnd >= patchesX ? patchesX - 1 : pxEnd;
+            pzEnd = pzEnd >= patchesZ ? patchesZ - 1 : pzEnd;
+
+            for (int x = pxStart * squares; x <= (pxEnd + 1) * squares; ++x)
+                for (int z = pzStart * squares; z <= (pzEnd + 1) * squares; ++z)
+                    errors[x * depth + z] = 0;
+
+            // Recompute the patches and their neighbours, which
+            // contribute to the errors on the shared edges.
+            pxStart = pxStart > 0 ? pxStart - 1 : 0;
+            pzStart = pzStart > 0 ? pzStart - 1 : 0;
+            pxEnd = pxEnd < patchesX - 1 ? pxEnd + 1 : pxEnd;
+            pzEnd = pzEnd < patchesZ - 1 ? pzEnd + 1 : pzEnd;
+            for (int px = pxStart; px <= pxEnd; ++px)
+                for (int pz = pzStart; pz <= pzEnd; ++pz){
+                    int p = px * patchesZ + pz;
+                    const BintreeNode& upper = nodes[p * 2];
+                    CalcError(upper.left, upper.right, upper.apex);
+                    const BintreeNode& lower = nodes[p * 2 + 1];
+                    CalcError(lower.left, lower.right, lower.apex);
+                }
+
+            // The priorities of all triangles below the patches have
+            // changed.
+            rebuildQueues = true;
+        }
+
+        void HeightMapBintree::Render(){
+            indices.clear();
+            for (unsigned int i = 0; i < roots.size(); ++i)
+                BuildIndices(roots[i]);
+
+            if (!indices.empty())
+                glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, &indices[0]);
+        }
+
+        void HeightMapBintree::Initialize(){
+            width = node->GetVerticeWidth();
+            depth = node->GetVerticeDepth();
+
+            errors.assign(width * depth, 0.0f);
+            SetupRoots();
+            for (unsigned int i = 0; i < roots.size(); ++i){
+                const BintreeNode& root = nodes[roots[i]];
+                CalcError(root.left, root.right, root.apex);
+            }
+
+            rebuildQueues = true;
+            initialized = true;
+        }
+
+        float HeightMapBintree::CalcError(int left, int right, int apex){
+            int lx = left / depth, lz = left % depth;
+            int rx = right / depth, rz = right % depth;
+            if ((lx + rx) % 2 || (lz + rz) % 2)
+                return 0;
+
+            int m = Midpoint(left, right);
+            float interpolated = (node->GetVertex(lx, lz)[1] + node->GetVertex(rx, rz)[1]) / 2;
+            float error = fabs(node->GetVertex(m / depth, m % depth)[1] - interpolated);
+
+            // The error must cover the triangles below.
+            float leftError = CalcError(apex, left, m);
+            float rightError = CalcError(right, apex, m);
+            error = leftError > error ? leftError : error;
+            error = rightError > error ? rightError : error;
+
+            if (error > errors[m])
+                errors[m] = error;
+            return errors[m];
+        }
+
+        void HeightMapBintree::SetupRoots(){
+            nodes.clear();
+            freeNodes.clear();
+            roots.clear();
+
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            int patchesX = (width - 1) / squares;
+            int patchesZ = (depth - 1) / squares;
+
+            // Split each patch along it's diagonal into an upper
+            // triangle, with the apex at (xStart, zEnd), and a lower
+            // triangle, with the apex at (xEnd, zStart).
+            for (int px = 0; px < patchesX; ++px)
+                for (int pz = 0; pz < patchesZ; ++pz){
+                    int xStart = px * squares, xEnd = xStart + squares;
+                    int zStart = pz * squares, zEnd = zStart + squares;
+                    int a = xStart * depth + zStart;
+                    int b = xEnd * depth + zStart;
+                    int c = xEnd * depth + zEnd;
+                    int d = xStart * depth + zEnd;
+                    roots.push_back(AllocateNode(c, a, d, -1));
+                    roots.push_back(AllocateNode(a, c, b, -1));
+                }
+
+            for (int px = 0; px < patchesX; ++px)
+                for (int pz = 0; pz < patchesZ; ++pz){
+                    int p = px * patchesZ + pz;
+                    BintreeNode& upper = nodes[p * 2];
+                    BintreeNode& lower = nodes[p * 2 + 1];
+                    upper.baseNeighbour = p * 2 + 1;
+                    lower.baseNeighbour = p * 2;
+                    // The upper triangle's legs are on the zEnd and
+                    // xStart edges, the lower's on the zStart and
+                    // xEnd edges.
+                    upper.leftNeighbour = pz + 1 < patchesZ ? (p + 1) * 2 + 1 : -1;
+                    upper.rightNeighbour = px > 0 ? (p - patchesZ) * 2 + 1 : -1;
+                    lower.leftNeighbour = pz > 0 ? (p - 1) * 2 : -1;
+                    lower.rightNeighbour = px + 1 < patchesX ? (p + patchesZ) * 2 : -1;
+                }
+
+            triangles = roots.size();
+        }
+
+        void HeightMapBintree::Split(int t){
+            if (nodes[t].leftChild >= 0) return;
+
+            // Only split diamonds, so the hypotenuse is shared by two
+            // triangles of the same size.
+            int b = nodes[t].baseNeighbour;
+            if (b >= 0 && nodes[b].baseNeighbour != t){
+                Split(b);
+                b = nodes[t].baseNeighbour;
+            }
+
+            int m = Midpoint(nodes[t].left, nodes[t].right);
+            int lc = AllocateNode(nodes[t].apex, nodes[t].left, m, t);
+            int rc = AllocateNode(nodes[t].right, nodes[t].apex, m, t);
+            nodes[t].leftChild = lc;
+            nodes[t].rightChild = rc;
+
+            nodes[lc].baseNeighbour = nodes[t].leftNeighbour;
+            nodes[lc].leftNeighbour = rc;
+            nodes[rc].baseNeighbour = nodes[t].rightNeighbour;
+            nodes[rc].rightNeighbour = lc;
+
+            if (nodes[t].leftNeighbour >= 0)
+                ReplaceNeighbour(nodes[t].leftNeighbour, t, lc);
+            if (nodes[t].rightNeighbour >= 0)
+                ReplaceNeighbour(nodes[t].rightNeighbour, t, rc);
+
+            ++triangles;
+            ++splits;
+
+            if (b >= 0){
+                if (nodes[b].leftChild >= 0){
+                    int blc = nodes[b].leftChild;
+                    int brc = nodes[b].rightChild;
+                    nodes[blc].rightNeighbour = rc;
+                    nodes[brc].leftNeighbour = lc;
+                    nodes[lc].rightNeighbour = brc;
+                    nodes[rc].leftNeighbour = blc;
+                }else
+                    Split(b);
+            }else{
+                nodes[lc].rightNeighbour = -1;
+                nodes[rc].leftNeighbour = -1;
+            }
+
+            Reprioritize(lc);
+            Reprioritize(rc);
+            int r = Representative(t);
+            if (IsMergeable(r))
+                PushMerge(r);
+        }
+
+        void HeightMapBintree::Merge(int t){
+            int diamond[2] = { t, nodes[t].baseNeighbour };
+            for (int i = 0; i < 2; ++i){
+                int d = diamond[i];
+                if (d < 0) continue;
+                int lc = nodes[d].leftChild;
+                int rc = nodes[d].rightChild;
+
+                nodes[d].leftNeighbour = nodes[lc].baseNeighbour;
+                if (nodes[d].leftNeighbour >= 0)
+                    ReplaceNeighbour(nodes[d].leftNeighbour, lc, d);
+                nodes[d].rightNeighbour = nodes[rc].baseNeighbour;
+                if (nodes[d].rightNeighbour >= 0)
+                    ReplaceNeighbour(nodes[d].rightNeighbour, rc, d);
+
+                FreeNode(lc);
+                FreeNode(rc);
+                nodes[d].leftChild = nodes[d].rightChild = -1;
+
+                --triangles;
+                ++merges;
+
+                PushSplit(d);
+            }
+
+            // The parents may have become mergeable.
+            for (int i = 0; i < 2; ++i){
+                if (diamond[i] < 0 || nodes[diamond[i]].parent < 0) continue;
+                int r = Representative(nodes[diamond[i]].parent);
+                if (IsMergeable(r))
+                    PushMerge(r);
+            }
+        }
+
+        void HeightMapBintree::BuildQueues(int t){
+            Reprioritize(t);
+            if (!IsLeaf(t)){
+                BuildQueues(nodes[t].leftChild);
+                BuildQueues(nodes[t].rightChild);
+            }
+        }
+
+        void HeightMapBintree::Reprioritize(int t){
+            // Both halves of a diamond must have the same priority,
+            // or one half could be merged below the tolerance only
+            // for the other half to split it again.
+            int diamond[2] = { t, nodes[t].baseNeighbour };
+            if (diamond[1] >= 0 && nodes[diamond[1]].baseNeighbour != t)
+                diamond[1] = -1;
+            float priority = CalcPriority(t);
+            ++reprioritized;
+            for (int i = 0; i < 2; ++i){
+                int d = diamond[i];
+                if (d < 0) continue;
+                nodes[d].priority = priority;
+                Schedule(d);
+                if (IsLeaf(d)){
+                    if (IsSplittable(d))
+                        PushSplit(d);
+                }else if (Representative(d) == d && IsMergeable(d))
+                    PushMerge(d);
+            }
+        }
+
+        void HeightMapBintree::Schedule(int t){
+            // Moving the viewer by a fraction of the distance changes
+            // the priority by at most about the same fraction, and a
+            // priority of zero never changes.
+            if (nodes[t].priority == 0){
+                nodes[t].due = -1;
+                return;
+            }
+            nodes[t].due = travel + CalcDistance(t) * RECOMPUTE_SLACK;
+            scheduleQueue.push_back(QueueEntry(nodes[t].due, t));
+            std::push_heap(scheduleQueue.begin(), scheduleQueue.end(), std::greater<QueueEntry>());
+        }
+
+        void HeightMapBintree::ReprioritizeDue(){
+            // Take the due triangles off the schedule before
+            // rescheduling them, since a triangle next to the viewer
+            // is due again right away. The halves of a diamond are
+            // due together, and clearing the due travel of the taken
+            // triangles skips the duplicate entries and the halves
+            // already reprioritized with their partner.
+            std::vector<int> due;
+            while (!scheduleQueue.empty() && scheduleQueue.front().first <= travel){
+                int t = scheduleQueue.front().second;
+                if (nodes[t].used && nodes[t].due == scheduleQueue.front().first){
+                    nodes[t].due = -1;
+                    due.push_back(t);
+                }
+                std::pop_heap(scheduleQueue.begin(), scheduleQueue.end(), std::greater<QueueEntry>());
+                scheduleQueue.pop_back();
+            }
+            for (unsigned int i = 0; i < due.size(); ++i)
+                if (nodes[due[i]].due < 0)
+                    Reprioritize(due[i]);
+        }
+
+        void HeightMapBintree::CompactQueues(){
+            // Stale entries are only dropped when they reach the top,
+            // so filter the heaps once they grow well beyond the
+            // number of triangles in use.
+            unsigned int limit = (nodes.size() - freeNodes.size()) * 4 + 64;
+            if (splitQueue.size() > limit){
+                unsigned int n = 0;
+                for (unsigned int i = 0; i < splitQueue.size(); ++i){
+                    int t = splitQueue[i].second;
+                    if (nodes[t].used && IsLeaf(t) && IsSplittable(t) && nodes[t].priority == splitQueue[i].first)
+                        splitQueue[n++] = splitQueue[i];
+                }
+                splitQueue.resize(n);
+                std::make_heap(splitQueue.begin(), splitQueue.end());
+            }
+            if (mergeQueue.size() > limit){
+                unsigned int n = 0;
+                for (unsigned int i = 0; i < mergeQueue.size(); ++i){
+                    int t = mergeQueue[i].second;
+                    if (nodes[t].used && IsMergeable(t) && Representative(t) == t && nodes[t].priority == mergeQueue[i].first)
+                        mergeQueue[n++] = mergeQueue[i];
+                }
+                mergeQueue.resize(n);
+                std::make_heap(mergeQueue.begin(), mergeQueue.end(), std::greater<QueueEntry>());
+            }
+            if (scheduleQueue.size() > limit){
+                unsigned int n = 0;
+                for (unsigned int i = 0; i < scheduleQueue.size(); ++i){
+                    int t = scheduleQueue[i].second;
+                    if (nodes[t].used && nodes[t].due == scheduleQueue[i].first)
+                        scheduleQueue[n++] = scheduleQueue[i];
+                }
+                scheduleQueue.resize(n);
+                std::make_heap(scheduleQueue.begin(), scheduleQueue.end(), std::greater<QueueEntry>());
+            }
+        }
+
+        void HeightMapBintree::BuildIndices(int t){
+            const BintreeNode& tri = nodes[t];
+            if (tri.leftChild >= 0){
+                BuildIndices(tri.leftChild);
+                BuildIndices(tri.rightChild);
+            }else{
+                indices.push_back(node->GetIndice(tri.left / depth, tri.left % depth));
+                indices.push_back(node->GetIndice(tri.right / depth, tri.right % depth));
+                indices.push_back(node->GetIndice(tri.apex / depth, tri.apex % depth));
+            }
+        }
+
+        // **** inline functions ****
+
+        int HeightMapBintree::AllocateNode(int left, int right, int apex, int parent){
+            int t;
+            if (freeNodes.empty()){
+                t = nodes.size();
+                nodes.push_back(BintreeNode());
+            }else{
+                t = freeNodes.back();
+                freeNodes.pop_back();
+            }
+            BintreeNode& tri = nodes[t];
+            tri.left = left;
+            tri.right = right;
+            tri.apex = apex;
+            tri.leftChild = tri.rightChild = -1;
+            tri.parent = parent;
+            tri.leftNeighbour = tri.rightNeighbour = tri.baseNeighbour = -1;
+            tri.used = true;
+            tri.priority = CalcPriority(t);
+            tri.due = -1;
+            return t;
+        }
+
+        void HeightMapBintree::FreeNode(int t){
+            nodes[t].used = false;
+            freeNodes.push_back(t);
+        }
+
+        bool HeightMapBintree::IsSplittable(const int t) const{
+            // The midpoint of the hypotenuse must be a vertex.
+            const BintreeNode& tri = nodes[t];
+            return (tri.left / depth + tri.right / depth) % 2 == 0 &&
+                (tri.left % depth + tri.right % depth) % 2 == 0;
+        }
+
+        bool HeightMapBintree::IsMergeable(const int t) const{
+            const BintreeNode& tri = nodes[t];
+            if (tri.leftChild < 0 || !IsLeaf(tri.leftChild) || !IsLeaf(tri.rightChild))
+                return false;
+            int b = tri.baseNeighbour;
+            if (b < 0) return true;
+            const BintreeNode& base = nodes[b];
+            return base.leftChild >= 0 && IsLeaf(base.leftChild) && IsLeaf(base.rightChild);
+        }
+
+        bool HeightMapBintree::IsLeaf(const int t) const{
+            return nodes[t].leftChild < 0;
+        }
+
+        void HeightMapBintree::ReplaceNeighbour(int t, int from, int to){
+            BintreeNode& tri = nodes[t];
+            if (tri.baseNeighbour == from)
+                tri.baseNeighbour = to;
+            else if (tri.leftNeighbour == from)
+                tri.leftNeighbour = to;
+            else if (tri.rightNeighbour == from)
+                tri.rightNeighbour = to;
+        }
+
+        int HeightMapBintree::CalcSplitCost(const int t) const{
+            int b = nodes[t].baseNeighbour;
+            if (b < 0) return 1;
+            if (nodes[b].baseNeighbour == t) return 2;
+            // The base neighbour is split first, then t and the base
+            // neighbour's child across it's hypotenuse.
+            return CalcSplitCost(b) + 2;
+        }
+
+        int HeightMapBintree::Midpoint(int a, int b) const{
+            int x = (a / depth + b / depth) / 2;
+            int z = (a % depth + b % depth) / 2;
+            return x * depth + z;
+        }
+
+        int HeightMapBintree::Representative(const int t) const{
+            // A diamond is queued by it's triangle with the lowest
+            // index.
+            int b = nodes[t].baseNeighbour;
+            return b >= 0 && b < t ? b : t;
+        }
+
+        float HeightMapBintree::CalcPriority(int t) const{
+            if (!IsSplittable(t))
+                return 0;
+            int m = Midpoint(nodes[t].left, nodes[t].right);
+            float distance = CalcDistance(t);
+            return errors[m] / (distance > 0.0001f ? distance : 0.0001f);
+        }
+
+        float HeightMapBintree::CalcDistance(int t) const{
+            int m = Midpoint(nodes[t].left, nodes[t].right);
+            float* v = node->GetVertex(m / depth, m % depth);
+            return (Vector<3, float>(v[0], v[1], v[2]) - viewPosition).GetLength();
+        }
+
+        void HeightMapBintree::PushSplit(int t){
+            splitQueue.push_back(QueueEntry(nodes[t].priority, t));
+            std::push_heap(splitQueue.begin(), splitQueue.end());
+        }
+
+        void HeightMapBintree::PushMerge(int t){
+            mergeQueue.push_back(QueueEntry(nodes[t].priority, t));
+            std::push_heap(mergeQueue.begin(), mergeQueue.end(), std::greater<QueueEntry>());
+        }
+
+    }
+}
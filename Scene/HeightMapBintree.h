@@ -0,0 +1,209 @@
+// Heightfield right triangle bintree.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_BINTREE_H_
+#define _HEIGHTFIELD_BINTREE_H_
+
+#include <Math/Vector.h>
+
+#include <vector>
+#include <functional>
+
+using namespace OpenEngine::Math;
+
+namespace OpenEngine {
+    namespace Scene {
+        class HeightMapNode;
+
+        /**
+         * Triangulates a heightmap adaptively with a right triangle
+         * bintree, as in Duchaineau et al's ROAM.
+         *
+         * Every patch sized square of the heightmap is the root of
+         * two bintrees, which are split and merged every frame by a
+         * split queue and a merge queue ordered by the triangles'
+         * priority. The triangulation starts from the previous
+         * frame's, so only the triangles that need to change are
+         * touched. Splits force the base neighbour to split as well,
+         * which keeps the mesh crack free.
+         *
+         * The queues are kept across frames. A priority only changes
+         * by the relative change of the distance to the viewer, so
+         * each triangle is given a distance the viewer can travel
+         * before it's priority is off by more than RECOMPUTE_SLACK,
+         * and a schedule ordered by that distance reprioritizes only
+         * the triangles that are due, as ROAM's deferred priority
+         * recomputation. A still viewer costs nothing.
+         *
+         * The error of a triangle is precomputed per heightmap
+         * vertex, as the largest height difference the vertex at the
+         * midpoint of the triangle's hypotenuse and the triangles
+         * below it introduce, as in Martini. The priority is the
+         * error divided by the distance to the viewer.
+         *
+         * The triangles index the heightmap's vertex buffer.
+         */
+        class HeightMapBintree {
+        public:
+            /**
+             * The relative distance the viewer may move before a
+             * priority is recomputed.
+             */
+            static const float RECOMPUTE_SLACK;
+
+        protected:
+            struct BintreeNode {
+                // Vertex indices of the corners, the hypotenuse is
+                // between left and right.
+                int left, right, apex;
+                int leftChild, rightChild, parent;
+                // The neighbours across the left leg, the right leg
+                // and the hypotenuse.
+                int leftNeighbour, rightNeighbour, baseNeighbour;
+                float priority;
+                // The travel at which the priority must be
+                // recomputed, negative if it never changes.
+                float due;
+                bool used;
+            };
+
+            typedef std::pair<float, int> QueueEntry;
+
+            HeightMapNode* node;
+            int width, depth;
+            bool initialized;
+
+            // The error introduced by each vertex
+            std::vector<float> errors;
+
+            std::vector<BintreeNode> nodes;
+            std::vector<int> freeNodes;
+            std::vector<int> roots;
+            int triangles;
+
+            // Heaps, kept with std::push_heap and std::pop_heap.
+            std::vector<QueueEntry> splitQueue; // highest priority first
+            std::vector<QueueEntry> mergeQueue; // lowest first
+            std::vector<QueueEntry> scheduleQueue; // earliest due first
+            bool rebuildQueues;
+
+            Vector<3, float> viewPosition;
+            // The distance the viewer has moved.
+            float travel;
+            int budget;
+            float tolerance;
+            int maxOperations;
+            int splits, merges, reprioritized;
+            unsigned int updateTime;
+
+            std::vector<unsigned int> indices;
+
+        public:
+            HeightMapBintree(HeightMapNode* node, int budget);
+            ~HeightMapBintree();
+
+            /**
+             * Splits and merges the triangles towards the best mesh
+             * within the triangle budget as seen from the position.
+             */
+            void Update(const Vector<3, float> position);
+            /**
+             * Recomputes the errors of the patches overlapping the
+             * area of the heightmap. Called by the node when it's
+             * heights change.
+             */
+            void Invalidate(int xStart, int zStart, int xEnd, int zEnd);
+            /**
+             * Draws the triangulation with the heightmap's vertex
+             * buffer applied.
+             */
+            void Render();
+
+            /**
+             * The maximum number of triangles.
+             */
+            void SetTriangleBudget(const int triangles) { budget = triangles; }
+            int GetTriangleBudget() const { return budget; }
+            /**
+             * Triangles with a priority below the tolerance are not
+             * split and diamonds below it are merged, even when the
+             * budget allows more triangles.
+             */
+            void SetErrorTolerance(const float t) { tolerance = t; }
+            float GetErrorTolerance() const { return tolerance; }
+            /**
+             * The maximum number of splits and merges per update.
+             */
+            void SetMaxOperations(const int ops) { maxOperations = ops; }
+            int GetMaxOperations() const { return maxOperations; }
+
+            int GetNumberOfTriangles() const { return triangles; }
+            /**
+             * The number of splits and merges done in the last
+             * update, including forced splits.
+             */
+            int GetNumberOfSplits() const { return splits; }
+            int GetNumberOfMerges() const { return merges; }
+            /**
+             * The number of priorities recomputed in the last update.
+             */
+            int GetNumberOfReprioritized() const { return reprioritized; }
+            /**
+             * The time the last update took in microseconds.
+             */
+            unsigned int GetUpdateTime() const { return updateTime; }
+
+            /**
+             * The error introduced by the vertex, the largest height
+             * difference of the triangles split at it. Zero until the
+             * first update.
+             */
+            float GetVertexError(const int x, const int z) const { return initialized ? errors[x * depth + z] : 0; }
+
+        protected:
+            void Initialize();
+            float CalcError(int left, int right, int apex);
+            void SetupRoots();
+            void Split(int t);
+            void Merge(int t);
+            void BuildQueues(int t);
+            void BuildIndices(int t);
+            /**
+             * Recomputes the priority of t and the other half of
+             * it's diamond, schedules the next recomputation and
+             * queues them with the new priority.
+             */
+            void Reprioritize(int t);
+            void Schedule(int t);
+            void ReprioritizeDue();
+            void CompactQueues();
+
+            inline int AllocateNode(int left, int right, int apex, int parent);
+            inline void FreeNode(int t);
+            inline bool IsSplittable(const int t) const;
+            inline bool IsMergeable(const int t) const;
+            inline bool IsLeaf(const int t) const;
+            inline void ReplaceNeighbour(int t, int from, int to);
+            /**
+             * The number of triangles splitting t adds, including the
+             * forced splits.
+             */
+            inline int CalcSplitCost(const int t) const;
+            inline int Midpoint(int a, int b) const;
+            inline int Representative(const int t) const;
+            inline float CalcPriority(int t) const;
+            inline float CalcDistance(int t) const;
+            inline void PushSplit(int t);
+            inline void PushMerge(int t);
+        };
+
+    }
+}
+
+#endif
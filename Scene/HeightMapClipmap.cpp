@@ -0,0 +1,396 @@
+// Heightfield geometry clipmap.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapClipmap.h>
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPyramid.h>
+#include <Scene/HeightMapPatch.h>
+#include <Meta/OpenGL.h>
+#include <Logging/Logger.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Scene {
+
+        // Logged by reference, so it needs a definition.
+        const int HeightMapClipmap::DEFAULT_SIZE;
+
+        HeightMapClipmap::HeightMapClipmap(HeightMapNode* node, int numberOfLevels, int size)
+            : node(node), pyramid(NULL), size(size), bound(false) {
+
+            if (((size - 1) & (size - 2)) != 0 || size < 9){
+                logger.error << "Clipmap size " << size << " is not 2^k + 1, using " << DEFAULT_SIZE << logger.end;
+                this->size = size = DEFAULT_SIZE;
+            }
+
+            levels.resize(numberOfLevels);
+            for (int l = 0; l < numberOfLevels; ++l){
+                Level& level = levels[l];
+                level.spacing = 1 << l;
+                level.originX = level.originZ = 0;
+                level.valid = level.dirty = false;
+                level.vertices = Float3DataBlockPtr(new DataBlock<3, float>(size * size));
+                level.vertices->SetUnloadPolicy(UNLOAD_EXPLICIT);
+                level.normals = Float3DataBlockPtr(new DataBlock<3, float>(size * size));
+                level.normals->SetUnloadPolicy(UNLOAD_EXPLICIT);
+                level.normalMapCoords = Float2DataBlockPtr(new DataBlock<2, float>(size * size));
+                level.normalMapCoords->SetUnloadPolicy(UNLOAD_EXPLICIT);
+                level.geomorph = Float3DataBlockPtr(new DataBlock<3, float>(size * size));
+                level.geomorph->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            }
+
+            SetupIndices();
+
+            drawCounts.resize(4 * (size - 1));
+            drawOffsets.resize(4 * (size - 1));
+        }
+
+        HeightMapClipmap::~HeightMapClipmap(){
+        }
+
+        void HeightMapClipmap::Update(const Vector<3, float> position){
+            Vector<3, float> offset = node->GetOffset();
+            float x = (position[0] - offset[0]) / node->GetWidthScale();
+            float z = (position[2] - offset[2]) / node->GetWidthScale();
+
+            // Refetch everything when the pyramid is replaced.
+            if (node->GetHeightPyramid() != pyramid){
+                pyramid = node->GetHeightPyramid();
+                for (unsigned int l = 0; l < levels.size(); ++l)
+                    levels[l].valid = false;
+            }
+
+            int half = (size - 1) / 2;
+            for (unsigned int l = 0; l < levels.size(); ++l){
+                Level& level = levels[l];
+                int s = level.spacing;
+
+                // Snap the origin to the vertices of the next coarser
+                // level, so the level lines up with it's hole.
+                int originX = (int)floor((x - half * s) / (2 * s)) * 2 * s;
+                int originZ = (int)floor((z - half * s) / (2 * s)) * 2 * s;
+                if (level.valid && originX == level.originX && originZ == level.originZ)
+                    continue;
+
+                bool coarsest = l == levels.size() - 1;
+                int extent = (size - 1) * s;
+                int dx = originX - level.originX;
+                int dz = originZ - level.originZ;
+
+                if (!level.valid || dx > extent || -dx > extent || dz > extent || -dz > extent){
+                    // Nothing can be reused, fetch the entire level.
+                    level.originX = originX;
+                    level.originZ = originZ;
+                    for (int i = 0; i < size; ++i)
+                        for (int j = 0; j < size; ++j)
+                            FetchVertex(level, i, j);
+                }else{
+                    // The old edge may be inside the level now.
+                    if (!coarsest)
+                        RestoreEdge(level);
+
+                    int oldX = level.originX;
+                    level.originX = originX;
+                    level.originZ = originZ;
+
+                    // Only fetch the vertices that weren't in the
+                    // level before. Their slots are the ones that
+                    // left it.
+                    int jBelow = -dz / s;
+                    int jAbove = jBelow + size;
+                    jBelow = jBelow < 0 ? 0 : (jBelow > size ? size : jBelow);
+                    jAbove = jAbove < 0 ? 0 : (jAbove > size ? size : jAbove);
+                    for (int i = 0; i < size; ++i){
+                        int vx = originX + i * s;
+                        if (vx < oldX || vx > oldX + extent){
+                            for (int j = 0; j < size; ++j)
+                                FetchVertex(level, i, j);
+                        }else{
+                            for (int j = 0; j < jBelow; ++j)
+                                FetchVertex(level, i, j);
+                            for (int j = jAbove; j < size; ++j)
+                                FetchVertex(level, i, j);
+                        }
+                    }
+                }
+
+                if (!coarsest)
+                    MorphEdge(level);
+                level.valid = level.dirty = true;
+            }
+        }
+
+        void HeightMapClipmap::Invalidate(int xStart, int zStart, int xEnd, int zEnd){
+            // The normals of the neighbouring vertices change as well.
+            --xStart; --zStart; ++xEnd; ++zEnd;
+
+            for (unsigned int l = 0; l < levels.size(); ++l){
+                Level& level = levels[l];
+                if (!level.valid) continue;
+                int s = level.spacing;
+
+                // A pyramid vertex is filtered from it's neighbours
+                // below, and it's normal from it's own neighbours.
+                int margin = PyramidLevel(level) > 0 ? 2 * s : 0;
+                int iStart = (int)ceil((xStart - margin - level.originX) / (float)s);
+                int iEnd = (int)floor((xEnd + margin - level.originX) / (float)s);
+                int jStart = (int)ceil((zStart - margin - level.originZ) / (float)s);
+                int jEnd = (int)floor((zEnd + margin - level.originZ) / (float)s);
+                iStart = iStart < 0 ? 0 : iStart;
+                jStart = jStart < 0 ? 0 : jStart;
+                iEnd = iEnd >= size ? size - 1 : iEnd;
+                jEnd = jEnd >= size ? size - 1 : jEnd;
+                if (iStart > iEnd || jStart > jEnd) continue;
+
+                for (int i = iStart; i <= iEnd; ++i)
+                    for (int j = jStart; j <= jEnd; ++j)
+                        FetchVertex(level, i, j);
+
+                if (l != levels.size() - 1)
+                    MorphEdge(level);
+                level.dirty = true;
+            }
+        }
+
+        void HeightMapClipmap::Render(Renderers::RenderingEventArg arg, bool shaded){
+            if (!bound){
+                arg.renderer.BindDataBlock(indexBuffer.get());
+                for (unsigned int l = 0; l < levels.size(); ++l){
+                    arg.renderer.BindDataBlock(levels[l].vertices.get());
+                    arg.renderer.BindDataBlock(levels[l].normals.get());
+                    arg.renderer.BindDataBlock(levels[l].normalMapCoords.get());
+                    arg.renderer.BindDataBlock(levels[l].geomorph.get());
+                }
+                bound = true;
+            }
+
+            bool vbo = indexBuffer->GetID() != 0;
+
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glEnableClientState(GL_NORMAL_ARRAY);
+            if (shaded) glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            if (vbo) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer->GetID());
+
+            for (unsigned int l = 0; l < levels.size(); ++l){
+                Level& level = levels[l];
+                if (!level.valid) continue;
+
+                // The shader's normals are the geomorph values, as
+                // in the node's geometry set.
+                Float3DataBlockPtr normals = shaded ? level.geomorph : level.normals;
+                if (vbo){
+                    GLsizeiptr bytes = sizeof(float) * 3 * size * size;
+                    glBindBuffer(GL_ARRAY_BUFFER, level.vertices->GetID());
+                    if (level.dirty)
+                        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, level.vertices->GetData());
+                    glVertexPointer(3, GL_FLOAT, 0, 0);
+                    if (level.dirty){
+                        // Both sets stay current, so switching the
+                        // shader on and off needs no refetch.
+                        glBindBuffer(GL_ARRAY_BUFFER, level.normals->GetID());
+                        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, level.normals->GetData());
+                        glBindBuffer(GL_ARRAY_BUFFER, level.geomorph->GetID());
+                        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, level.geomorph->GetData());
+                        glBindBuffer(GL_ARRAY_BUFFER, level.normalMapCoords->GetID());
+                        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * 2 * size * size, 
+                                        level.normalMapCoords->GetData());
+                    }
+                    glBindBuffer(GL_ARRAY_BUFFER, normals->GetID());
+                    glNormalPointer(GL_FLOAT, 0, 0);
+                    if (shaded){
+                        glBindBuffer(GL_ARRAY_BUFFER, level.normalMapCoords->GetID());
+                        glTexCoordPointer(2, GL_FLOAT, 0, 0);
+                    }
+                }else{
+                    glVertexPointer(3, GL_FLOAT, 0, level.vertices->GetData());
+                    glNormalPointer(GL_FLOAT, 0, normals->GetData());
+                    if (shaded)
+                        glTexCoordPointer(2, GL_FLOAT, 0, level.normalMapCoords->GetData());
+                }
+                level.dirty = false;
+
+                int draws = CalcDrawRanges(l);
+                glMultiDrawElements(GL_TRIANGLES, (GLsizei*)&drawCounts[0], GL_UNSIGNED_INT,
+                                    (const GLvoid**)&drawOffsets[0], draws);
+            }
+
+            if (vbo){
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            }
+            if (shaded) glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+            glDisableClientState(GL_NORMAL_ARRAY);
+            glDisableClientState(GL_VERTEX_ARRAY);
+        }
+
+        // **** inline functions ****
+
+        void HeightMapClipmap::SetupIndices(){
+            // Two triangles between every slot and it's upper and
+            // right neighbours, wrapping around. The quads between
+            // the last and first logical rows and columns are skipped
+            // when drawing.
+            indexBuffer = IndicesPtr(new Indices(6 * size * size));
+            unsigned int* indices = indexBuffer->GetData();
+            int i = 0;
+            for (int x = 0; x < size; ++x){
+                int nextX = (x + 1) % size;
+                for (int z = 0; z < size; ++z){
+                    int nextZ = (z + 1) % size;
+                    indices[i++] = x * size + nextZ;
+                    indices[i++] = nextX * size + nextZ;
+                    indices[i++] = x * size + z;
+                    indices[i++] = x * size + z;
+                    indices[i++] = nextX * size + nextZ;
+                    indices[i++] = nextX * size + z;
+                }
+            }
+        }
+
+        void HeightMapClipmap::FetchVertex(Level& level, int i, int j){
+            int x = level.originX + i * level.spacing;
+            int z = level.originZ + j * level.spacing;
+            int slot = Slot(level, i, j);
+
+            // Outside the heightmap the edge is extended.
+            float widthScale = node->GetWidthScale();
+            Vector<3, float> offset = node->GetOffset();
+            float* vertex = level.vertices->GetData() + 3 * slot;
+            vertex[0] = widthScale * x + offset[0];
+            vertex[2] = widthScale * z + offset[2];
+
+            // The geomorph center is the vertex itself, as the
+            // clipmap doesn't morph.
+            float* geomorph = level.geomorph->GetData() + 3 * slot;
+            geomorph[0] = vertex[0];
+            geomorph[1] = vertex[2];
+            geomorph[2] = HeightMapPatch::MAX_LODS;
+
+            int maxX = node->GetVerticeWidth() - 1;
+            int maxZ = node->GetVerticeDepth() - 1;
+            x = x < 0 ? 0 : (x > maxX ? maxX : x);
+            z = z < 0 ? 0 : (z > maxZ ? maxZ : z);
+
+            float* coord = level.normalMapCoords->GetData() + 2 * slot;
+            coord[1] = (x + 0.5f) / (float) node->GetVerticeWidth();
+            coord[0] = (z + 0.5f) / (float) node->GetVerticeDepth();
+
+            int p = PyramidLevel(level);
+            if (p > 0){
+                // The level's vertices are on the pyramid level's
+                // grid, which is clamped like the heightmap.
+                int px = std::min(x >> p, pyramid->GetWidth(p) - 1);
+                int pz = std::min(z >> p, pyramid->GetDepth(p) - 1);
+                int index = pz + px * pyramid->GetDepth(p);
+                vertex[1] = pyramid->GetHeights(p)[index];
+                memcpy(level.normals->GetData() + 3 * slot, pyramid->GetNormals(p) + 3 * index, sizeof(float) * 3);
+            }else{
+                vertex[1] = node->GetVertexHeight(x, z);
+                node->GetNormal(x, z).ToArray(level.normals->GetData() + 3 * slot);
+            }
+        }
+
+        void HeightMapClipmap::MorphEdge(Level& level){
+            float* vertices = level.vertices->GetData();
+            int last = size - 1;
+            for (int k = 1; k < last; k += 2){
+                vertices[3 * Slot(level, 0, k) + 1] = (vertices[3 * Slot(level, 0, k-1) + 1] +
+                                                       vertices[3 * Slot(level, 0, k+1) + 1]) / 2;
+                vertices[3 * Slot(level, last, k) + 1] = (vertices[3 * Slot(level, last, k-1) + 1] +
+                                                          vertices[3 * Slot(level, last, k+1) + 1]) / 2;
+                vertices[3 * Slot(level, k, 0) + 1] = (vertices[3 * Slot(level, k-1, 0) + 1] +
+                                                       vertices[3 * Slot(level, k+1, 0) + 1]) / 2;
+                vertices[3 * Slot(level, k, last) + 1] = (vertices[3 * Slot(level, k-1, last) + 1] +
+                                                          vertices[3 * Slot(level, k+1, last) + 1]) / 2;
+            }
+        }
+
+        void HeightMapClipmap::RestoreEdge(Level& level){
+            int last = size - 1;
+            for (int k = 1; k < last; k += 2){
+                FetchVertex(level, 0, k);
+                FetchVertex(level, last, k);
+                FetchVertex(level, k, 0);
+                FetchVertex(level, k, last);
+            }
+        }
+
+        int HeightMapClipmap::CalcDrawRanges(int l){
+            const Level& level = levels[l];
+            bool vbo = indexBuffer->GetID() != 0;
+            unsigned int* indices = indexBuffer->GetData();
+
+            // The hole covered by the finer level, in quads.
+            int holeIStart = size, holeIEnd = size, holeJStart = size, holeJEnd = size;
+            if (l > 0 && levels[l-1].valid){
+                const Level& finer = levels[l-1];
+                holeIStart = (finer.originX - level.originX) / level.spacing;
+                holeIEnd = holeIStart + (size - 1) / 2;
+                holeJStart = (finer.originZ - level.originZ) / level.spacing;
+                holeJEnd = holeJStart + (size - 1) / 2;
+            }
+
+            int draws = 0;
+            int firstSlot = Slot(level, 0, 0);
+            int slotX = firstSlot / size, slotZ = firstSlot % size;
+            for (int i = 0; i < size - 1; ++i){
+                int row = (slotX + i) % size;
+
+                // The quad columns to draw in this row.
+                int ranges[4] = { 0, size - 1, size - 1, size - 1 };
+                if (holeIStart <= i && i < holeIEnd){
+                    ranges[1] = holeJStart < 0 ? 0 : (holeJStart > size - 1 ? size - 1 : holeJStart);
+                    ranges[2] = holeJEnd < 0 ? 0 : (holeJEnd > size - 1 ? size - 1 : holeJEnd);
+                }
+
+                for (int r = 0; r < 4; r += 2){
+                    int quads = ranges[r+1] - ranges[r];
+                    if (quads <= 0) continue;
+
+                    // Split the range where it wraps around.
+                    int column = (slotZ + ranges[r]) % size;
+                    int split = column + quads > size ? size - column : quads;
+                    int starts[2] = { row * size + column, row * size };
+                    int lengths[2] = { split, quads - split };
+                    for (int k = 0; k < 2; ++k){
+                        if (lengths[k] == 0) continue;
+                        drawCounts[draws] = 6 * lengths[k];
+                        if (vbo)
+                            drawOffsets[draws] = (const void*)(6 * starts[k] * sizeof(GLuint));
+                        else
+                            drawOffsets[draws] = indices + 6 * starts[k];
+                        ++draws;
+                    }
+                }
+            }
+            return draws;
+        }
+
+        int HeightMapClipmap::PyramidLevel(const Level& level) const{
+            if (pyramid == NULL) return 0;
+            int l = 0;
+            while ((1 << (l + 1)) <= level.spacing && l + 1 < pyramid->GetNumberOfLevels())
+                ++l;
+            return l;
+        }
+
+        int HeightMapClipmap::Slot(const Level& level, int i, int j) const{
+            int x = (level.originX / level.spacing + i) % size;
+            int z = (level.originZ / level.spacing + j) % size;
+            x = x < 0 ? x + size : x;
+            z = z < 0 ? z + size : z;
+            return x * size + z;
+        }
+
+    }
+}
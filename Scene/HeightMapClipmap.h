@@ -0,0 +1,141 @@
+// Heightfield geometry clipmap.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_CLIPMAP_H_
+#define _HEIGHTFIELD_CLIPMAP_H_
+
+#include <Renderers/IRenderer.h>
+#include <Resources/DataBlock.h>
+#include <Math/Vector.h>
+
+#include <vector>
+
+using namespace OpenEngine::Math;
+
+namespace OpenEngine {
+    namespace Scene {
+        class HeightMapNode;
+        class HeightMapPyramid;
+
+        /**
+         * Renders a heightmap as nested rings of fixed size grids
+         * centered on the viewer, as described in Losasso and Hoppe's
+         * geometry clipmaps.
+         *
+         * Level l samples every 2^l'th vertex of the heightmap and
+         * covers twice the area of level l-1, minus the hole where
+         * level l-1 is drawn. Each level stores it's vertices
+         * toroidally, so when the viewer moves only the rows and
+         * columns entering the level are fetched from the heightmap.
+         * All levels share a single index buffer, and the per frame
+         * cost and memory only depend on the number of levels and
+         * their size, not on the size of the heightmap.
+         *
+         * The outer edge of each level is morphed onto the next
+         * coarser level to avoid cracks.
+         *
+         * When the node has a height pyramid, the levels it covers
+         * are fetched from it's filtered heights and normals instead
+         * of point sampling the heightmap. The node still keeps the
+         * full heightmap and it's patches in memory, the clipmap only
+         * bounds the per frame work.
+         *
+         * The clipmap can be drawn with the node's landscape shader,
+         * without geomorphing, like the bintree. It then supplies
+         * the normal map coords and geomorph values of the shader's
+         * full vertex format.
+         */
+        class HeightMapClipmap {
+        public:
+            // The number of vertices along the edge of a level. Must
+            // be 2^k + 1.
+            static const int DEFAULT_SIZE = 65;
+
+        protected:
+            struct Level {
+                int spacing; // heightmap vertices between level vertices
+                int originX, originZ; // heightmap coords of the levels lower corner
+                bool valid, dirty;
+                Resources::Float3DataBlockPtr vertices;
+                Resources::Float3DataBlockPtr normals;
+                // Only drawn with the landscape shader.
+                Resources::Float2DataBlockPtr normalMapCoords;
+                Resources::Float3DataBlockPtr geomorph;
+            };
+
+            HeightMapNode* node;
+            // The pyramid the levels were fetched from.
+            HeightMapPyramid* pyramid;
+            int size;
+            std::vector<Level> levels;
+            // The quads between all neighbouring vertex slots, shared
+            // by the levels.
+            Resources::IndicesPtr indexBuffer;
+            bool bound;
+
+            // Scratch buffers for the draw ranges of a level.
+            std::vector<int> drawCounts;
+            std::vector<const void*> drawOffsets;
+
+        public:
+            HeightMapClipmap(HeightMapNode* node, int levels, int size = DEFAULT_SIZE);
+            ~HeightMapClipmap();
+
+            /**
+             * Recenters the levels around the position given in
+             * world space, fetching the vertices entering them.
+             */
+            void Update(const Vector<3, float> position);
+            /**
+             * Refetches the vertices in the given area of the
+             * heightmap. Called by the node when it's heights change.
+             */
+            void Invalidate(int xStart, int zStart, int xEnd, int zEnd);
+            /**
+             * Draws the levels. The shaded clipmap is drawn with
+             * the normal map coords and geomorph values of the
+             * landscape shader, which must be applied by the caller.
+             */
+            void Render(Renderers::RenderingEventArg arg, bool shaded = false);
+
+            int GetNumberOfLevels() const { return levels.size(); }
+            int GetSize() const { return size; }
+
+        protected:
+            inline void SetupIndices();
+            /**
+             * Fetches the vertex at the level coords (i, j), relative
+             * to the level's origin, into it's slot.
+             */
+            inline void FetchVertex(Level& level, int i, int j);
+            /**
+             * Moves the odd vertices on the edge of the level onto
+             * the line between their even neighbours.
+             */
+            inline void MorphEdge(Level& level);
+            inline void RestoreEdge(Level& level);
+            /**
+             * Fills the scratch buffers with the index ranges of the
+             * level's quads, skipping the wrap around and the hole
+             * covered by the finer level.
+             */
+            inline int CalcDrawRanges(int l);
+            inline int Slot(const Level& level, int i, int j) const;
+            /**
+             * The pyramid level the level's vertices are fetched
+             * from, the finest that has all of them, or 0 for the
+             * heightmap.
+             */
+            inline int PyramidLevel(const Level& level) const;
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,79 @@
+// Heightfield index arena.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_INDEX_ARENA_H_
+#define _HEIGHTFIELD_INDEX_ARENA_H_
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        /**
+         * A bump allocator for the indices the patches compute
+         * before they are copied into the heightmap's index buffer.
+         *
+         * Allocations are carved out of large blocks and are never
+         * freed one by one. Clear makes the blocks available again
+         * and Release frees them.
+         */
+        class HeightMapIndexArena {
+        public:
+            static const unsigned int BLOCK_SIZE = 1 << 16;
+
+        protected:
+            struct Block {
+                unsigned int* data;
+                unsigned int size;
+            };
+            std::vector<Block> blocks;
+            unsigned int current, used;
+
+        public:
+            HeightMapIndexArena() : current(0), used(0) {}
+            ~HeightMapIndexArena() { Release(); }
+
+            unsigned int* Allocate(const unsigned int count) {
+                while (current < blocks.size() && used + count > blocks[current].size){
+                    ++current;
+                    used = 0;
+                }
+                if (current == blocks.size()){
+                    Block block;
+                    block.size = count > BLOCK_SIZE ? count : BLOCK_SIZE;
+                    block.data = new unsigned int[block.size];
+                    blocks.push_back(block);
+                    used = 0;
+                }
+                unsigned int* ret = blocks[current].data + used;
+                used += count;
+                return ret;
+            }
+
+            /**
+             * Invalidates all allocations, but keeps the blocks for
+             * the next.
+             */
+            void Clear() { current = used = 0; }
+
+            /**
+             * Invalidates all allocations and frees the blocks.
+             */
+            void Release() {
+                for (unsigned int i = 0; i < blocks.size(); ++i)
+                    delete [] blocks[i].data;
+                blocks.clear();
+                current = used = 0;
+            }
+        };
+
+    }
+}
+
+#endif
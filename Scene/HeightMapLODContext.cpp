@@ -0,0 +1,115 @@
+// Heightfield LOD context.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapLODContext.h>
+#include <Scene/HeightMapNode.h>
+#include <Core/Thread.h>
+
+#include <SDL/SDL_mutex.h>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        /**
+         * Calculates the back packet of a context on a separate
+         * thread. The thread lives as long as the context and sleeps
+         * on a semaphore between packets, so a frame only costs two
+         * semaphore signals.
+         */
+        class HeightMapLODWorker : public Core::Thread {
+        private:
+            HeightMapNode* node;
+            HeightMapLODPacket* packet;
+            SDL_sem* startSignal;
+            SDL_sem* doneSignal;
+            bool quit;
+        public:
+            HeightMapLODWorker()
+                : node(NULL), packet(NULL), 
+                  startSignal(SDL_CreateSemaphore(0)), 
+                  doneSignal(SDL_CreateSemaphore(0)), quit(false) {}
+            ~HeightMapLODWorker(){
+                SDL_DestroySemaphore(startSignal);
+                SDL_DestroySemaphore(doneSignal);
+            }
+            /**
+             * Hands the worker a packet to calculate.
+             */
+            void Calc(HeightMapNode* n, HeightMapLODPacket* p){
+                node = n;
+                packet = p;
+                SDL_SemPost(startSignal);
+            }
+            /**
+             * Blocks until the packet handed to Calc is done.
+             */
+            void WaitDone() { SDL_SemWait(doneSignal); }
+            /**
+             * Ends the thread and joins it. The worker must be idle.
+             */
+            void Stop(){
+                quit = true;
+                SDL_SemPost(startSignal);
+                Wait();
+            }
+            void Run(){
+                for (;;){
+                    SDL_SemWait(startSignal);
+                    if (quit) return;
+                    node->CalcLOD(*packet);
+                    SDL_SemPost(doneSignal);
+                }
+            }
+        };
+
+        HeightMapLODContext::HeightMapLODContext()
+            : node(NULL), frontPacket(0), lodBias(0), 
+              pipeline(false), worker(NULL), workerRunning(false) {
+        }
+
+        HeightMapLODContext::~HeightMapLODContext(){
+            StopWorker();
+            if (node != NULL)
+                node->RemoveLODContext(this);
+        }
+
+        void HeightMapLODContext::SetPipelined(const bool p){
+            // Views that stop pipelining don't keep an idle thread.
+            if (!p)
+                StopWorker();
+            pipeline = p;
+        }
+
+        void HeightMapLODContext::Wait(){
+            if (workerRunning){
+                worker->WaitDone();
+                workerRunning = false;
+            }
+        }
+
+        void HeightMapLODContext::StopWorker(){
+            Wait();
+            if (worker){
+                worker->Stop();
+                delete worker;
+                worker = NULL;
+            }
+        }
+
+        void HeightMapLODContext::StartWorker(){
+            if (worker == NULL){
+                worker = new HeightMapLODWorker();
+                worker->Start();
+            }
+            workerRunning = true;
+            worker->Calc(node, &packets[1 - frontPacket]);
+        }
+
+    }
+}
@@ -0,0 +1,104 @@
+// Heightfield LOD context.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_LOD_CONTEXT_H_
+#define _HEIGHTFIELD_LOD_CONTEXT_H_
+
+#include <Scene/HeightMapLODPacket.h>
+#include <Scene/HeightMapLODController.h>
+
+namespace OpenEngine {
+    namespace Scene {
+        class HeightMapNode;
+        class HeightMapLODWorker;
+
+        /**
+         * The culling and LOD state of one view of a heightmap.
+         *
+         * Every view that renders a HeightMapNode, fx the main
+         * camera, a reflection or a shadow camera, should use it's
+         * own context. Contexts of different views can be
+         * calculated concurrently on different threads, since
+         * HeightMapNode::CalcLOD only reads the shared patches.
+         *
+         * The context holds two LOD packets. When pipelined the back
+         * packet is calculated on a worker thread while the front
+         * packet is rendered. Each pipelined context keeps one
+         * thread, started by it's first pipelined frame and joined
+         * when the context is deleted or stops pipelining, so views
+         * only pay for a thread when they are pipelined.
+         */
+        class HeightMapLODContext {
+            friend class HeightMapNode;
+
+        protected:
+            HeightMapNode* node;
+
+            HeightMapLODPacket packets[2];
+            int frontPacket;
+
+            float lodBias;
+            bool pipeline;
+            HeightMapLODWorker* worker;
+            bool workerRunning;
+
+            HeightMapLODController controller;
+
+        public:
+            HeightMapLODContext();
+            ~HeightMapLODContext();
+
+            /**
+             * Offsets the LOD of every patch by the given number of
+             * levels. Positive values give coarser LODs, which is
+             * usefull for cheap secondary views.
+             */
+            void SetLODBias(const float bias) { lodBias = bias; }
+            float GetLODBias() const { return lodBias; }
+
+            /**
+             * Pipeline the culling and LOD calculation with
+             * rendering. When enabled HeightMapNode::CalcLOD hands
+             * the view to a worker thread and Render draws the
+             * results calculated from the previous frame's view.
+             */
+            void SetPipelined(const bool pipeline);
+            bool IsPipelined() const { return pipeline; }
+
+            /**
+             * Blocks until the worker is done calculating.
+             */
+            void Wait();
+
+            /**
+             * The packet that will be rendered.
+             */
+            const HeightMapLODPacket& GetFrontPacket() const { return packets[frontPacket]; }
+
+            /**
+             * The controller scaling the LOD distances of this
+             * context to a triangle or culling time budget. Disabled
+             * by default.
+             */
+            HeightMapLODController& GetController() { return controller; }
+            /**
+             * The heightmap the context was last calculated for, or
+             * NULL if it has been deleted.
+             */
+            HeightMapNode* GetNode() const { return node; }
+
+        protected:
+            void StartWorker();
+            void StopWorker();
+        };
+
+    }
+}
+
+#endif
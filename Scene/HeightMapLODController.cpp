@@ -0,0 +1,66 @@
+// Heightfield LOD controller.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapLODController.h>
+#include <Scene/HeightMapLODPacket.h>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        HeightMapLODController::HeightMapLODController()
+            : target(NONE), targetValue(0), hysteresis(0.1f), smoothing(0.2f),
+              gain(0.5f), maxStep(0.1f), minScale(0.25f), maxScale(4.0f),
+              smoothedValue(0), distanceScale(1), adjusting(false) {
+        }
+
+        void HeightMapLODController::SetTarget(const Target t, const float value){
+            target = t;
+            targetValue = value;
+            smoothedValue = 0;
+            adjusting = false;
+            if (target == NONE)
+                distanceScale = 1;
+        }
+
+        void HeightMapLODController::Update(const HeightMapLODPacket& packet){
+            Update(packet.triangles, packet.cullTime);
+        }
+
+        void HeightMapLODController::Update(const unsigned int triangles, const unsigned int cullTime){
+            if (target == NONE || targetValue <= 0) return;
+
+            float value = target == TRIANGLES ? triangles : cullTime;
+            if (smoothedValue == 0)
+                smoothedValue = value;
+            else
+                smoothedValue += smoothing * (value - smoothedValue);
+
+            // Only start adjusting outside the band and keep going
+            // until well inside it.
+            float error = smoothedValue / targetValue - 1.0f;
+            float absError = fabs(error);
+            if (adjusting)
+                adjusting = absError > hysteresis * 0.5f;
+            else
+                adjusting = absError > hysteresis;
+            if (!adjusting || smoothedValue <= 0) return;
+
+            // Triangles grow with the square of the distances.
+            float step = pow(targetValue / smoothedValue, 0.5f * gain);
+            if (step > 1.0f + maxStep) step = 1.0f + maxStep;
+            else if (step < 1.0f - maxStep) step = 1.0f - maxStep;
+
+            distanceScale *= step;
+            if (distanceScale < minScale) distanceScale = minScale;
+            else if (distanceScale > maxScale) distanceScale = maxScale;
+        }
+
+    }
+}
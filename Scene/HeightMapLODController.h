@@ -0,0 +1,106 @@
+// Heightfield LOD controller.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_LOD_CONTROLLER_H_
+#define _HEIGHTFIELD_LOD_CONTROLLER_H_
+
+namespace OpenEngine {
+    namespace Scene {
+        struct HeightMapLODPacket;
+
+        /**
+         * Scales the LOD switch distances of a LOD context every
+         * frame to keep the terrain's triangle count or culling time
+         * at a target.
+         *
+         * The measurement is smoothed and only acted upon when it
+         * leaves a band around the target, so the LODs don't
+         * oscillate around it. The number of triangles is roughly
+         * proportional to the square of the distance scale, so each
+         * correction moves the scale by the gain times the square
+         * root of the relative error, limited to a maximum step.
+         */
+        class HeightMapLODController {
+        public:
+            enum Target { NONE, TRIANGLES, CULL_TIME };
+
+        protected:
+            Target target;
+            float targetValue;
+            float hysteresis;
+            float smoothing;
+            float gain;
+            float maxStep;
+            float minScale, maxScale;
+
+            float smoothedValue;
+            float distanceScale;
+            bool adjusting;
+
+        public:
+            HeightMapLODController();
+
+            /**
+             * Hold the number of triangles rendered, or the time in
+             * microseconds spent culling, at the value. NONE disables
+             * the controller and resets the scale.
+             */
+            void SetTarget(const Target t, const float value);
+            Target GetTarget() const { return target; }
+            float GetTargetValue() const { return targetValue; }
+
+            /**
+             * The relative distance from the target the smoothed
+             * measurement must be before the scale is adjusted. The
+             * adjustment stops when it is within half that
+             * distance. Defaults to 0.1.
+             */
+            void SetHysteresis(const float h) { hysteresis = h; }
+            float GetHysteresis() const { return hysteresis; }
+            /**
+             * The weight of a new measurement in the smoothed value,
+             * between 0 and 1.
+             */
+            void SetSmoothing(const float s) { smoothing = s; }
+            /**
+             * The fraction of the correction applied per frame and
+             * the largest relative change of the scale per frame.
+             */
+            void SetGain(const float g, const float step) { gain = g; maxStep = step; }
+            void SetScaleLimits(const float min, const float max) { minScale = min; maxScale = max; }
+
+            /**
+             * Feeds the statistics of the last calculated packet to
+             * the controller.
+             */
+            void Update(const HeightMapLODPacket& packet);
+            /**
+             * Feeds the statistics of a frame to the controller, fx
+             * the totals of several heightmaps sharing it.
+             */
+            void Update(const unsigned int triangles, const unsigned int cullTime);
+
+            /**
+             * The scale applied to the LOD switch distances.
+             */
+            float GetDistanceScale() const { return distanceScale; }
+            /**
+             * Sets the scale directly, fx to give neighbouring
+             * heightmaps the scale of a shared controller. Update
+             * overwrites it unless the target is NONE.
+             */
+            void SetDistanceScale(const float scale) { distanceScale = scale; }
+            float GetSmoothedValue() const { return smoothedValue; }
+            bool IsAdjusting() const { return adjusting; }
+        };
+
+    }
+}
+
+#endif
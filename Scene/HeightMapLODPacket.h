@@ -0,0 +1,76 @@
+// Heightfield LOD packet.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_LOD_PACKET_H_
+#define _HEIGHTFIELD_LOD_PACKET_H_
+
+#include <Scene/HeightMapView.h>
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        /**
+         * The culling and LOD result for a single patch.
+         */
+        struct PatchLOD {
+            bool visible;
+            unsigned char LOD, upperLOD, rightLOD;
+            float geomorphingScale;
+        };
+
+        /**
+         * The culling and LOD results of a heightmap for one frame.
+         *
+         * A packet is written by HeightMapNode::CalcLOD and read by
+         * HeightMapNode::Render, which lets the next frame be culled
+         * into one packet while the current is rendered from another.
+         */
+        struct HeightMapLODPacket {
+            // The view and LOD distances the packet was calculated
+            // from.
+            HeightMapView view;
+            float baseDistance;
+            float invIncDistance;
+
+            std::vector<PatchLOD> patches;
+
+            // Visible patches sorted front to back and the buffers
+            // used to sort them. Reused between frames.
+            std::vector<unsigned int> renderOrder;
+            std::vector<unsigned int> renderOrderTemp;
+            std::vector<unsigned short> sortKeys;
+            std::vector<unsigned short> sortKeysTemp;
+            std::vector<bool> inRenderOrder;
+
+            // Statistics of the frame, the culling time is in
+            // microseconds.
+            unsigned int visiblePatches;
+            unsigned int triangles;
+            unsigned int cullTime;
+
+            /**
+             * Prepares the packet for a heightmap with the given
+             * number of patches.
+             */
+            void Setup(int numberOfPatches){
+                PatchLOD init = { false, 0, 0, 0, 1.0f };
+                patches.assign(numberOfPatches, init);
+                inRenderOrder.assign(numberOfPatches, false);
+                renderOrder.clear();
+                renderOrder.reserve(numberOfPatches);
+                visiblePatches = triangles = cullTime = 0;
+            }
+        };
+
+    }
+}
+
+#endif
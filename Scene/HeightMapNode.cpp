@@ -9,95 +9,361 @@
 
 #include <Scene/HeightMapNode.h>
 #include <Scene/HeightMapPatch.h>
+#include <Scene/HeightMapClipmap.h>
+#include <Scene/HeightMapBintree.h>
+#include <Scene/HeightMapPyramid.h>
 #include <Resources/IShaderResource.h>
 #include <Math/Math.h>
 #include <Meta/OpenGL.h>
 #include <Utils/TerrainUtils.h>
+#include <Utils/HeightCodec.h>
+#include <Utils/DepthComplexity.h>
 #include <Display/IViewingVolume.h>
 #include <Display/Viewport.h>
 #include <Geometry/GeometrySet.h>
+#include <Core/Thread.h>
 
 #include <Logging/Logger.h>
+#include <Utils/Timer.h>
 
 #include <algorithm>
 #include <cstring>
+#include <fstream>
 
 using namespace OpenEngine::Display;
 
 namespace OpenEngine {
     namespace Scene {
 
+        static const char BAKE_MAGIC[4] = { 'O', 'E', 'H', 'B' };
+        // Written in the machine's byte order, to detect bake files
+        // from machines with another one.
+        static const unsigned int BAKE_BYTE_ORDER = 0x01020304;
+        // Written by address, so it needs a definition.
+        const unsigned int HeightMapNode::BAKE_VERSION;
+
+        static inline bool ReadBakeData(const char*& data, const char* end, void* dest, unsigned int size){
+            if ((unsigned int)(end - data) < size) return false;
+            memcpy(dest, data, size);
+            data += size;
+            return true;
+        }
+
+        /**
+         * FNV-1a, a word at a time.
+         */
+        static inline void HashBakeData(unsigned long long& hash, const void* data, unsigned int size){
+            const unsigned long long prime = 1099511628211ULL;
+            const char* bytes = (const char*) data;
+            unsigned int words = size / 4;
+            for (unsigned int i = 0; i < words; ++i){
+                unsigned int word;
+                memcpy(&word, bytes + i * 4, 4);
+                hash = (hash ^ word) * prime;
+            }
+            for (unsigned int i = words * 4; i < size; ++i)
+                hash = (hash ^ (unsigned char)bytes[i]) * prime;
+        }
+
+        /**
+         * Builds a heightmap on a separate thread.
+         */
+        class HeightMapLoadWorker : public Core::Thread {
+        private:
+            HeightMapNode* node;
+        public:
+            HeightMapLoadWorker(HeightMapNode* n)
+                : node(n) {}
+            void Run() { node->BuildAsync(); }
+        };
+
+        /**
+         * Creates a buffer object of the size without data.
+         */
+        static inline unsigned int CreateBufferObject(GLenum target, unsigned int size){
+            GLuint id;
+            glGenBuffers(1, &id);
+            glBindBuffer(target, id);
+            glBufferData(target, size, NULL, GL_STATIC_DRAW);
+            glBindBuffer(target, 0);
+            return id;
+        }
+
+        /**
+         * Deletes the buffer object of the data block, if it has one.
+         */
+        static inline void DeleteBufferObject(IDataBlockPtr block){
+            if (block == NULL || block->GetID() == 0) return;
+            GLuint id = block->GetID();
+            glDeleteBuffers(1, &id);
+            block->SetID(0);
+        }
+
+        HeightMapNode::HeightMapNode(){
+            Init();
+        }
+
         HeightMapNode::HeightMapNode(FloatTexture2DPtr tex)
             : tex(tex) {
             tex->Load();
+            Init();
+        }
+
+        void HeightMapNode::Init(){
             heightScale = 1;
             widthScale = 1;
+            resample = false;
+            resampleFilter = Utils::HEIGHT_FILTER_BICUBIC;
+            resampleScale = 1;
+            resampleThreads = DEFAULT_RESAMPLE_THREADS;
             offset = Vector<3, float>(0, 0, 0);
             
             baseDistance = 1;
             invIncDistance = 1.0f / 100.0f;
 
             isLoaded = false;
+            bakeLoaded = false;
+
+            asyncLoad = false;
+            loadState = LOAD_NONE;
+            loadWorker = NULL;
+            asyncUploadSize = DEFAULT_ASYNC_UPLOAD_SIZE;
+            uploadedVertices = 0;
+            loadBuilt = false;
+            loadProgress = loadProgressStart = loadProgressEnd = 0;
+
+            numberOfPatches = 0;
+            patchNodes = NULL;
+
+            clipmap = NULL;
+            bintree = NULL;
+            pyramid = NULL;
+            pyramidLevels = 0;
+            builtPyramid = NULL;
+
+            patchVertexCacheSize = 0;
+            tiledLayout = false;
+            slimVertexFormat = false;
+            packedNormals = NULL;
+            packedNormalBuffer = 0;
+            normalMapFormat = NORMALMAP_FLOAT;
+            encodedNormalMap = NULL;
+            normalMapError.mean = normalMapError.max = 0;
+            tilesWidth = tilesDepth = 0;
+            sparseTiles = false;
+            numberOfSlots = 0;
+            firstSlotVertex = 0;
+            for (int i = 0; i < TILE_SIZE; ++i){
+                spreadBits[i] = 0;
+                for (int b = 0; b < TILE_BITS; ++b)
+                    spreadBits[i] |= ((i >> b) & 1) << (2 * b);
+            }
+            normals = normalMapData = NULL;
+            deltaValues = NULL;
+            width = depth = 0;
+            patchGridWidth = patchGridDepth = 0;
+            lazyPatchIndices = false;
+            usedIndices = uploadedIndices = 0;
+            indexBufferGrown = false;
+            freedIndices = 0;
 
             landscapeShader.reset();
         }
 
         HeightMapNode::~HeightMapNode(){
+            if (loadWorker){
+                loadWorker->Wait();
+                delete loadWorker;
+            }
+
+            // Let go of the contexts.
+            contextsMutex.Lock();
+            std::list<HeightMapLODContext*>::iterator itr;
+            for (itr = contexts.begin(); itr != contexts.end(); ++itr){
+                (*itr)->Wait();
+                (*itr)->node = NULL;
+            }
+            contextsMutex.Unlock();
+
+            if (normalMapData != normals)
+                delete [] normalMapData;
+            // The buffer objects and the normal map's texture are
+            // made by the renderer or SetupBuffers, and nothing else
+            // frees them.
+            DeleteBufferObject(vertexBuffer);
+            DeleteBufferObject(indexBuffer);
+            DeleteBufferObject(geomorphBuffer);
+            DeleteBufferObject(normalMapCoordBuffer);
+            DeleteBufferObject(normalBuffer);
+            if (packedNormalBuffer)
+                glDeleteBuffers(1, &packedNormalBuffer);
+            if (normalmap && normalmap->GetID()){
+                GLuint id = normalmap->GetID();
+                glDeleteTextures(1, &id);
+                normalmap->SetID(0);
+            }
+            delete [] packedNormals;
+            delete [] encodedNormalMap;
             delete [] normals;
             delete [] deltaValues;
 
             delete [] patchNodes;
+
+            delete clipmap;
+            delete bintree;
+            delete pyramid;
+            delete builtPyramid;
         }
         
         void HeightMapNode::Load() {
             if (isLoaded)
                 return;
 
-            InitArrays();
-            SetupPatches();
+            Build();
+            PublishPyramid();
 
             isLoaded = true;
         }
 
+        void HeightMapNode::Build(){
+            unsigned long long bakeKey = 0;
+            if (!bakeFile.empty()){
+                bakeKey = CalcBakeKey();
+                bakeLoaded = ReadBake(bakeKey);
+            }
+
+            if (!bakeLoaded){
+                SetLoadPhase(0.0f, 0.5f);
+                InitArrays();
+                SetLoadPhase(0.5f, 0.75f);
+                SetupPatches();
+                if (!bakeFile.empty())
+                    WriteBake(bakeKey);
+            }
+
+            // The pyramid may be read on the main thread while the
+            // worker builds, so it is published by PublishPyramid.
+            HeightMapPyramid* built = pyramidLevels > 0 ? new HeightMapPyramid(this, pyramidLevels) : NULL;
+            loadMutex.Lock();
+            delete builtPyramid;
+            builtPyramid = built;
+            loadMutex.Unlock();
+        }
+
+        void HeightMapNode::PublishPyramid(){
+            loadMutex.Lock();
+            delete pyramid;
+            pyramid = builtPyramid;
+            builtPyramid = NULL;
+            loadMutex.Unlock();
+        }
+
+        void HeightMapNode::BuildAsync(){
+            Build();
+            SetLoadPhase(0.75f, 0.8f);
+            SetupRenderData();
+
+            loadMutex.Lock();
+            loadBuilt = true;
+            loadMutex.Unlock();
+        }
+
         void HeightMapNode::CalcLOD(IViewingVolume* view){
-            for (int i = 0; i < numberOfPatches; ++i)
-                patchNodes[i]->CalcLOD(view);
+            CalcLOD(defaultContext, view);
         }
 
-        void HeightMapNode::Render(Renderers::RenderingEventArg arg){
-            PreRender(arg);
+        void HeightMapNode::CalcLOD(HeightMapLODContext& context, IViewingVolume* view){
+            CalcLOD(context, HeightMapView(view));
+        }
 
-            // Draw patches front to back.
-            Vector<3, float> dir = arg.canvas.GetViewingVolume()->GetDirection().RotateVector(Vector<3, float>(0,0,1));
-            
-            int xStart, xEnd, xStep, zStart, zEnd, zStep;
-            if (dir[0] < 0){
-                // If we're looking along the x-axis.
-                xStart = 0;
-                xEnd = patchGridWidth;
-                xStep = 1;
-            }else{
-                // else iterate form the other side.
-                xStart = patchGridWidth-1;
-                    xEnd = -1;
-                    xStep = -1;
-            }
-            if (dir[2] < 0){
-                // If we're looking along the z-axis.
-                zStart = 0;
-                zEnd = patchGridDepth;
-                zStep = 1;
+        void HeightMapNode::CalcLOD(HeightMapLODContext& context, const HeightMapView& view){
+            if (context.node != this){
+                if (context.node != NULL)
+                    context.node->RemoveLODContext(&context);
+                context.node = this;
+                contextsMutex.Lock();
+                contexts.push_back(&context);
+                contextsMutex.Unlock();
+            }
+
+            if (IsLoading()){
+                // Nothing is visible until the heightmap is ready.
+                context.packets[context.frontPacket].Setup(0);
+                return;
+            }
+
+            if (!context.pipeline){
+                HeightMapLODPacket& packet = context.packets[context.frontPacket];
+                SetupLODPacket(context, packet, view);
+                CalcLOD(packet);
+                context.controller.Update(packet);
+                return;
+            }
+
+            if (context.workerRunning){
+                // The worker has been calculating the back packet
+                // since last frame. Render it.
+                context.Wait();
+                context.frontPacket = 1 - context.frontPacket;
             }else{
-                // else iterate form the other side.
-                zStart = patchGridDepth-1;
-                zEnd = -1;
-                zStep = -1;
+                // Nothing in flight, calculate this frame directly.
+                HeightMapLODPacket& packet = context.packets[context.frontPacket];
+                SetupLODPacket(context, packet, view);
+                CalcLOD(packet);
             }
-            
-            for (int x = xStart; x != xEnd ; x += xStep){
-                for (int z = zStart; z != zEnd; z += zStep){
-                    patchNodes[z + x * patchGridDepth]->Render();
+            context.controller.Update(context.packets[context.frontPacket]);
+
+            // Start calculating the next frame from the current view.
+            SetupLODPacket(context, context.packets[1 - context.frontPacket], view);
+            context.StartWorker();
+        }
+
+        void HeightMapNode::CalcLOD(HeightMapLODPacket& packet){
+            Utils::Timer timer;
+            timer.Start();
+
+            if ((int)packet.patches.size() != numberOfPatches)
+                packet.Setup(numberOfPatches);
+
+            packet.triangles = 0;
+            for (int i = 0; i < numberOfPatches; ++i){
+                patchNodes[i].CalcLOD(packet, packet.patches[i]);
+                if (packet.patches[i].visible)
+                    packet.triangles += patchNodes[i].GetNumberOfTriangles(packet.patches[i]);
+            }
+
+            SortPatches(packet);
+
+            packet.visiblePatches = packet.renderOrder.size();
+            packet.cullTime = timer.GetElapsedIntervals(1);
+        }
+
+        void HeightMapNode::Render(Renderers::RenderingEventArg arg){
+            Render(defaultContext, arg);
+        }
+
+        void HeightMapNode::Render(HeightMapLODContext& context, Renderers::RenderingEventArg arg){
+            if (IsLoading())
+                return;
+
+            PreRender(arg);
+
+            // Draw the visible patches front to back, as sorted by
+            // CalcLOD.
+            const HeightMapLODPacket& packet = context.GetFrontPacket();
+            if (lazyPatchIndices || sparseTiles){
+                // Generate the indices of the LODs drawn for the
+                // first time, and of the flat patches that were
+                // edited.
+                for (unsigned int i = 0; i < packet.renderOrder.size(); ++i){
+                    unsigned int p = packet.renderOrder[i];
+                    patchNodes[p].PrepareLOD(packet.patches[p]);
                 }
+                UploadPatchIndices();
+            }
+            for (unsigned int i = 0; i < packet.renderOrder.size(); ++i){
+                unsigned int p = packet.renderOrder[i];
+                patchNodes[p].Render(packet.patches[p]);
             }
 
             PostRender(arg);
@@ -126,7 +392,7 @@ namespace OpenEngine {
 
         void HeightMapNode::RenderBoundingGeometry(){
             for (int i = 0; i < numberOfPatches; ++i)
-                patchNodes[i]->RenderBoundingGeometry();
+                patchNodes[i].RenderBoundingGeometry();
         }
 
         void HeightMapNode::VisitSubNodes(ISceneNodeVisitor& visitor){
@@ -139,51 +405,299 @@ namespace OpenEngine {
         void HeightMapNode::Handle(RenderingEventArg arg){
             Initialize(arg);
 
+            if (asyncLoad && !isLoaded){
+                // Setters check isLoaded, so the settings can't
+                // change under the worker.
+                isLoaded = true;
+                loadState = LOAD_BUILDING;
+                loadWorker = new HeightMapLoadWorker(this);
+                loadWorker->Start();
+                return;
+            }
+
             Load();
+            SetupRenderData();
+            SetupBuffers(arg, true);
+            SetupRendering(arg);
+            loadState = LOAD_READY;
+        }
 
-            // Create vbos
-            arg.renderer.BindDataBlock(vertexBuffer.get());
-            arg.renderer.BindDataBlock(indexBuffer.get());
+        void HeightMapNode::ContinueAsyncLoad(RenderingEventArg arg){
+            if (loadState == LOAD_BUILDING){
+                loadMutex.Lock();
+                bool built = loadBuilt;
+                loadMutex.Unlock();
+                if (!built) return;
+
+                loadWorker->Wait();
+                delete loadWorker;
+                loadWorker = NULL;
+
+                PublishPyramid();
+                SetupBuffers(arg, false);
+                uploadedVertices = 0;
+                uploadedIndices = 0;
+                if (vertexBuffer->GetID() == 0){
+                    // Drawn from the arrays in memory.
+                    uploadedVertices = vertexBuffer->GetSize();
+                    uploadedIndices = usedIndices;
+                }
+                loadState = LOAD_UPLOADING;
+                SetLoadPhase(0.8f, 1.0f);
+                return;
+            }
+            if (loadState != LOAD_UPLOADING) return;
+
+            unsigned int vertexSize = sizeof(float) * DIMENSIONS;
+            if (normalMapCoordBuffer) vertexSize += sizeof(float) * TEXCOORDS;
+            if (geomorphBuffer) vertexSize += sizeof(float) * 3;
+            if (normalBuffer) vertexSize += sizeof(float) * 3;
+            if (packedNormals) vertexSize += 4;
+            unsigned int vertices = vertexBuffer->GetSize();
+
+            if (uploadedVertices < vertices){
+                unsigned int count = std::max(asyncUploadSize / vertexSize, 1u);
+                count = std::min(count, vertices - uploadedVertices);
+                UploadVertices(uploadedVertices, count, false);
+                uploadedVertices += count;
+            }else if (uploadedIndices < usedIndices){
+                unsigned int count = std::max(asyncUploadSize / (unsigned int)sizeof(GLuint), 1u);
+                count = std::min(count, usedIndices - uploadedIndices);
+                if (indexBuffer->GetID()){
+                    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer->GetID());
+                    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * uploadedIndices, 
+                                    sizeof(GLuint) * count, indexBuffer->GetData() + uploadedIndices);
+                    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+                }
+                uploadedIndices += count;
+            }else{
+                // The textures and the shader in the last frame.
+                SetupRendering(arg);
+                loadState = LOAD_READY;
+                return;
+            }
 
-            if (landscapeShader != NULL) {
-                // Init shader used buffer objects
+            float total = (float)vertexSize * vertices + sizeof(GLuint) * usedIndices;
+            float done = (float)vertexSize * uploadedVertices + sizeof(GLuint) * uploadedIndices;
+            ReportLoadProgress(total > 0 ? done / total : 1.0f);
+        }
 
-                // Create the image to hold the normal map
-                normalmap = FloatTexture2DPtr(new Texture2D<float>(width, depth, 3, normals));
-                normalmap->SetColorFormat(RGB32F);
-                normalmap->SetMipmapping(false);
-                normalmap->SetCompression(false);
-                landscapeShader->SetTexture("normalMap", (ITexture2DPtr)normalmap);
+        float HeightMapNode::GetLoadProgress() const{
+            if (loadState == LOAD_READY) return 1.0f;
+            loadMutex.Lock();
+            float progress = loadProgress;
+            loadMutex.Unlock();
+            return progress;
+        }
 
-                // Geomorph values buffer object
-                arg.renderer.BindDataBlock(geomorphBuffer.get());
+        void HeightMapNode::SetAsyncLoad(const bool async){
+            if (isLoaded){
+                logger.error << "Asynchronous loading must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            asyncLoad = async;
+        }
 
-                // normal map Coord buffer object
-                arg.renderer.BindDataBlock(normalMapCoordBuffer.get());
+        void HeightMapNode::Handle(Core::ProcessEventArg arg){
+            if (IsLoading())
+                return;
+            Process(arg);
+        }
 
-                IDataBlockList texCoords;
-                texCoords.push_back(normalMapCoordBuffer);
-                geom = GeometrySetPtr(new GeometrySet(vertexBuffer, geomorphBuffer, texCoords));
+        void HeightMapNode::SetClipmapLevels(int levels, int size){
+            delete clipmap;
+            clipmap = levels > 0 ? new HeightMapClipmap(this, levels, size) : NULL;
+        }
 
-                landscapeShader->Load();
-                TextureList texs = landscapeShader->GetTextures();
-                for (unsigned int i = 0; i < texs.size(); ++i)
-                    arg.renderer.LoadTexture(texs[i].get());
-            }else{
-                // Create a non shader geometry set
-                IDataBlockList texCoords;
-                unsigned int numberOfVertices = vertexBuffer->GetSize();
-                normalBuffer = Float3DataBlockPtr(new DataBlock<3, float>(numberOfVertices, normals));
-                normalBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
-                arg.renderer.BindDataBlock(normalBuffer.get());
-                geom = GeometrySetPtr(new GeometrySet(vertexBuffer, normalBuffer, texCoords));
+        void HeightMapNode::SetBintreeBudget(int triangles){
+            if (triangles > 0 && sparseTiles){
+                logger.error << "The bintree can't be used with sparse tiles." << logger.end;
+                return;
             }
+            if (triangles <= 0){
+                delete bintree;
+                bintree = NULL;
+            }else if (bintree)
+                bintree->SetTriangleBudget(triangles);
+            else
+                bintree = new HeightMapBintree(this, triangles);
+        }
 
-            SetLODSwitchDistance(baseDistance, 1 / invIncDistance);
+        void HeightMapNode::SetHeightPyramidLevels(int levels){
+            if (IsLoading()){
+                logger.error << "The height pyramid can't be changed while the heightmap is loading." << logger.end;
+                return;
+            }
+            pyramidLevels = levels;
+            delete pyramid;
+            pyramid = levels > 0 && isLoaded ? new HeightMapPyramid(this, levels) : NULL;
         }
 
-        void HeightMapNode::Handle(Core::ProcessEventArg arg){
-            Process(arg);
+        void HeightMapNode::SetPatchVertexCacheSize(const int size){
+            if (isLoaded){
+                logger.error << "The patch vertex cache size must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            patchVertexCacheSize = size < 0 ? 0 : size;
+        }
+
+        float HeightMapNode::CalcPatchACMR(const int lod, const int cacheSize, const bool fifo){
+            if (numberOfPatches == 0) return 0;
+
+            PatchLOD patchLOD;
+            patchLOD.visible = true;
+            patchLOD.LOD = patchLOD.rightLOD = patchLOD.upperLOD = lod;
+            float acmr = 0;
+            for (int p = 0; p < numberOfPatches; ++p){
+                patchNodes[p].PrepareLOD(patchLOD);
+                acmr += patchNodes[p].CalcACMR(patchLOD, cacheSize, fifo);
+            }
+            return acmr / numberOfPatches;
+        }
+
+        float HeightMapNode::CalcDepthComplexity(const HeightMapLODContext& context, const bool gridOrder,
+                                                 const int resolution) const {
+            const HeightMapLODPacket& packet = context.GetFrontPacket();
+            Utils::DepthComplexityCounter counter(resolution, resolution);
+            std::vector<unsigned int> order;
+            if (gridOrder){
+                // Columns then rows, starting from the side the view
+                // faces.
+                Vector<3, float> forward = packet.view.GetForward();
+                int xStart = forward[0] > 0 ? 0 : patchGridWidth - 1;
+                int xStep = forward[0] > 0 ? 1 : -1;
+                int zStart = forward[2] > 0 ? 0 : patchGridDepth - 1;
+                int zStep = forward[2] > 0 ? 1 : -1;
+                for (int x = xStart; 0 <= x && x < patchGridWidth; x += xStep)
+                    for (int z = zStart; 0 <= z && z < patchGridDepth; z += zStep)
+                        if (packet.patches[z + x * patchGridDepth].visible)
+                            order.push_back(z + x * patchGridDepth);
+            }else
+                order = packet.renderOrder;
+
+            for (unsigned int i = 0; i < order.size(); ++i){
+                const HeightMapPatch& patch = patchNodes[order[i]];
+                Vector<2, float> ndcMin, ndcMax;
+                float depth;
+                if (packet.view.ProjectBox(patch.GetMin(), patch.GetMax(), ndcMin, ndcMax, depth))
+                    counter.AddRect(ndcMin[0], ndcMin[1], ndcMax[0], ndcMax[1], depth);
+            }
+            return counter.GetDepthComplexity();
+        }
+
+        void HeightMapNode::SetLazyPatchIndices(const bool lazy){
+            if (isLoaded){
+                logger.error << "Lazy patch indices must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            lazyPatchIndices = lazy;
+        }
+
+        void HeightMapNode::SetSlimVertexFormat(const bool slim){
+            if (isLoaded){
+                logger.error << "The vertex format must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            slimVertexFormat = slim;
+            // The compact normal map goes with the slim vertices.
+            if (slim && normalMapFormat == NORMALMAP_FLOAT)
+                normalMapFormat = NORMALMAP_OCT8;
+        }
+
+        void HeightMapNode::SetNormalMapFormat(const NormalMapFormat format){
+            if (isLoaded){
+                logger.error << "The normal map format must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            normalMapFormat = format;
+        }
+
+        void HeightMapNode::ApplyPackedNormals() const{
+            if (packedNormals == NULL) return;
+            glEnableClientState(GL_NORMAL_ARRAY);
+            if (packedNormalBuffer){
+                glBindBuffer(GL_ARRAY_BUFFER, packedNormalBuffer);
+                glNormalPointer(GL_BYTE, 4, 0);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }else
+                glNormalPointer(GL_BYTE, 4, packedNormals);
+        }
+
+        void HeightMapNode::ReleasePackedNormals() const{
+            if (packedNormals != NULL)
+                glDisableClientState(GL_NORMAL_ARRAY);
+        }
+
+        void HeightMapNode::SetTiledVertexLayout(const bool tiled){
+            if (isLoaded){
+                logger.error << "The vertex layout must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            tiledLayout = tiled;
+        }
+
+        void HeightMapNode::SetSparseTiles(const bool sparse){
+            if (isLoaded){
+                logger.error << "Sparse tiles must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            if (sparse && bintree){
+                logger.error << "Sparse tiles can't be used with the bintree." << logger.end;
+                return;
+            }
+            sparseTiles = sparse;
+        }
+
+        void HeightMapNode::SetResampling(const bool enabled, const Utils::HeightFilter filter, const float scale){
+            if (isLoaded){
+                logger.error << "Resampling must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            if (!(scale > 0)){
+                logger.error << "Can't resample the heightmap by " << scale << logger.end;
+                return;
+            }
+            resample = enabled;
+            resampleFilter = filter;
+            resampleScale = scale;
+        }
+
+        void HeightMapNode::SetBakeFile(const std::string& file){
+            if (isLoaded){
+                logger.error << "The bake file must be set before the heightmap is loaded." << logger.end;
+                return;
+            }
+            bakeFile = file;
+        }
+
+        unsigned int HeightMapNode::AllocatePatchIndices(const unsigned int count){
+            unsigned int offset = usedIndices;
+            usedIndices += count;
+
+            unsigned int capacity = indexBuffer->GetSize();
+            if (usedIndices > capacity){
+                while (capacity < usedIndices)
+                    capacity *= 2;
+                ResizeIndexBuffer(capacity);
+            }
+
+            return offset;
+        }
+
+        void HeightMapNode::WaitForLOD(){
+            contextsMutex.Lock();
+            std::list<HeightMapLODContext*>::iterator itr;
+            for (itr = contexts.begin(); itr != contexts.end(); ++itr)
+                (*itr)->Wait();
+            contextsMutex.Unlock();
+        }
+
+        void HeightMapNode::RemoveLODContext(HeightMapLODContext* context){
+            context->Wait();
+            context->node = NULL;
+            contextsMutex.Lock();
+            contexts.remove(context);
+            contextsMutex.Unlock();
         }
         
         // **** Get/Set methods ****
@@ -195,6 +709,10 @@ namespace OpenEngine {
             /**
              * http://en.wikipedia.org/wiki/Bilinear_interpolation
              */
+
+            // The worker is replacing the heights.
+            if (IsLoading())
+                return offset.Get(1);
             
             // x and z normalized with respect to the scaling and
             // translation from offset.
@@ -209,10 +727,10 @@ namespace OpenEngine {
             float dZ = z - Z;
 
             // Bilinear interpolation of the heights.
-            float height = GetVertice(X, Z)[1] * (1-dX) * (1-dZ) +
-                           GetVertice(X+1, Z)[1] * dX * (1-dZ) +
-                           GetVertice(X, Z+1)[1] * (1-dX) * dZ +
-                           GetVertice(X+1, Z+1)[1] * dX * dZ;
+            float height = GetVertexHeight(X, Z) * (1-dX) * (1-dZ) +
+                           GetVertexHeight(X+1, Z) * dX * (1-dZ) +
+                           GetVertexHeight(X, Z+1) * (1-dX) * dZ +
+                           GetVertexHeight(X+1, Z+1) * dX * dZ;
             
             return height;
         }
@@ -224,6 +742,9 @@ namespace OpenEngine {
             /**
              * http://en.wikipedia.org/wiki/Bilinear_interpolation
              */
+
+            if (IsLoading())
+                return Vector<3, float>(0.0f, 1.0f, 0.0f);
             
             // x and z normalized with respect to the scaling and
             // translation from offset.
@@ -246,6 +767,28 @@ namespace OpenEngine {
             return normal.GetNormalize();
         }
 
+        float HeightMapNode::GetHeight(Vector<3, float> point, int level) const{
+            return GetHeight(point[0], point[2], level);
+        }
+        float HeightMapNode::GetHeight(float x, float z, int level) const{
+            if (pyramid == NULL || level <= 0 || IsLoading())
+                return GetHeight(x, z);
+            level = std::min(level, pyramid->GetNumberOfLevels() - 1);
+            return pyramid->GetHeight(level, (x - offset.Get(0)) / widthScale, 
+                                      (z - offset.Get(2)) / widthScale);
+        }
+
+        Vector<3, float> HeightMapNode::GetNormal(Vector<3, float> point, int level) const{
+            return GetNormal(point[0], point[2], level);
+        }
+        Vector<3, float> HeightMapNode::GetNormal(float x, float z, int level) const{
+            if (pyramid == NULL || level <= 0 || IsLoading())
+                return GetNormal(x, z);
+            level = std::min(level, pyramid->GetNumberOfLevels() - 1);
+            return pyramid->GetNormal(level, (x - offset.Get(0)) / widthScale, 
+                                      (z - offset.Get(2)) / widthScale);
+        }
+
         Vector<3, float> HeightMapNode::GetReflectedDirection(Vector<3, float> point, Vector<3, float> dir) const{
             return GetReflectedDirection(point[0], point[2], dir);
         }
@@ -279,7 +822,34 @@ namespace OpenEngine {
             return GetVertice(x, z);
         }
 
+        float HeightMapNode::GetVertexHeight(int x, int z) const{
+            if (x < 0)
+                x = 0;
+            else if (x >= width)
+                x = width - 1;
+
+            if (z < 0)
+                z = 0;
+            else if (z >= depth)
+                z = depth - 1;
+
+            int index = CoordToIndex(x, z);
+            if (index < 0)
+                return tileHeights[CoordToTile(x, z)];
+            return GetVertice(index)[1];
+        }
+
         void HeightMapNode::SetVertex(int x, int z, float value){
+            // The worker is building the arrays being edited.
+            if (IsLoading()) return;
+
+            // The LOD worker reads the bounding boxes we're about to
+            // update.
+            WaitForLOD();
+
+            if (sparseTiles)
+                MaterializePatches(x, z, x+1, z+1);
+
             glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer->GetID());
             float* vbo = (float*) glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
 
@@ -364,6 +934,11 @@ namespace OpenEngine {
             HeightMapPatch* upperRightNode = GetPatch(x+1, z+1);
             if (upperRightNode != mainNode) upperRightNode->UpdateBoundingGeometry(value);
 
+            // The clipmap may be fetched from the pyramid.
+            if (pyramid) pyramid->Invalidate(x, z, x+1, z+1);
+            if (clipmap) clipmap->Invalidate(x, z, x+1, z+1);
+            if (bintree) bintree->Invalidate(x, z, x+1, z+1);
+
         }
 
         void HeightMapNode::SetVertices(int x, int z, int w, int d, float* values){
@@ -379,21 +954,85 @@ namespace OpenEngine {
             // 
             //          Below
 
+            // The worker is building the arrays being edited.
+            if (IsLoading()) return;
+
             // if the area is outside the heightmap
             if (x >= width || z >= depth || x + w <= 0 || z + d <= 0) return;
 
+            // The LOD worker reads the bounding boxes we're about to
+            // update.
+            WaitForLOD();
+
             // Update the height for the moved vertices
             int xStart = x < 0 ? 0 : x;
             int zStart = z < 0 ? 0 : z;
             int xEnd = (x + w >= width) ? width : x + w;
             int zEnd = (z + d >= depth) ? depth : z + d;
+
+            if (sparseTiles)
+                MaterializePatches(xStart, zStart, xEnd, zEnd);
             
+            for (int xi = xStart; xi < xEnd; ++xi)
+                for (int zi = zStart; zi < zEnd; ++zi){
+                    int index = CoordToIndex(xi, zi);
+                    GetVertice(index)[1] = values[(zi - z) + (xi - x) * d];
+                }
+
+            UpdateVertices(xStart, zStart, xEnd, zEnd);
+        }
+
+        unsigned int HeightMapNode::EncodeVertices(int x, int z, int w, int d, float maxError,
+                                                   std::vector<unsigned char>& data){
+            if (x < 0 || z < 0 || w < 0 || d < 0 || x + w > width || z + d > depth){
+                logger.error << "Can't encode vertices outside the heightmap." << logger.end;
+                return 0;
+            }
+
+            // The rows of the heights are along z, like the values
+            // of SetVertices.
+            if (!tiledLayout)
+                return Utils::EncodeHeights(GetVertice(x, z) + 1, d, w, DIMENSIONS, 
+                                            depth * DIMENSIONS, maxError, data);
+
+            std::vector<float> values(w * d);
+            for (int xi = 0; xi < w; ++xi)
+                for (int zi = 0; zi < d; ++zi)
+                    values[zi + xi * d] = GetVertexHeight(x + xi, z + zi);
+            return Utils::EncodeHeights(values.empty() ? NULL : &values[0], d, w, 1, d, maxError, data);
+        }
+
+        bool HeightMapNode::DecodeVertices(int x, int z, const unsigned char* data, unsigned int size){
+            int w, d;
+            if (!Utils::GetEncodedHeightsSize(data, size, d, w)){
+                logger.error << "Can't decode vertices, the data is not encoded heights." << logger.end;
+                return false;
+            }
+
+            if (tiledLayout || x < 0 || z < 0 || x + w > width || z + d > depth){
+                std::vector<float> values(w * d);
+                if (values.empty()) return true;
+                if (!Utils::DecodeHeights(data, size, &values[0], 1, d))
+                    return false;
+                SetVertices(x, z, w, d, &values[0]);
+                return true;
+            }
+
+            // Decode straight into the vertices.
+            WaitForLOD();
+            if (!Utils::DecodeHeights(data, size, GetVertice(x, z) + 1, DIMENSIONS, depth * DIMENSIONS))
+                return false;
+            UpdateVertices(x, z, x + w, z + d);
+            return true;
+        }
+
+        void HeightMapNode::UpdateVertices(int xStart, int zStart, int xEnd, int zEnd){
             glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer->GetID());
             float* vbo = (float*) glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
             for (int xi = xStart; xi < xEnd; ++xi)
                 for (int zi = zStart; zi < zEnd; ++zi){
                     int index = CoordToIndex(xi, zi);
-                    vbo[index * DIMENSIONS + 1] = GetVertice(index)[1] = values[(zi - z) + (xi - x) * d];
+                    vbo[index * DIMENSIONS + 1] = GetVertice(index)[1];
                 }
 
             // Update the morphing height for all affected vertices
@@ -405,6 +1044,8 @@ namespace OpenEngine {
             for (int xi = morphLeft; xi < morphRight; ++xi)
                 for (int zi = morphBelow; zi < morphAbove; ++zi){
                     int index = CoordToIndex(xi, zi);
+                    // The flat tiles have no morph.
+                    if (index < 0) continue;
                     vbo[index * DIMENSIONS + 3] = GetVertice(index)[3] = CalcGeomorphHeight(xi, zi);
                 }
 
@@ -448,37 +1089,42 @@ namespace OpenEngine {
                 for (int zi = zBoundingStart; zi < zEnd; zi += patchSize){
                     GetPatch(xi, zi)->UpdateBoundingGeometry();
                 }
+
+            // The clipmap may be fetched from the pyramid.
+            if (pyramid) pyramid->Invalidate(xStart, zStart, xEnd, zEnd);
+            if (clipmap) clipmap->Invalidate(xStart, zStart, xEnd, zEnd);
+            if (bintree) bintree->Invalidate(xStart, zStart, xEnd, zEnd);
         }
 
         Vector<3, float> HeightMapNode::GetNormal(int x, int z){
             
             Vector<3, float> normal = Vector<3, float>(0.0f);
-            float vHeight = GetVertice(x, z)[1];
+            float vHeight = GetVertexHeight(x, z);
 
             // Right vertex
             if (x + 1 < width){
-                float wHeight = GetVertice(x + 1, z)[1];
+                float wHeight = GetVertexHeight(x + 1, z);
                 normal[0] += vHeight - wHeight;
                 normal[1] += widthScale;
             }
             
             // Left vertex
             if (0 < x){
-                float wHeight = GetVertice(x - 1, z)[1];
+                float wHeight = GetVertexHeight(x - 1, z);
                 normal[0] += wHeight - vHeight;
                 normal[1] += widthScale;
             }
 
             // upper vertex
             if (z + 1 < depth){
-                float wHeight = GetVertice(x, z + 1)[1];
+                float wHeight = GetVertexHeight(x, z + 1);
                 normal[2] += vHeight - wHeight;
                 normal[1] += widthScale;
             }
             
             // Lower vertex
             if (0 < z){
-                float wHeight = GetVertice(x, z - 1)[1];
+                float wHeight = GetVertexHeight(x, z - 1);
                 normal[2] += wHeight - vHeight;
                 normal[1] += widthScale;
             }
@@ -514,7 +1160,109 @@ namespace OpenEngine {
 
         // **** inline functions ****
 
+        void HeightMapNode::SetupLODPacket(HeightMapLODContext& context, HeightMapLODPacket& packet,
+                                           const HeightMapView& view){
+            packet.view = view;
+            // Offsetting the LOD by the bias is the same as moving
+            // the base distance. The controller scales both
+            // distances, but not below the lowest incremental
+            // distance.
+            float scale = context.controller.GetDistanceScale();
+            float edgeLength = HeightMapPatch::PATCH_EDGE_SQUARES * widthScale;
+            float maxInvIncDistance = 1.0f / sqrt(edgeLength * edgeLength * 2);
+            packet.invIncDistance = invIncDistance / scale;
+            if (packet.invIncDistance > maxInvIncDistance)
+                packet.invIncDistance = maxInvIncDistance;
+            packet.baseDistance = (baseDistance - context.lodBias / invIncDistance) * scale;
+        }
+
+        void HeightMapNode::SortPatches(HeightMapLODPacket& packet){
+            std::vector<unsigned int>& renderOrder = packet.renderOrder;
+            std::vector<unsigned int>& renderOrderTemp = packet.renderOrderTemp;
+            std::vector<unsigned short>& sortKeys = packet.sortKeys;
+            std::vector<unsigned short>& sortKeysTemp = packet.sortKeysTemp;
+            std::vector<bool>& inRenderOrder = packet.inRenderOrder;
+            Vector<3, float> viewPos = packet.view.GetPosition();
+
+            // Start from the packets last order. Patches that are
+            // still visible keep their relative order and newly visible
+            // patches are appended, so when the camera moves slowly
+            // the list is almost sorted already.
+            unsigned int n = 0;
+            for (unsigned int i = 0; i < renderOrder.size(); ++i){
+                unsigned int p = renderOrder[i];
+                if (packet.patches[p].visible){
+                    renderOrder[n++] = p;
+                    inRenderOrder[p] = true;
+                }else
+                    inRenderOrder[p] = false;
+            }
+            renderOrder.resize(n);
+            for (int p = 0; p < numberOfPatches; ++p){
+                if (packet.patches[p].visible && !inRenderOrder[p]){
+                    renderOrder.push_back(p);
+                    inRenderOrder[p] = true;
+                }
+            }
+            n = renderOrder.size();
+
+            // Quantize the distance to the patches so a patch edge
+            // spans SORT_KEY_STEPS keys.
+            float invQuantization = SORT_KEY_STEPS / (HeightMapPatch::PATCH_EDGE_SQUARES * widthScale);
+            sortKeys.resize(n);
+            unsigned int descents = 0;
+            for (unsigned int i = 0; i < n; ++i){
+                float key = patchNodes[renderOrder[i]].GetDistance(viewPos) * invQuantization;
+                sortKeys[i] = key < 0xFFFF ? (unsigned short) key : 0xFFFF;
+                if (i > 0 && sortKeys[i] < sortKeys[i-1])
+                    ++descents;
+            }
+            if (descents == 0) return;
+
+            // Insertion sort is linear on nearly sorted input. Give
+            // up on it if the order changed too much since last
+            // frame and fall back to the radix sort.
+            unsigned int moves = 0;
+            unsigned int maxMoves = 4 * n;
+            unsigned int i = 1;
+            for (; i < n && moves < maxMoves; ++i){
+                unsigned short key = sortKeys[i];
+                unsigned int patch = renderOrder[i];
+                unsigned int j = i;
+                for (; j > 0 && sortKeys[j-1] > key; --j){
+                    sortKeys[j] = sortKeys[j-1];
+                    renderOrder[j] = renderOrder[j-1];
+                }
+                sortKeys[j] = key;
+                renderOrder[j] = patch;
+                moves += i - j;
+            }
+            if (i == n) return;
+
+            // LSD radix sort on the 16 bit keys, one byte per pass.
+            sortKeysTemp.resize(n);
+            renderOrderTemp.resize(n);
+            for (int shift = 0; shift < 16; shift += 8){
+                unsigned int count[257];
+                memset(count, 0, sizeof(count));
+                for (unsigned int k = 0; k < n; ++k)
+                    ++count[((sortKeys[k] >> shift) & 0xFF) + 1];
+                for (int b = 0; b < 256; ++b)
+                    count[b+1] += count[b];
+                for (unsigned int k = 0; k < n; ++k){
+                    unsigned int dest = count[(sortKeys[k] >> shift) & 0xFF]++;
+                    sortKeysTemp[dest] = sortKeys[k];
+                    renderOrderTemp[dest] = renderOrder[k];
+                }
+                sortKeys.swap(sortKeysTemp);
+                renderOrder.swap(renderOrderTemp);
+            }
+        }
+
         void HeightMapNode::InitArrays(){
+            if (resample)
+                ResampleHeightMap();
+
             int texWidth = tex->GetHeight();
             int texDepth = tex->GetWidth();
 
@@ -526,79 +1274,576 @@ namespace OpenEngine {
             int depthRest = (texDepth - 1) % patchWidth;
             depth = depthRest ? texDepth + patchWidth - depthRest : texDepth;
 
+            patchGridWidth = (width-1) / patchWidth;
+            patchGridDepth = (depth-1) / patchWidth;
+            numberOfPatches = patchGridWidth * patchGridDepth;
+
+            if (sparseTiles)
+                tiledLayout = true;
+
             unsigned int numberOfVertices = width * depth;
+            if (tiledLayout){
+                // Round up to whole tiles. The padding is never
+                // indexed.
+                tilesWidth = (width + TILE_SIZE - 1) / TILE_SIZE;
+                tilesDepth = (depth + TILE_SIZE - 1) / TILE_SIZE;
+                numberOfVertices = tilesWidth * tilesDepth * TILE_VERTICES;
+            }
 
+            FloatTexture2DPtr source = tex;
             Texture2D<float>* newTex = new Texture2D<float>(width, depth, LUMINANCE32F);
             newTex->SetWrapping(CLAMP_TO_EDGE);
             newTex->Load();
-            for (int x = 0; x < width; ++x){
-                for (int z = 0; z < depth; ++z){
-                    if (x < texWidth && z < texDepth){
-                        // inside the heightmap
-                        newTex->GetPixel(x, z)[0] = tex->GetPixel(x, z)[0] * heightScale + offset[1];
-                    }else{
-                        // outside the heightmap, set height to waterlevel
-                        newTex->GetPixel(x, z)[0] = offset[1];
-                    }
-                }
-            }
-
             tex = FloatTexture2DPtr(newTex);
 
+            if (sparseTiles){
+                // The flat patches are found from the padded heights
+                // before the vertex arrays are allocated.
+                PadHeights(source.get(), 0, width);
+                SetupSparseTiles();
+                numberOfVertices = firstSlotVertex + numberOfSlots * TILE_VERTICES;
+            }
+
             vertexBuffer = Float4DataBlockPtr(new DataBlock<4, float>(numberOfVertices));
             vertexBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
             normals = new float[numberOfVertices * 3];
-            normalMapCoordBuffer = Float2DataBlockPtr(new DataBlock<2, float>(numberOfVertices));
-            geomorphBuffer = Float3DataBlockPtr(new DataBlock<3, float>(numberOfVertices));
+            // Zero the padding of the tiled layout.
+            if (tiledLayout)
+                memset(normals, 0, sizeof(float) * numberOfVertices * 3);
+            if (!slimVertexFormat){
+                normalMapCoordBuffer = Float2DataBlockPtr(new DataBlock<2, float>(numberOfVertices));
+                geomorphBuffer = Float3DataBlockPtr(new DataBlock<3, float>(numberOfVertices));
+            }
             deltaValues = new char[numberOfVertices];
 
-            // Fill the vertex array
-            for (int x = 0; x < width; ++x){
-                for (int z = 0; z < depth; ++z){
-                    float* vertice = GetVertice(x, z);
-                     
-                    vertice[0] = widthScale * x + offset[0];
-                    vertice[1] = newTex->GetPixel(x, z)[0];
-                    vertice[2] = widthScale * z + offset[2];
-                    vertice[3] = 1;
+            // Pad the heights in the same pass as the vertices are
+            // filled, unless it's done.
+            FillVertices(0, 0, width, depth, sparseTiles ? NULL : source.get());
+
+            if (sparseTiles)
+                for (int p = 0; p < numberOfPatches; ++p)
+                    if (flatPatches[p])
+                        SetupFlatQuad(p);
+        }
+
+        void HeightMapNode::ResampleHeightMap(){
+            int columns = tex->GetWidth();
+            int rows = tex->GetHeight();
+            if (columns < 2 || rows < 2) return;
+
+            // The same step along both axes, from the columns.
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            int newColumns = Utils::CalcPatchAlignedSize((int)((columns - 1) * resampleScale + 0.5f) + 1, squares);
+            float step = (columns - 1) / (float)(newColumns - 1);
+            int newRows = Utils::CalcPatchAlignedSize((int)((rows - 1) / step + 0.5f) + 1, squares);
+            if (newColumns == columns && newRows == rows)
+                return;
+
+            tex = Utils::ResampleHeights(tex, newColumns, newRows, step, step, resampleFilter, resampleThreads);
+            widthScale *= step;
+        }
+
+        unsigned long long HeightMapNode::CalcBakeKey() const{
+            unsigned long long hash = 14695981039346656037ULL;
+            int params[] = { BAKE_VERSION, (int)tex->GetWidth(), (int)tex->GetHeight(), (int)tex->GetChannels(),
+                             HeightMapPatch::PATCH_EDGE_SQUARES, HeightMapPatch::MAX_LODS, TILE_BITS,
+                             tiledLayout, sparseTiles, slimVertexFormat, landscapeShader != NULL,
+                             patchVertexCacheSize, lazyPatchIndices, resample, resampleFilter };
+            float scales[] = { heightScale, widthScale, offset[0], offset[1], offset[2], resampleScale };
+            HashBakeData(hash, params, sizeof(params));
+            HashBakeData(hash, scales, sizeof(scales));
+            HashBakeData(hash, tex->GetData(), 
+                         sizeof(float) * tex->GetWidth() * tex->GetHeight() * tex->GetChannels());
+            return hash;
+        }
+
+        bool HeightMapNode::ReadBake(unsigned long long key){
+            // Read the file in one go.
+            std::ifstream in(bakeFile.c_str(), std::ios::in | std::ios::binary);
+            if (!in) return false;
+            in.seekg(0, std::ios::end);
+            std::streamoff size = in.tellg();
+            in.seekg(0, std::ios::beg);
+            if (size <= 0) return false;
+            std::vector<char> buffer(size);
+            if (!in.read(&buffer[0], size)) return false;
+            const char* data = &buffer[0];
+            const char* end = data + size;
+
+            char magic[4];
+            unsigned int version, byteOrder;
+            unsigned long long fileKey;
+            // The width scale, changed by resampling.
+            float scale;
+            // width, depth, tilesWidth, tilesDepth, patchGridWidth,
+            // patchGridDepth, numberOfSlots, firstSlotVertex,
+            // tiledLayout
+            int sizes[9];
+            // vertices, index buffer capacity, used indices
+            unsigned int counts[3];
+            if (!ReadBakeData(data, end, magic, sizeof(magic)) || memcmp(magic, BAKE_MAGIC, 4) != 0 ||
+                !ReadBakeData(data, end, &version, sizeof(version)) || version != BAKE_VERSION ||
+                !ReadBakeData(data, end, &byteOrder, sizeof(byteOrder)) || byteOrder != BAKE_BYTE_ORDER ||
+                !ReadBakeData(data, end, &fileKey, sizeof(fileKey)) || fileKey != key ||
+                !ReadBakeData(data, end, sizes, sizeof(sizes)) ||
+                !ReadBakeData(data, end, counts, sizeof(counts)) ||
+                !ReadBakeData(data, end, &scale, sizeof(scale)))
+                return false;
+
+            for (int i = 0; i < 9; ++i)
+                if (sizes[i] < 0) return false;
+            unsigned long long vertices = counts[0];
+            unsigned long long heights = (unsigned long long)sizes[0] * sizes[1];
+            unsigned long long tiles = (unsigned long long)sizes[2] * sizes[3];
+            unsigned long long patches = (unsigned long long)sizes[4] * sizes[5];
+            unsigned int used = counts[2];
+
+            // Check the size before allocating anything.
+            unsigned long long expected = sizeof(float) * heights + 
+                vertices * (sizeof(float) * (DIMENSIONS + 3) + sizeof(char)) +
+                sizeof(int) * HeightMapPatch::NUMBER_OF_LOD_STRUCTS +
+                sizeof(unsigned int) * used + HeightMapPatch::BAKE_SIZE * patches;
+            if (!slimVertexFormat)
+                expected += vertices * sizeof(float) * (TEXCOORDS + 3);
+            if (sparseTiles)
+                expected += tiles * (sizeof(int) + sizeof(float)) + patches;
+            if (expected != (unsigned long long)(end - data) || used > counts[1]){
+                logger.error << "The bake file " << bakeFile << " is corrupt, recomputing it." << logger.end;
+                return false;
+            }
+
+            widthScale = scale;
+            width = sizes[0];
+            depth = sizes[1];
+            tilesWidth = sizes[2];
+            tilesDepth = sizes[3];
+            patchGridWidth = sizes[4];
+            patchGridDepth = sizes[5];
+            numberOfPatches = patches;
+            numberOfSlots = sizes[6];
+            firstSlotVertex = sizes[7];
+            tiledLayout = sizes[8];
+
+            Texture2D<float>* newTex = new Texture2D<float>(width, depth, LUMINANCE32F);
+            newTex->SetWrapping(CLAMP_TO_EDGE);
+            newTex->Load();
+            ReadBakeData(data, end, newTex->GetData(), sizeof(float) * heights);
+            tex = FloatTexture2DPtr(newTex);
+
+            vertexBuffer = Float4DataBlockPtr(new DataBlock<4, float>(vertices));
+            vertexBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            ReadBakeData(data, end, vertexBuffer->GetData(), sizeof(float) * DIMENSIONS * vertices);
+            normals = new float[vertices * 3];
+            ReadBakeData(data, end, normals, sizeof(float) * 3 * vertices);
+            if (!slimVertexFormat){
+                normalMapCoordBuffer = Float2DataBlockPtr(new DataBlock<2, float>(vertices));
+                ReadBakeData(data, end, normalMapCoordBuffer->GetData(), sizeof(float) * TEXCOORDS * vertices);
+                geomorphBuffer = Float3DataBlockPtr(new DataBlock<3, float>(vertices));
+                ReadBakeData(data, end, geomorphBuffer->GetData(), sizeof(float) * 3 * vertices);
+            }
+            deltaValues = new char[vertices];
+            ReadBakeData(data, end, deltaValues, vertices);
+
+            if (sparseTiles){
+                tileSlots.resize(tiles);
+                tileHeights.resize(tiles);
+                flatPatches.resize(patches);
+                if (tiles > 0){
+                    ReadBakeData(data, end, &tileSlots[0], sizeof(int) * tiles);
+                    ReadBakeData(data, end, &tileHeights[0], sizeof(float) * tiles);
                 }
+                for (unsigned int p = 0; p < patches; ++p)
+                    flatPatches[p] = *data++ != 0;
             }
 
-            SetupNormalMap();
+            patchIndexCounts.resize(HeightMapPatch::NUMBER_OF_LOD_STRUCTS);
+            ReadBakeData(data, end, &patchIndexCounts[0], sizeof(int) * HeightMapPatch::NUMBER_OF_LOD_STRUCTS);
+            indexBuffer = IndicesPtr(new Indices(counts[1]));
+            indexBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            ReadBakeData(data, end, indexBuffer->GetData(), sizeof(unsigned int) * used);
+            usedIndices = uploadedIndices = used;
+            indexBufferGrown = false;
+            freedIndices = 0;
+
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            patchNodes = new HeightMapPatch[numberOfPatches];
+            for (int p = 0; p < numberOfPatches; ++p){
+                patchNodes[p].ReadBake((p / patchGridDepth) * squares, (p % patchGridDepth) * squares, 
+                                       this, data + p * HeightMapPatch::BAKE_SIZE);
+                patchNodes[p].SetDataIndices(indexBuffer);
+            }
+
+            return true;
+        }
+
+        void HeightMapNode::WriteBake(unsigned long long key) const{
+            std::ofstream out(bakeFile.c_str(), std::ios::out | std::ios::binary);
+            if (!out){
+                logger.error << "Can't write the bake file " << bakeFile << logger.end;
+                return;
+            }
+
+            unsigned int vertices = vertexBuffer->GetSize();
+            int sizes[9] = { width, depth, tilesWidth, tilesDepth, patchGridWidth, patchGridDepth,
+                             numberOfSlots, (int)firstSlotVertex, tiledLayout };
+            unsigned int counts[3] = { vertices, indexBuffer->GetSize(), usedIndices };
+            out.write(BAKE_MAGIC, sizeof(BAKE_MAGIC));
+            out.write((const char*)&BAKE_VERSION, sizeof(BAKE_VERSION));
+            out.write((const char*)&BAKE_BYTE_ORDER, sizeof(BAKE_BYTE_ORDER));
+            out.write((const char*)&key, sizeof(key));
+            out.write((const char*)sizes, sizeof(sizes));
+            out.write((const char*)counts, sizeof(counts));
+            out.write((const char*)&widthScale, sizeof(widthScale));
+
+            out.write((const char*)tex->GetData(), sizeof(float) * width * depth);
+            out.write((const char*)vertexBuffer->GetData(), sizeof(float) * DIMENSIONS * vertices);
+            out.write((const char*)normals, sizeof(float) * 3 * vertices);
+            if (!slimVertexFormat){
+                out.write((const char*)normalMapCoordBuffer->GetData(), sizeof(float) * TEXCOORDS * vertices);
+                out.write((const char*)geomorphBuffer->GetData(), sizeof(float) * 3 * vertices);
+            }
+            out.write(deltaValues, vertices);
+
+            if (sparseTiles){
+                if (!tileSlots.empty()){
+                    out.write((const char*)&tileSlots[0], sizeof(int) * tileSlots.size());
+                    out.write((const char*)&tileHeights[0], sizeof(float) * tileHeights.size());
+                }
+                for (int p = 0; p < numberOfPatches; ++p)
+                    out.put(flatPatches[p] ? 1 : 0);
+            }
+
+            out.write((const char*)&patchIndexCounts[0], sizeof(int) * patchIndexCounts.size());
+            out.write((const char*)indexBuffer->GetData(), sizeof(unsigned int) * usedIndices);
+            std::vector<char> patches(numberOfPatches * HeightMapPatch::BAKE_SIZE);
+            for (int p = 0; p < numberOfPatches; ++p)
+                patchNodes[p].WriteBake(&patches[p * HeightMapPatch::BAKE_SIZE]);
+            if (!patches.empty())
+                out.write(&patches[0], patches.size());
+
+            if (!out)
+                logger.error << "Can't write the bake file " << bakeFile << logger.end;
+        }
+
+        void HeightMapNode::SetupSparseTiles(){
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+
+            // A patch is flat if all it's vertices have the height of
+            // it's corner.
+            flatPatches.assign(numberOfPatches, false);
+            for (int px = 0; px < patchGridWidth; ++px)
+                for (int pz = 0; pz < patchGridDepth; ++pz){
+                    float height = tex->GetPixel(px * squares, pz * squares)[0];
+                    bool flat = true;
+                    for (int x = px * squares; x <= (px + 1) * squares && flat; ++x)
+                        for (int z = pz * squares; z <= (pz + 1) * squares && flat; ++z)
+                            flat = tex->GetPixel(x, z)[0] == height;
+                    flatPatches[pz + px * patchGridDepth] = flat;
+                }
+
+            // A tile is stored if a patch that is not flat uses it's
+            // vertices. The patches using tile (tx, tz) are (tx, tz)
+            // and the ones below and to the left of it, which share
+            // it's lower left corner, so the heights of a tile that
+            // is only used by flat patches are all the same.
+            int tiles = tilesWidth * tilesDepth;
+            tileSlots.assign(tiles, NO_SLOT);
+            tileHeights.assign(tiles, 0.0f);
+            numberOfSlots = 0;
+            // Every patch has room for a quad, so a patch's quad
+            // doesn't move when other patches are edited.
+            firstSlotVertex = 4 * numberOfPatches;
+            for (int tx = 0; tx < tilesWidth; ++tx)
+                for (int tz = 0; tz < tilesDepth; ++tz){
+                    bool used = false;
+                    for (int px = tx - 1; px <= tx; ++px)
+                        for (int pz = tz - 1; pz <= tz; ++pz)
+                            if (0 <= px && px < patchGridWidth && 0 <= pz && pz < patchGridDepth)
+                                used |= !flatPatches[pz + px * patchGridDepth];
+
+                    int tile = tz + tx * tilesDepth;
+                    if (used)
+                        tileSlots[tile] = numberOfSlots++;
+                    else
+                        tileHeights[tile] = tex->GetPixel(tx * TILE_SIZE, tz * TILE_SIZE)[0];
+                }
+        }
+
+        void HeightMapNode::PadHeights(Texture2D<float>* source, int xStart, int xEnd){
+            int texWidth = source->GetHeight();
+            int texDepth = source->GetWidth();
+            for (int zBlock = 0; zBlock < depth; zBlock += TILE_SIZE){
+                int zEnd = std::min(zBlock + TILE_SIZE, depth);
+                for (int x = xStart; x < xEnd; ++x)
+                    for (int z = zBlock; z < zEnd; ++z){
+                        if (x < texWidth && z < texDepth){
+                            // inside the heightmap
+                            tex->GetPixel(x, z)[0] = source->GetPixel(x, z)[0] * heightScale + offset[1];
+                        }else{
+                            // outside the heightmap, set height to waterlevel
+                            tex->GetPixel(x, z)[0] = offset[1];
+                        }
+                    }
+            }
+        }
+
+        void HeightMapNode::FillVertices(int xStart, int zStart, int xEnd, int zEnd, Texture2D<float>* source){
+            // Walk the area a tile wide column at a time, with the
+            // positions filled a column ahead of the values that
+            // depend on the neighbouring positions, at most
+            // MAX_DELTA / 2 away, so they are still in the cache.
+            int xNext = std::min(xStart + TILE_SIZE, xEnd);
+            if (source) PadHeights(source, xStart, xNext);
+            FillPositions(xStart, zStart, xNext, zEnd);
+            for (int x = xStart; x < xEnd; x = xNext){
+                ReportLoadProgress((float)(x - xStart) / (xEnd - xStart));
+                xNext = std::min(x + TILE_SIZE, xEnd);
+                if (xNext < xEnd){
+                    int xAhead = std::min(xNext + TILE_SIZE, xEnd);
+                    if (source) PadHeights(source, xNext, xAhead);
+                    FillPositions(xNext, zStart, xAhead, zEnd);
+                }
+                FillDerived(x, zStart, xNext, zEnd);
+            }
+        }
+
+        void HeightMapNode::FillPositions(int xStart, int zStart, int xEnd, int zEnd){
+            // The heights are read across the rows of the texture,
+            // so go through tile sized blocks to keep the rows in
+            // the cache.
+            for (int zBlock = zStart; zBlock < zEnd; zBlock += TILE_SIZE){
+                int zBlockEnd = std::min(zBlock + TILE_SIZE, zEnd);
+                for (int x = xStart; x < xEnd; ++x)
+                    for (int z = zBlock; z < zBlockEnd; ++z){
+                        int index = CoordToIndex(x, z);
+                        if (index < 0) continue;
+                        float* vertice = GetVertice(index);
+                     
+                        vertice[0] = widthScale * x + offset[0];
+                        vertice[1] = tex->GetPixel(x, z)[0];
+                        vertice[2] = widthScale * z + offset[2];
+                        vertice[3] = 1;
+                    }
+            }
+        }
+
+        void HeightMapNode::FillDerived(int xStart, int zStart, int xEnd, int zEnd){
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            // Write the arrays in the order they are stored, a tile
+            // at a time in the tiled layout.
+            for (int zBlock = zStart; zBlock < zEnd; ){
+                int zBlockEnd = tiledLayout ? std::min((zBlock / TILE_SIZE + 1) * TILE_SIZE, zEnd) : zEnd;
+                for (int x = xStart; x < xEnd; ++x)
+                    for (int z = zBlock; z < zBlockEnd; ++z){
+                        int index = CoordToIndex(x, z);
+                        if (index < 0) continue;
+
+                        Vector<3, float> normal = GetNormal(x, z);
+                        normal.ToArray(GetNormals(index));
+                        if (packedNormals)
+                            for (int c = 0; c < 3; ++c)
+                                packedNormals[index * 4 + c] = (char)floor(normal[c] * 127.0f + 0.5f);
+
+                        // The vertex is in the LODs whose step divides
+                        // both coords.
+                        int LOD = 1, delta = 1;
+                        while (LOD < HeightMapPatch::MAX_LODS && x % (2 * delta) == 0 && z % (2 * delta) == 0){
+                            ++LOD;
+                            delta *= 2;
+                        }
+                        GetVerticeDelta(index) = delta;
+
+                        if (!slimVertexFormat){
+                            float* coord = GetNormalMapCoord(x, z);
+                            coord[1] = (x + 0.5f) / (float) width;
+                            coord[0] = (z + 0.5f) / (float) depth;
+
+                            // The center of the patch the vertex belongs
+                            // to, see GetPatchIndex.
+                            float* geomorph = GetGeomorphValues(x, z);
+                            int patchX = (x-1) / squares;
+                            int patchZ = (z-1) / squares;
+                            geomorph[0] = widthScale * (patchX * squares + squares / 2) + offset[0];
+                            geomorph[1] = widthScale * (patchZ * squares + squares / 2) + offset[2];
+                            GetVerticeLOD(index) = LOD;
+                        }
 
-            if (landscapeShader != NULL){
-                CalcVerticeLOD();
-                for (int x = 0; x < width; ++x)
-                    for (int z = 0; z < depth; ++z){
                         // Store the morphing value in the w-coord to
                         // use in the shader.
-                        float* vertice = GetVertice(x, z);
-                        vertice[3] = CalcGeomorphHeight(x, z);
+                        if (landscapeShader != NULL)
+                            GetVertice(index)[3] = CalcGeomorphHeight(x, z);
                     }
+                zBlock = zBlockEnd;
             }
         }
 
-        void HeightMapNode::SetupNormalMap(){
-            for (int x = 0; x < width; ++x)
-                for (int z = 0; z < depth; ++z){
-                    float* coord = GetNormalMapCoord(x, z);
+        void HeightMapNode::SetupFlatQuad(int patch){
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            int xStart = (patch / patchGridDepth) * squares;
+            int zStart = (patch % patchGridDepth) * squares;
+            float height = tex->GetPixel(xStart, zStart)[0];
+            int corners[4][2] = { { xStart, zStart + squares }, { xStart + squares, zStart + squares },
+                                  { xStart, zStart }, { xStart + squares, zStart } };
+
+            for (int c = 0; c < 4; ++c){
+                int x = corners[c][0], z = corners[c][1];
+                int index = 4 * patch + c;
+                float* vertice = GetVertice(index);
+                vertice[0] = widthScale * x + offset[0];
+                vertice[1] = height;
+                vertice[2] = widthScale * z + offset[2];
+                // A flat patch doesn't morph.
+                vertice[3] = landscapeShader != NULL ? 0 : 1;
+
+                float* normal = GetNormals(index);
+                normal[0] = normal[2] = 0;
+                normal[1] = 1;
+                GetVerticeDelta(index) = HeightMapPatch::MAX_DELTA;
+
+                if (!slimVertexFormat){
+                    float* coord = normalMapCoordBuffer->GetData() + index * 2;
                     coord[1] = (x + 0.5f) / (float) width;
                     coord[0] = (z + 0.5f) / (float) depth;
-                    Vector<3, float> normal = GetNormal(x, z);
-                    normal.ToArray(GetNormals(x, z));
+                    float* geomorph = geomorphBuffer->GetData() + index * 3;
+                    geomorph[0] = widthScale * (xStart + squares / 2) + offset[0];
+                    geomorph[1] = widthScale * (zStart + squares / 2) + offset[2];
+                    geomorph[2] = HeightMapPatch::MAX_LODS;
                 }
+            }
         }
 
-        void HeightMapNode::CalcVerticeLOD(){
-            for (int LOD = 1; LOD <= HeightMapPatch::MAX_LODS; ++LOD){
-                int delta = pow(2, LOD-1);
-                for (int x = 0; x < width; x += delta){
-                    for (int z = 0; z < depth; z += delta){
-                        GetVerticeLOD(x, z) = LOD;
-                        GetVerticeDelta(x, z) = pow(2, LOD-1);
-                    }
+        void HeightMapNode::SetupRenderData(){
+            if (landscapeShader != NULL) {
+                // Create the image to hold the normal map
+                if (tiledLayout){
+                    normalMapData = new float[width * depth * 3];
+                    for (int x = 0; x < width; ++x)
+                        for (int z = 0; z < depth; ++z)
+                            memcpy(normalMapData + (z + x * depth) * 3, GetNormals(x, z), sizeof(float) * 3);
+                }else
+                    normalMapData = normals;
+                if (normalMapFormat == NORMALMAP_FLOAT){
+                    normalmap = FloatTexture2DPtr(new Texture2D<float>(width, depth, 3, normalMapData));
+                    normalmap->SetColorFormat(RGB32F);
+                }else{
+                    Utils::NormalEncoding encoding = normalMapFormat == NORMALMAP_XZ8 ? 
+                        Utils::NORMAL_XZ8 : Utils::NORMAL_OCT8;
+                    encodedNormalMap = new unsigned char[width * depth * 2];
+                    Utils::EncodeNormals(normalMapData, width * depth, encodedNormalMap, encoding);
+                    normalMapError = Utils::CalcNormalEncodingError(normalMapData, width * depth, 
+                                                                    encodedNormalMap, encoding);
+                    normalmap = UCharTexture2DPtr(new Texture2D<unsigned char>(width, depth, 2, encodedNormalMap));
+                    normalmap->SetColorFormat(LUMINANCE_ALPHA);
+                }
+                normalmap->SetMipmapping(false);
+                normalmap->SetCompression(false);
+            }else if (slimVertexFormat){
+                // Pack the normals into signed bytes, padded to 4
+                // bytes, and draw them with glNormalPointer.
+                unsigned int numberOfVertices = vertexBuffer->GetSize();
+                packedNormals = new char[numberOfVertices * 4];
+                for (unsigned int i = 0; i < numberOfVertices; ++i){
+                    for (int c = 0; c < 3; ++c)
+                        packedNormals[i * 4 + c] = (char)floor(GetNormals(i)[c] * 127.0f + 0.5f);
+                    packedNormals[i * 4 + 3] = 0;
+                }
+            }else{
+                // The normals of the non shader geometry set
+                unsigned int numberOfVertices = vertexBuffer->GetSize();
+                normalBuffer = Float3DataBlockPtr(new DataBlock<3, float>(numberOfVertices, normals));
+                normalBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            }
+        }
+
+        void HeightMapNode::SetupBuffers(RenderingEventArg arg, bool upload){
+            // Geomorph values and normal map coords are only used by
+            // the shader.
+            bool shaderBuffers = landscapeShader != NULL && !slimVertexFormat;
+            unsigned int numberOfVertices = vertexBuffer->GetSize();
+            if (upload){
+                // Create vbos
+                arg.renderer.BindDataBlock(vertexBuffer.get());
+                arg.renderer.BindDataBlock(indexBuffer.get());
+                if (shaderBuffers){
+                    arg.renderer.BindDataBlock(geomorphBuffer.get());
+                    arg.renderer.BindDataBlock(normalMapCoordBuffer.get());
+                }
+                if (normalBuffer)
+                    arg.renderer.BindDataBlock(normalBuffer.get());
+            }else if (arg.renderer.BufferSupport()){
+                vertexBuffer->SetID(CreateBufferObject(GL_ARRAY_BUFFER, sizeof(float) * DIMENSIONS * numberOfVertices));
+                indexBuffer->SetID(CreateBufferObject(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indexBuffer->GetSize()));
+                if (shaderBuffers){
+                    geomorphBuffer->SetID(CreateBufferObject(GL_ARRAY_BUFFER, sizeof(float) * 3 * numberOfVertices));
+                    normalMapCoordBuffer->SetID(CreateBufferObject(GL_ARRAY_BUFFER, 
+                                                                   sizeof(float) * TEXCOORDS * numberOfVertices));
+                }
+                if (normalBuffer)
+                    normalBuffer->SetID(CreateBufferObject(GL_ARRAY_BUFFER, sizeof(float) * 3 * numberOfVertices));
+            }
+
+            // Drop the packed normals' buffer of an earlier setup, it
+            // is replaced or, without the slim format, unused.
+            if (packedNormalBuffer){
+                glDeleteBuffers(1, &packedNormalBuffer);
+                packedNormalBuffer = 0;
+            }
+            if (packedNormals && arg.renderer.BufferSupport()){
+                glGenBuffers(1, &packedNormalBuffer);
+                glBindBuffer(GL_ARRAY_BUFFER, packedNormalBuffer);
+                glBufferData(GL_ARRAY_BUFFER, numberOfVertices * 4, upload ? packedNormals : NULL, GL_STATIC_DRAW);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+        }
+
+        void HeightMapNode::SetupRendering(RenderingEventArg arg){
+            SetupGeometrySet();
+
+            if (landscapeShader != NULL) {
+                landscapeShader->SetTexture("normalMap", (ITexture2DPtr)normalmap);
+                landscapeShader->Load();
+                landscapeShader->SetUniform("normalMapEncoding", (int)normalMapFormat);
+                if (slimVertexFormat){
+                    landscapeShader->SetUniform("gridOffset", offset);
+                    landscapeShader->SetUniform("gridScale", widthScale);
+                    landscapeShader->SetUniform("gridSize", Vector<2, float>(width, depth));
                 }
+                TextureList texs = landscapeShader->GetTextures();
+                for (unsigned int i = 0; i < texs.size(); ++i)
+                    arg.renderer.LoadTexture(texs[i].get());
             }
+
+            SetLODSwitchDistance(baseDistance, 1 / invIncDistance);
+        }
+
+        void HeightMapNode::SetLoadPhase(float start, float end){
+            loadProgressStart = start;
+            loadProgressEnd = end;
+            ReportLoadProgress(0.0f);
+        }
+
+        void HeightMapNode::ReportLoadProgress(float fraction){
+            if (!IsLoading()) return;
+            loadMutex.Lock();
+            loadProgress = loadProgressStart + (loadProgressEnd - loadProgressStart) * fraction;
+            loadMutex.Unlock();
+        }
+
+        void HeightMapNode::SetupGeometrySet(){
+            IDataBlockList texCoords;
+            if (landscapeShader != NULL){
+                if (slimVertexFormat){
+                    // The shader derives the normal map coords and
+                    // geomorph values from the vertex position.
+                    geom = GeometrySetPtr(new GeometrySet(vertexBuffer, IDataBlockPtr(), texCoords));
+                }else{
+                    texCoords.push_back(normalMapCoordBuffer);
+                    geom = GeometrySetPtr(new GeometrySet(vertexBuffer, geomorphBuffer, texCoords));
+                }
+            }else if (slimVertexFormat)
+                geom = GeometrySetPtr(new GeometrySet(vertexBuffer));
+            else
+                geom = GeometrySetPtr(new GeometrySet(vertexBuffer, normalBuffer, texCoords));
         }
 
         float HeightMapNode::CalcGeomorphHeight(int x, int z){
@@ -616,11 +1861,12 @@ namespace OpenEngine {
                     dz = 0;
                 }
                 
-                float* vertice = GetVertice(x, z);
-                float* verticeNeighbour1 = GetVertice(x + dx, z + dz);
-                float* verticeNeighbour2 = GetVertice(x - dx, z - dz);
+                // The neighbours may be in a tile without storage.
+                float height = GetVertexHeight(x, z);
+                float neighbour1 = GetVertexHeight(x + dx, z + dz);
+                float neighbour2 = GetVertexHeight(x - dx, z - dz);
                 
-                return (verticeNeighbour1[1] + verticeNeighbour2[1]) / 2 - vertice[1];
+                return (neighbour1 + neighbour2) / 2 - height;
             }
         }
 
@@ -649,67 +1895,296 @@ namespace OpenEngine {
         void HeightMapNode::SetupPatches(){
             // Create the patches
             int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
-            patchGridWidth = (width-1) / squares;
-            patchGridDepth = (depth-1) / squares;
-            numberOfPatches = patchGridWidth * patchGridDepth;
-            patchNodes = new HeightMapPatch*[numberOfPatches];
+            patchNodes = new HeightMapPatch[numberOfPatches];
             int entry = 0;
             for (int x = 0; x < width - squares; x +=squares ){
                 for (int z = 0; z < depth - squares; z += squares){
-                    patchNodes[entry++] = new HeightMapPatch(x, z, this);
+                    patchNodes[entry++].Setup(x, z, this);
                 }
             }
 
-            // Setup indice buffer
-            unsigned int numberOfIndices = 0;
+            // The number of indices of each LOD struct is the same
+            // for all the patches that are not flat.
+            indexBuffer = IndicesPtr(new Indices(INITIAL_LAZY_INDICES));
+            indexBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            usedIndices = freedIndices = 0;
+            patchIndexCounts.assign(HeightMapPatch::NUMBER_OF_LOD_STRUCTS, 0);
+            if (numberOfPatches > 0)
+                patchNodes[0].CalcIndexCounts(&patchIndexCounts[0]);
+            unsigned int patchIndices = 0;
+            for (int i = 0; i < HeightMapPatch::NUMBER_OF_LOD_STRUCTS; ++i)
+                patchIndices += patchIndexCounts[i];
+
+            unsigned int totalIndices = 0;
             for (int p = 0; p < numberOfPatches; ++p){
-                for (int l = 0; l < HeightMapPatch::MAX_LODS; ++l){
-                    for (int rl = 0; rl < 3; ++rl){
-                        for (int ul = 0; ul < 3; ++ul){
-                            LODstruct& lod = patchNodes[p]->GetLodStruct(l,rl,ul);
-                            lod.indiceBufferOffset = numberOfIndices;
-                            numberOfIndices += lod.numberOfIndices;
-                        }
-                    }
+                patchNodes[p].SetDataIndices(indexBuffer);
+                if (IsFlatPatch(p)){
+                    patchNodes[p].SetFlat(4 * p);
+                    totalIndices += 6;
+                }else{
+                    patchNodes[p].SetIndexCounts(&patchIndexCounts[0]);
+                    totalIndices += patchIndices;
                 }
             }
 
-            indexBuffer = IndicesPtr(new Indices(numberOfIndices));
-            unsigned int* indices = indexBuffer->GetData();
+            // Unless they are generated as they are rendered.
+            if (!lazyPatchIndices){
+                if (totalIndices > 0)
+                    ResizeIndexBuffer(totalIndices);
+                for (int p = 0; p < numberOfPatches; ++p){
+                    if ((p & 63) == 0)
+                        ReportLoadProgress((float)p / numberOfPatches);
+                    patchNodes[p].PrepareAllLODs();
+                }
+            }
+            indexArena.Release();
 
-            unsigned int i = 0;
-            for (int p = 0; p < numberOfPatches; ++p){
-                patchNodes[p]->SetDataIndices(indexBuffer);
-                for (int l = 0; l < HeightMapPatch::MAX_LODS; ++l){
-                    for (int rl = 0; rl < 3; ++rl){
-                        for (int ul = 0; ul < 3; ++ul){
-                            LODstruct& lod = patchNodes[p]->GetLodStruct(l,rl,ul);
-                            memcpy(indices + i, lod.indices, sizeof(unsigned int) * lod.numberOfIndices);
-                            i += lod.numberOfIndices;
+            // Binding the buffer uploads it.
+            uploadedIndices = usedIndices;
+            indexBufferGrown = false;
+        }
+        
+        void HeightMapNode::ResizeIndexBuffer(unsigned int capacity){
+            // Keep the buffer object, so it can be reallocated on the
+            // next upload.
+            IndicesPtr buffer = IndicesPtr(new Indices(capacity));
+            memcpy(buffer->GetData(), indexBuffer->GetData(), sizeof(unsigned int) * usedIndices);
+            buffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            buffer->SetID(indexBuffer->GetID());
+            indexBuffer = buffer;
+            indexBufferGrown = true;
+
+            for (int p = 0; p < numberOfPatches; ++p)
+                patchNodes[p].SetDataIndices(indexBuffer);
+        }
+
+        void HeightMapNode::CompactPatchIndices(){
+            IndicesPtr buffer = IndicesPtr(new Indices(indexBuffer->GetSize()));
+            unsigned int used = 0;
+            for (int p = 0; p < numberOfPatches; ++p)
+                patchNodes[p].MoveIndices(indexBuffer->GetData(), buffer->GetData(), used);
+            buffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            buffer->SetID(indexBuffer->GetID());
+            indexBuffer = buffer;
+            usedIndices = used;
+            freedIndices = 0;
+            // Upload the entire buffer again.
+            indexBufferGrown = true;
+
+            for (int p = 0; p < numberOfPatches; ++p)
+                patchNodes[p].SetDataIndices(indexBuffer);
+        }
+
+        void HeightMapNode::UploadPatchIndices(){
+            unsigned int id = indexBuffer->GetID();
+            if (id == 0 || (uploadedIndices == usedIndices && !indexBufferGrown))
+                return;
+
+            // The element buffer is bound while rendering the
+            // patches.
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+            if (indexBufferGrown){
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indexBuffer->GetSize(), 
+                             indexBuffer->GetData(), GL_STATIC_DRAW);
+                indexBufferGrown = false;
+            }else
+                glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * uploadedIndices, 
+                                sizeof(GLuint) * (usedIndices - uploadedIndices), 
+                                indexBuffer->GetData() + uploadedIndices);
+            uploadedIndices = usedIndices;
+        }
+
+        void HeightMapNode::MaterializePatches(int xStart, int zStart, int xEnd, int zEnd){
+            // The patches sharing vertices with the area.
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            int pxStart = xStart > 0 ? (xStart - 1) / squares : 0;
+            int pzStart = zStart > 0 ? (zStart - 1) / squares : 0;
+            int pxEnd = std::min((xEnd - 1) / squares, patchGridWidth - 1);
+            int pzEnd = std::min((zEnd - 1) / squares, patchGridDepth - 1);
+
+            int firstNewSlot = numberOfSlots;
+            std::vector<int> newTiles;
+            for (int px = pxStart; px <= pxEnd; ++px)
+                for (int pz = pzStart; pz <= pzEnd; ++pz){
+                    int p = pz + px * patchGridDepth;
+                    if (!flatPatches[p]) continue;
+
+                    // Store the tiles the patch uses.
+                    for (int tx = px; tx <= px + 1 && tx < tilesWidth; ++tx)
+                        for (int tz = pz; tz <= pz + 1 && tz < tilesDepth; ++tz){
+                            int tile = tz + tx * tilesDepth;
+                            if (tileSlots[tile] == NO_SLOT){
+                                tileSlots[tile] = numberOfSlots++;
+                                newTiles.push_back(tile);
+                            }
                         }
-                    }
+
+                    flatPatches[p] = false;
+                    freedIndices += patchNodes[p].GetNumberOfGeneratedIndices();
+                    patchNodes[p].SetIndexCounts(&patchIndexCounts[0]);
                 }
+            if (newTiles.empty()) return;
+
+            // Keep the unused quads to a fraction of the buffer.
+            if (freedIndices > usedIndices / 4)
+                CompactPatchIndices();
+
+            unsigned int capacity = vertexBuffer->GetSize();
+            unsigned int needed = firstSlotVertex + numberOfSlots * TILE_VERTICES;
+            bool resized = needed > capacity;
+            if (resized){
+                if (capacity == 0)
+                    capacity = needed;
+                while (capacity < needed)
+                    capacity *= 2;
+                ResizeVertexArrays(capacity);
             }
 
-            // Setup shader uniforms used in geomorphing
-            if (landscapeShader != NULL){
-                for (int x = 0; x < width - 1; ++x){
-                    for (int z = 0; z < depth - 1; ++z){
-                        HeightMapPatch* patch = GetPatch(x, z);
-                        float* geomorph = GetGeomorphValues(x, z);
-                        geomorph[0] = patch->GetCenter()[0];
-                        geomorph[1] = patch->GetCenter()[2];
-                    }
-                }
+            // All the new positions first, the derived values of a
+            // tile read the positions of it's neighbours.
+            for (unsigned int t = 0; t < newTiles.size(); ++t){
+                int x = (newTiles[t] / tilesDepth) * TILE_SIZE;
+                int z = (newTiles[t] % tilesDepth) * TILE_SIZE;
+                FillPositions(x, z, std::min(x + TILE_SIZE, width), std::min(z + TILE_SIZE, depth));
             }
+            for (unsigned int t = 0; t < newTiles.size(); ++t){
+                int x = (newTiles[t] / tilesDepth) * TILE_SIZE;
+                int z = (newTiles[t] % tilesDepth) * TILE_SIZE;
+                FillDerived(x, z, std::min(x + TILE_SIZE, width), std::min(z + TILE_SIZE, depth));
+            }
+
+            UploadVertices(firstSlotVertex + firstNewSlot * TILE_VERTICES, 
+                           (numberOfSlots - firstNewSlot) * TILE_VERTICES, resized);
         }
-        
+
+        void HeightMapNode::ResizeVertexArrays(unsigned int capacity){
+            // Keep the buffer objects, so they can be reallocated by
+            // UploadVertices.
+            unsigned int size = vertexBuffer->GetSize();
+
+            Float4DataBlockPtr vertices = Float4DataBlockPtr(new DataBlock<4, float>(capacity));
+            memcpy(vertices->GetData(), vertexBuffer->GetData(), sizeof(float) * DIMENSIONS * size);
+            vertices->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            vertices->SetID(vertexBuffer->GetID());
+            vertexBuffer = vertices;
+
+            float* newNormals = new float[capacity * 3];
+            memcpy(newNormals, normals, sizeof(float) * 3 * size);
+            memset(newNormals + 3 * size, 0, sizeof(float) * 3 * (capacity - size));
+            if (normalMapData == normals)
+                normalMapData = newNormals;
+            delete [] normals;
+            normals = newNormals;
+            if (normalBuffer){
+                Float3DataBlockPtr buffer = Float3DataBlockPtr(new DataBlock<3, float>(capacity, normals));
+                buffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+                buffer->SetID(normalBuffer->GetID());
+                normalBuffer = buffer;
+            }
+
+            if (!slimVertexFormat){
+                Float2DataBlockPtr coords = Float2DataBlockPtr(new DataBlock<2, float>(capacity));
+                memcpy(coords->GetData(), normalMapCoordBuffer->GetData(), sizeof(float) * 2 * size);
+                coords->SetID(normalMapCoordBuffer->GetID());
+                normalMapCoordBuffer = coords;
+
+                Float3DataBlockPtr geomorph = Float3DataBlockPtr(new DataBlock<3, float>(capacity));
+                memcpy(geomorph->GetData(), geomorphBuffer->GetData(), sizeof(float) * 3 * size);
+                geomorph->SetID(geomorphBuffer->GetID());
+                geomorphBuffer = geomorph;
+            }
+
+            char* deltas = new char[capacity];
+            memcpy(deltas, deltaValues, size);
+            delete [] deltaValues;
+            deltaValues = deltas;
+
+            if (packedNormals){
+                char* packed = new char[capacity * 4];
+                memcpy(packed, packedNormals, size * 4);
+                memset(packed + size * 4, 0, (capacity - size) * 4);
+                delete [] packedNormals;
+                packedNormals = packed;
+            }
+
+            if (geom != NULL)
+                SetupGeometrySet();
+        }
+
+        void HeightMapNode::UploadVertices(unsigned int first, unsigned int count, bool resized){
+            // The buffer objects of the vertex arrays, their bytes
+            // per vertex and data.
+            unsigned int ids[5], sizes[5];
+            const char* data[5];
+            int buffers = 0;
+            ids[buffers] = vertexBuffer->GetID();
+            sizes[buffers] = sizeof(float) * DIMENSIONS;
+            data[buffers++] = (const char*) vertexBuffer->GetData();
+            if (normalMapCoordBuffer){
+                ids[buffers] = normalMapCoordBuffer->GetID();
+                sizes[buffers] = sizeof(float) * 2;
+                data[buffers++] = (const char*) normalMapCoordBuffer->GetData();
+            }
+            if (geomorphBuffer){
+                ids[buffers] = geomorphBuffer->GetID();
+                sizes[buffers] = sizeof(float) * 3;
+                data[buffers++] = (const char*) geomorphBuffer->GetData();
+            }
+            if (normalBuffer){
+                ids[buffers] = normalBuffer->GetID();
+                sizes[buffers] = sizeof(float) * 3;
+                data[buffers++] = (const char*) normals;
+            }
+            if (packedNormals){
+                ids[buffers] = packedNormalBuffer;
+                sizes[buffers] = 4;
+                data[buffers++] = packedNormals;
+            }
+
+            unsigned int capacity = vertexBuffer->GetSize();
+            for (int b = 0; b < buffers; ++b){
+                if (ids[b] == 0) continue;
+                glBindBuffer(GL_ARRAY_BUFFER, ids[b]);
+                if (resized)
+                    glBufferData(GL_ARRAY_BUFFER, sizes[b] * capacity, data[b], GL_STATIC_DRAW);
+                else
+                    glBufferSubData(GL_ARRAY_BUFFER, sizes[b] * first, sizes[b] * count, 
+                                    data[b] + sizes[b] * first);
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
         int HeightMapNode::CoordToIndex(const int x, const int z) const{
-            return z + x * depth;
+            if (!tiledLayout)
+                return z + x * depth;
+
+            const int mask = TILE_SIZE - 1;
+            int tile = CoordToTile(x, z);
+            int local = (spreadBits[x & mask] << 1) | spreadBits[z & mask];
+            if (!sparseTiles)
+                return (tile << (2 * TILE_BITS)) | local;
+
+            int slot = tileSlots[tile];
+            if (slot == NO_SLOT)
+                // A unique index below zero, so the indices of a
+                // patch can still be counted.
+                return -1 - ((tile << (2 * TILE_BITS)) | local);
+            return firstSlotVertex + ((slot << (2 * TILE_BITS)) | local);
+        }
+
+        int HeightMapNode::CoordToTile(const int x, const int z) const{
+            return (z >> TILE_BITS) + (x >> TILE_BITS) * tilesDepth;
         }
         
         float* HeightMapNode::GetVertice(const int x, const int z) const{
             int index = CoordToIndex(x, z);
+            if (index < 0){
+                constantVertex[0] = widthScale * x + offset[0];
+                constantVertex[1] = tileHeights[CoordToTile(x, z)];
+                constantVertex[2] = widthScale * z + offset[2];
+                constantVertex[3] = landscapeShader != NULL ? 0 : 1;
+                return constantVertex;
+            }
             return GetVertice(index);
         }
 
@@ -719,6 +2194,13 @@ namespace OpenEngine {
         
         float* HeightMapNode::GetNormals(const int x, const int z) const{
             int index = CoordToIndex(x, z);
+            if (index < 0){
+                // A tile without storage is surrounded by vertices of
+                // the same height.
+                constantNormal[0] = constantNormal[2] = 0;
+                constantNormal[1] = 1;
+                return constantNormal;
+            }
             return GetNormals(index);
         }
 
@@ -762,7 +2244,7 @@ namespace OpenEngine {
 
         HeightMapPatch* HeightMapNode::GetPatch(const int x, const int z) const{
             int index = GetPatchIndex(x, z);
-            return patchNodes[index];
+            return patchNodes + index;
         }
 
     }
@@ -12,10 +12,20 @@
 
 #include <Scene/ISceneNode.h>
 #include <Core/IListener.h>
+#include <Core/Mutex.h>
 #include <Renderers/IRenderer.h>
 #include <Resources/Texture2D.h>
 #include <Display/Viewport.h>
 #include <Resources/DataBlock.h>
+#include <Scene/HeightMapLODContext.h>
+#include <Scene/HeightMapClipmap.h>
+#include <Scene/HeightMapIndexArena.h>
+#include <Utils/NormalEncoding.h>
+#include <Utils/HeightResampler.h>
+
+#include <list>
+#include <string>
+#include <vector>
 
 using namespace OpenEngine;
 using namespace OpenEngine::Core;
@@ -37,6 +47,9 @@ namespace OpenEngine {
     }
     namespace Scene {
         class HeightMapPatch;
+        class HeightMapBintree;
+        class HeightMapPyramid;
+        class HeightMapLoadWorker;
 
         /**
          * A class for creating landscapes through heightmaps
@@ -62,49 +75,190 @@ namespace OpenEngine {
         public:
             static const int DIMENSIONS = 4;
             static const int TEXCOORDS = 2;
+            static const int SORT_KEY_STEPS = 16;
+            // The initial size of the index buffer, before the
+            // number of indices per patch is known.
+            static const unsigned int INITIAL_LAZY_INDICES = 1 << 16;
+            // The vertices are stored in tiles of 2^TILE_BITS squared
+            // vertices in the tiled layout.
+            static const int TILE_BITS = 5;
+            static const int TILE_SIZE = 1 << TILE_BITS;
+            static const int TILE_VERTICES = TILE_SIZE * TILE_SIZE;
+            // The slot of a tile without storage.
+            static const int NO_SLOT = -1;
+
+            // Bumped whenever the bake file layout or the data in it
+            // changes.
+            static const unsigned int BAKE_VERSION = 2;
+
+            enum NormalMapFormat { NORMALMAP_FLOAT, NORMALMAP_XZ8, NORMALMAP_OCT8 };
+
+            static const int DEFAULT_RESAMPLE_THREADS = 4;
+
+            // The bytes uploaded per frame by an asynchronous load.
+            static const unsigned int DEFAULT_ASYNC_UPLOAD_SIZE = 1 << 20;
 
         protected:
+            enum LoadState { LOAD_NONE, LOAD_BUILDING, LOAD_UPLOADING, LOAD_READY };
+
             Float4DataBlockPtr vertexBuffer;
             Float2DataBlockPtr normalMapCoordBuffer;
             Float3DataBlockPtr geomorphBuffer; // {PatchCenterX, PatchCenterZ, LOD}
 
             float* normals;
-            FloatTexture2DPtr normalmap;
+            // The normals packed into signed bytes for the slim
+            // vertex format without a shader.
+            char* packedNormals;
+            unsigned int packedNormalBuffer;
+            // The normals in row major order for the normal map, the
+            // same as normals unless the layout is tiled.
+            float* normalMapData;
+            ITexture2DPtr normalmap;
+            NormalMapFormat normalMapFormat;
+            unsigned char* encodedNormalMap;
+            Utils::NormalEncodingError normalMapError;
             Float3DataBlockPtr normalBuffer;
 
             GeometrySetPtr geom;
             IndicesPtr indexBuffer;
+            // The patch indices in use and uploaded when they are
+            // generated lazily.
+            bool lazyPatchIndices;
+            unsigned int usedIndices, uploadedIndices;
+            bool indexBufferGrown;
+            // The indices of the flat quads of materialized patches,
+            // which are unused until the buffer is compacted.
+            unsigned int freedIndices;
 
             char* deltaValues;
 
             int width;
             int depth;
+            // Store the vertices in tiles instead of rows.
+            bool tiledLayout;
+            bool slimVertexFormat;
+            int tilesWidth, tilesDepth;
+            // The bits of a coordinate within a tile interleaved
+            // with zeros.
+            int spreadBits[TILE_SIZE];
+            // Only store the tiles used by patches that are not flat.
+            bool sparseTiles;
+            // The tile's slot in the vertex arrays, or NO_SLOT if all
+            // it's vertices have the height in tileHeights.
+            std::vector<int> tileSlots;
+            std::vector<float> tileHeights;
+            int numberOfSlots;
+            // The slots start after the quads of the flat patches.
+            unsigned int firstSlotVertex;
+            std::vector<bool> flatPatches;
+            // Returned for the vertices of tiles without storage.
+            mutable float constantVertex[4];
+            mutable float constantNormal[3];
             float widthScale;
             float heightScale;
+            // Resample the heightmap to a patch aligned size instead
+            // of padding it.
+            bool resample;
+            Utils::HeightFilter resampleFilter;
+            float resampleScale;
+            int resampleThreads;
             Vector<3, float> offset;
 
             // Patch variables
             int patchGridWidth, patchGridDepth, numberOfPatches;
-            HeightMapPatch** patchNodes;
+            HeightMapPatch* patchNodes;
+            // Scratch memory for the patch indices until they are in
+            // the index buffer.
+            HeightMapIndexArena indexArena;
+            // The number of indices in each LOD struct of a patch
+            // that is not flat.
+            std::vector<int> patchIndexCounts;
+
+            // The LOD context used when no other is given and all
+            // contexts that have been calculated for this node. The
+            // list is guarded by contextsMutex, since contexts can be
+            // calculated on different threads.
+            HeightMapLODContext defaultContext;
+            std::list<HeightMapLODContext*> contexts;
+            Core::Mutex contextsMutex;
+
+            // Renders the heightmap instead of the patches if set.
+            HeightMapClipmap* clipmap;
+            // Triangulates the heightmap instead of the patches if set.
+            HeightMapBintree* bintree;
+            // Coarser levels of the heights for queries, if set.
+            HeightMapPyramid* pyramid;
+            int pyramidLevels;
 
             // Distances for changing the LOD
             float baseDistance;
             float invIncDistance;
 
+            // Size of the vertex cache the patch indices are
+            // ordered for, zero for triangle strips.
+            int patchVertexCacheSize;
+
             FloatTexture2DPtr tex;
             IShaderResourcePtr landscapeShader;
 
             bool isLoaded;
+            // The file the data computed by Load is cached in.
+            std::string bakeFile;
+            bool bakeLoaded;
+
+            // Asynchronous loading. The worker builds the heightmap,
+            // then the buffers are uploaded a slice per frame.
+            bool asyncLoad;
+            LoadState loadState;
+            HeightMapLoadWorker* loadWorker;
+            unsigned int asyncUploadSize;
+            unsigned int uploadedVertices;
+            // Guards the progress, the built flag and the built
+            // pyramid, which are written by the worker.
+            mutable Core::Mutex loadMutex;
+            bool loadBuilt;
+            // The pyramid made by Build, until it is published.
+            HeightMapPyramid* builtPyramid;
+            float loadProgress;
+            float loadProgressStart, loadProgressEnd;
+
+            friend class HeightMapLoadWorker;
+
+            /**
+             * Sets the members to their defaults, the owned pointers
+             * to NULL. Shared by the constructors.
+             */
+            void Init();
 
         public:
-            HeightMapNode() {}
+            HeightMapNode();
             HeightMapNode(FloatTexture2DPtr tex);
+            /**
+             * Frees the buffer objects and the normal map, so the
+             * node must be deleted with it's GL context current.
+             */
             ~HeightMapNode();
 
             void Load();
 
             void CalcLOD(Display::IViewingVolume* view);
             void Render(Renderers::RenderingEventArg arg);
+            /**
+             * Culls the patches and calculates their LOD as seen from
+             * the view into the LOD context.
+             */
+            void CalcLOD(HeightMapLODContext& context, Display::IViewingVolume* view);
+            void CalcLOD(HeightMapLODContext& context, const HeightMapView& view);
+            /**
+             * Renders the patches using the LODs in the context.
+             */
+            void Render(HeightMapLODContext& context, Renderers::RenderingEventArg arg);
+            /**
+             * Culls the patches and calculates their LOD from the view
+             * stored in the packet. Only reads the patches, so it may
+             * run concurrently with Render and with other packets.
+             */
+            void CalcLOD(HeightMapLODPacket& packet);
             void RenderBoundingGeometry();
 
             void VisitSubNodes(ISceneNodeVisitor& visitor);
@@ -142,6 +296,20 @@ namespace OpenEngine {
              * @return The normal at the given point.
              */
             Vector<3, float> GetNormal(float x, float z) const;
+            /**
+             * The height and normal at the point from a level of the
+             * height pyramid, where level 0 is the full heightmap.
+             * Levels above the pyramid's are clamped to it's
+             * coarsest, so without a pyramid every level is the full
+             * heightmap. While the heightmap is loading every level
+             * is the full heightmap.
+             *
+             * @see SetHeightPyramidLevels
+             */
+            float GetHeight(Vector<3, float> point, int level) const;
+            float GetHeight(float x, float z, int level) const;
+            Vector<3, float> GetNormal(Vector<3, float> point, int level) const;
+            Vector<3, float> GetNormal(float x, float z, int level) const;
             /**
              * Takes as argument a 3D vector in worldspace, a
              * direction and returns the direction reflected of the
@@ -164,13 +332,51 @@ namespace OpenEngine {
             inline IDataBlockPtr GetNormalMapCoordBuffer() const { return normalMapCoordBuffer; }
             inline IndicesPtr    GetIndices() const { return indexBuffer; }
             inline GeometrySetPtr GetGeometrySet() const { return geom; }
-            inline FloatTexture2DPtr GetHeightMap() const { return tex; }
-            inline ITexture2DPtr GetNormalMap() const { return normalmap; }
+            /**
+             * The heightmap and normal map textures, or empty
+             * pointers while the heightmap is loading, since an
+             * asynchronous load replaces them.
+             */
+            inline FloatTexture2DPtr GetHeightMap() const { return IsLoading() ? FloatTexture2DPtr() : tex; }
+            inline ITexture2DPtr GetNormalMap() const { return IsLoading() ? ITexture2DPtr() : normalmap; }
 
             int GetIndice(int x, int z);
+            /**
+             * Returns the vertex at the coords, clamped to the
+             * heightmap. With sparse tiles the vertices of a tile
+             * without storage are returned in a scratch vertex, which
+             * is only valid until the next call and must not be
+             * written to.
+             */
             float* GetVertex(int x, int z);
+            /**
+             * Returns the height of the vertex at the coords, clamped
+             * to the heightmap.
+             */
+            float GetVertexHeight(int x, int z) const;
             void SetVertex(int x, int z, float value);
             void SetVertices(int x, int z, int width, int depth, float* values);
+            /**
+             * Appends the heights of the area to the data, compressed
+             * as rows along z with Utils::EncodeHeights. The area
+             * must be inside the heightmap.
+             *
+             * @param maxError The largest error of the decoded
+             * heights, zero for lossless.
+             * @return The number of bytes appended.
+             */
+            unsigned int EncodeVertices(int x, int z, int width, int depth, float maxError,
+                                        std::vector<unsigned char>& data);
+            /**
+             * Sets the heights of the area from data encoded by
+             * EncodeVertices, with it's lower left corner at (x, z).
+             * The heights are decoded straight into the vertex array
+             * when the layout is not tiled and the area is inside
+             * the heightmap.
+             *
+             * @return False if the data is corrupt.
+             */
+            bool DecodeVertices(int x, int z, const unsigned char* data, unsigned int size);
             Vector<3, float> GetNormal(int x, int z);
 
             void SetHeightScale(const float scale) { heightScale = scale; }
@@ -188,6 +394,284 @@ namespace OpenEngine {
             float GetLODIncDistance() const { return 1.0f / invIncDistance; }
             float GetLODInverseIncDistance() const { return invIncDistance; }
 
+            /**
+             * Pipeline the culling and LOD calculation of the default
+             * context with rendering.
+             *
+             * @see HeightMapLODContext::SetPipelined
+             */
+            void SetPipelinedLOD(const bool pipeline) { defaultContext.SetPipelined(pipeline); }
+            bool IsPipelinedLOD() const { return defaultContext.IsPipelined(); }
+            HeightMapLODContext& GetDefaultLODContext() { return defaultContext; }
+            /**
+             * Blocks until the LOD workers of all contexts are done
+             * with the patches.
+             */
+            void WaitForLOD();
+            /**
+             * Called by a context when it is destroyed.
+             */
+            void RemoveLODContext(HeightMapLODContext* context);
+
+            /**
+             * Render the heightmap as a geometry clipmap with the
+             * given number of levels instead of as patches. Zero
+             * levels switches back to the patches.
+             *
+             * @see HeightMapClipmap
+             */
+            void SetClipmapLevels(int levels, int size = HeightMapClipmap::DEFAULT_SIZE);
+            HeightMapClipmap* GetClipmap() const { return clipmap; }
+            /**
+             * Render the heightmap as an adaptive bintree
+             * triangulation with at most the given number of
+             * triangles instead of as patches. Zero switches back to
+             * the patches.
+             *
+             * @see HeightMapBintree
+             */
+            void SetBintreeBudget(int triangles);
+            HeightMapBintree* GetBintree() const { return bintree; }
+            /**
+             * Keep a pyramid of at most the given number of coarser
+             * levels of the heights and normals, updated along with
+             * the heights, for far LODs, minimaps and coarse
+             * queries. Zero removes the pyramid. Can't be changed
+             * while the heightmap is loading asynchronously.
+             *
+             * @see HeightMapPyramid
+             */
+            void SetHeightPyramidLevels(int levels);
+            HeightMapPyramid* GetHeightPyramid() const { return pyramid; }
+
+            /**
+             * Draw the patches as triangle lists ordered for a post
+             * transform vertex cache of the given size instead of as
+             * triangle strips. Zero selects the strips. A LOD whose
+             * strips already miss less than the ordered list keeps
+             * their order. Must be set before the heightmap is
+             * loaded.
+             *
+             * @see Utils::OptimizeVertexCache
+             */
+            void SetPatchVertexCacheSize(const int size);
+            int GetPatchVertexCacheSize() const { return patchVertexCacheSize; }
+            /**
+             * The average cache miss ratio of the patches drawn at
+             * the given LOD with neighbours at the same LOD, through a
+             * simulated vertex cache of the given size.
+             */
+            float CalcPatchACMR(const int lod, const int cacheSize, const bool fifo = true);
+            /**
+             * The average number of times a pixel of the heightmap
+             * is shaded when the visible patches of the context's
+             * front packet are drawn, counted by drawing their
+             * bounding boxes into a software depth buffer of the
+             * given resolution.
+             *
+             * @param gridOrder Draw the patches row by row from the
+             * side the view faces, as before the patches were sorted,
+             * instead of in the sorted render order.
+             *
+             * @see Utils::DepthComplexityCounter
+             */
+            float CalcDepthComplexity(const HeightMapLODContext& context, const bool gridOrder = false,
+                                      const int resolution = 64) const;
+            /**
+             * Generate the indices of each patch LOD and stitching
+             * the first time it is rendered instead of all of them
+             * when the heightmap is loaded. The indices are appended
+             * to the index buffer, which grows as needed, and
+             * uploaded before the patches are drawn. Must be set
+             * before the heightmap is loaded.
+             */
+            void SetLazyPatchIndices(const bool lazy);
+            /**
+             * Store the vertices in tiles of TILE_SIZE by TILE_SIZE
+             * vertices, each in Morton order, instead of row by row,
+             * so the vertices of a patch or any small area are close
+             * in memory. Must be set before the heightmap is loaded.
+             *
+             * Off by default. A patch's vertices are on a quarter of
+             * the pages, but on about as many cache lines, and the
+             * extra index arithmetic makes vertex and normal lookups
+             * slower, see Tools/HeightMapLayoutBench. Sparse tiles
+             * need it.
+             */
+            void SetTiledVertexLayout(const bool tiled);
+            /**
+             * Only store the vertex stream, 16 bytes per vertex,
+             * instead of 36 bytes with the normal map coords and
+             * geomorph values, or 28 with float normals without a
+             * shader. Must be set before the heightmap is loaded.
+             *
+             * The landscape shader must then derive the rest from
+             * the vertex position and the uniforms gridOffset,
+             * gridScale and gridSize (the width and depth in
+             * vertices). With g = (position.xz - gridOffset.xz) /
+             * gridScale the grid coords:
+             *
+             * - The normal map coords are (g.y + 0.5, g.x + 0.5) /
+             *   (gridSize.y, gridSize.x).
+             * - The geomorph center is gridOffset.xz + (max(floor((g
+             *   - 1) / 32), 0) * 32 + 16) * gridScale, the center of
+             *   the patch the vertex belongs to. A per draw center
+             *   would give the vertices shared by two patches
+             *   different morphs and crack the edge.
+             * - The vertex LOD is the largest LOD, at most 6, whose
+             *   step 2^(LOD-1) divides both grid coords.
+             *
+             * A float normal map is switched to NORMALMAP_OCT8, 2
+             * bytes per texel instead of 12, unless the format is
+             * set again afterwards. So the shader path stores 18
+             * bytes per vertex instead of 48.
+             *
+             * Without a shader the normals are packed into 4 bytes
+             * and applied with ApplyPackedNormals, as fixed function
+             * normals can't be decoded from 2 octahedral bytes.
+             */
+            void SetSlimVertexFormat(const bool slim);
+            /**
+             * The format of the normal map given to the landscape
+             * shader. NORMALMAP_FLOAT is 12 bytes per texel, the
+             * others 2 bytes in the luminance and alpha channels,
+             * see Utils::NormalEncoding. The shader gets the format
+             * in the normalMapEncoding uniform. Must be set before
+             * the heightmap is loaded.
+             */
+            void SetNormalMapFormat(const NormalMapFormat format);
+            NormalMapFormat GetNormalMapFormat() const { return normalMapFormat; }
+            /**
+             * The error of the encoded normal map against the float
+             * normals.
+             */
+            Utils::NormalEncodingError GetNormalMapError() const { return normalMapError; }
+            bool IsSlimVertexFormat() const { return slimVertexFormat; }
+            /**
+             * Enables the packed normals as the normal array, if the
+             * heightmap has them.
+             */
+            void ApplyPackedNormals() const;
+            void ReleasePackedNormals() const;
+            bool IsTiledVertexLayout() const { return tiledLayout; }
+            /**
+             * Only store the tiles of the tiled layout that are used
+             * by patches whose heights are not all the same. A flat
+             * patch is drawn as a single quad and a tile is only
+             * stored if a patch that is not flat uses it's vertices,
+             * the rest keep a single height. The tiles of a flat
+             * patch are stored the first time one of it's vertices
+             * is set, and the index buffer is compacted when the
+             * quads of such patches are a quarter of it. Implies the tiled layout and can't be combined
+             * with the bintree. Must be set before the heightmap is
+             * loaded.
+             */
+            void SetSparseTiles(const bool sparse);
+            bool IsSparseTiles() const { return sparseTiles; }
+            /**
+             * The number of tiles with storage, out of
+             * GetNumberOfTiles.
+             */
+            int GetNumberOfStoredTiles() const { return numberOfSlots; }
+            int GetNumberOfTiles() const { return tileSlots.size(); }
+            bool IsFlatPatch(const int patch) const { return sparseTiles && flatPatches[patch]; }
+            bool IsLazyPatchIndices() const { return lazyPatchIndices; }
+            /**
+             * Reserves room for the indices in the index buffer.
+             * Called by the patches when generating indices lazily.
+             *
+             * @return The offset of the indices in the buffer.
+             */
+            unsigned int AllocatePatchIndices(const unsigned int count);
+            HeightMapIndexArena& GetIndexArena() { return indexArena; }
+
+            /**
+             * Cache the data Load computes from the heightmap in the
+             * file: the padded heights, the vertex arrays, the tiles,
+             * the patch bounding boxes and the patch indices. If the
+             * file holds data for the same heights and settings, Load
+             * reads it instead of computing it, otherwise Load
+             * writes it. The data is keyed by a hash of the heights,
+             * the scales, the offset, the resampling, the patch
+             * parameters, the vertex options and whether there is a
+             * landscape shader.
+             * Must be set before the heightmap is loaded.
+             *
+             * The file is in the byte order of the machine, it is a
+             * cache and not an asset format.
+             */
+            void SetBakeFile(const std::string& file);
+            const std::string& GetBakeFile() const { return bakeFile; }
+            /**
+             * True if Load read the data from the bake file.
+             */
+            bool IsBakeLoaded() const { return bakeLoaded; }
+
+            /**
+             * Build the heightmap on a separate thread when the
+             * rendering is initialized, instead of blocking it. The
+             * buffers are then uploaded a slice per frame by
+             * ContinueAsyncLoad, and the heightmap is not culled,
+             * rendered or processed until it is ready. Until then
+             * GetHeight and GetNormal return the offset height and
+             * the up vector, SetVertex and SetVertices are ignored,
+             * GetHeightMap and GetNormalMap return empty pointers, and
+             * nodes using the heightmap's textures must wait until
+             * IsReady.
+             *
+             * Must be set before the heightmap is loaded.
+             */
+            void SetAsyncLoad(const bool async);
+            bool IsAsyncLoad() const { return asyncLoad; }
+            /**
+             * The number of bytes uploaded per frame by an
+             * asynchronous load.
+             */
+            void SetAsyncUploadSize(const unsigned int bytes) { asyncUploadSize = bytes > 0 ? bytes : 1; }
+            unsigned int GetAsyncUploadSize() const { return asyncUploadSize; }
+            /**
+             * Uploads the next slice of an asynchronous load once the
+             * worker is done. Called every frame by the rendering view
+             * while the heightmap is loading.
+             */
+            void ContinueAsyncLoad(RenderingEventArg arg);
+            /**
+             * The fraction of the load done, between 0 and 1.
+             */
+            float GetLoadProgress() const;
+            /**
+             * True while an asynchronous load is building or
+             * uploading the heightmap.
+             */
+            bool IsLoading() const { return loadState == LOAD_BUILDING || loadState == LOAD_UPLOADING; }
+            /**
+             * True when the heightmap is built, uploaded and can be
+             * rendered.
+             */
+            bool IsReady() const { return loadState == LOAD_READY; }
+
+            /**
+             * Resample the heightmap with the filter to the nearest
+             * size of the form n * PATCH_EDGE_SQUARES + 1, instead of
+             * padding it with heights at the water level. A scale
+             * below one downsamples the heightmap first, for low
+             * detail settings. The heights are resampled with the
+             * same step along both axes, and the width scale is
+             * multiplied by the step, so the landscape keeps it's
+             * size. The last row may end up to half a patch short of
+             * or past the edge of the heightmap, which is extended.
+             *
+             * Must be set before the heightmap is loaded.
+             */
+            void SetResampling(const bool enabled, 
+                               const Utils::HeightFilter filter = Utils::HEIGHT_FILTER_BICUBIC, 
+                               const float scale = 1);
+            bool IsResampling() const { return resample; }
+            /**
+             * The number of threads the heightmap is resampled by.
+             */
+            void SetResampleThreads(const int threads) { resampleThreads = threads < 1 ? 1 : threads; }
+
             void SetLandscapeShader(IShaderResourcePtr shader) { landscapeShader = shader; }
             IShaderResourcePtr GetLandscapeShader() const { return landscapeShader; }
 
@@ -220,18 +704,142 @@ namespace OpenEngine {
             virtual void PostRender(Renderers::RenderingEventArg arg) {}
 
             // Setup methods
+            /**
+             * Computes the heightmap's data, or reads it from the
+             * bake file.
+             */
+            void Build();
+            /**
+             * Builds the heightmap and the data the renderer needs on
+             * the load worker.
+             */
+            void BuildAsync();
+            /**
+             * Replaces the pyramid with the one made by Build. Called
+             * on the main thread, where the pyramid is read.
+             */
+            void PublishPyramid();
+            /**
+             * Creates the normal map or the normal buffer the heightmap
+             * is rendered with. Doesn't touch the renderer.
+             */
+            inline void SetupRenderData();
+            /**
+             * Creates the buffer objects, with the data or empty to
+             * be filled by ContinueAsyncLoad.
+             */
+            inline void SetupBuffers(RenderingEventArg arg, bool upload);
+            /**
+             * Loads the shader and textures and sets up the geometry
+             * set.
+             */
+            inline void SetupRendering(RenderingEventArg arg);
+            /**
+             * Sets the part of the load progress the following calls
+             * to ReportLoadProgress cover.
+             */
+            inline void SetLoadPhase(float start, float end);
+            /**
+             * Reports the fraction of the current load phase done,
+             * if the heightmap is loaded asynchronously.
+             */
+            inline void ReportLoadProgress(float fraction);
             inline void InitArrays();
-            inline void SetupNormalMap();
-            inline void CalcVerticeLOD();
+            /**
+             * Replaces the heightmap by it's resampling, if it's
+             * enabled and changes the size.
+             */
+            inline void ResampleHeightMap();
+            /**
+             * The key of the bake file for the current heightmap and
+             * settings.
+             */
+            inline unsigned long long CalcBakeKey() const;
+            /**
+             * Reads the data computed by Load from the bake file, if
+             * it has the key.
+             */
+            inline bool ReadBake(unsigned long long key);
+            inline void WriteBake(unsigned long long key) const;
+            /**
+             * Finds the flat patches and gives the tiles used by the
+             * rest a slot.
+             */
+            inline void SetupSparseTiles();
+            /**
+             * Scales and offsets the heights of the source into the
+             * padded heights, in the columns from xStart to xEnd.
+             */
+            inline void PadHeights(Texture2D<float>* source, int xStart, int xEnd);
+            /**
+             * Fills the vertex arrays in the area, skipping the
+             * tiles without storage, in a single pass over tile
+             * sized blocks. If a source is given the padded heights
+             * are filled from it in the same pass.
+             */
+            inline void FillVertices(int xStart, int zStart, int xEnd, int zEnd, 
+                                     Texture2D<float>* source = NULL);
+            /**
+             * Fills the positions from the padded heights.
+             */
+            inline void FillPositions(int xStart, int zStart, int xEnd, int zEnd);
+            /**
+             * Fills the normals, LOD values, normal map coords and
+             * morph heights from the positions.
+             */
+            inline void FillDerived(int xStart, int zStart, int xEnd, int zEnd);
+            inline void SetupFlatQuad(int patch);
+            inline void SetupGeometrySet();
             inline float CalcGeomorphHeight(int x, int z);
             inline void ComputeIndices();
             inline void SetupPatches();
+            inline void ResizeIndexBuffer(unsigned int capacity);
+            /**
+             * Moves the patches' indices together at the start of
+             * the index buffer, dropping the freed ones.
+             */
+            inline void CompactPatchIndices();
+            /**
+             * Stores the tiles of the flat patches overlapping the
+             * area and draws them as normal patches.
+             */
+            inline void MaterializePatches(int xStart, int zStart, int xEnd, int zEnd);
+            inline void ResizeVertexArrays(unsigned int capacity);
+            /**
+             * Uploads the vertex arrays, or the range of them if they
+             * have not been resized.
+             */
+            inline void UploadVertices(unsigned int first, unsigned int count, bool resized);
+            /**
+             * Uploads the heights in the area and updates the morphs
+             * and bounding boxes that depend on them.
+             */
+            void UpdateVertices(int xStart, int zStart, int xEnd, int zEnd);
+            /**
+             * Uploads the patch indices generated since last frame.
+             */
+            inline void UploadPatchIndices();
+            /**
+             * Sorts the visible patches front to back by their
+             * quantized distance to the viewer. Reuses the order from
+             * the previous frame.
+             */
+            inline void SortPatches(HeightMapLODPacket& packet);
+            /**
+             * Copies the view and LOD distances into the packet.
+             */
+            inline void SetupLODPacket(HeightMapLODContext& context, HeightMapLODPacket& packet,
+                                       const HeightMapView& view);
 
             /**
              * Returns the index into the arrays based on the coords.
              * The index must be multiplied by the 'size' of the entry.
              */
             inline int CoordToIndex(const int x, const int z) const;
+            /**
+             * The tile containing the coords.
+             */
+            inline int CoordToTile(const int x, const int z) const;
             /**
              * Returns a pointer to the vertice from the indices into
              * the 2D array.
@@ -9,13 +9,16 @@
 
 #include <Scene/HeightMapPatch.h>
 #include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapLODPacket.h>
 #include <Meta/OpenGL.h>
 #include <Display/IViewingVolume.h>
 #include <Logging/Logger.h>
 #include <math.h>
 #include <Resources/DataBlock.h>
+#include <Utils/VertexCache.h>
 
 #include <cstring>
+#include <vector>
 
 using namespace OpenEngine::Display;
 using namespace OpenEngine::Resources;
@@ -23,30 +26,54 @@ using namespace OpenEngine::Resources;
 namespace OpenEngine {
     namespace Scene {
         
-        HeightMapPatch::HeightMapPatch(int xStart, int zStart, HeightMapNode* t)
-            : terrain(t), LOD(1), geomorphingScale(1), visible(false), 
-              xStart(xStart), zStart(zStart) {
+        HeightMapPatch::HeightMapPatch(int xStart, int zStart, HeightMapNode* t){
+            Setup(xStart, zStart, t);
+        }
 
-            xEnd = xStart + PATCH_EDGE_VERTICES;
-            zEnd = zStart + PATCH_EDGE_VERTICES;
-            xEndMinusOne = xEnd - 1;
-            zEndMinusOne = zEnd - 1;
+        void HeightMapPatch::Setup(int xStart, int zStart, HeightMapNode* t){
+            SetupPosition(xStart, zStart, t);
+            flatVertex = -1;
 
-            edgeLength = (xEndMinusOne - xStart) * t->GetWidthScale();
+            // The indices are generated into the heightmap's index
+            // buffer by PrepareLOD.
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i){
+                LODs[i].numberOfIndices = 0;
+                LODs[i].indiceBufferOffset = NOT_GENERATED;
+            }
 
-            ComputeIndices();
-            
             SetupBoundingBox();
         }
 
-        HeightMapPatch::~HeightMapPatch(){
-            delete [] LODs;
+        void HeightMapPatch::ReadBake(int xStart, int zStart, HeightMapNode* t, const char* data){
+            SetupPosition(xStart, zStart, t);
+
+            float box[6];
+            memcpy(box, data, sizeof(box));
+            data += sizeof(box);
+            min = Vector<3, float>(box[0], box[1], box[2]);
+            max = Vector<3, float>(box[3], box[4], box[5]);
+            memcpy(&flatVertex, data, sizeof(int));
+            data += sizeof(int);
+            memcpy(LODs, data, sizeof(LODs));
+
+            UpdateBoundingBox();
+        }
+
+        void HeightMapPatch::WriteBake(char* data) const{
+            float box[6] = { min[0], min[1], min[2], max[0], max[1], max[2] };
+            memcpy(data, box, sizeof(box));
+            data += sizeof(box);
+            memcpy(data, &flatVertex, sizeof(int));
+            data += sizeof(int);
+            memcpy(data, LODs, sizeof(LODs));
         }
 
+        HeightMapPatch::~HeightMapPatch(){}
+
         void HeightMapPatch::UpdateBoundingGeometry(){
             for (int x = xStart; x < xEnd; ++x){
                 for (int z = zStart; z < zEnd; ++z){
-                    float y = terrain->GetVertex(x, z)[1];
+                    float y = terrain->GetVertexHeight(x, z);
                     min[1] = y < min[1] ? y : min[1];
                     max[1] = y > max[1] ? y : max[1];
                 }
@@ -67,7 +94,7 @@ namespace OpenEngine {
                 bool roofSupport = false;
                 for (int x = xStart; x < xEnd && !roofSupport; ++x){
                     for (int z = zStart; z < zEnd && !roofSupport; ++z){
-                        float y = terrain->GetVertex(x, z)[1];
+                        float y = terrain->GetVertexHeight(x, z);
                         roofSupport = y == max[1];
                         if (y > tempHeight)
                             tempHeight = y;
@@ -83,7 +110,7 @@ namespace OpenEngine {
                 bool floorSupport = false;
                 for (int x = xStart; x < xEnd && !floorSupport; ++x){
                     for (int z = zStart; z < zEnd && !floorSupport; ++z){
-                        float y = terrain->GetVertex(x, z)[1];
+                        float y = terrain->GetVertexHeight(x, z);
                         floorSupport = y == min[1];
                         if (y < tempHeight)
                             tempHeight = y;
@@ -95,64 +122,177 @@ namespace OpenEngine {
             UpdateBoundingBox();
         }
         
-        void HeightMapPatch::CalcLOD(IViewingVolume* view){
-            visible = view->IsVisible(boundingBox);
-            if (!visible) return;
+        void HeightMapPatch::CalcLOD(const HeightMapLODPacket& packet, PatchLOD& lod) const{
+            lod.visible = packet.view.IsVisible(min, max);
+            if (!lod.visible) return;
 
-            Vector<3, float> viewPos = view->GetPosition();
-            float baseDistance = terrain->GetLODBaseDistance();
-            float invIncDistance = terrain->GetLODInverseIncDistance();
+            Vector<3, float> viewPos = packet.view.GetPosition();
 
             // Calculate own LOD
             float distance = (viewPos - patchCenter).GetLength();
-            distance -= baseDistance;
+            lod.geomorphingScale = CalcGeomorphingScale(distance, packet);
+            lod.LOD = floor(lod.geomorphingScale) - 1;
+
+            // Calculate upper LOD
+            distance = (viewPos - (patchCenter + Vector<3, float>(edgeLength, 0, 0))).GetLength();
+            lod.upperLOD = floor(CalcGeomorphingScale(distance, packet)) - 1;
 
-            geomorphingScale = distance * invIncDistance;
+            // Calculate right LOD
+            distance = (viewPos - (patchCenter + Vector<3, float>(0, 0, edgeLength))).GetLength();
+            lod.rightLOD = floor(CalcGeomorphingScale(distance, packet)) - 1;
+        }
 
-            if (geomorphingScale < 1)
-                geomorphingScale = 1;
-            else if (geomorphingScale > MAX_LODS)
-                geomorphingScale = MAX_LODS;
+        void HeightMapPatch::PrepareLOD(const PatchLOD& lod){
+            if (!lod.visible) return;
 
-            LOD = floor(geomorphingScale) - 1;
+            if (IsFlat()){
+                if (LODs[0].indiceBufferOffset == NOT_GENERATED)
+                    GenerateFlatQuad();
+                return;
+            }
 
-            // Calculate upper LOD
-            distance = (viewPos - (patchCenter + Vector<3, float>(edgeLength, 0, 0))).GetLength();
-            distance -= baseDistance;
+            int structs[3] = { lod.LOD,
+                               MAX_LODS + lod.LOD * MAX_LODS + lod.rightLOD,
+                               MAX_LODS + (MAX_LODS + lod.LOD) * MAX_LODS + lod.upperLOD };
+            for (int i = 0; i < 3; ++i)
+                if (LODs[structs[i]].indiceBufferOffset == NOT_GENERATED)
+                    GenerateLodStruct(structs[i]);
+        }
 
-            upperGeomorphingScale = distance * invIncDistance;
-            if (upperGeomorphingScale < 1)
-                upperGeomorphingScale = 1;
-            else if (upperGeomorphingScale > MAX_LODS)
-                upperGeomorphingScale = MAX_LODS;
+        void HeightMapPatch::PrepareAllLODs(){
+            if (IsFlat()){
+                if (LODs[0].indiceBufferOffset == NOT_GENERATED)
+                    GenerateFlatQuad();
+                return;
+            }
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i)
+                if (LODs[i].indiceBufferOffset == NOT_GENERATED)
+                    GenerateLodStruct(i);
+        }
 
-            upperLOD = floor(upperGeomorphingScale) - 1;
+        void HeightMapPatch::CalcIndexCounts(int* counts){
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i){
+                ComputeLodStruct(counts[i], i);
+                terrain->GetIndexArena().Clear();
+            }
+        }
 
-            // Calculate right LOD
-            distance = (viewPos - (patchCenter + Vector<3, float>(0, 0, edgeLength))).GetLength();
-            distance -= baseDistance;
+        void HeightMapPatch::SetIndexCounts(const int* counts){
+            flatVertex = -1;
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i){
+                LODs[i].numberOfIndices = counts[i];
+                LODs[i].indiceBufferOffset = NOT_GENERATED;
+            }
+        }
+
+        unsigned int HeightMapPatch::GetNumberOfGeneratedIndices() const{
+            // The bodies of a flat patch share the quad.
+            if (IsFlat())
+                return LODs[0].indiceBufferOffset == NOT_GENERATED ? 0 : LODs[0].numberOfIndices;
+            unsigned int count = 0;
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i)
+                if (LODs[i].indiceBufferOffset != NOT_GENERATED)
+                    count += LODs[i].numberOfIndices;
+            return count;
+        }
+
+        void HeightMapPatch::MoveIndices(const unsigned int* from, unsigned int* to, unsigned int& used){
+            if (IsFlat()){
+                unsigned int offset = LODs[0].indiceBufferOffset;
+                if (offset == NOT_GENERATED) return;
+                memcpy(to + used, from + offset, sizeof(unsigned int) * LODs[0].numberOfIndices);
+                for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i)
+                    LODs[i].indiceBufferOffset = used;
+                used += LODs[0].numberOfIndices;
+                return;
+            }
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i){
+                LODstruct& lod = LODs[i];
+                if (lod.indiceBufferOffset == NOT_GENERATED) continue;
+                memcpy(to + used, from + lod.indiceBufferOffset, sizeof(unsigned int) * lod.numberOfIndices);
+                lod.indiceBufferOffset = used;
+                used += lod.numberOfIndices;
+            }
+        }
+
+        void HeightMapPatch::SetFlat(int firstVertex){
+            flatVertex = firstVertex;
+            // The bodies are the quad and the stitchings are empty.
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i){
+                LODs[i].numberOfIndices = i < MAX_LODS ? (triangleLists ? 6 : 4) : 0;
+                LODs[i].indiceBufferOffset = NOT_GENERATED;
+            }
+        }
 
-            rightGeomorphingScale = distance * invIncDistance;
-            if (rightGeomorphingScale < 1)
-                rightGeomorphingScale = 1;
-            else if (rightGeomorphingScale > MAX_LODS)
-                rightGeomorphingScale = MAX_LODS;
+        void HeightMapPatch::Render(const PatchLOD& lod) const{
+            if (lod.visible){
+                // Draw the body and the stitchings matching the
+                // neighbours in one call.
+                const LODstruct* strips[3] = { LODs + lod.LOD,
+                                               LODs + MAX_LODS + lod.LOD * MAX_LODS + lod.rightLOD,
+                                               LODs + MAX_LODS + (MAX_LODS + lod.LOD) * MAX_LODS + lod.upperLOD };
+                GLsizei counts[3];
+                const GLvoid* offsets[3];
+                bool vbo = indexBuffer->GetID() != 0;
+                for (int i = 0; i < 3; ++i){
+                    counts[i] = strips[i]->numberOfIndices;
+                    if (vbo)
+                        offsets[i] = (GLvoid*)(strips[i]->indiceBufferOffset * sizeof(GLuint));
+                    else
+                        offsets[i] = indexBuffer->GetData() + strips[i]->indiceBufferOffset;
+                }
+                glMultiDrawElements(triangleLists ? GL_TRIANGLES : GL_TRIANGLE_STRIP, 
+                                    counts, GL_UNSIGNED_INT, offsets, 3);
+            }
+        }
 
-            rightLOD = floor(rightGeomorphingScale) - 1;
+        unsigned int HeightMapPatch::GetNumberOfTriangles(const PatchLOD& lod) const{
+            const LODstruct* strips[3] = { LODs + lod.LOD,
+                                           LODs + MAX_LODS + lod.LOD * MAX_LODS + lod.rightLOD,
+                                           LODs + MAX_LODS + (MAX_LODS + lod.LOD) * MAX_LODS + lod.upperLOD };
+            unsigned int triangles = 0;
+            for (int i = 0; i < 3; ++i)
+                if (triangleLists)
+                    triangles += strips[i]->numberOfIndices / 3;
+                else if (strips[i]->numberOfIndices > 2)
+                    triangles += strips[i]->numberOfIndices - 2;
+            return triangles;
         }
 
-        void HeightMapPatch::Render() const{
-            if (visible){
-                int rightLODdiff = rightLOD - LOD + 1;
-                int upperLODdiff = upperLOD - LOD + 1;
+        float HeightMapPatch::CalcACMR(const PatchLOD& lod, int cacheSize, bool fifo) const{
+            const LODstruct* strips[3] = { LODs + lod.LOD,
+                                           LODs + MAX_LODS + lod.LOD * MAX_LODS + lod.rightLOD,
+                                           LODs + MAX_LODS + (MAX_LODS + lod.LOD) * MAX_LODS + lod.upperLOD };
+            // Concatenate the triangles in the order they are drawn.
+            std::vector<unsigned int> list;
+            for (int i = 0; i < 3; ++i){
+                int count = strips[i]->numberOfIndices;
+                if (count < 3 || strips[i]->indiceBufferOffset == NOT_GENERATED) continue;
+                const unsigned int* indices = indexBuffer->GetData() + strips[i]->indiceBufferOffset;
+                int offset = list.size();
+                if (triangleLists){
+                    list.insert(list.end(), indices, indices + count);
+                }else{
+                    list.resize(offset + 3 * (count - 2));
+                    int added = Utils::ConvertStripToList(indices, count, &list[offset]);
+                    list.resize(offset + added);
+                }
+            }
+            if (list.empty()) return 0;
+            return Utils::CalcACMR(&list[0], list.size(), cacheSize, fifo);
+        }
 
-                unsigned int numberOfIndices = LODs[LOD][rightLODdiff][upperLODdiff].numberOfIndices;
-                unsigned int offset = LODs[LOD][rightLODdiff][upperLODdiff].indiceBufferOffset;
-                if (indexBuffer->GetID() != 0)
-                    glDrawElements(GL_TRIANGLE_STRIP, numberOfIndices, GL_UNSIGNED_INT, (void*)(offset * sizeof(GLuint)));
+        float HeightMapPatch::GetDistance(const Vector<3, float> point) const{
+            Vector<3, float> d;
+            for (int i = 0; i < 3; ++i){
+                if (point[i] < min[i])
+                    d[i] = min[i] - point[i];
+                else if (point[i] > max[i])
+                    d[i] = point[i] - max[i];
                 else
-                    glDrawElements(GL_TRIANGLE_STRIP, numberOfIndices, GL_UNSIGNED_INT, indexBuffer->GetData() + offset);
+                    d[i] = 0;
             }
+            return d.GetLength();
         }
 
         void HeightMapPatch::RenderBoundingGeometry() const{
@@ -173,55 +313,90 @@ namespace OpenEngine {
 
         // **** inlined functions ****
 
-        void HeightMapPatch::ComputeIndices(){
-
-            for (int i = 0; i < MAX_LODS; ++i){
-                int bodyIndices;
-                unsigned int* body = ComputeBodyIndices(bodyIndices, i);
-                
-                for (int j = 0; j < 3; ++j){
-                    int rightIndices;
-                    unsigned int* right = ComputeRightStichingIndices(rightIndices, i, (LODrelation) j);
-
-                    for (int k = 0; k < 3; ++k){
-                        int upperIndices;
-                        unsigned int* upper = ComputeUpperStichingIndices(upperIndices, i, (LODrelation) k);
-
-                        if (rightIndices > 0 && upperIndices > 0){
-                            LODs[i][j][k].numberOfIndices = bodyIndices + rightIndices + upperIndices + 4;
-                            LODs[i][j][k].indices = new unsigned int[LODs[i][j][k].numberOfIndices];
-                            
-                            int c = 0; // a counter into the array of indices
-                            // Copy the body of the lod
-                            memcpy(LODs[i][j][k].indices, body, bodyIndices * sizeof(unsigned int));
-                            c += bodyIndices;
-                            
-                            // Add indices to draw 2 degenerate triangles
-                            LODs[i][j][k].indices[c++] = body[bodyIndices-1];
-                            LODs[i][j][k].indices[c++] = right[0];
-                            
-                            // Copy the right stitching
-                            memcpy(LODs[i][j][k].indices + c, right, rightIndices * sizeof(unsigned int));
-                            c += rightIndices;
-                            
-                            // Add indices to draw 2 degenerate triangles
-                            LODs[i][j][k].indices[c++] = right[rightIndices-1];
-                            LODs[i][j][k].indices[c++] = upper[0];
-                            
-                            // Copy the upper stitching
-                            memcpy(LODs[i][j][k].indices + c, upper, upperIndices * sizeof(unsigned int));
-                        }else{
-                            LODs[i][j][k].numberOfIndices = 0;
-                            LODs[i][j][k].indices = NULL;
-                        }
-                        delete[] upper;
-                    }
+        void HeightMapPatch::SetupPosition(int xStart, int zStart, HeightMapNode* t){
+            terrain = t;
+            this->xStart = xStart;
+            this->zStart = zStart;
 
-                    delete[] right;
-                }
+            xEnd = xStart + PATCH_EDGE_VERTICES;
+            zEnd = zStart + PATCH_EDGE_VERTICES;
+            xEndMinusOne = xEnd - 1;
+            zEndMinusOne = zEnd - 1;
+
+            edgeLength = (xEndMinusOne - xStart) * t->GetWidthScale();
+            triangleLists = t->GetPatchVertexCacheSize() > 0;
+        }
+
+        unsigned int* HeightMapPatch::ComputeLodStruct(int& indices, int i){
+            unsigned int* ret;
+            if (i < MAX_LODS)
+                ret = ComputeBodyIndices(indices, i);
+            else if (i < MAX_LODS + MAX_LODS * MAX_LODS){
+                int s = i - MAX_LODS;
+                ret = ComputeRightStichingIndices(indices, s / MAX_LODS, s % MAX_LODS);
+            }else{
+                int s = i - MAX_LODS - MAX_LODS * MAX_LODS;
+                ret = ComputeUpperStichingIndices(indices, s / MAX_LODS, s % MAX_LODS);
+            }
+
+            if (triangleLists)
+                ret = ConvertToTriangleList(ret, indices, terrain->GetPatchVertexCacheSize());
+            return ret;
+        }
+
+        void HeightMapPatch::GenerateLodStruct(int i){
+            LODstruct& lod = LODs[i];
+            int count;
+            unsigned int* indices = ComputeLodStruct(count, i);
+
+            // Allocating may replace the index buffer, so fetch it
+            // afterwards.
+            unsigned int offset = terrain->AllocatePatchIndices(count);
+            if (count > 0)
+                memcpy(terrain->GetIndices()->GetData() + offset, indices, sizeof(unsigned int) * count);
+            terrain->GetIndexArena().Clear();
+
+            // The count is the same for all patches and may already
+            // be read by the LOD workers, so only set it once.
+            if (lod.numberOfIndices != count)
+                lod.numberOfIndices = count;
+            lod.indiceBufferOffset = offset;
+        }
+
+        void HeightMapPatch::GenerateFlatQuad(){
+            unsigned int v = flatVertex;
+            unsigned int strip[4] = { v, v + 1, v + 2, v + 3 };
+            unsigned int list[6] = { v, v + 1, v + 2, v + 2, v + 1, v + 3 };
+            int count = triangleLists ? 6 : 4;
+
+            unsigned int offset = terrain->AllocatePatchIndices(count);
+            memcpy(terrain->GetIndices()->GetData() + offset, triangleLists ? list : strip, 
+                   sizeof(unsigned int) * count);
+
+            // Every LOD struct points to the quad.
+            for (int i = 0; i < NUMBER_OF_LOD_STRUCTS; ++i)
+                LODs[i].indiceBufferOffset = offset;
+        }
 
-                delete[] body;
+        unsigned int* HeightMapPatch::ConvertToTriangleList(unsigned int* strip, int& indices, int cacheSize){
+            if (indices < 3){
+                indices = 0;
+                return strip;
             }
+
+            unsigned int* list = terrain->GetIndexArena().Allocate(3 * (indices - 2));
+            indices = Utils::ConvertStripToList(strip, indices, list);
+            if (indices == 0) return list;
+
+            // The optimization is a heuristic, and the strips of the
+            // coarser LODs are short enough to reuse the cache
+            // better, so keep the order that misses the least.
+            unsigned int* optimized = terrain->GetIndexArena().Allocate(indices);
+            memcpy(optimized, list, sizeof(unsigned int) * indices);
+            Utils::OptimizeVertexCache(optimized, indices, cacheSize);
+            if (Utils::CalcACMR(optimized, indices, cacheSize) < Utils::CalcACMR(list, indices, cacheSize))
+                return optimized;
+            return list;
         }
         
         unsigned int* HeightMapPatch::ComputeBodyIndices(int& indices, int LOD){
@@ -229,9 +404,14 @@ namespace OpenEngine {
             
             int xs = PATCH_EDGE_SQUARES / delta - 1;
             int zs = PATCH_EDGE_SQUARES / delta;
+            if (xs == 0){
+                // The stitchings cover the entire patch.
+                indices = 0;
+                return NULL;
+            }
             indices = 2 * xs * zs + 2 * xs - 2;
 
-            unsigned int* ret = new unsigned int[indices];
+            unsigned int* ret = terrain->GetIndexArena().Allocate(indices);
 
             int i = 0;
             for (int x = xStart; x < xEnd - 2 * delta; x += delta){
@@ -248,123 +428,62 @@ namespace OpenEngine {
             return ret;
         }
 
-        unsigned int* HeightMapPatch::ComputeRightStichingIndices(int& indices, int LOD, LODrelation rightLOD){
-            int delta = pow(2, LOD);
-
-            int i = 0;
-
-            switch (rightLOD){
-            case LOWER:
-                {
-                    if (delta > 1){
-                        int rightDelta = delta / 2;
-                        
-                        indices = 4 * PATCH_EDGE_SQUARES / delta + 1;
-                        unsigned int* ret = new unsigned int[indices];
-                        
-                        for (int x = xEndMinusOne - delta; x >= xStart; x -= delta){
-                            ret[i++] = terrain->GetIndice(x + delta, zEndMinusOne);
-                            ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                            ret[i++] = terrain->GetIndice(x + rightDelta, zEndMinusOne);
-                            ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                        }
-                        ret[i++] = terrain->GetIndice(xStart, zEndMinusOne);
-
-                        return ret;
-                    }else{
-                        indices = 0;
-                        return NULL;
-                    }
-                }
-            case SAME:
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
-
-                    ret[i++] = terrain->GetIndice(xEndMinusOne, zEndMinusOne);
-                    for (int x = xEndMinusOne - delta; x >= xStart; x -= delta){
-                        ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                        ret[i++] = terrain->GetIndice(x, zEndMinusOne);
-                    }
-
-                    return ret;
-                }
-            default: // HIGHER
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
-                    
-                    for (int x = xEndMinusOne - 2 * delta; x >= xStart; x -= 2 * delta){
-                        ret[i++] = terrain->GetIndice(x + 2 * delta, zEndMinusOne);
-                        ret[i++] = terrain->GetIndice(x + delta, zEndMinusOne - delta);
-                        ret[i++] = terrain->GetIndice(x + 2 * delta, zEndMinusOne);
-                        ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                    }
-                    ret[i++] = terrain->GetIndice(xStart, zEnd - 1);
-
-                    return ret;
-                }
-            }
+        unsigned int* HeightMapPatch::ComputeRightStichingIndices(int& indices, int LOD, int rightLOD){
+            return ComputeStichingIndices(indices, pow(2, LOD), pow(2, rightLOD), -1, 0, 0, -1);
         }
 
-        unsigned int* HeightMapPatch::ComputeUpperStichingIndices(int& indices, int LOD, LODrelation upperLOD){
-            int delta = pow(2, LOD);
-
-            int i = 0;
-
-            switch (upperLOD){
-            case LOWER:
-                {
-                    if (delta > 1){
-                        int upperDelta = delta / 2;
-                        
-                        indices = 4 * PATCH_EDGE_SQUARES / delta + 1;
-                        unsigned int* ret = new unsigned int[indices];
-                        
-                        for (int z = zEndMinusOne - delta; z >= zStart; z -= delta){
-                            ret[i++] = terrain->GetIndice(xEndMinusOne, z + delta);
-                            ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
-                            ret[i++] = terrain->GetIndice(xEndMinusOne, z + upperDelta);
-                            ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
-                        }
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, zStart);
-                        
-                        return ret;
-                    }else{
-                        indices = 0;
-                        return NULL;
-                    }
+        unsigned int* HeightMapPatch::ComputeUpperStichingIndices(int& indices, int LOD, int upperLOD){
+            return ComputeStichingIndices(indices, pow(2, LOD), pow(2, upperLOD), 0, -1, -1, 0);
+        }
 
-                }
-            case SAME:
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
+        unsigned int* HeightMapPatch::ComputeStichingIndices(int& indices, int innerDelta, int outerDelta,
+                                                             int xDir, int zDir, int xIn, int zIn){
+            // The outer edge has a vertex at t = o * outerDelta and
+            // the inner line at t = (n + 1) * innerDelta, where t is
+            // the distance from the corner along the edge.
+            int outers = PATCH_EDGE_SQUARES / outerDelta + 1;
+            int inners = PATCH_EDGE_SQUARES / innerDelta;
 
+            unsigned int* ret = terrain->GetIndexArena().Allocate(2 * (outers + inners - 1));
 
-                    ret[i++] = terrain->GetIndice(xEndMinusOne, zEndMinusOne);
-                    for (int z = zEndMinusOne - delta; z >= zStart; z -= delta){
-                        ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, z);
+            int i = 0;
+            int o = 0, n = 0;
+            ret[i++] = terrain->GetIndice(xEndMinusOne, zEndMinusOne);
+            ret[i++] = terrain->GetIndice(xEndMinusOne + xIn * innerDelta + xDir * innerDelta, 
+                                          zEndMinusOne + zIn * innerDelta + zDir * innerDelta);
+            bool innerLast = true;
+            while (o < outers - 1 || n < inners - 1){
+                // Advance along the side whose next vertex is closest
+                // to the corner. The strip must alternate between the
+                // sides, so repeat the other side's vertex if the
+                // same side advances twice.
+                bool advanceOuter = n == inners - 1 || 
+                    (o < outers - 1 && (o + 1) * outerDelta < (n + 2) * innerDelta);
+                if (advanceOuter){
+                    if (!innerLast){
+                        int t = (n + 1) * innerDelta;
+                        ret[i++] = terrain->GetIndice(xEndMinusOne + xIn * innerDelta + xDir * t, 
+                                                      zEndMinusOne + zIn * innerDelta + zDir * t);
                     }
-                    return ret;
-                }
-            default: // HIGHER
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
-                    
-                    for (int z = zEndMinusOne - 2 * delta; z >= zStart; z -= 2 * delta){
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, z + 2 * delta);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z + delta);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, z + 2 * delta);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
+                    ++o;
+                    int t = o * outerDelta;
+                    ret[i++] = terrain->GetIndice(xEndMinusOne + xDir * t, zEndMinusOne + zDir * t);
+                    innerLast = false;
+                }else{
+                    if (innerLast){
+                        int t = o * outerDelta;
+                        ret[i++] = terrain->GetIndice(xEndMinusOne + xDir * t, zEndMinusOne + zDir * t);
                     }
-                    ret[i++] = terrain->GetIndice(xEnd - 1, zStart);
-
-                    return ret;
+                    ++n;
+                    int t = (n + 1) * innerDelta;
+                    ret[i++] = terrain->GetIndice(xEndMinusOne + xIn * innerDelta + xDir * t, 
+                                                  zEndMinusOne + zIn * innerDelta + zDir * t);
+                    innerLast = true;
                 }
             }
+            indices = i;
+
+            return ret;
         }
 
         void HeightMapPatch::SetupBoundingBox(){
@@ -373,7 +492,7 @@ namespace OpenEngine {
 
             for (int x = xStart; x < xEnd; ++x){
                 for (int z = zStart; z < zEnd; ++z){
-                    float y = terrain->GetVertex(x, z)[1];
+                    float y = terrain->GetVertexHeight(x, z);
                     min[1] = y < min[1] ? y : min[1];
                     max[1] = y > max[1] ? y : max[1];
                 }
@@ -382,6 +501,15 @@ namespace OpenEngine {
             UpdateBoundingBox();
         }
 
+        float HeightMapPatch::CalcGeomorphingScale(float distance, const HeightMapLODPacket& packet) const{
+            float scale = (distance - packet.baseDistance) * packet.invIncDistance;
+            if (scale < 1)
+                return 1;
+            else if (scale > MAX_LODS)
+                return MAX_LODS;
+            return scale;
+        }
+
         void HeightMapPatch::UpdateBoundingBox(){
             patchCenter = (min + max) / 2;
             boundingBox = Box(patchCenter, max - patchCenter);
@@ -24,10 +24,13 @@ namespace OpenEngine {
     }
     namespace Scene {
         class HeightMapNode;
+        struct HeightMapLODPacket;
+        struct PatchLOD;
 
         struct LODstruct {
             int numberOfIndices;
-            unsigned int* indices;
+            // NOT_GENERATED until the indices are in the index
+            // buffer.
             unsigned int indiceBufferOffset;
         };
         
@@ -36,57 +39,177 @@ namespace OpenEngine {
         public:
             static const int PATCH_EDGE_SQUARES = 32;
             static const int PATCH_EDGE_VERTICES = PATCH_EDGE_SQUARES + 1;
-            static const int MAX_LODS = 3;
-            static const int MAX_DELTA = 4; //pow(2, MAX_LODS-1);
+            // LODs down to a single quad, log2(PATCH_EDGE_SQUARES) + 1.
+            static const int MAX_LODS = 6;
+            static const int MAX_DELTA = 32; //pow(2, MAX_LODS-1);
+            // A body for each LOD and a right and upper stitching for
+            // each LOD and neighbour LOD pair.
+            static const int NUMBER_OF_LOD_STRUCTS = MAX_LODS + 2 * MAX_LODS * MAX_LODS;
+            static const unsigned int NOT_GENERATED = 0xFFFFFFFF;
+            // The bytes WriteBake writes, the bounding box, the flat
+            // vertex and the LOD structs.
+            static const unsigned int BAKE_SIZE = 6 * sizeof(float) + sizeof(int) + 
+                NUMBER_OF_LOD_STRUCTS * sizeof(LODstruct);
 
-            enum LODrelation { LOWER = 0, SAME = 1, HIGHER = 2 };
-            
         private:
             HeightMapNode* terrain;
 
-            unsigned int LOD, upperLOD, rightLOD;
-            float geomorphingScale, rightGeomorphingScale, upperGeomorphingScale;
-            bool visible;
-            
             int xStart, zStart, xEnd, zEnd, xEndMinusOne, zEndMinusOne;
             Vector<3, float> patchCenter;
             Geometry::Box boundingBox;
             Vector<3, float> min, max;
             float edgeLength;
+            // Triangle lists instead of strips.
+            bool triangleLists;
+            // The first of the four vertices of the quad the patch is
+            // drawn as while it is flat, or -1.
+            int flatVertex;
 
             Resources::IndicesPtr indexBuffer;
-            LODstruct LODs[MAX_LODS][3][3];
+            // The bodies followed by the right and upper stitchings,
+            // see GetBody, GetRightStitching and GetUpperStitching.
+            LODstruct LODs[NUMBER_OF_LOD_STRUCTS];
             
         public:            
             HeightMapPatch() {}
             HeightMapPatch(int xStart, int zStart, HeightMapNode* t);
             ~HeightMapPatch();
+            /**
+             * Initializes a default constructed patch.
+             */
+            void Setup(int xStart, int zStart, HeightMapNode* t);
+            /**
+             * Initializes a default constructed patch from the state
+             * written by WriteBake, instead of from the heightmap.
+             */
+            void ReadBake(int xStart, int zStart, HeightMapNode* t, const char* data);
+            void WriteBake(char* data) const;
 
             void UpdateBoundingGeometry();
             void UpdateBoundingGeometry(float height);
 
             // Render functions
-            void CalcLOD(Display::IViewingVolume* view);
-            void Render() const;
+
+            /**
+             * Culls the patch against the view and calculates it's
+             * LOD and the LOD of it's upper and right neighbours.
+             */
+            void CalcLOD(const HeightMapLODPacket& packet, PatchLOD& lod) const;
+            /**
+             * Generates the indices Render needs for the LOD into the
+             * heightmap's index buffer, if the heightmap generates
+             * them lazily and they have not been generated yet.
+             */
+            void PrepareLOD(const PatchLOD& lod);
+            /**
+             * Generates all the indices not generated yet.
+             */
+            void PrepareAllLODs();
+            void Render(const PatchLOD& lod) const;
+            /**
+             * The number of triangles Render draws at the LOD,
+             * including degenerate ones.
+             */
+            unsigned int GetNumberOfTriangles(const PatchLOD& lod) const;
+            /**
+             * Simulates rendering the patch at the LOD through a
+             * vertex cache.
+             *
+             * @see Utils::CalcACMR
+             */
+            float CalcACMR(const PatchLOD& lod, int cacheSize, bool fifo = true) const;
             void RenderBoundingGeometry() const;
 
             // *** Get/Set methods ***
 
             void SetDataIndices(IndicesPtr i) { indexBuffer = i; }
-            int GetLOD() const { return LOD; }
-            inline bool IsVisible() const { return visible; }
-            float GetGeomorphingScale() const { return geomorphingScale; }
-            LODstruct& GetLodStruct(const int lod, const int rightlod, const int upperlod) { return (LODs[lod][rightlod][upperlod]); }
+            /**
+             * Computes the number of indices of each LOD struct
+             * without generating them.
+             */
+            void CalcIndexCounts(int* counts);
+            /**
+             * Sets the number of indices of each LOD struct, which
+             * is the same for all patches that are not flat, so the
+             * triangle counts are known before the indices are
+             * generated. Draws the patch from it's vertices again if
+             * it was flat.
+             */
+            void SetIndexCounts(const int* counts);
+            /**
+             * Draws the patch as a single quad at every LOD, from the
+             * four vertices starting at firstVertex in the order
+             * upper left, upper right, lower left, lower right.
+             */
+            void SetFlat(int firstVertex);
+            bool IsFlat() const { return flatVertex >= 0; }
+            /**
+             * The number of indices the patch has in the index
+             * buffer.
+             */
+            unsigned int GetNumberOfGeneratedIndices() const;
+            /**
+             * Copies the patch's generated indices from one index
+             * buffer to the used end of another, and points the LOD
+             * structs to the copies.
+             */
+            void MoveIndices(const unsigned int* from, unsigned int* to, unsigned int& used);
+            LODstruct& GetLodStruct(const int i) { return LODs[i]; }
+            /**
+             * The triangle strip, or list if the heightmap has a
+             * vertex cache size, of the patch at the given LOD,
+             * without it's right and upper edge.
+             */
+            LODstruct& GetBody(const int lod) { return LODs[lod]; }
+            /**
+             * The triangle strip connecting the body at the given LOD
+             * to a right neighbour at rightlod.
+             */
+            LODstruct& GetRightStitching(const int lod, const int rightlod) { return LODs[MAX_LODS + lod * MAX_LODS + rightlod]; }
+            /**
+             * The triangle strip connecting the body at the given LOD
+             * to an upper neighbour at upperlod.
+             */
+            LODstruct& GetUpperStitching(const int lod, const int upperlod) { return LODs[MAX_LODS + (MAX_LODS + lod) * MAX_LODS + upperlod]; }
             Vector<3, float> GetCenter() const { return patchCenter; }
+            /**
+             * Returns the distance from the point to the patch's
+             * bounding box.
+             */
+            float GetDistance(const Vector<3, float> point) const;
+            Vector<3, float> GetMin() const { return min; }
+            Vector<3, float> GetMax() const { return max; }
 
         protected:
-            inline void ComputeIndices();
+            inline void SetupPosition(int xStart, int zStart, HeightMapNode* t);
+            /**
+             * Computes the indices of the i'th LOD struct.
+             */
+            inline unsigned int* ComputeLodStruct(int& indices, int i);
+            inline void GenerateLodStruct(int i);
+            inline void GenerateFlatQuad();
+            /**
+             * Converts the strip to a triangle list ordered for the
+             * vertex cache.
+             */
+            inline unsigned int* ConvertToTriangleList(unsigned int* strip, int& indices, int cacheSize);
             inline unsigned int* ComputeBodyIndices(int& indices, int LOD);
-            inline unsigned int* ComputeRightStichingIndices(int& indices, int LOD, LODrelation rightLOD);
-            inline unsigned int* ComputeUpperStichingIndices(int& indices, int LOD, LODrelation upperLOD);
+            inline unsigned int* ComputeRightStichingIndices(int& indices, int LOD, int rightLOD);
+            inline unsigned int* ComputeUpperStichingIndices(int& indices, int LOD, int upperLOD);
+            /**
+             * Zips the outer edge, with vertices every outerDelta,
+             * to the inner line, with vertices every innerDelta, into
+             * a triangle strip. Both start at the corner of the patch
+             * and run along the edge, with (xDir, zDir) the direction
+             * along the edge and (xIn, zIn) the direction into the
+             * patch.
+             */
+            inline unsigned int* ComputeStichingIndices(int& indices, int innerDelta, int outerDelta,
+                                                        int xDir, int zDir, int xIn, int zIn);
 
             inline void SetupBoundingBox();
             inline void UpdateBoundingBox();
+            inline float CalcGeomorphingScale(float distance, const HeightMapLODPacket& packet) const;
         };
         
     }
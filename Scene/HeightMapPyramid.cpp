@@ -0,0 +1,141 @@
+// Heightfield height pyramid.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapPyramid.h>
+#include <Scene/HeightMapNode.h>
+#include <algorithm>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        HeightMapPyramid::HeightMapPyramid(HeightMapNode* node, int numberOfLevels)
+            : node(node) {
+            int width = node->GetVerticeWidth();
+            int depth = node->GetVerticeDepth();
+            for (int l = 0; l < numberOfLevels && (width > 2 || depth > 2); ++l){
+                // Every other vertex, including the last.
+                width = width / 2 + 1;
+                depth = depth / 2 + 1;
+                Level level;
+                level.width = width;
+                level.depth = depth;
+                level.heights.resize(width * depth);
+                level.normals.resize(width * depth * 3);
+                levels.push_back(level);
+            }
+
+            Invalidate(0, 0, node->GetVerticeWidth(), node->GetVerticeDepth());
+        }
+
+        void HeightMapPyramid::Invalidate(int xStart, int zStart, int xEnd, int zEnd){
+            for (unsigned int l = 1; l <= levels.size(); ++l){
+                const Level& level = levels[l-1];
+                // The vertices whose filter covers the area below.
+                xStart = xStart / 2;
+                zStart = zStart / 2;
+                xEnd = std::min(xEnd / 2 + 1, level.width);
+                zEnd = std::min(zEnd / 2 + 1, level.depth);
+                if (xStart >= xEnd || zStart >= zEnd) return;
+
+                FilterHeights(l, xStart, zStart, xEnd, zEnd);
+                CalcNormals(l, std::max(xStart - 1, 0), std::max(zStart - 1, 0),
+                            std::min(xEnd + 1, level.width), std::min(zEnd + 1, level.depth));
+            }
+        }
+
+        inline float HeightMapPyramid::GetLevelHeight(const int l, int x, int z) const {
+            if (l == 0)
+                return node->GetVertexHeight(x, z);
+            const Level& level = levels[l-1];
+            x = std::max(0, std::min(x, level.width - 1));
+            z = std::max(0, std::min(z, level.depth - 1));
+            return level.heights[z + x * level.depth];
+        }
+
+        inline const float* HeightMapPyramid::GetLevelNormal(const int l, int x, int z) const {
+            const Level& level = levels[l-1];
+            x = std::max(0, std::min(x, level.width - 1));
+            z = std::max(0, std::min(z, level.depth - 1));
+            return &level.normals[(z + x * level.depth) * 3];
+        }
+
+        void HeightMapPyramid::FilterHeights(const int l, int xStart, int zStart, int xEnd, int zEnd){
+            Level& level = levels[l-1];
+            // The weights of the tent filter, 1/4, 1/2, 1/4 along
+            // each axis.
+            static const float weights[3] = { 0.25f, 0.5f, 0.25f };
+            for (int x = xStart; x < xEnd; ++x)
+                for (int z = zStart; z < zEnd; ++z){
+                    float height = 0;
+                    for (int i = 0; i < 3; ++i)
+                        for (int j = 0; j < 3; ++j)
+                            height += weights[i] * weights[j] * GetLevelHeight(l - 1, 2 * x + i - 1, 2 * z + j - 1);
+                    level.heights[z + x * level.depth] = height;
+                }
+        }
+
+        void HeightMapPyramid::CalcNormals(const int l, int xStart, int zStart, int xEnd, int zEnd){
+            // As HeightMapNode::GetNormal, with the level's spacing.
+            Level& level = levels[l-1];
+            float spacing = node->GetWidthScale() * (1 << l);
+            for (int x = xStart; x < xEnd; ++x)
+                for (int z = zStart; z < zEnd; ++z){
+                    float height = level.heights[z + x * level.depth];
+                    Vector<3, float> normal(0.0f);
+                    if (x + 1 < level.width){
+                        normal[0] += height - level.heights[z + (x + 1) * level.depth];
+                        normal[1] += spacing;
+                    }
+                    if (0 < x){
+                        normal[0] += level.heights[z + (x - 1) * level.depth] - height;
+                        normal[1] += spacing;
+                    }
+                    if (z + 1 < level.depth){
+                        normal[2] += height - level.heights[z + 1 + x * level.depth];
+                        normal[1] += spacing;
+                    }
+                    if (0 < z){
+                        normal[2] += level.heights[z - 1 + x * level.depth] - height;
+                        normal[1] += spacing;
+                    }
+                    normal.Normalize();
+                    normal.ToArray(&level.normals[(z + x * level.depth) * 3]);
+                }
+        }
+
+        float HeightMapPyramid::GetHeight(const int l, float x, float z) const {
+            x /= 1 << l;
+            z /= 1 << l;
+            int X = floor(x);
+            int Z = floor(z);
+            float dX = x - X;
+            float dZ = z - Z;
+            return GetLevelHeight(l, X, Z) * (1-dX) * (1-dZ) +
+                GetLevelHeight(l, X+1, Z) * dX * (1-dZ) +
+                GetLevelHeight(l, X, Z+1) * (1-dX) * dZ +
+                GetLevelHeight(l, X+1, Z+1) * dX * dZ;
+        }
+
+        Vector<3, float> HeightMapPyramid::GetNormal(const int l, float x, float z) const {
+            x /= 1 << l;
+            z /= 1 << l;
+            int X = floor(x);
+            int Z = floor(z);
+            float dX = x - X;
+            float dZ = z - Z;
+            Vector<3, float> normal = Vector<3, float>(GetLevelNormal(l, X, Z)) * (1-dX) * (1-dZ) +
+                Vector<3, float>(GetLevelNormal(l, X+1, Z)) * dX * (1-dZ) +
+                Vector<3, float>(GetLevelNormal(l, X, Z+1)) * (1-dX) * dZ +
+                Vector<3, float>(GetLevelNormal(l, X+1, Z+1)) * dX * dZ;
+            return normal.GetNormalize();
+        }
+
+    }
+}
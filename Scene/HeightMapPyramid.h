@@ -0,0 +1,100 @@
+// Heightfield height pyramid.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_PYRAMID_H_
+#define _HEIGHTFIELD_PYRAMID_H_
+
+#include <Math/Vector.h>
+
+#include <vector>
+
+using namespace OpenEngine::Math;
+
+namespace OpenEngine {
+    namespace Scene {
+        class HeightMapNode;
+
+        /**
+         * Coarser copies of a heightmap's heights and normals, for
+         * queries and rendering that don't need the full resolution.
+         *
+         * Level 0 is the heightmap itself. Level l holds every 2^l'th
+         * vertex of the heightmap, each the tent filtered average of
+         * the vertex below it and it's neighbours in level l-1, so a
+         * level is a quarter the size of the one below. The normals
+         * of a level are computed from it's own heights, like the
+         * heightmap's. The levels stop when they are 2 vertices
+         * wide and deep.
+         *
+         * The levels are stored like the heightmap's vertices, with
+         * z varying fastest. When the heightmap's heights change
+         * only the vertices above the changed area are refiltered.
+         */
+        class HeightMapPyramid {
+        protected:
+            struct Level {
+                int width, depth;
+                std::vector<float> heights;
+                std::vector<float> normals;
+            };
+
+            HeightMapNode* node;
+            // Level l is at l-1, level 0 is the node.
+            std::vector<Level> levels;
+
+        public:
+            /**
+             * Builds at most the given number of levels above the
+             * heightmap.
+             */
+            HeightMapPyramid(HeightMapNode* node, int levels);
+
+            /**
+             * Refilters the levels above the area of the heightmap.
+             * Called by the node when it's heights change.
+             */
+            void Invalidate(int xStart, int zStart, int xEnd, int zEnd);
+
+            /**
+             * The number of levels including the heightmap.
+             */
+            int GetNumberOfLevels() const { return levels.size() + 1; }
+            /**
+             * The size and data of a level above the heightmap. The
+             * height of vertex (x, z) is at z + x * depth and it's
+             * normal at 3 times that.
+             */
+            int GetWidth(const int level) const { return levels[level-1].width; }
+            int GetDepth(const int level) const { return levels[level-1].depth; }
+            const float* GetHeights(const int level) const { return &levels[level-1].heights[0]; }
+            const float* GetNormals(const int level) const { return &levels[level-1].normals[0]; }
+
+            /**
+             * The bilinearly interpolated height and normal of a
+             * level above the heightmap, at the position given in
+             * heightmap vertex coords.
+             */
+            float GetHeight(const int level, float x, float z) const;
+            Vector<3, float> GetNormal(const int level, float x, float z) const;
+
+        protected:
+            inline float GetLevelHeight(const int level, int x, int z) const;
+            inline const float* GetLevelNormal(const int level, int x, int z) const;
+            /**
+             * Filters the heights of the area of the level, in it's
+             * own coords, from the level below.
+             */
+            void FilterHeights(const int level, int xStart, int zStart, int xEnd, int zEnd);
+            void CalcNormals(const int level, int xStart, int zStart, int xEnd, int zEnd);
+        };
+
+    }
+}
+
+#endif
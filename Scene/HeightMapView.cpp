@@ -0,0 +1,164 @@
+// Heightfield view.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapView.h>
+#include <Display/IViewingVolume.h>
+#include <Math/Quaternion.h>
+
+#include <algorithm>
+#include <math.h>
+
+using namespace OpenEngine::Display;
+
+namespace OpenEngine {
+    namespace Scene {
+
+        HeightMapView::HeightMapView()
+            : position(0.0f), forward(0, 0, -1), up(0, 1, 0), right(1, 0, 0),
+              nearDistance(1), farDistance(3000), tanHalfFOV(1), aspect(1) {
+            SetupPlanes();
+        }
+
+        HeightMapView::HeightMapView(IViewingVolume* view) {
+            Set(view);
+        }
+
+        void HeightMapView::Set(IViewingVolume* view){
+            position = view->GetPosition();
+
+            // The viewing volume looks down the negative z-axis.
+            Quaternion<float> dir = view->GetDirection();
+            forward = -dir.RotateVector(Vector<3, float>(0, 0, 1));
+            up = dir.RotateVector(Vector<3, float>(0, 1, 0));
+            right = dir.RotateVector(Vector<3, float>(1, 0, 0));
+
+            nearDistance = view->GetNear();
+            farDistance = view->GetFar();
+            tanHalfFOV = tan(view->GetFOV() / 2.0f);
+            aspect = view->GetAspect();
+
+            SetupPlanes();
+        }
+
+        void HeightMapView::Set(const Vector<3, float> position, const Vector<3, float> forward, const Vector<3, float> up,
+                                const float fov, const float aspect, const float nearDistance, const float farDistance){
+            this->position = position;
+            this->forward = forward.GetNormalize();
+            right = (this->forward % up).GetNormalize();
+            this->up = right % this->forward;
+
+            this->nearDistance = nearDistance;
+            this->farDistance = farDistance;
+            tanHalfFOV = tan(fov / 2.0f);
+            this->aspect = aspect;
+
+            SetupPlanes();
+        }
+
+        bool HeightMapView::Project(const Vector<3, float> point, Vector<2, float>& ndc) const{
+            Vector<3, float> p = point - position;
+            float z = p * forward;
+            if (z < nearDistance) return false;
+            ndc[0] = (p * right) / (z * tanHalfFOV * aspect);
+            ndc[1] = (p * up) / (z * tanHalfFOV);
+            return true;
+        }
+
+        bool HeightMapView::ProjectBox(const Vector<3, float> min, const Vector<3, float> max,
+                                       Vector<2, float>& ndcMin, Vector<2, float>& ndcMax, float& depth) const{
+            ndcMin = Vector<2, float>(1.0f);
+            ndcMax = Vector<2, float>(-1.0f);
+            depth = farDistance;
+            bool clipped = false, inFront = false;
+            for (int i = 0; i < 8; ++i){
+                Vector<3, float> corner(i & 1 ? max[0] : min[0],
+                                        i & 2 ? max[1] : min[1],
+                                        i & 4 ? max[2] : min[2]);
+                Vector<2, float> ndc;
+                if (!Project(corner, ndc)){
+                    clipped = true;
+                    continue;
+                }
+                inFront = true;
+                depth = std::min(depth, (corner - position) * forward);
+                for (int j = 0; j < 2; ++j){
+                    ndcMin[j] = std::min(ndcMin[j], ndc[j]);
+                    ndcMax[j] = std::max(ndcMax[j], ndc[j]);
+                }
+            }
+            if (!inFront) return false;
+            if (clipped){
+                ndcMin = Vector<2, float>(-1.0f);
+                ndcMax = Vector<2, float>(1.0f);
+                depth = nearDistance;
+                return true;
+            }
+            for (int j = 0; j < 2; ++j){
+                ndcMin[j] = std::max(ndcMin[j], -1.0f);
+                ndcMax[j] = std::min(ndcMax[j], 1.0f);
+            }
+            return ndcMin[0] < ndcMax[0] && ndcMin[1] < ndcMax[1];
+        }
+
+        bool HeightMapView::IsVisible(const Vector<3, float> min, const Vector<3, float> max) const{
+            for (int p = 0; p < numberOfPlanes; ++p){
+                // Test the corner furthest along the plane normal.
+                const Vector<4, float>& plane = planes[p];
+                float x = plane[0] < 0 ? min[0] : max[0];
+                float y = plane[1] < 0 ? min[1] : max[1];
+                float z = plane[2] < 0 ? min[2] : max[2];
+                if (plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0)
+                    return false;
+            }
+            return true;
+        }
+
+        void HeightMapView::Mirror(const float height){
+            position[1] = 2 * height - position[1];
+            forward[1] = -forward[1];
+            up[1] = -up[1];
+            right[1] = -right[1];
+
+            // A point p seen in the mirror is at p' = (px, 2h - py,
+            // pz), so n * p' + d = (nx, -ny, nz) * p + d + 2h ny.
+            for (int p = 0; p < 6; ++p){
+                planes[p][3] += 2 * height * planes[p][1];
+                planes[p][1] = -planes[p][1];
+            }
+
+            // Only what is above the water is reflected.
+            planes[6] = Vector<4, float>(0, 1, 0, -height);
+            numberOfPlanes = 7;
+        }
+
+        void HeightMapView::SetupPlanes(){
+            float h = tanHalfFOV;
+            float w = tanHalfFOV * aspect;
+
+            Vector<3, float> normals[6];
+            normals[0] = forward;
+            normals[1] = -forward;
+            normals[2] = (forward * w + right).GetNormalize(); // left
+            normals[3] = (forward * w - right).GetNormalize(); // right
+            normals[4] = (forward * h + up).GetNormalize(); // bottom
+            normals[5] = (forward * h - up).GetNormalize(); // top
+
+            Vector<3, float> nearPoint = position + forward * nearDistance;
+            Vector<3, float> farPoint = position + forward * farDistance;
+
+            for (int p = 0; p < 6; ++p){
+                Vector<3, float> point = p == 0 ? nearPoint : (p == 1 ? farPoint : position);
+                planes[p] = Vector<4, float>(normals[p][0], normals[p][1], normals[p][2],
+                                             -(normals[p] * point));
+            }
+            numberOfPlanes = 6;
+        }
+
+    }
+}
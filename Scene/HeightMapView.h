@@ -0,0 +1,102 @@
+// Heightfield view.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_VIEW_H_
+#define _HEIGHTFIELD_VIEW_H_
+
+#include <Math/Vector.h>
+
+using namespace OpenEngine::Math;
+
+namespace OpenEngine {
+    namespace Display {
+        class IViewingVolume;
+    }
+    namespace Scene {
+
+        /**
+         * A copy of the parts of a viewing volume needed to cull and
+         * LOD a heightmap.
+         *
+         * Since it doesn't reference the viewing volume it was
+         * created from, it can be used off the render thread while
+         * the camera moves on.
+         */
+        class HeightMapView {
+        protected:
+            Vector<3, float> position;
+            Vector<3, float> forward, up, right;
+            float nearDistance, farDistance;
+            float tanHalfFOV, aspect;
+
+            // The frustum planes as {normal, distance} with the
+            // normals pointing inwards, plus an optional clipping
+            // plane.
+            Vector<4, float> planes[7];
+            int numberOfPlanes;
+
+        public:
+            HeightMapView();
+            HeightMapView(Display::IViewingVolume* view);
+
+            /**
+             * Copies the state of the viewing volume.
+             */
+            void Set(Display::IViewingVolume* view);
+            /**
+             * Sets up a perspective view looking along forward, fx
+             * for tools without a camera. The field of view is
+             * vertical and in radians.
+             */
+            void Set(const Vector<3, float> position, const Vector<3, float> forward, const Vector<3, float> up,
+                     const float fov, const float aspect, const float nearDistance, const float farDistance);
+
+            Vector<3, float> GetPosition() const { return position; }
+            Vector<3, float> GetForward() const { return forward; }
+
+            /**
+             * Mirrors the view in the horizontal plane at the given
+             * height and clips away everything below the plane. Used
+             * for rendering reflections in water.
+             */
+            void Mirror(const float height);
+
+            /**
+             * Projects the point into normalized device coordinates.
+             *
+             * @return False if the point is behind the near plane.
+             */
+            bool Project(const Vector<3, float> point, Vector<2, float>& ndc) const;
+            /**
+             * Projects the axis aligned box spanned by min and max
+             * into the screen rectangle covering it, in normalized
+             * device coordinates, and the depth of it's nearest
+             * corner. A box crossing the near plane covers the whole
+             * screen at the near distance.
+             *
+             * @return False if the box is behind the near plane or
+             * outside the screen.
+             */
+            bool ProjectBox(const Vector<3, float> min, const Vector<3, float> max,
+                            Vector<2, float>& ndcMin, Vector<2, float>& ndcMax, float& depth) const;
+
+            /**
+             * Returns true if the axis aligned box spanned by min and
+             * max is inside or intersects the frustum.
+             */
+            bool IsVisible(const Vector<3, float> min, const Vector<3, float> max) const;
+
+        protected:
+            void SetupPlanes();
+        };
+
+    }
+}
+
+#endif
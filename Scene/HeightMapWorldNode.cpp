@@ -0,0 +1,474 @@
+// Heightfield world node.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapWorldNode.h>
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPatch.h>
+#include <Meta/OpenGL.h>
+#include <Logging/Logger.h>
+#include <Core/Thread.h>
+
+#include <algorithm>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        /**
+         * Reads and decodes a tile's heights off the render thread.
+         */
+        class HeightMapTileReader : public Core::Thread {
+        private:
+            HeightMapWorldNode* world;
+            Core::Mutex doneMutex;
+            bool done;
+        public:
+            int x, z;
+            FloatTexture2DPtr heights;
+            HeightMapTileReader(HeightMapWorldNode* world, int x, int z)
+                : world(world), done(false), x(x), z(z) {}
+            void Run(){
+                FloatTexture2DPtr h = world->ReadTileHeights(x, z);
+                doneMutex.Lock();
+                heights = h;
+                done = true;
+                doneMutex.Unlock();
+            }
+            bool IsDone(){
+                doneMutex.Lock();
+                bool d = done;
+                doneMutex.Unlock();
+                return d;
+            }
+        };
+
+        HeightMapWorldNode::HeightMapWorldNode()
+            : tilesWidth(0), tilesDepth(0), tileSquares(0), spacing(1),
+              offset(Vector<3, float>(0.0f)),
+              coarseSize(0), coarseSpacing(1),
+              loadDistance(1000), unloadDistance(1200),
+              loadsPerFrame(DEFAULT_LOADS_PER_FRAME), asyncLoad(true),
+              baseDistance(-1), incDistance(-1), 
+              fillXStart(0), fillZStart(0), fillXEnd(0), fillZEnd(0) {
+        }
+
+        HeightMapWorldNode::~HeightMapWorldNode(){
+            CancelReads();
+            UnloadTiles();
+        }
+
+        bool HeightMapWorldNode::Open(const std::string& tileFile){
+            CancelReads();
+            UnloadTiles();
+            tilesWidth = tilesDepth = tileSquares = coarseSize = 0;
+            fillXStart = fillZStart = fillXEnd = fillZEnd = 0;
+            tiles.clear();
+            failedTiles.clear();
+            readingTiles.clear();
+            coarseHeights.clear();
+            coarseNormals.clear();
+
+            if (!file.Open(tileFile))
+                return false;
+
+            tileSquares = file.GetTileSquares();
+            if (tileSquares % HeightMapPatch::PATCH_EDGE_SQUARES != 0)
+                logger.error << tileFile << " has tiles of " << tileSquares
+                             << " squares, the LOD of the tile borders will only agree for multiples of "
+                             << HeightMapPatch::PATCH_EDGE_SQUARES << "." << logger.end;
+
+            tilesWidth = file.GetTilesAcross(0);
+            tilesDepth = file.GetTilesDown(0);
+            spacing = file.GetSpacing(0);
+            tiles.resize(tilesWidth * tilesDepth, NULL);
+            failedTiles.resize(tilesWidth * tilesDepth, false);
+            readingTiles.resize(tilesWidth * tilesDepth, false);
+
+            // The top level is a single tile.
+            int top = file.GetNumberOfLevels() - 1;
+            coarseSize = tileSquares + 1;
+            coarseSpacing = file.GetSpacing(top);
+            coarseHeights.resize(coarseSize * coarseSize);
+            coarseNormals.resize(coarseSize * coarseSize * 3);
+            if (!file.ReadTile(top, 0, 0, &coarseHeights[0], &coarseNormals[0])){
+                coarseSize = 0;
+                coarseHeights.clear();
+                coarseNormals.clear();
+            }
+
+            return true;
+        }
+
+        void HeightMapWorldNode::Update(RenderingEventArg arg, const Vector<3, float> position){
+            FinishReads(arg, position);
+
+            // Unload the tiles that are too far away. Tiles still
+            // loading are left until they are done, since deleting
+            // them waits for the loader.
+            for (unsigned int i = 0; i < loadedTiles.size(); ){
+                int x = loadedTiles[i] % tilesWidth;
+                int z = loadedTiles[i] / tilesWidth;
+                if (!tiles[loadedTiles[i]]->IsLoading() &&
+                    GetTileDistance(position, x, z) > unloadDistance)
+                    UnloadTile(x, z);
+                else
+                    ++i;
+            }
+
+            if (tilesWidth == 0) return;
+
+            // Only the tiles in the square around the load distance
+            // are considered.
+            float tileSize = tileSquares * spacing;
+            int xStart = std::max((int)floor((position[0] - offset[0] - loadDistance) / tileSize), 0);
+            int zStart = std::max((int)floor((position[2] - offset[2] - loadDistance) / tileSize), 0);
+            int xEnd = std::min((int)floor((position[0] - offset[0] + loadDistance) / tileSize) + 1, tilesWidth);
+            int zEnd = std::min((int)floor((position[2] - offset[2] + loadDistance) / tileSize) + 1, tilesDepth);
+            fillXStart = xStart;
+            fillZStart = zStart;
+            fillXEnd = xEnd;
+            fillZEnd = zEnd;
+
+            // Load the closest missing tiles first.
+            for (int loads = 0; loads < loadsPerFrame; ++loads){
+                int closestX = -1, closestZ = -1;
+                float closest = loadDistance;
+                for (int x = xStart; x < xEnd; ++x)
+                    for (int z = zStart; z < zEnd; ++z){
+                        int i = x + z * tilesWidth;
+                        if (tiles[i] || failedTiles[i] || readingTiles[i]) continue;
+                        float distance = GetTileDistance(position, x, z);
+                        if (distance <= closest){
+                            closest = distance;
+                            closestX = x;
+                            closestZ = z;
+                        }
+                    }
+                if (closestX < 0) return;
+                LoadTile(arg, closestX, closestZ);
+            }
+        }
+
+        HeightMapNode* HeightMapWorldNode::CreateTile(FloatTexture2DPtr heights, int, int){
+            return new HeightMapNode(heights);
+        }
+
+        FloatTexture2DPtr HeightMapWorldNode::ReadTileHeights(int x, int z){
+            fileMutex.Lock();
+            FloatTexture2DPtr heights = file.ReadTileHeights(0, x, z);
+            fileMutex.Unlock();
+            return heights;
+        }
+
+        void HeightMapWorldNode::LoadTile(RenderingEventArg arg, int x, int z){
+            if (asyncLoad){
+                // The heights are read on a reader, and the tile is
+                // added by FinishReads once they are.
+                HeightMapTileReader* reader = new HeightMapTileReader(this, x, z);
+                readingTiles[x + z * tilesWidth] = true;
+                readers.push_back(reader);
+                reader->Start();
+                return;
+            }
+            AddTile(arg, x, z, ReadTileHeights(x, z));
+        }
+
+        void HeightMapWorldNode::FinishReads(RenderingEventArg arg, const Vector<3, float> position){
+            for (unsigned int r = 0; r < readers.size(); ){
+                HeightMapTileReader* reader = readers[r];
+                if (!reader->IsDone()){
+                    ++r;
+                    continue;
+                }
+                reader->Wait();
+                readingTiles[reader->x + reader->z * tilesWidth] = false;
+                // The viewer may have left while the tile was read.
+                if (GetTileDistance(position, reader->x, reader->z) <= unloadDistance)
+                    AddTile(arg, reader->x, reader->z, reader->heights);
+                delete reader;
+                readers.erase(readers.begin() + r);
+            }
+        }
+
+        void HeightMapWorldNode::CancelReads(){
+            for (unsigned int r = 0; r < readers.size(); ++r){
+                readers[r]->Wait();
+                delete readers[r];
+            }
+            readers.clear();
+            readingTiles.assign(readingTiles.size(), false);
+        }
+
+        void HeightMapWorldNode::AddTile(RenderingEventArg arg, int x, int z, FloatTexture2DPtr heights){
+            int i = x + z * tilesWidth;
+            if (!heights){
+                // Don't try again every frame.
+                failedTiles[i] = true;
+                return;
+            }
+
+            HeightMapNode* tile = CreateTile(heights, x, z);
+            tile->SetWidthScale(spacing);
+            tile->SetOffset(offset + Vector<3, float>(x * tileSquares * spacing, 0.0f,
+                                                      z * tileSquares * spacing));
+            if (baseDistance >= 0)
+                tile->SetLODSwitchDistance(baseDistance, incDistance);
+            tile->SetAsyncLoad(asyncLoad);
+            tiles[i] = tile;
+            loadedTiles.push_back(i);
+            AddNode(tile);
+            tile->Handle(arg);
+        }
+
+        void HeightMapWorldNode::UnloadTile(int x, int z){
+            int i = x + z * tilesWidth;
+            HeightMapNode* tile = tiles[i];
+            if (tile == NULL) return;
+            RemoveNode(tile);
+            tiles[i] = NULL;
+            loadedTiles.erase(std::find(loadedTiles.begin(), loadedTiles.end(), i));
+            unloadedTiles.push_back(tile);
+            delete tile;
+        }
+
+        void HeightMapWorldNode::UnloadTiles(){
+            while (!loadedTiles.empty()){
+                int i = loadedTiles.back();
+                UnloadTile(i % tilesWidth, i / tilesWidth);
+            }
+        }
+
+        float HeightMapWorldNode::GetTileDistance(const Vector<3, float> position, int x, int z) const {
+            float tileSize = tileSquares * spacing;
+            float xMin = offset[0] + x * tileSize;
+            float zMin = offset[2] + z * tileSize;
+            float dx = std::max(std::max(xMin - position[0], position[0] - xMin - tileSize), 0.0f);
+            float dz = std::max(std::max(zMin - position[2], position[2] - zMin - tileSize), 0.0f);
+            return sqrt(dx * dx + dz * dz);
+        }
+
+        HeightMapNode* HeightMapWorldNode::GetTile(const int x, const int z) const {
+            if (x < 0 || x >= tilesWidth || z < 0 || z >= tilesDepth)
+                return NULL;
+            return tiles[x + z * tilesWidth];
+        }
+
+        HeightMapNode* HeightMapWorldNode::GetTile(float x, float z) const {
+            if (tilesWidth == 0) return NULL;
+            float tileSize = tileSquares * spacing;
+            x = (x - offset[0]) / tileSize;
+            z = (z - offset[2]) / tileSize;
+            // The far edge of the world belongs to the last tile.
+            int X = std::min((int)floor(x), tilesWidth - 1);
+            int Z = std::min((int)floor(z), tilesDepth - 1);
+            return GetTile(X, Z);
+        }
+
+        float HeightMapWorldNode::GetCoarseHeight(int x, int z) const {
+            x = std::max(0, std::min(x, coarseSize - 1));
+            z = std::max(0, std::min(z, coarseSize - 1));
+            return coarseHeights[x + z * coarseSize];
+        }
+
+        float HeightMapWorldNode::GetHeight(Vector<3, float> point) const {
+            return GetHeight(point[0], point[2]);
+        }
+
+        float HeightMapWorldNode::GetHeight(float x, float z) const {
+            const HeightMapNode* tile = GetTile(x, z);
+            if (tile && tile->IsReady())
+                return tile->GetHeight(x, z);
+            return GetCoarseHeight(x, z);
+        }
+
+        float HeightMapWorldNode::GetCoarseHeight(float x, float z) const {
+            if (coarseSize == 0)
+                return offset[1];
+
+            x = (x - offset[0]) / coarseSpacing;
+            z = (z - offset[2]) / coarseSpacing;
+            int X = floor(x);
+            int Z = floor(z);
+            float dX = x - X;
+            float dZ = z - Z;
+            // The tiles are built at the offset's height as well.
+            return offset[1] + 
+                GetCoarseHeight(X, Z) * (1-dX) * (1-dZ) +
+                GetCoarseHeight(X+1, Z) * dX * (1-dZ) +
+                GetCoarseHeight(X, Z+1) * (1-dX) * dZ +
+                GetCoarseHeight(X+1, Z+1) * dX * dZ;
+        }
+
+        Vector<3, float> HeightMapWorldNode::GetNormal(Vector<3, float> point) const {
+            return GetNormal(point[0], point[2]);
+        }
+
+        Vector<3, float> HeightMapWorldNode::GetNormal(float x, float z) const {
+            const HeightMapNode* tile = GetTile(x, z);
+            if (tile && tile->IsReady())
+                return tile->GetNormal(x, z);
+            return GetCoarseNormal(x, z);
+        }
+
+        Vector<3, float> HeightMapWorldNode::GetCoarseNormal(float x, float z) const {
+            if (coarseSize == 0)
+                return Vector<3, float>(0.0f, 1.0f, 0.0f);
+
+            x = (x - offset[0]) / coarseSpacing;
+            z = (z - offset[2]) / coarseSpacing;
+            int X = floor(x);
+            int Z = floor(z);
+            float dX = x - X;
+            float dZ = z - Z;
+            Vector<3, float> normal(0.0f);
+            for (int i = 0; i < 2; ++i)
+                for (int j = 0; j < 2; ++j){
+                    int cx = std::max(0, std::min(X + i, coarseSize - 1));
+                    int cz = std::max(0, std::min(Z + j, coarseSize - 1));
+                    float weight = (i ? dX : 1-dX) * (j ? dZ : 1-dZ);
+                    normal += Vector<3, float>(&coarseNormals[(cx + cz * coarseSize) * 3]) * weight;
+                }
+            return normal.GetNormalize();
+        }
+
+        bool HeightMapWorldNode::IsTileReady(int x, int z) const {
+            const HeightMapNode* tile = GetTile(x, z);
+            return tile && tile->IsReady();
+        }
+
+        void HeightMapWorldNode::RenderFillIn(RenderingEventArg arg){
+            if (coarseSize == 0) return;
+
+            fillVertices.clear();
+            fillNormals.clear();
+            float tileSize = tileSquares * spacing;
+            int side = tileSquares + 1;
+            std::vector<Vector<3, float> > edge(std::max(side, FILL_QUADS + 1));
+            std::vector<Vector<3, float> > edgeNormals(edge.size());
+            for (int x = fillXStart; x < fillXEnd; ++x)
+                for (int z = fillZStart; z < fillZEnd; ++z){
+                    if (IsTileReady(x, z)) continue;
+
+                    // A grid over the tile from the top level.
+                    float x0 = offset[0] + x * tileSize, z0 = offset[2] + z * tileSize;
+                    float step = tileSize / FILL_QUADS;
+                    for (int i = 0; i < FILL_QUADS; ++i)
+                        for (int j = 0; j < FILL_QUADS; ++j){
+                            float xs[4] = { x0 + i * step, x0 + (i+1) * step, x0 + (i+1) * step, x0 + i * step };
+                            float zs[4] = { z0 + j * step, z0 + j * step, z0 + (j+1) * step, z0 + (j+1) * step };
+                            Vector<3, float> quad[4], normals[4];
+                            for (int c = 0; c < 4; ++c){
+                                quad[c] = Vector<3, float>(xs[c], GetCoarseHeight(xs[c], zs[c]), zs[c]);
+                                normals[c] = GetCoarseNormal(xs[c], zs[c]);
+                            }
+                            AddFillQuad(quad, normals);
+                        }
+
+                    // Skirts on the tile's borders, and on the border
+                    // of a ready neighbour, cover the gaps between
+                    // the grid and the neighbours.
+                    for (int s = 0; s < 4; ++s){
+                        // Along x at z0 or the far edge, or along z.
+                        bool alongX = s < 2;
+                        bool far = s % 2 == 1;
+                        for (int k = 0; k <= FILL_QUADS; ++k){
+                            float t = k * step;
+                            float px = alongX ? x0 + t : x0 + (far ? tileSize : 0);
+                            float pz = alongX ? z0 + (far ? tileSize : 0) : z0 + t;
+                            edge[k] = Vector<3, float>(px, GetCoarseHeight(px, pz), pz);
+                            edgeNormals[k] = GetCoarseNormal(px, pz);
+                        }
+                        AddSkirt(&edge[0], &edgeNormals[0], FILL_QUADS + 1);
+
+                        int nx = alongX ? x : x + (far ? 1 : -1);
+                        int nz = alongX ? z + (far ? 1 : -1) : z;
+                        if (!IsTileReady(nx, nz)) continue;
+                        HeightMapNode* neighbour = GetTile(nx, nz);
+                        // The neighbour's edge facing this tile.
+                        int fixed = far ? 0 : side - 1;
+                        for (int k = 0; k < side; ++k){
+                            int vx = alongX ? k : fixed;
+                            int vz = alongX ? fixed : k;
+                            float* v = neighbour->GetVertex(vx, vz);
+                            edge[k] = Vector<3, float>(v[0], v[1], v[2]);
+                            edgeNormals[k] = neighbour->GetNormal(vx, vz);
+                        }
+                        AddSkirt(&edge[0], &edgeNormals[0], side);
+                    }
+                }
+            if (fillVertices.empty()) return;
+
+            // The skirts are seen from both sides.
+            GLboolean cull = glIsEnabled(GL_CULL_FACE);
+            glDisable(GL_CULL_FACE);
+            if (arg.renderer.BufferSupport()){
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            }
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glEnableClientState(GL_NORMAL_ARRAY);
+            glVertexPointer(3, GL_FLOAT, 0, &fillVertices[0]);
+            glNormalPointer(GL_FLOAT, 0, &fillNormals[0]);
+            glDrawArrays(GL_TRIANGLES, 0, fillVertices.size() / 3);
+            glDisableClientState(GL_NORMAL_ARRAY);
+            glDisableClientState(GL_VERTEX_ARRAY);
+            if (cull) glEnable(GL_CULL_FACE);
+        }
+
+        void HeightMapWorldNode::AddFillQuad(const Vector<3, float>* quad, const Vector<3, float>* normals){
+            static const int corners[6] = { 0, 1, 2, 0, 2, 3 };
+            for (int c = 0; c < 6; ++c)
+                for (int i = 0; i < 3; ++i){
+                    fillVertices.push_back(quad[corners[c]][i]);
+                    fillNormals.push_back(normals[corners[c]][i]);
+                }
+        }
+
+        void HeightMapWorldNode::AddSkirt(const Vector<3, float>* edge, const Vector<3, float>* normals, int count){
+            // Down to the lowest height of the world, so no gap is
+            // seen from above.
+            float bottom = offset[1] + file.GetMinHeight();
+            for (int k = 0; k + 1 < count; ++k){
+                Vector<3, float> quad[4] = { edge[k], edge[k+1], edge[k+1], edge[k] };
+                quad[2][1] = std::min(bottom, edge[k+1][1]);
+                quad[3][1] = std::min(bottom, edge[k][1]);
+                Vector<3, float> quadNormals[4] = { normals[k], normals[k+1], normals[k+1], normals[k] };
+                AddFillQuad(quad, quadNormals);
+            }
+        }
+
+        void HeightMapWorldNode::SetLoadDistance(const float load, const float unload){
+            loadDistance = load;
+            unloadDistance = std::max(load, unload);
+        }
+
+        void HeightMapWorldNode::SetLODSwitchDistance(const float base, const float inc){
+            baseDistance = base;
+            incDistance = inc;
+            for (unsigned int i = 0; i < loadedTiles.size(); ++i)
+                tiles[loadedTiles[i]]->SetLODSwitchDistance(base, inc);
+        }
+
+        void HeightMapWorldNode::SetOffset(const Vector<3, float> o){
+            if (!loadedTiles.empty()){
+                logger.error << "The world's offset must be set before any tiles are loaded." << logger.end;
+                return;
+            }
+            offset = o;
+        }
+
+        void HeightMapWorldNode::VisitSubNodes(ISceneNodeVisitor& visitor){
+            list<ISceneNode*>::iterator itr;
+            for (itr = subNodes.begin(); itr != subNodes.end(); ++itr){
+                (*itr)->Accept(visitor);
+            }
+        }
+
+    }
+}
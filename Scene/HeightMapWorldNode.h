@@ -0,0 +1,259 @@
+// Heightfield world node.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_WORLD_NODE_H_
+#define _HEIGHTFIELD_WORLD_NODE_H_
+
+#include <Scene/ISceneNode.h>
+#include <Scene/HeightMapLODController.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/Texture2D.h>
+#include <Utils/HeightTiles.h>
+#include <Math/Vector.h>
+#include <Core/Mutex.h>
+
+#include <string>
+#include <vector>
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Renderers;
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Scene {
+        class HeightMapNode;
+        class HeightMapTileReader;
+
+        /**
+         * A world of HeightMapNode tiles in a grid, paged in and out
+         * of level 0 of a height tile file by their distance to the
+         * viewer.
+         *
+         * Tile (x, z) is the tile in column x and row z of the file,
+         * with the file's columns along the x axis. Neighbouring
+         * tiles share their edge vertices, and the patches on both
+         * sides of a border meet without cracks when they agree on
+         * the LOD of the border. A patch's LOD and the LODs it
+         * stitches to above and to the right of it only depend on
+         * the patch's position, the viewer and the LOD distances, so
+         * the world gives all tiles the same width scale and LOD
+         * switch distances, and the rendering view drives the LOD
+         * controllers of all the tiles with the world's controller,
+         * fed with the totals of the tiles. The tile size must be a
+         * multiple of the patch size for the patches to line up.
+         *
+         * The height and normal queries find the tile by dividing by
+         * the tile size. Where the tile isn't loaded they read the
+         * file's top level, which is kept in memory, so the whole
+         * world can be queried at any time. The rendering view fills
+         * the tiles that aren't ready from the top level as well,
+         * with skirts down to the world's lowest height hiding the
+         * gaps to the ready tiles.
+         *
+         * The tiles are created by CreateTile, which can be
+         * overridden to give the tiles a shader and textures, and
+         * are loaded asynchronously, a few per frame, nearest first.
+         * An asynchronous tile's heights are read and decoded on a
+         * reader thread, and it's node is built on the node's load
+         * worker, so only the upload is left to the render thread.
+         */
+        class HeightMapWorldNode : public ISceneNode {
+            OE_SCENE_NODE(HeightMapWorldNode, ISceneNode)
+
+        public:
+            static const int DEFAULT_LOADS_PER_FRAME = 1;
+            // The squares across the fill-in of a tile that isn't
+            // ready.
+            static const int FILL_QUADS = 8;
+
+        protected:
+            Utils::HeightTileFile file;
+            // Guards the file, which is read by the readers.
+            Core::Mutex fileMutex;
+            int tilesWidth, tilesDepth, tileSquares;
+            float spacing;
+            Vector<3, float> offset;
+
+            // The tile of each grid cell, or NULL, x varying fastest.
+            std::vector<HeightMapNode*> tiles;
+            std::vector<bool> failedTiles;
+            // The tiles whose heights are being read.
+            std::vector<bool> readingTiles;
+            std::vector<HeightMapTileReader*> readers;
+            std::vector<int> loadedTiles;
+            std::vector<HeightMapNode*> unloadedTiles;
+
+            // The file's top level for the tiles that aren't loaded.
+            std::vector<float> coarseHeights;
+            std::vector<float> coarseNormals;
+            int coarseSize;
+            float coarseSpacing;
+
+            float loadDistance, unloadDistance;
+            int loadsPerFrame;
+            bool asyncLoad;
+            float baseDistance, incDistance;
+            HeightMapLODController controller;
+
+            // The tiles considered by the last Update, which are
+            // filled in when they aren't ready, and the fill-in's
+            // triangles.
+            int fillXStart, fillZStart, fillXEnd, fillZEnd;
+            std::vector<float> fillVertices;
+            std::vector<float> fillNormals;
+
+            friend class HeightMapTileReader;
+
+        public:
+            HeightMapWorldNode();
+            virtual ~HeightMapWorldNode();
+
+            /**
+             * Opens a height tile file baked by HeightMapBake,
+             * unloading the tiles of the previous file. The spacing
+             * of the vertices is the file's.
+             */
+            bool Open(const std::string& tileFile);
+
+            /**
+             * Loads the tiles within the load distance of the
+             * position, at most the loads per frame, and unloads the
+             * tiles beyond the unload distance. Called by the
+             * rendering view every frame.
+             */
+            void Update(RenderingEventArg arg, const Vector<3, float> position);
+
+            /**
+             * The height and normal of the world at the point in
+             * world space, from the tile when it is loaded and from
+             * the file's top level otherwise.
+             */
+            float GetHeight(Vector<3, float> point) const;
+            float GetHeight(float x, float z) const;
+            Vector<3, float> GetNormal(Vector<3, float> point) const;
+            Vector<3, float> GetNormal(float x, float z) const;
+            /**
+             * The height and normal interpolated from the file's top
+             * level, whether the tile is loaded or not.
+             */
+            float GetCoarseHeight(float x, float z) const;
+            Vector<3, float> GetCoarseNormal(float x, float z) const;
+
+            /**
+             * Draws the tiles near the viewer that aren't ready from
+             * the file's top level, with skirts along their borders
+             * and the borders of their ready neighbours. Called by the
+             * rendering view after the tiles are drawn.
+             */
+            void RenderFillIn(RenderingEventArg arg);
+
+            /**
+             * The tile holding the point, or NULL if it isn't loaded
+             * or the point is outside the world.
+             */
+            HeightMapNode* GetTile(float x, float z) const;
+            HeightMapNode* GetTile(const int x, const int z) const;
+            int GetTilesWidth() const { return tilesWidth; }
+            int GetTilesDepth() const { return tilesDepth; }
+            int GetNumberOfLoadedTiles() const { return loadedTiles.size(); }
+            HeightMapNode* GetLoadedTile(const int i) const { return tiles[loadedTiles[i]]; }
+            /**
+             * The tiles unloaded, by Update or Open, since the last
+             * ClearUnloadedTiles. They have been deleted, so the
+             * pointers are only good as keys, fx to drop state kept
+             * per tile.
+             */
+            const std::vector<HeightMapNode*>& GetUnloadedTiles() const { return unloadedTiles; }
+            void ClearUnloadedTiles() { unloadedTiles.clear(); }
+
+            /**
+             * Tiles closer than the load distance to the viewer are
+             * loaded, and tiles further away than the unload
+             * distance are unloaded. The load distance should be
+             * beyond the far plane, since a tile is only drawn from
+             * the coarse top level until it is loaded.
+             */
+            void SetLoadDistance(const float load, const float unload);
+            float GetLoadDistance() const { return loadDistance; }
+            float GetUnloadDistance() const { return unloadDistance; }
+            void SetLoadsPerFrame(const int loads) { loadsPerFrame = loads < 1 ? 1 : loads; }
+            int GetLoadsPerFrame() const { return loadsPerFrame; }
+            /**
+             * Read the tiles' heights on reader threads and load
+             * the tiles with HeightMapNode::SetAsyncLoad. Enabled by
+             * default.
+             */
+            void SetAsyncLoad(const bool async) { asyncLoad = async; }
+            bool IsAsyncLoad() const { return asyncLoad; }
+
+            /**
+             * Sets the LOD switch distances of all tiles.
+             *
+             * @see HeightMapNode::SetLODSwitchDistance
+             */
+            void SetLODSwitchDistance(const float base, const float inc);
+            /**
+             * The controller whose scale all tiles use. The tiles'
+             * own controllers must be left disabled.
+             */
+            HeightMapLODController& GetLODController() { return controller; }
+
+            /**
+             * The position of the world's first vertex. Must be set
+             * before any tiles are loaded, since the tiles' vertices
+             * are built at their offsets.
+             */
+            void SetOffset(const Vector<3, float> o);
+            Vector<3, float> GetOffset() const { return offset; }
+            float GetSpacing() const { return spacing; }
+
+            void VisitSubNodes(ISceneNodeVisitor& visitor);
+
+        protected:
+            /**
+             * Creates the node of a tile from it's heights.
+             */
+            virtual HeightMapNode* CreateTile(FloatTexture2DPtr heights, int x, int z);
+
+            void LoadTile(RenderingEventArg arg, int x, int z);
+            /**
+             * Adds the tiles whose heights have been read.
+             */
+            void FinishReads(RenderingEventArg arg, const Vector<3, float> position);
+            /**
+             * Waits for the readers and drops what they read.
+             */
+            void CancelReads();
+            /**
+             * Creates and starts loading the tile from it's heights,
+             * or marks it failed if they couldn't be read.
+             */
+            void AddTile(RenderingEventArg arg, int x, int z, FloatTexture2DPtr heights);
+            FloatTexture2DPtr ReadTileHeights(int x, int z);
+            void UnloadTile(int x, int z);
+            void UnloadTiles();
+            /**
+             * The distance in the xz plane from the position to the
+             * tile.
+             */
+            float GetTileDistance(const Vector<3, float> position, int x, int z) const;
+            float GetCoarseHeight(int x, int z) const;
+            bool IsTileReady(int x, int z) const;
+            void AddFillQuad(const Vector<3, float>* quad, const Vector<3, float>* normals);
+            /**
+             * Adds a strip hanging from the edge down to the lowest
+             * height of the world.
+             */
+            void AddSkirt(const Vector<3, float>* edge, const Vector<3, float>* normals, int count);
+        };
+
+    }
+}
+
+#endif
@@ -21,20 +21,26 @@ namespace OpenEngine {
     namespace Scene {
 
         WaterNode::WaterNode(Vector<3, float> c, float d)
-            : center(c), diameter(d), planetDiameter(1000),
+            : center(c), diameter(d), planetDiameter(1000), reflectionFbo(NULL), ownsReflectionFbo(false),
               waterShader(IShaderResourcePtr()), elapsedTime(0) {
             SetupArrays();
         }
 
         WaterNode::~WaterNode(){
-            
+            if (ownsReflectionFbo)
+                delete reflectionFbo;
         }
 
         void WaterNode::Handle(RenderingEventArg arg){
             if (waterShader != NULL){
-                Vector<2, int> dim(400,300);
-                reflectionFbo = new FrameBuffer(dim, 1, false);
-                arg.renderer.BindFrameBuffer(reflectionFbo);
+                // The initial reflection target. The renderer may
+                // replace it with one fitted to the viewport.
+                if (reflectionFbo == NULL){
+                    Vector<2, int> dim(400,300);
+                    reflectionFbo = new FrameBuffer(dim, 1, false);
+                    ownsReflectionFbo = true;
+                    arg.renderer.BindFrameBuffer(reflectionFbo);
+                }
                 
                 waterShader->SetTexture("reflection", reflectionFbo->GetTexAttachment(0));
 
@@ -50,6 +56,14 @@ namespace OpenEngine {
                 arg.renderer.LoadTexture(surface);
         }
 
+        void WaterNode::SetReflectionFbo(FrameBuffer* fbo){
+            if (fbo == reflectionFbo) return;
+            if (ownsReflectionFbo)
+                delete reflectionFbo;
+            reflectionFbo = fbo;
+            ownsReflectionFbo = false;
+        }
+
         void WaterNode::Handle(Core::ProcessEventArg arg){
             elapsedTime += arg.approx;
         }
@@ -60,12 +60,15 @@ namespace OpenEngine {
             float planetDiameter;
 
             FrameBuffer* reflectionFbo;
+            // True if the reflection frame buffer was created by the
+            // node, and not set by the renderer.
+            bool ownsReflectionFbo;
 
             IShaderResourcePtr waterShader;
             unsigned int elapsedTime;
 
         public:
-            WaterNode() {}
+            WaterNode() : reflectionFbo(NULL), ownsReflectionFbo(false) {}
             WaterNode(Vector<3, float> c, float d);
             ~WaterNode();
 
@@ -86,6 +89,13 @@ namespace OpenEngine {
             float* GetTextureCoordArray() const { return texCoords; }
 
             FrameBuffer* GetReflectionFbo() const { return reflectionFbo; }
+            /**
+             * Sets the frame buffer the reflection is rendered
+             * into. Used by the renderer to resize the reflection.
+             * The caller keeps ownership of the frame buffer, and the
+             * one the node created is deleted.
+             */
+            void SetReflectionFbo(FrameBuffer* fbo);
             unsigned int GetElapsedTime() { return elapsedTime; }
 
             void SetNormalDudvMap(UCharTexture2DPtr normal, UCharTexture2DPtr dudv);
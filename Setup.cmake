@@ -1,6 +1,7 @@
 OE_ADD_SCENE_NODES(Extensions_HeightMap
   Scene/GrassNode
   Scene/HeightMapNode
+  Scene/HeightMapWorldNode
   Scene/SunNode
   Scene/SkySphereNode
   Scene/WaterNode
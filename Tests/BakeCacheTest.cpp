@@ -0,0 +1,94 @@
+// Heightmap bake file test.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Loads heightmaps with a bake file and checks that the same heights
+// are read back from it with the vertices they were computed with,
+// and that changed heights and damaged files are computed again.
+
+#include "Check.h"
+
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPatch.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <math.h>
+#include <vector>
+
+using namespace OpenEngine::Scene;
+
+static const int SIDE = 2 * HeightMapPatch::PATCH_EDGE_SQUARES + 1;
+static const char* FILE_NAME = "BakeCacheTest.bake";
+
+static FloatTexture2DPtr MakeHeights(float amplitude){
+    FloatTexture2DPtr tex = FloatTexture2DPtr(new Texture2D<float>(SIDE, SIDE, LUMINANCE32F));
+    float* heights = tex->GetData();
+    for (int x = 0; x < SIDE; ++x)
+        for (int z = 0; z < SIDE; ++z)
+            heights[z + x * SIDE] = amplitude * sin(x * 0.2f) * cos(z * 0.15f);
+    return tex;
+}
+
+static std::vector<float> Vertices(HeightMapNode& node){
+    std::vector<float> vertices;
+    for (int x = 0; x < node.GetVerticeWidth(); ++x)
+        for (int z = 0; z < node.GetVerticeDepth(); ++z){
+            float* v = node.GetVertex(x, z);
+            vertices.insert(vertices.end(), v, v + 4);
+        }
+    return vertices;
+}
+
+/**
+ * Loads the heights with the bake file and returns whether they
+ * were read from it.
+ */
+static bool Load(float amplitude, std::vector<float>& vertices){
+    HeightMapNode node(MakeHeights(amplitude));
+    node.SetBakeFile(FILE_NAME);
+    node.Load();
+    vertices = Vertices(node);
+    return node.IsBakeLoaded();
+}
+
+static void Damage(bool truncate){
+    std::ifstream in(FILE_NAME, std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    if (truncate)
+        data.resize(data.size() / 2);
+    else
+        data[0] ^= 0xff;
+    std::ofstream out(FILE_NAME, std::ios::binary | std::ios::trunc);
+    out.write(&data[0], data.size());
+}
+
+int main(){
+    remove(FILE_NAME);
+
+    std::vector<float> computed, baked;
+    Check(!Load(10, computed), "the first load computes the heightmap");
+    Check(Load(10, baked), "the same heights are read from the bake file");
+    Check(baked == computed, "the baked vertices are the computed ones");
+
+    std::vector<float> changed;
+    Check(!Load(12, changed), "changed heights are computed again");
+    Check(changed != computed, "the changed heights have other vertices");
+    Check(Load(12, baked) && baked == changed, "the changed heights replace the bake file");
+
+    Damage(true);
+    Check(!Load(12, baked) && baked == changed, "a truncated bake file is computed again");
+    Damage(false);
+    Check(!Load(12, baked) && baked == changed, "a corrupt bake file is computed again");
+    Check(Load(12, baked) && baked == changed, "the damaged bake file is written again");
+
+    remove(FILE_NAME);
+    return failures;
+}
@@ -0,0 +1,28 @@
+// Checks for the util and scene tests.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTMAP_TESTS_CHECK_H_
+#define _HEIGHTMAP_TESTS_CHECK_H_
+
+#include <iostream>
+
+// The tests are programs returning the number of failed checks, so
+// they can be run by ctest.
+static int failures = 0;
+
+/**
+ * Reports the check if it failed.
+ */
+static inline void Check(bool ok, const char* what){
+    if (ok) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+}
+
+#endif
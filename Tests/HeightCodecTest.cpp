@@ -0,0 +1,99 @@
+// Height codec round trip test.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Encodes grids of heights and checks that they decode within the
+// error bound, including heights at the limit of quantization.
+
+#include "Check.h"
+
+#include <Utils/HeightCodec.h>
+
+#include <cstdlib>
+#include <float.h>
+#include <math.h>
+#include <vector>
+
+using namespace OpenEngine::Utils;
+
+static const int COLUMNS = 77, ROWS = 45;
+
+/**
+ * Encodes and decodes the heights, and returns the largest error
+ * beyond the bound, the max error plus the rounding of the decoded
+ * float.
+ */
+static float RoundTrip(const std::vector<float>& heights, float maxError, bool& decoded){
+    std::vector<unsigned char> data;
+    EncodeHeights(&heights[0], COLUMNS, ROWS, 1, COLUMNS, maxError, data);
+    int columns = 0, rows = 0;
+    decoded = GetEncodedHeightsSize(&data[0], data.size(), columns, rows) &&
+        columns == COLUMNS && rows == ROWS;
+    std::vector<float> result(heights.size());
+    decoded = decoded && DecodeHeights(&data[0], data.size(), &result[0], 1, COLUMNS);
+
+    float worst = 0;
+    for (unsigned int i = 0; i < heights.size(); ++i){
+        float bound = maxError + fabs(heights[i]) * FLT_EPSILON * 0.5f;
+        float excess = fabs(result[i] - heights[i]) - bound;
+        if (excess > worst) worst = excess;
+    }
+    return worst;
+}
+
+/**
+ * Rolling terrain around the height, with steps of up to a few
+ * units.
+ */
+static std::vector<float> MakeHeights(float base, float amplitude){
+    std::vector<float> heights(COLUMNS * ROWS);
+    srand(7);
+    for (int r = 0; r < ROWS; ++r)
+        for (int c = 0; c < COLUMNS; ++c)
+            heights[c + r * COLUMNS] = base + amplitude * (sin(c * 0.3f) * cos(r * 0.2f) + 
+                                                           (rand() % 1000) * 0.001f);
+    return heights;
+}
+
+int main(){
+    bool decoded;
+
+    std::vector<float> heights = MakeHeights(0, 100);
+    std::vector<unsigned char> lossless;
+    EncodeHeights(&heights[0], COLUMNS, ROWS, 1, COLUMNS, 0, lossless);
+    std::vector<float> result(COLUMNS * ROWS);
+    Check(DecodeHeights(&lossless[0], lossless.size(), &result[0], 1, COLUMNS), "lossless heights decode");
+    Check(result == heights, "lossless heights are exact");
+
+    Check(RoundTrip(heights, 0.01f, decoded) <= 0 && decoded, "quantized heights within the error");
+    Check(RoundTrip(heights, 0.5f, decoded) <= 0 && decoded, "coarse heights within the error");
+
+    // Just inside the quantization limit of 2^23 steps, where a
+    // float's spacing is close to the step.
+    float maxError = 0.01f;
+    float limit = (1 << 23) * 2 * maxError;
+    Check(RoundTrip(MakeHeights(limit - 10, 2), maxError, decoded) <= 0 && decoded, 
+          "heights at the quantization limit within the error");
+    Check(RoundTrip(MakeHeights(-limit + 10, 2), maxError, decoded) <= 0 && decoded, 
+          "negative heights at the quantization limit within the error");
+    // Beyond it the heights are stored lossless.
+    Check(RoundTrip(MakeHeights(limit * 8, 2), maxError, decoded) <= 0 && decoded, 
+          "heights beyond the quantization limit within the error");
+
+    // Flat rows are a zero byte per block.
+    std::vector<float> flat(COLUMNS * ROWS, 12.5f);
+    Check(RoundTrip(flat, 0.01f, decoded) <= 0 && decoded, "flat heights within the error");
+    std::vector<unsigned char> data;
+    unsigned int bytes = EncodeHeights(&flat[0], COLUMNS, ROWS, 1, COLUMNS, 0.01f, data);
+    Check(bytes < HEIGHT_CODEC_HEADER_SIZE + ROWS * 8, "flat heights are a byte per block");
+
+    // Truncated data is rejected.
+    Check(!DecodeHeights(&data[0], data.size() / 2, &result[0], 1, COLUMNS), "truncated heights are rejected");
+
+    return failures;
+}
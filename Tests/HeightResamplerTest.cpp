@@ -0,0 +1,117 @@
+// Height resampler test.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Resamples heights with every filter and checks that a step of one
+// returns the source, that planes are reproduced, that resampling to
+// a size keeps the corners, and that the threads don't change the
+// result.
+
+#include "Check.h"
+
+#include <Utils/HeightResampler.h>
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+using namespace OpenEngine::Utils;
+
+static const int COLUMNS = 67;
+static const int ROWS = 45;
+static const HeightFilter FILTERS[3] = { HEIGHT_FILTER_BILINEAR, HEIGHT_FILTER_BICUBIC, HEIGHT_FILTER_LANCZOS };
+
+static std::vector<float> MakeHills(){
+    std::vector<float> heights(COLUMNS * ROWS);
+    for (int r = 0; r < ROWS; ++r)
+        for (int c = 0; c < COLUMNS; ++c)
+            heights[c + r * COLUMNS] = 12 * sin(c * 0.21f) * cos(r * 0.37f) + 0.5f * c;
+    return heights;
+}
+
+static float MaxDifference(const std::vector<float>& a, const std::vector<float>& b){
+    if (a.size() != b.size()) return 1e30f;
+    float max = 0;
+    for (unsigned int i = 0; i < a.size(); ++i)
+        max = std::max(max, fabsf(a[i] - b[i]));
+    return max;
+}
+
+static void TestIdentity(){
+    std::vector<float> source = MakeHills();
+    for (int f = 0; f < 3; ++f){
+        std::vector<float> dest(COLUMNS * ROWS);
+        ResampleHeights(&source[0], COLUMNS, ROWS, 1, &dest[0], COLUMNS, ROWS, 1, 1, FILTERS[f]);
+        Check(MaxDifference(source, dest) < 1e-4f, "a step of one returns the source heights");
+    }
+}
+
+static void TestPlane(){
+    std::vector<float> source(COLUMNS * ROWS);
+    for (int r = 0; r < ROWS; ++r)
+        for (int c = 0; c < COLUMNS; ++c)
+            source[c + r * COLUMNS] = 3 + 0.25f * c - 0.5f * r;
+
+    // Upsampling by 2.5, away from the extended edges where the
+    // bicubic filter sees the edge repeated.
+    int columns = 100, rows = 60;
+    float step = 0.4f;
+    for (int f = 0; f < 2; ++f){
+        std::vector<float> dest(columns * rows);
+        ResampleHeights(&source[0], COLUMNS, ROWS, 1, &dest[0], columns, rows, step, step, FILTERS[f]);
+        float max = 0;
+        for (int r = 3; r < rows; ++r)
+            for (int c = 3; c < columns; ++c)
+                max = std::max(max, fabsf(dest[c + r * columns] - (3 + 0.25f * c * step - 0.5f * r * step)));
+        Check(max < 1e-3f, "bilinear and bicubic reproduce a plane");
+    }
+}
+
+static void TestCorners(){
+    std::vector<float> hills = MakeHills();
+    FloatTexture2DPtr tex = FloatTexture2DPtr(new Texture2D<float>(COLUMNS, ROWS, LUMINANCE32F));
+    tex->Load();
+    std::copy(hills.begin(), hills.end(), tex->GetData());
+
+    for (int f = 0; f < 3; ++f){
+        // Upsampling interpolates, so the corners are kept exactly.
+        FloatTexture2DPtr up = ResampleHeights(tex, 129, 97, FILTERS[f]);
+        const float* h = up->GetData();
+        Check(up->GetWidth() == 129 && up->GetHeight() == 97, "the resampled heights have the requested size");
+        Check(fabsf(h[0] - hills[0]) < 1e-4f &&
+              fabsf(h[128] - hills[COLUMNS - 1]) < 1e-4f &&
+              fabsf(h[96 * 129] - hills[(ROWS - 1) * COLUMNS]) < 1e-4f &&
+              fabsf(h[96 * 129 + 128] - hills[ROWS * COLUMNS - 1]) < 1e-4f,
+              "resampling to a size keeps the corners");
+    }
+}
+
+static void TestThreads(){
+    std::vector<float> source = MakeHills();
+    int columns = 33, rows = 23;
+    for (int f = 0; f < 3; ++f){
+        std::vector<float> one(columns * rows), four(columns * rows);
+        ResampleHeights(&source[0], COLUMNS, ROWS, 1, &one[0], columns, rows, 2, 2, FILTERS[f], 1);
+        ResampleHeights(&source[0], COLUMNS, ROWS, 1, &four[0], columns, rows, 2, 2, FILTERS[f], 4);
+        Check(one == four, "the threads resample the same heights as one");
+    }
+}
+
+int main(){
+    TestIdentity();
+    TestPlane();
+    TestCorners();
+    TestThreads();
+
+    Check(CalcPatchAlignedSize(1025, 32) == 1025, "an aligned size is kept");
+    Check(CalcPatchAlignedSize(1000, 32) == 993, "a size is rounded down to the nearest patch");
+    Check(CalcPatchAlignedSize(1010, 32) == 1025, "a size is rounded up to the nearest patch");
+    Check(CalcPatchAlignedSize(2, 32) == 33, "a size is at least one patch");
+
+    return failures;
+}
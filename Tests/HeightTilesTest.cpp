@@ -0,0 +1,101 @@
+// Height tile file test.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Bakes a heightmap into a height tile file, lossless and lossy, and
+// reads every tile of level 0 back, checking the heights against the
+// source with the edges repeated, the bounds in the index and the
+// normals.
+
+#include "Check.h"
+
+#include <Utils/HeightTiles.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <math.h>
+#include <vector>
+
+using namespace OpenEngine::Utils;
+
+static const int COLUMNS = 300;
+static const int ROWS = 200;
+static const int TILE_SQUARES = 64;
+static const char* FILE_NAME = "HeightTilesTest.tiles";
+
+static float Height(int c, int r){
+    c = std::min(std::max(c, 0), COLUMNS - 1);
+    r = std::min(std::max(r, 0), ROWS - 1);
+    return 30 * sin(c * 0.043f) * cos(r * 0.071f) + 0.1f * r;
+}
+
+static bool Bake(float maxError){
+    HeightTileBaker baker(COLUMNS, ROWS, TILE_SQUARES, 1, maxError, 2);
+    if (!baker.Open(FILE_NAME)) return false;
+    std::vector<float> row(COLUMNS);
+    for (int r = 0; r < ROWS; ++r){
+        for (int c = 0; c < COLUMNS; ++c)
+            row[c] = Height(c, r);
+        if (!baker.AddRow(&row[0])) return false;
+    }
+    return baker.Close();
+}
+
+static void TestRoundTrip(float maxError){
+    Check(Bake(maxError), "the heights are baked");
+    HeightTileFile file;
+    Check(file.Open(FILE_NAME), "the baked file is opened");
+    if (!file.IsOpen()) return;
+
+    Check(file.GetColumns() == COLUMNS && file.GetRows() == ROWS, "the file has the size of the heights");
+    Check(file.GetTileSquares() == TILE_SQUARES, "the file has the tile size");
+    int across = file.GetTilesAcross(0), down = file.GetTilesDown(0);
+    Check(across * TILE_SQUARES >= COLUMNS - 1 && (across - 1) * TILE_SQUARES < COLUMNS - 1 &&
+          down * TILE_SQUARES >= ROWS - 1 && (down - 1) * TILE_SQUARES < ROWS - 1,
+          "level 0 has the tiles covering the heights");
+    int top = file.GetNumberOfLevels() - 1;
+    Check(top > 0 && file.GetTilesAcross(top) == 1 && file.GetTilesDown(top) == 1,
+          "the top level is a single tile");
+
+    int side = TILE_SQUARES + 1;
+    std::vector<float> heights(side * side), normals(3 * side * side);
+    float maxDifference = 0;
+    bool bounded = true, normalized = true, allRead = true;
+    for (int tr = 0; tr < down; ++tr)
+        for (int tc = 0; tc < across; ++tc){
+            if (!file.ReadTile(0, tc, tr, &heights[0], &normals[0])){
+                allRead = false;
+                continue;
+            }
+            const HeightTileInfo& info = file.GetTileInfo(0, tc, tr);
+            for (int r = 0; r < side; ++r)
+                for (int c = 0; c < side; ++c){
+                    float h = heights[c + r * side];
+                    maxDifference = std::max(maxDifference, fabsf(h - Height(tc * TILE_SQUARES + c, tr * TILE_SQUARES + r)));
+                    bounded = bounded && info.minHeight <= h && h <= info.maxHeight;
+                    const float* n = &normals[3 * (c + r * side)];
+                    normalized = normalized && fabsf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2] - 1) < 0.05f && n[1] > 0;
+                }
+        }
+    Check(allRead, "every tile of level 0 is read");
+    if (maxError == 0)
+        Check(maxDifference == 0, "lossless tiles hold the heights exactly");
+    else
+        Check(maxDifference <= maxError * 1.0001f, "lossy tiles keep within the error");
+    Check(bounded, "the index bounds the heights of the tiles");
+    Check(normalized, "the normals are unit length and point up");
+
+    Check(!file.ReadTile(0, across, 0, &heights[0]), "a tile past the level isn't read");
+}
+
+int main(){
+    TestRoundTrip(0);
+    TestRoundTrip(0.05f);
+    remove(FILE_NAME);
+    return failures;
+}
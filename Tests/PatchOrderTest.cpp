@@ -0,0 +1,116 @@
+// Patch render order test.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Flies over a heightmap and checks that the visible patches are
+// drawn once each and front to back, both when the order is kept
+// from the last frame and when the view jumps, and that drawing them
+// sorted shades fewer fragments than drawing them row by row.
+
+#include "Check.h"
+
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPatch.h>
+#include <Scene/HeightMapLODContext.h>
+#include <Scene/HeightMapView.h>
+
+#include <math.h>
+#include <vector>
+
+using namespace OpenEngine::Scene;
+
+static const int SIDE = 8 * HeightMapPatch::PATCH_EDGE_SQUARES + 1;
+
+/**
+ * Gives the test the distances the patches are sorted by.
+ */
+class TestNode : public HeightMapNode {
+public:
+    TestNode(FloatTexture2DPtr tex) : HeightMapNode(tex) {}
+    float GetPatchDistance(const unsigned int patch, const Vector<3, float> point) const {
+        return patchNodes[patch].GetDistance(point);
+    }
+    int GetNumberOfPatches() const { return numberOfPatches; }
+};
+
+static FloatTexture2DPtr MakeHeights(){
+    FloatTexture2DPtr tex = FloatTexture2DPtr(new Texture2D<float>(SIDE, SIDE, LUMINANCE32F));
+    float* heights = tex->GetData();
+    for (int x = 0; x < SIDE; ++x)
+        for (int z = 0; z < SIDE; ++z)
+            heights[z + x * SIDE] = 20 * sin(x * 0.05f) * cos(z * 0.03f) + 5 * sin(x * 0.31f + z * 0.17f);
+    return tex;
+}
+
+/**
+ * Checks the front packet's render order against the distances of
+ * the patches, allowing for the quantization of the sort keys.
+ */
+static void CheckOrder(const TestNode& node, const HeightMapLODContext& context, const char* what){
+    const HeightMapLODPacket& packet = context.GetFrontPacket();
+    Vector<3, float> viewPos = packet.view.GetPosition();
+    float step = HeightMapPatch::PATCH_EDGE_SQUARES * node.GetWidthScale() / HeightMapNode::SORT_KEY_STEPS;
+
+    std::vector<int> drawn(node.GetNumberOfPatches(), 0);
+    bool sorted = true;
+    for (unsigned int i = 0; i < packet.renderOrder.size(); ++i){
+        unsigned int p = packet.renderOrder[i];
+        ++drawn[p];
+        if (i > 0){
+            float previous = node.GetPatchDistance(packet.renderOrder[i-1], viewPos);
+            sorted = sorted && previous <= node.GetPatchDistance(p, viewPos) + step;
+        }
+    }
+    bool once = true;
+    for (int p = 0; p < node.GetNumberOfPatches(); ++p)
+        once = once && drawn[p] == (packet.patches[p].visible ? 1 : 0);
+
+    if (!once || !sorted)
+        std::cerr << what << ": ";
+    Check(once, "every visible patch is drawn exactly once");
+    Check(sorted, "the patches are drawn front to back");
+}
+
+static HeightMapView MakeView(float angle, float radius, float height){
+    HeightMapView view;
+    Vector<3, float> center(SIDE / 2, 0, SIDE / 2);
+    Vector<3, float> position = center + Vector<3, float>(radius * cos(angle), height, radius * sin(angle));
+    Vector<3, float> forward(-sin(angle), -0.15f, cos(angle));
+    forward.Normalize();
+    view.Set(position, forward, Vector<3, float>(0, 1, 0), M_PI / 3, 4.0f / 3.0f, 1, 3000);
+    return view;
+}
+
+int main(){
+    TestNode node(MakeHeights());
+    node.Load();
+    HeightMapLODContext context;
+
+    // Small steps keep the last frame's order.
+    float sortedComplexity = 0, gridComplexity = 0;
+    int frames = 0;
+    for (float angle = 0; angle < 2 * M_PI; angle += 0.05f){
+        node.CalcLOD(context, MakeView(angle, SIDE / 4, 40));
+        CheckOrder(node, context, "circling");
+        sortedComplexity += node.CalcDepthComplexity(context);
+        gridComplexity += node.CalcDepthComplexity(context, true);
+        ++frames;
+    }
+
+    // Jumps reorder most of the patches.
+    for (int i = 0; i < 20; ++i){
+        node.CalcLOD(context, MakeView(i * 2.4f, (i % 3) * SIDE / 6, 30 + i * 5));
+        CheckOrder(node, context, "jumping");
+    }
+
+    std::cout << "Depth complexity, row by row " << gridComplexity / frames
+              << ", sorted " << sortedComplexity / frames << std::endl;
+    Check(sortedComplexity < gridComplexity, "the sorted patches shade fewer fragments");
+
+    return failures;
+}
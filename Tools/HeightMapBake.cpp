@@ -0,0 +1,158 @@
+// Heightmap tile pyramid baker.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Streams a headerless heightmap of any size from disk into a height
+// tile file, see Utils/HeightTiles.h, a few rows at a time.
+
+#include <Utils/HeightTiles.h>
+#include <Utils/HeightImporter.h>
+#include <Utils/Timer.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace OpenEngine::Utils;
+
+// The rows read from the file at a time.
+static const int READ_ROWS = 16;
+
+static void PrintUsage(){
+    std::cout << "Usage: HeightMapBake [options] input columns rows output" << std::endl
+              << "  -be          16 bit samples are big endian" << std::endl
+              << "  -signed      16 bit samples are signed" << std::endl
+              << "  -float       32 bit float samples in the machine's byte order" << std::endl
+              << "  -scale s     multiply the samples by s" << std::endl
+              << "  -spacing s   distance between the samples, for the normals" << std::endl
+              << "  -tile n      squares across a tile, even, defaults to " << DEFAULT_TILE_SQUARES << std::endl
+              << "  -error e     maximum height error, defaults to lossless" << std::endl
+              << "  -threads n   threads encoding tiles, defaults to all cores" << std::endl;
+}
+
+static int CountCores(){
+#ifdef _SC_NPROCESSORS_ONLN
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * The peak resident set size in megabytes, or a negative number
+ * when unknown.
+ */
+static double PeakMemory(){
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#else
+    return -1;
+#endif
+}
+
+int main(int argc, char** argv){
+    bool bigEndian = false, isSigned = false, isFloat = false;
+    float scale = 1, spacing = 1, maxError = 0;
+    int tileSquares = DEFAULT_TILE_SQUARES;
+    int threads = CountCores();
+
+    std::vector<char*> args;
+    for (int i = 1; i < argc; ++i){
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "-be") == 0) bigEndian = true;
+        else if (strcmp(argv[i], "-signed") == 0) isSigned = true;
+        else if (strcmp(argv[i], "-float") == 0) isFloat = true;
+        else if (strcmp(argv[i], "-scale") == 0 && hasValue) scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "-spacing") == 0 && hasValue) spacing = atof(argv[++i]);
+        else if (strcmp(argv[i], "-tile") == 0 && hasValue) tileSquares = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-error") == 0 && hasValue) maxError = atof(argv[++i]);
+        else if (strcmp(argv[i], "-threads") == 0 && hasValue) threads = atoi(argv[++i]);
+        else if (argv[i][0] == '-'){
+            PrintUsage();
+            return 1;
+        }else args.push_back(argv[i]);
+    }
+    if (args.size() != 4){
+        PrintUsage();
+        return 1;
+    }
+    const char* input = args[0];
+    int columns = atoi(args[1]);
+    int rows = atoi(args[2]);
+    const char* output = args[3];
+
+    int sampleSize = isFloat ? 4 : 2;
+    std::streamoff rowSize = (std::streamoff)columns * sampleSize;
+    std::ifstream in(input, std::ios::in | std::ios::binary);
+    if (!in){
+        std::cerr << "Can't read " << input << std::endl;
+        return 1;
+    }
+    in.seekg(0, std::ios::end);
+    if (columns <= 0 || rows <= 0 || in.tellg() < rowSize * rows){
+        std::cerr << input << " is too short for " << columns << " by " << rows << " samples." << std::endl;
+        return 1;
+    }
+    in.seekg(0, std::ios::beg);
+
+    HeightTileBaker baker(columns, rows, tileSquares, spacing, maxError, threads);
+    if (!baker.Open(output))
+        return 1;
+
+    Timer timer;
+    timer.Start();
+    std::vector<unsigned char> buffer(rowSize * READ_ROWS);
+    std::vector<float> heights(columns);
+    for (int r = 0; r < rows; r += READ_ROWS){
+        int count = std::min(READ_ROWS, rows - r);
+        if (!in.read((char*)&buffer[0], rowSize * count)){
+            std::cerr << "Can't read row " << r << " of " << input << std::endl;
+            return 1;
+        }
+        for (int i = 0; i < count; ++i){
+            const unsigned char* samples = &buffer[i * rowSize];
+            if (isFloat){
+                memcpy(&heights[0], samples, rowSize);
+                for (int c = 0; c < columns; ++c)
+                    heights[c] *= scale;
+            }else
+                ConvertRaw16Heights(samples, columns, bigEndian, isSigned, scale, &heights[0]);
+            if (!baker.AddRow(&heights[0]))
+                return 1;
+        }
+    }
+    if (!baker.Close())
+        return 1;
+
+    double seconds = timer.GetElapsedTime().AsInt() / 1000000.0;
+    double megabytes = (double)rowSize * rows / (1024.0 * 1024.0);
+    std::cout << "Baked " << columns << " by " << rows << " samples into "
+              << baker.GetNumberOfTiles() << " tiles on " << baker.GetNumberOfLevels() << " levels, "
+              << baker.GetBytesWritten() / (1024 * 1024) << " MB, with " << threads << " threads." << std::endl;
+    std::cout << "Read " << megabytes << " MB in " << seconds << " s, "
+              << (seconds > 0 ? megabytes / seconds : 0) << " MB/s." << std::endl;
+    double peak = PeakMemory();
+    if (peak >= 0)
+        std::cout << "Peak resident memory " << peak << " MB." << std::endl;
+    return 0;
+}
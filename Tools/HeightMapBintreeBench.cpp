@@ -0,0 +1,172 @@
+// Heightmap bintree benchmark.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Flies over a heightmap and compares the triangles and the CPU time
+// per frame of the patch LODs and the bintree at equal error. Runs
+// without a GL context, only the LOD selection is timed.
+//
+// The patch path's screen error in a frame is the largest error over
+// distance of the vertices left out by the patch LODs, measured with
+// the bintree's vertex errors. The bintree's error tolerance is set
+// to the median of that over the flight, so both meshes leave out
+// the same screen error.
+
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPatch.h>
+#include <Scene/HeightMapBintree.h>
+#include <Scene/HeightMapLODContext.h>
+#include <Scene/HeightMapView.h>
+#include <Utils/HeightImporter.h>
+#include <Utils/Timer.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <math.h>
+#include <vector>
+
+using namespace OpenEngine::Scene;
+using namespace OpenEngine::Utils;
+
+// Frames flown before measuring, for the bintree to settle.
+static const int WARMUP_FRAMES = 20;
+
+static void PrintUsage(){
+    std::cout << "Usage: HeightMapBintreeBench [options] heightmap" << std::endl
+              << "  -scale s     multiply the heights by s" << std::endl
+              << "  -frames n    frames to measure, defaults to 400" << std::endl
+              << "  -speed s     distance flown per frame, defaults to 2" << std::endl
+              << "  -height h    flying height above the ground, defaults to 40" << std::endl
+              << "  -lod b i     LOD switch distances of the patches, defaults to 100 150" << std::endl;
+}
+
+static double Microseconds(Timer& timer){
+    return (double)timer.GetElapsedTime().AsInt();
+}
+
+int main(int argc, char** argv){
+    float scale = 1, speed = 2, height = 40;
+    float baseDistance = 100, incDistance = 150;
+    int frames = 400;
+
+    std::vector<char*> args;
+    for (int i = 1; i < argc; ++i){
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "-scale") == 0 && hasValue) scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "-frames") == 0 && hasValue) frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-speed") == 0 && hasValue) speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "-height") == 0 && hasValue) height = atof(argv[++i]);
+        else if (strcmp(argv[i], "-lod") == 0 && i + 2 < argc){
+            baseDistance = atof(argv[++i]);
+            incDistance = atof(argv[++i]);
+        }else if (argv[i][0] == '-'){
+            PrintUsage();
+            return 1;
+        }else args.push_back(argv[i]);
+    }
+    if (args.size() != 1 || frames < 1){
+        PrintUsage();
+        return 1;
+    }
+
+    FloatTexture2DPtr heights = ImportHeights(args[0], scale);
+    if (!heights){
+        std::cerr << "Can't read " << args[0] << std::endl;
+        return 1;
+    }
+
+    HeightMapNode node(heights);
+    node.SetLODSwitchDistance(baseDistance, incDistance);
+    node.Load();
+    HeightMapLODContext context;
+
+    int width = node.GetVerticeWidth(), depth = node.GetVerticeDepth();
+    int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+    int patchGridDepth = (depth - 1) / squares;
+
+    // The bintree's vertex errors are computed by it's first update.
+    HeightMapBintree bintree(&node, 1 << 30);
+    bintree.SetMaxOperations(1 << 30);
+    bintree.Update(Vector<3, float>(0.0f));
+
+    // A figure eight over the middle of the map, looking along the
+    // path and a little down.
+    float radius = std::min(width, depth) * 0.3f;
+    std::vector<HeightMapView> views(frames + WARMUP_FRAMES);
+    float angle = 0;
+    for (unsigned int f = 0; f < views.size(); ++f){
+        Vector<3, float> position(width / 2 + radius * sin(angle), 0, depth / 2 + radius * sin(2 * angle));
+        position[1] = node.GetVertex((int)position[0], (int)position[2])[1] + height;
+        Vector<3, float> direction(radius * cos(angle), 0, 2 * radius * cos(2 * angle));
+        direction.Normalize();
+        direction[1] = -0.2f;
+        views[f].Set(position, direction, Vector<3, float>(0, 1, 0), M_PI / 3, 4.0f / 3.0f, 1, 3000);
+        angle += speed / (radius * sqrt(cos(angle) * cos(angle) + 4 * cos(2 * angle) * cos(2 * angle)) + 0.0001f);
+    }
+
+    Timer timer;
+    double patchTime = 0, patchTriangles = 0;
+    std::vector<float> patchErrors;
+    for (unsigned int f = 0; f < views.size(); ++f){
+        timer.Start();
+        node.CalcLOD(context, views[f]);
+        double time = Microseconds(timer);
+        if ((int)f < WARMUP_FRAMES) continue;
+
+        const HeightMapLODPacket& packet = context.GetFrontPacket();
+        Vector<3, float> position = views[f].GetPosition();
+        float error = 0;
+        for (unsigned int p = 0; p < packet.patches.size(); ++p){
+            if (!packet.patches[p].visible) continue;
+            int step = 1 << packet.patches[p].LOD;
+            int xStart = p / patchGridDepth * squares;
+            int zStart = p % patchGridDepth * squares;
+            for (int x = xStart; x <= xStart + squares; ++x)
+                for (int z = zStart; z <= zStart + squares; ++z){
+                    if (x % step == 0 && z % step == 0) continue;
+                    float* v = node.GetVertex(x, z);
+                    float distance = (Vector<3, float>(v[0], v[1], v[2]) - position).GetLength();
+                    error = std::max(error, bintree.GetVertexError(x, z) / std::max(distance, 0.0001f));
+                }
+        }
+        patchErrors.push_back(error);
+        patchTime += time;
+        patchTriangles += packet.triangles;
+    }
+
+    std::vector<float> sorted(patchErrors);
+    std::sort(sorted.begin(), sorted.end());
+    float tolerance = sorted[sorted.size() / 2];
+    bintree.SetErrorTolerance(tolerance);
+
+    double bintreeTime = 0, bintreeTriangles = 0, worstTime = 0, reprioritized = 0, operations = 0;
+    for (unsigned int f = 0; f < views.size(); ++f){
+        timer.Start();
+        bintree.Update(views[f].GetPosition());
+        double time = Microseconds(timer);
+        if ((int)f < WARMUP_FRAMES) continue;
+
+        bintreeTime += time;
+        worstTime = std::max(worstTime, time);
+        bintreeTriangles += bintree.GetNumberOfTriangles();
+        reprioritized += bintree.GetNumberOfReprioritized();
+        operations += bintree.GetNumberOfSplits() + bintree.GetNumberOfMerges();
+    }
+
+    std::cout << width << " by " << depth << " vertices, " << frames << " frames, "
+              << "error tolerance " << tolerance << "." << std::endl;
+    std::cout << "Patches: " << patchTriangles / frames << " triangles, "
+              << patchTime / frames << " us per frame." << std::endl;
+    std::cout << "Bintree: " << bintreeTriangles / frames << " triangles, "
+              << bintreeTime / frames << " us per frame, " << worstTime << " us worst, "
+              << reprioritized / frames << " reprioritized and "
+              << operations / frames << " splits and merges per frame." << std::endl;
+    return 0;
+}
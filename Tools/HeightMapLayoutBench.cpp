@@ -0,0 +1,157 @@
+// Heightmap vertex layout benchmark.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Loads a heightmap with the row major and the tiled vertex layout
+// and compares them on patch local and random access. Runs without a
+// GL context.
+//
+// For each layout it counts the distinct cache lines and pages the
+// vertices of a patch are on, and times a walk over every patch's
+// vertices and bilinear GetHeight and GetNormal lookups at random
+// points.
+
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPatch.h>
+#include <Utils/HeightImporter.h>
+#include <Utils/Timer.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <vector>
+
+using namespace OpenEngine::Scene;
+using namespace OpenEngine::Utils;
+
+static const unsigned long CACHE_LINE = 64;
+static const unsigned long PAGE = 4096;
+
+static void PrintUsage(){
+    std::cout << "Usage: HeightMapLayoutBench [options] heightmap" << std::endl
+              << "  -scale s     multiply the heights by s" << std::endl
+              << "  -lookups n   random lookups to time, defaults to 4000000" << std::endl
+              << "  -walks n     walks over all patches to time, defaults to 10" << std::endl;
+}
+
+static double Microseconds(Timer& timer){
+    return (double)timer.GetElapsedTime().AsInt();
+}
+
+struct Result {
+    double lines, pages;
+    double walkTime, heightTime, normalTime;
+    float sum;
+};
+
+static Result Measure(FloatTexture2DPtr heights, bool tiled,
+                      const std::vector<float>& points, int walks){
+    HeightMapNode node(heights);
+    node.SetTiledVertexLayout(tiled);
+    node.Load();
+
+    Result result;
+    result.sum = 0;
+    int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+    int patchGridWidth = (node.GetVerticeWidth() - 1) / squares;
+    int patchGridDepth = (node.GetVerticeDepth() - 1) / squares;
+    int patches = patchGridWidth * patchGridDepth;
+
+    // The memory a patch's vertices are on.
+    double lines = 0, pages = 0;
+    for (int p = 0; p < patches; ++p){
+        int xStart = p / patchGridDepth * squares;
+        int zStart = p % patchGridDepth * squares;
+        std::set<unsigned long> patchLines, patchPages;
+        for (int x = xStart; x <= xStart + squares; ++x)
+            for (int z = zStart; z <= zStart + squares; ++z){
+                unsigned long address = (unsigned long)node.GetVertex(x, z);
+                patchLines.insert(address / CACHE_LINE);
+                patchPages.insert(address / PAGE);
+            }
+        lines += patchLines.size();
+        pages += patchPages.size();
+    }
+    result.lines = lines / patches;
+    result.pages = pages / patches;
+
+    Timer timer;
+    timer.Start();
+    for (int w = 0; w < walks; ++w)
+        for (int p = 0; p < patches; ++p){
+            int xStart = p / patchGridDepth * squares;
+            int zStart = p % patchGridDepth * squares;
+            for (int x = xStart; x <= xStart + squares; ++x)
+                for (int z = zStart; z <= zStart + squares; ++z)
+                    result.sum += node.GetVertex(x, z)[1];
+        }
+    result.walkTime = Microseconds(timer);
+
+    // The bilinear lookups are the const overloads.
+    const HeightMapNode& lookup = node;
+    timer.Start();
+    for (unsigned int i = 0; i < points.size(); i += 2)
+        result.sum += lookup.GetHeight(points[i], points[i+1]);
+    result.heightTime = Microseconds(timer);
+
+    timer.Start();
+    for (unsigned int i = 0; i < points.size(); i += 2)
+        result.sum += lookup.GetNormal(points[i], points[i+1])[1];
+    result.normalTime = Microseconds(timer);
+
+    return result;
+}
+
+int main(int argc, char** argv){
+    float scale = 1;
+    int lookups = 4000000, walks = 10;
+
+    std::vector<char*> args;
+    for (int i = 1; i < argc; ++i){
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "-scale") == 0 && hasValue) scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "-lookups") == 0 && hasValue) lookups = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-walks") == 0 && hasValue) walks = atoi(argv[++i]);
+        else if (argv[i][0] == '-'){
+            PrintUsage();
+            return 1;
+        }else args.push_back(argv[i]);
+    }
+    if (args.size() != 1 || lookups < 1 || walks < 1){
+        PrintUsage();
+        return 1;
+    }
+
+    FloatTexture2DPtr heights = ImportHeights(args[0], scale);
+    if (!heights){
+        std::cerr << "Can't read " << args[0] << std::endl;
+        return 1;
+    }
+
+    // The same random points for both layouts, in local space.
+    int width = heights->GetHeight(), depth = heights->GetWidth();
+    std::vector<float> points(2 * lookups);
+    srand(1);
+    for (int i = 0; i < lookups; ++i){
+        points[2 * i] = (width - 1) * (rand() / (float)RAND_MAX);
+        points[2 * i + 1] = (depth - 1) * (rand() / (float)RAND_MAX);
+    }
+
+    const char* names[2] = { "Row major", "Tiled" };
+    for (int tiled = 0; tiled < 2; ++tiled){
+        Result r = Measure(heights, tiled, points, walks);
+        std::cout << names[tiled] << ": "
+                  << r.lines << " cache lines and " << r.pages << " pages per patch, "
+                  << r.walkTime / walks << " us per walk over the patches, "
+                  << 1000 * r.heightTime / lookups << " ns per GetHeight, "
+                  << 1000 * r.normalTime / lookups << " ns per GetNormal"
+                  << " (" << r.sum << ")." << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+// Heightmap load benchmark.
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+// Times loading a heightmap into a node, which pads the heights and
+// fills the vertex arrays, their normals, LOD values and morph
+// heights. Runs without a GL context, so nothing is uploaded. Run it
+// on two builds to compare their loading.
+
+#include <Scene/HeightMapNode.h>
+#include <Utils/HeightImporter.h>
+#include <Utils/Timer.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace OpenEngine::Scene;
+using namespace OpenEngine::Utils;
+
+static void PrintUsage(){
+    std::cout << "Usage: HeightMapLoadBench [options] heightmap" << std::endl
+              << "  -scale s     multiply the heights by s" << std::endl
+              << "  -runs n      loads to time, defaults to 5" << std::endl
+              << "  -tiled       use the tiled vertex layout" << std::endl;
+}
+
+int main(int argc, char** argv){
+    float scale = 1;
+    int runs = 5;
+    bool tiled = false;
+
+    std::vector<char*> args;
+    for (int i = 1; i < argc; ++i){
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "-scale") == 0 && hasValue) scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "-runs") == 0 && hasValue) runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-tiled") == 0) tiled = true;
+        else if (argv[i][0] == '-'){
+            PrintUsage();
+            return 1;
+        }else args.push_back(argv[i]);
+    }
+    if (args.size() != 1 || runs < 1){
+        PrintUsage();
+        return 1;
+    }
+
+    FloatTexture2DPtr heights = ImportHeights(args[0], scale);
+    if (!heights){
+        std::cerr << "Can't read " << args[0] << std::endl;
+        return 1;
+    }
+
+    std::vector<double> times;
+    float check = 0;
+    for (int r = 0; r < runs; ++r){
+        HeightMapNode node(heights);
+        node.SetTiledVertexLayout(tiled);
+        Timer timer;
+        timer.Start();
+        node.Load();
+        times.push_back((double)timer.GetElapsedTime().AsInt() / 1000);
+        check += node.GetVertex(node.GetVerticeWidth() / 2, node.GetVerticeDepth() / 2)[3];
+    }
+
+    std::sort(times.begin(), times.end());
+    std::cout << heights->GetHeight() << " by " << heights->GetWidth() << " heights, "
+              << runs << " loads: " << times.front() << " ms best, "
+              << times[times.size() / 2] << " ms median (" << check << ")." << std::endl;
+    return 0;
+}
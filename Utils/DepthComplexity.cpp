@@ -0,0 +1,54 @@
+// Depth complexity util classes
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Utils/DepthComplexity.h>
+
+#include <algorithm>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        DepthComplexityCounter::DepthComplexityCounter(const int width, const int height)
+            : width(std::max(width, 1)), height(std::max(height, 1)) {
+            depths.resize(this->width * this->height);
+            Clear();
+        }
+
+        void DepthComplexityCounter::Clear(){
+            std::fill(depths.begin(), depths.end(), HUGE_VAL);
+            fragments = shadedFragments = coveredPixels = 0;
+        }
+
+        void DepthComplexityCounter::AddRect(float xMin, float yMin, float xMax, float yMax, const float depth){
+            // The pixels whose centers are inside the rectangle.
+            int xStart = std::max((int)ceil((xMin + 1) * 0.5f * width - 0.5f), 0);
+            int yStart = std::max((int)ceil((yMin + 1) * 0.5f * height - 0.5f), 0);
+            int xEnd = std::min((int)floor((xMax + 1) * 0.5f * width - 0.5f) + 1, width);
+            int yEnd = std::min((int)floor((yMax + 1) * 0.5f * height - 0.5f) + 1, height);
+
+            for (int y = yStart; y < yEnd; ++y)
+                for (int x = xStart; x < xEnd; ++x){
+                    float& pixel = depths[x + y * width];
+                    ++fragments;
+                    if (depth < pixel){
+                        if (pixel == HUGE_VAL)
+                            ++coveredPixels;
+                        pixel = depth;
+                        ++shadedFragments;
+                    }
+                }
+        }
+
+        float DepthComplexityCounter::GetDepthComplexity() const {
+            return coveredPixels ? (float)shadedFragments / coveredPixels : 0.0f;
+        }
+
+    }
+}
@@ -0,0 +1,67 @@
+// Depth complexity util classes
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _DEPTH_COMPLEXITY_UTIL_CLASSES_H_
+#define _DEPTH_COMPLEXITY_UTIL_CLASSES_H_
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * A software depth buffer of a few pixels, counting the
+         * fragments that would pass an early depth test when
+         * rectangles are drawn into it in order.
+         *
+         * Each rectangle is drawn at a single depth, fx the nearest
+         * depth of a bounding box, so drawing the same boxes in a
+         * different order shows how much of the shading the order
+         * saves.
+         */
+        class DepthComplexityCounter {
+        protected:
+            int width, height;
+            std::vector<float> depths;
+            unsigned int fragments, shadedFragments, coveredPixels;
+
+        public:
+            DepthComplexityCounter(const int width = 64, const int height = 64);
+
+            /**
+             * Clears the depths and the counts.
+             */
+            void Clear();
+
+            /**
+             * Draws the rectangle, given in normalized device
+             * coordinates, at the depth. A pixel is covered if it's
+             * center is inside the rectangle, and it's fragment is
+             * shaded if it is nearer than the pixel's depth.
+             */
+            void AddRect(float xMin, float yMin, float xMax, float yMax, const float depth);
+
+            /**
+             * The number of fragments drawn and the number that
+             * passed the depth test.
+             */
+            unsigned int GetFragments() const { return fragments; }
+            unsigned int GetShadedFragments() const { return shadedFragments; }
+            unsigned int GetCoveredPixels() const { return coveredPixels; }
+            /**
+             * The average number of times a covered pixel was
+             * shaded, 1 when nothing was shaded twice.
+             */
+            float GetDepthComplexity() const;
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,324 @@
+// Height codec util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Utils/HeightCodec.h>
+
+#include <Logging/Logger.h>
+
+#include <cstring>
+#include <fstream>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        // The header is the magic, the version, the mode, two
+        // reserved bytes, the columns, the rows and the quantization
+        // step, all little endian.
+        static const unsigned char MAGIC[4] = { 'O', 'E', 'H', 'C' };
+        static const unsigned char VERSION = 1;
+        enum HeightCodecMode { LOSSLESS = 0, QUANTIZED = 1 };
+        static const int BLOCK_SIZE = 32;
+
+        // Quantized heights further from zero than this fall back to
+        // lossless. Beyond 2^23 steps a float's spacing is larger
+        // than the step, so quantizing no longer bounds the error.
+        // The quantization itself is done in double.
+        static const double MAX_QUANTIZED = 1 << 23;
+
+        static inline void WriteUInt(unsigned char* p, unsigned int v){
+            p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+        }
+
+        static inline unsigned int ReadUInt(const unsigned char* p){
+            return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+        }
+
+        static inline unsigned int FloatBits(float f){
+            unsigned int u;
+            memcpy(&u, &f, sizeof(u));
+            return u;
+        }
+
+        static inline float BitsFloat(unsigned int u){
+            float f;
+            memcpy(&f, &u, sizeof(f));
+            return f;
+        }
+
+        /**
+         * Maps the float bits to integers in the same order as the
+         * floats, by flipping the negative floats.
+         */
+        static inline unsigned int OrderedBits(float f){
+            unsigned int u = FloatBits(f);
+            return u ^ ((0 - (u >> 31)) | 0x80000000);
+        }
+
+        static inline float FromOrderedBits(unsigned int u){
+            return BitsFloat(u ^ (((u >> 31) - 1) | 0x80000000));
+        }
+
+        static inline unsigned int ZigZag(unsigned int d){
+            return (d << 1) ^ (0 - (d >> 31));
+        }
+
+        static inline unsigned int UnZigZag(unsigned int z){
+            return (z >> 1) ^ (0 - (z & 1));
+        }
+
+        static inline int BitWidth(unsigned int v){
+            int width = 0;
+            while (v){
+                ++width;
+                v >>= 1;
+            }
+            return width;
+        }
+
+        /**
+         * Packs the values at the width into out and returns the
+         * number of bytes written.
+         */
+        static inline unsigned int PackBlock(const unsigned int* values, int count, int width, unsigned char* out){
+            unsigned long long buffer = 0;
+            int bits = 0;
+            unsigned int bytes = 0;
+            for (int i = 0; i < count; ++i){
+                buffer |= (unsigned long long)values[i] << bits;
+                bits += width;
+                while (bits >= 8){
+                    out[bytes++] = buffer;
+                    buffer >>= 8;
+                    bits -= 8;
+                }
+            }
+            if (bits > 0)
+                out[bytes++] = buffer;
+            return bytes;
+        }
+
+        static inline void UnpackBlock(const unsigned char* in, const unsigned char* end, 
+                                       int count, int width, unsigned int* values){
+            if (width == 0){
+                memset(values, 0, sizeof(unsigned int) * count);
+                return;
+            }
+            unsigned long long mask = (1ULL << width) - 1;
+            if (end - in >= BLOCK_SIZE * 4 + 8){
+                // Each value is within the 8 bytes from the byte it
+                // starts in, so they are unpacked independently.
+                for (int i = 0; i < count; ++i){
+                    unsigned int bit = i * width;
+                    unsigned long long word;
+                    memcpy(&word, in + (bit >> 3), sizeof(word));
+                    values[i] = (word >> (bit & 7)) & mask;
+                }
+                return;
+            }
+            // Near the end of the data.
+            unsigned long long buffer = 0;
+            int bits = 0;
+            for (int i = 0; i < count; ++i){
+                while (bits < width){
+                    buffer |= (unsigned long long)*in++ << bits;
+                    bits += 8;
+                }
+                values[i] = buffer & mask;
+                buffer >>= width;
+                bits -= width;
+            }
+        }
+
+        /**
+         * The prediction error of the row, given the row above it,
+         * or NULL for the first row.
+         */
+        static inline void PredictRow(const unsigned int* row, const unsigned int* above,
+                                      int columns, unsigned int* residuals){
+            if (above == NULL){
+                unsigned int left = 0;
+                for (int c = 0; c < columns; ++c){
+                    residuals[c] = ZigZag(row[c] - left);
+                    left = row[c];
+                }
+            }else{
+                residuals[0] = ZigZag(row[0] - above[0]);
+                for (int c = 1; c < columns; ++c)
+                    residuals[c] = ZigZag(row[c] - (row[c-1] + above[c] - above[c-1]));
+            }
+        }
+
+        unsigned int EncodeHeights(const float* heights, int columns, int rows,
+                                   int stride, int rowStride, float maxError,
+                                   std::vector<unsigned char>& data){
+            if (columns < 0 || rows < 0){
+                logger.error << "Can't encode a grid of " << columns << " by " << rows << " heights." << logger.end;
+                return 0;
+            }
+
+            float step = 2 * maxError;
+            HeightCodecMode mode = step > 0 ? QUANTIZED : LOSSLESS;
+            double invStep = mode == QUANTIZED ? 1.0 / step : 0;
+            if (mode == QUANTIZED)
+                for (int r = 0; r < rows && mode == QUANTIZED; ++r)
+                    for (int c = 0; c < columns; ++c)
+                        if (!(fabs(heights[r * rowStride + c * stride] * invStep) < MAX_QUANTIZED)){
+                            mode = LOSSLESS;
+                            break;
+                        }
+            if (mode == LOSSLESS)
+                step = 0;
+
+            unsigned int start = data.size();
+            data.resize(start + HEIGHT_CODEC_HEADER_SIZE);
+            unsigned char* header = &data[start];
+            memcpy(header, MAGIC, 4);
+            header[4] = VERSION;
+            header[5] = mode;
+            header[6] = header[7] = 0;
+            WriteUInt(header + 8, columns);
+            WriteUInt(header + 12, rows);
+            WriteUInt(header + 16, FloatBits(step));
+
+            std::vector<unsigned int> row(columns), above(columns), residuals(columns);
+            // Room for a block at full width and it's width byte.
+            unsigned char packed[BLOCK_SIZE * 4 + 1];
+            for (int r = 0; r < rows; ++r){
+                const float* h = heights + r * rowStride;
+                if (mode == LOSSLESS)
+                    for (int c = 0; c < columns; ++c)
+                        row[c] = OrderedBits(h[c * stride]);
+                else
+                    for (int c = 0; c < columns; ++c)
+                        row[c] = (unsigned int)(int)floor(h[c * stride] * invStep + 0.5);
+
+                if (columns > 0)
+                    PredictRow(&row[0], r > 0 ? &above[0] : NULL, columns, &residuals[0]);
+
+                for (int b = 0; b < columns; b += BLOCK_SIZE){
+                    int count = columns - b < BLOCK_SIZE ? columns - b : BLOCK_SIZE;
+                    unsigned int largest = 0;
+                    for (int i = 0; i < count; ++i)
+                        largest |= residuals[b + i];
+                    int width = BitWidth(largest);
+                    packed[0] = width;
+                    unsigned int bytes = 1 + PackBlock(&residuals[b], count, width, packed + 1);
+                    data.insert(data.end(), packed, packed + bytes);
+                }
+                row.swap(above);
+            }
+
+            return data.size() - start;
+        }
+
+        bool GetEncodedHeightsSize(const unsigned char* data, unsigned int size,
+                                   int& columns, int& rows){
+            if (size < HEIGHT_CODEC_HEADER_SIZE || memcmp(data, MAGIC, 4) != 0 || data[4] != VERSION)
+                return false;
+            columns = ReadUInt(data + 8);
+            rows = ReadUInt(data + 12);
+            return columns >= 0 && rows >= 0;
+        }
+
+        bool DecodeHeights(const unsigned char* data, unsigned int size,
+                           float* heights, int stride, int rowStride){
+            int columns, rows;
+            if (!GetEncodedHeightsSize(data, size, columns, rows)){
+                logger.error << "Not encoded heights." << logger.end;
+                return false;
+            }
+            HeightCodecMode mode = (HeightCodecMode)data[5];
+            double step = BitsFloat(ReadUInt(data + 16));
+
+            const unsigned char* in = data + HEIGHT_CODEC_HEADER_SIZE;
+            const unsigned char* end = data + size;
+            std::vector<unsigned int> row(columns), above(columns), residuals(columns);
+            for (int r = 0; r < rows; ++r){
+                // Unpack the row's blocks.
+                for (int b = 0; b < columns; b += BLOCK_SIZE){
+                    int count = columns - b < BLOCK_SIZE ? columns - b : BLOCK_SIZE;
+                    if (in >= end || *in > 32 || end - in - 1 < (count * *in + 7) / 8){
+                        logger.error << "Corrupt heights in row " << r << "." << logger.end;
+                        return false;
+                    }
+                    int width = *in++;
+                    UnpackBlock(in, end, count, width, &residuals[b]);
+                    in += (count * width + 7) / 8;
+                }
+
+                // Undo the prediction.
+                if (columns > 0){
+                    unsigned int* v = &row[0];
+                    const unsigned int* res = &residuals[0];
+                    const unsigned int* up = &above[0];
+                    float* h = heights + r * rowStride;
+                    unsigned int left = r == 0 ? 0 : up[0];
+                    v[0] = left + UnZigZag(res[0]);
+                    if (r == 0)
+                        for (int c = 1; c < columns; ++c)
+                            v[c] = v[c-1] + UnZigZag(res[c]);
+                    else
+                        for (int c = 1; c < columns; ++c)
+                            v[c] = v[c-1] + (up[c] - up[c-1]) + UnZigZag(res[c]);
+
+                    if (mode == LOSSLESS)
+                        for (int c = 0; c < columns; ++c)
+                            h[c * stride] = FromOrderedBits(v[c]);
+                    else
+                        for (int c = 0; c < columns; ++c)
+                            h[c * stride] = (float)((int)v[c] * step);
+                }
+                row.swap(above);
+            }
+            return true;
+        }
+
+        bool WriteHeightFile(const std::string& file, FloatTexture2DPtr tex, float maxError){
+            tex->Load();
+            std::vector<unsigned char> data;
+            EncodeHeights(tex->GetData(), tex->GetWidth(), tex->GetHeight(),
+                          tex->GetChannels(), tex->GetWidth() * tex->GetChannels(), maxError, data);
+
+            std::ofstream out(file.c_str(), std::ios::out | std::ios::binary);
+            if (!out){
+                logger.error << "Can't write heights to " << file << logger.end;
+                return false;
+            }
+            out.write((const char*)&data[0], data.size());
+            return out.good();
+        }
+
+        FloatTexture2DPtr ReadHeightFile(const std::string& file){
+            std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+            if (!in){
+                logger.error << "Can't read heights from " << file << logger.end;
+                return FloatTexture2DPtr();
+            }
+            std::vector<unsigned char> data;
+            in.seekg(0, std::ios::end);
+            data.resize(in.tellg());
+            in.seekg(0, std::ios::beg);
+            if (data.empty() || !in.read((char*)&data[0], data.size()))
+                return FloatTexture2DPtr();
+
+            int columns, rows;
+            if (!GetEncodedHeightsSize(&data[0], data.size(), columns, rows)){
+                logger.error << file << " is not a height file." << logger.end;
+                return FloatTexture2DPtr();
+            }
+            FloatTexture2DPtr tex = FloatTexture2DPtr(new Texture2D<float>(columns, rows, LUMINANCE32F));
+            tex->Load();
+            if (!DecodeHeights(&data[0], data.size(), tex->GetData(), 1, columns))
+                return FloatTexture2DPtr();
+            return tex;
+        }
+
+    }
+}
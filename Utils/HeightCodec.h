@@ -0,0 +1,93 @@
+// Height codec util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHT_CODEC_UTIL_FUNCTIONS_H_
+#define _HEIGHT_CODEC_UTIL_FUNCTIONS_H_
+
+#include <Resources/Texture2D.h>
+
+#include <string>
+#include <vector>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * Compresses a grid of heights, row by row.
+         *
+         * The heights are mapped to integers, their float bits in an
+         * order preserving form when lossless, or rounded to
+         * multiples of twice the maximum error. Each height is
+         * predicted as left + up - upper left, the plane through
+         * it's neighbours, or from the left or upper neighbour on
+         * the first row and column. The prediction errors are zig
+         * zag encoded, so small negative errors become small
+         * numbers, and bit packed in blocks of 32 at the width of
+         * the largest error in the block, which is stored in the
+         * byte before it. A block of equal heights, like the
+         * ocean, is a single zero byte.
+         *
+         * The heights are read and written with a stride between
+         * the heights of a row and between the rows, so they can be
+         * coded straight from and into interleaved vertex arrays.
+         *
+         * The encoded data starts with a header of
+         * HEIGHT_CODEC_HEADER_SIZE bytes holding the size of the
+         * grid, so it can be stored on it's own, on disk or as a
+         * compressed tile in memory.
+         */
+        static const unsigned int HEIGHT_CODEC_HEADER_SIZE = 20;
+
+        /**
+         * Appends the heights of the grid to the buffer.
+         *
+         * @param maxError The largest difference between a height
+         * and it's decoded height, apart from the rounding of the
+         * decoded float, or zero for lossless. Heights too large to
+         * quantize are stored lossless.
+         * @return The number of bytes appended.
+         */
+        unsigned int EncodeHeights(const float* heights, int columns, int rows,
+                                   int stride, int rowStride, float maxError,
+                                   std::vector<unsigned char>& data);
+        /**
+         * Reads the size of the grid in the encoded data.
+         *
+         * @return False if the data is not encoded heights.
+         */
+        bool GetEncodedHeightsSize(const unsigned char* data, unsigned int size,
+                                   int& columns, int& rows);
+        /**
+         * Decodes the heights into the grid, which must have the
+         * size given by GetEncodedHeightsSize.
+         *
+         * @return False if the data is corrupt.
+         */
+        bool DecodeHeights(const unsigned char* data, unsigned int size,
+                           float* heights, int stride, int rowStride);
+
+        /**
+         * Writes the texture's heights to a file, with the texture's
+         * rows as the encoded rows.
+         */
+        bool WriteHeightFile(const std::string& file, FloatTexture2DPtr tex, float maxError = 0);
+        /**
+         * Reads a file written by WriteHeightFile into a
+         * LUMINANCE32F texture.
+         *
+         * @return An empty pointer if the file can't be read.
+         */
+        FloatTexture2DPtr ReadHeightFile(const std::string& file);
+
+    }
+}
+
+#endif
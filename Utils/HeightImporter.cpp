@@ -0,0 +1,279 @@
+// Height importer util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Utils/HeightImporter.h>
+
+#include <Core/Thread.h>
+#include <Logging/Logger.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#ifdef HEIGHTMAP_PNG
+#include <png.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        struct SampleFormat {
+            int bytes;
+            bool bigEndian, isSigned;
+            float scale;
+        };
+
+        static inline void ConvertRow(const unsigned char* in, int columns, const SampleFormat& format, float* out){
+            if (format.bytes == 1){
+                for (int c = 0; c < columns; ++c)
+                    out[c] = in[c] * format.scale;
+                return;
+            }
+            int high = format.bigEndian ? 0 : 1;
+            for (int c = 0; c < columns; ++c){
+                int v = (in[2 * c + high] << 8) | in[2 * c + 1 - high];
+                if (format.isSigned && v > 0x7FFF)
+                    v -= 0x10000;
+                out[c] = v * format.scale;
+            }
+        }
+
+        /**
+         * Reads the rows of a band of a file with fixed size rows,
+         * a few at a time.
+         */
+        static bool ReadRowBand(const std::string& file, std::streamoff dataStart, int columns, 
+                                int rowStart, int rowEnd, const SampleFormat& format, float* dest){
+            std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+            if (!in) return false;
+            std::streamoff rowSize = (std::streamoff)columns * format.bytes;
+            in.seekg(dataStart + rowStart * rowSize);
+            std::vector<unsigned char> buffer(rowSize * HEIGHT_IMPORT_ROWS);
+            for (int r = rowStart; r < rowEnd; r += HEIGHT_IMPORT_ROWS){
+                int count = std::min(HEIGHT_IMPORT_ROWS, rowEnd - r);
+                if (!in.read((char*)&buffer[0], rowSize * count))
+                    return false;
+                for (int i = 0; i < count; ++i)
+                    ConvertRow(&buffer[i * rowSize], columns, format, dest + (r + i) * (std::streamoff)columns);
+            }
+            return true;
+        }
+
+        class HeightImportWorker : public Core::Thread {
+        private:
+            const std::string& file;
+            std::streamoff dataStart;
+            int columns, rowStart, rowEnd;
+            SampleFormat format;
+            float* dest;
+        public:
+            bool result;
+
+            HeightImportWorker(const std::string& file, std::streamoff dataStart, int columns, 
+                               int rowStart, int rowEnd, const SampleFormat& format, float* dest)
+                : file(file), dataStart(dataStart), columns(columns), rowStart(rowStart), 
+                  rowEnd(rowEnd), format(format), dest(dest), result(false) {}
+            void Run() { result = ReadRowBand(file, dataStart, columns, rowStart, rowEnd, format, dest); }
+        };
+
+        /**
+         * Imports the fixed size rows starting at dataStart in the
+         * file, in a band per thread.
+         */
+        static FloatTexture2DPtr ImportRows(const std::string& file, std::streamoff dataStart,
+                                            int columns, int rows, const SampleFormat& format, int threads){
+            if (columns <= 0 || rows <= 0){
+                logger.error << "Can't import " << columns << " by " << rows << " heights from " << file << logger.end;
+                return FloatTexture2DPtr();
+            }
+
+            // Check the size before allocating the texture.
+            std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+            if (!in){
+                logger.error << "Can't read heights from " << file << logger.end;
+                return FloatTexture2DPtr();
+            }
+            in.seekg(0, std::ios::end);
+            std::streamoff size = in.tellg();
+            in.close();
+            if (size < dataStart + (std::streamoff)columns * rows * format.bytes){
+                logger.error << file << " is too short for " << columns << " by " << rows << " heights." << logger.end;
+                return FloatTexture2DPtr();
+            }
+
+            FloatTexture2DPtr tex = FloatTexture2DPtr(new Texture2D<float>(columns, rows, LUMINANCE32F));
+            tex->Load();
+            float* dest = tex->GetData();
+
+            if (threads > rows) threads = rows;
+            if (threads < 1) threads = 1;
+            std::vector<HeightImportWorker*> workers;
+            for (int t = 1; t < threads; ++t){
+                workers.push_back(new HeightImportWorker(file, dataStart, columns, rows * t / threads, 
+                                                         rows * (t + 1) / threads, format, dest));
+                workers.back()->Start();
+            }
+            // The first band on this thread.
+            bool result = ReadRowBand(file, dataStart, columns, 0, rows / threads, format, dest);
+            for (unsigned int t = 0; t < workers.size(); ++t){
+                workers[t]->Wait();
+                result = result && workers[t]->result;
+                delete workers[t];
+            }
+
+            if (!result){
+                logger.error << "Can't read heights from " << file << logger.end;
+                return FloatTexture2DPtr();
+            }
+            return tex;
+        }
+
+        FloatTexture2DPtr ImportRaw16Heights(const std::string& file, int columns, int rows,
+                                             bool bigEndian, bool isSigned, float scale, int threads){
+            SampleFormat format = { 2, bigEndian, isSigned, scale };
+            return ImportRows(file, 0, columns, rows, format, threads);
+        }
+
+        /**
+         * Reads the next number of a PGM header, skipping white space
+         * and comments.
+         */
+        static bool ReadPGMNumber(std::istream& in, int& number){
+            int c = in.get();
+            while (in && (isspace(c) || c == '#')){
+                if (c == '#')
+                    while (in && c != '\n') c = in.get();
+                c = in.get();
+            }
+            if (!in || !isdigit(c)) return false;
+            number = 0;
+            while (in && isdigit(c)){
+                number = number * 10 + (c - '0');
+                c = in.get();
+            }
+            // The single white space after the number.
+            return in && isspace(c);
+        }
+
+        FloatTexture2DPtr ImportPGMHeights(const std::string& file, float scale, int threads){
+            std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+            if (!in){
+                logger.error << "Can't read heights from " << file << logger.end;
+                return FloatTexture2DPtr();
+            }
+            char magic[2];
+            int columns, rows, maxValue;
+            if (!in.read(magic, 2) || magic[0] != 'P' || magic[1] != '5' ||
+                !ReadPGMNumber(in, columns) || !ReadPGMNumber(in, rows) || 
+                !ReadPGMNumber(in, maxValue) || maxValue <= 0 || maxValue > 0xFFFF){
+                logger.error << file << " is not a binary PGM file." << logger.end;
+                return FloatTexture2DPtr();
+            }
+            std::streamoff dataStart = in.tellg();
+            in.close();
+
+            SampleFormat format = { maxValue > 0xFF ? 2 : 1, true, false, scale };
+            return ImportRows(file, dataStart, columns, rows, format, threads);
+        }
+
+#ifdef HEIGHTMAP_PNG
+        // libpng reports errors by long jumping back to the calling
+        // function, so these only touch plain data.
+
+        static bool ReadPNGHeader(png_structp png, png_infop info, FILE* fp, int& columns, int& rows, int& bytes){
+            if (setjmp(png_jmpbuf(png)))
+                return false;
+            png_init_io(png, fp);
+            png_read_info(png, info);
+
+            int colorType = png_get_color_type(png, info);
+            int bitDepth = png_get_bit_depth(png, info);
+            if ((colorType & PNG_COLOR_MASK_COLOR) || 
+                png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+                return false;
+            if (bitDepth < 8)
+                png_set_expand_gray_1_2_4_to_8(png);
+            if (colorType & PNG_COLOR_MASK_ALPHA)
+                png_set_strip_alpha(png);
+            png_read_update_info(png, info);
+
+            columns = png_get_image_width(png, info);
+            rows = png_get_image_height(png, info);
+            bytes = bitDepth == 16 ? 2 : 1;
+            return png_get_rowbytes(png, info) == (png_size_t)columns * bytes;
+        }
+
+        static bool ReadPNGRows(png_structp png, png_infop info, unsigned char* row, 
+                                int columns, int rows, const SampleFormat* format, float* dest){
+            if (setjmp(png_jmpbuf(png)))
+                return false;
+            for (int r = 0; r < rows; ++r){
+                png_read_row(png, row, NULL);
+                ConvertRow(row, columns, *format, dest + r * (long)columns);
+            }
+            png_read_end(png, NULL);
+            return true;
+        }
+#endif
+
+        FloatTexture2DPtr ImportPNGHeights(const std::string& file, float scale){
+#ifdef HEIGHTMAP_PNG
+            FILE* fp = fopen(file.c_str(), "rb");
+            if (fp == NULL){
+                logger.error << "Can't read heights from " << file << logger.end;
+                return FloatTexture2DPtr();
+            }
+            png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            png_infop info = png ? png_create_info_struct(png) : NULL;
+            FloatTexture2DPtr tex;
+            int columns, rows, bytes;
+            if (info == NULL || !ReadPNGHeader(png, info, fp, columns, rows, bytes))
+                logger.error << file << " is not a non interlaced grey scale PNG file." << logger.end;
+            else{
+                tex = FloatTexture2DPtr(new Texture2D<float>(columns, rows, LUMINANCE32F));
+                tex->Load();
+                std::vector<unsigned char> row(columns * bytes);
+                SampleFormat format = { bytes, true, false, scale };
+                if (!ReadPNGRows(png, info, &row[0], columns, rows, &format, tex->GetData())){
+                    logger.error << "Can't read heights from " << file << logger.end;
+                    tex.reset();
+                }
+            }
+            png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+            fclose(fp);
+            return tex;
+#else
+            (void)scale;
+            logger.error << "Can't import " << file << ", built without PNG support." << logger.end;
+            return FloatTexture2DPtr();
+#endif
+        }
+
+        FloatTexture2DPtr ImportHeights(const std::string& file, float scale, int threads){
+            std::string extension = file.substr(file.find_last_of('.') + 1);
+            for (unsigned int i = 0; i < extension.size(); ++i)
+                extension[i] = tolower(extension[i]);
+            if (extension == "pgm")
+                return ImportPGMHeights(file, scale, threads);
+            if (extension == "png")
+                return ImportPNGHeights(file, scale);
+            logger.error << "Can't import heights from " << file << ", the format is unknown." << logger.end;
+            return FloatTexture2DPtr();
+        }
+
+        void ConvertRaw16Heights(const unsigned char* samples, int count, bool bigEndian, 
+                                 bool isSigned, float scale, float* heights){
+            SampleFormat format = { 2, bigEndian, isSigned, scale };
+            ConvertRow(samples, count, format, heights);
+        }
+
+    }
+}
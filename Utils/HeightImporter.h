@@ -0,0 +1,82 @@
+// Height importer util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHT_IMPORTER_UTIL_FUNCTIONS_H_
+#define _HEIGHT_IMPORTER_UTIL_FUNCTIONS_H_
+
+#include <Resources/Texture2D.h>
+
+#include <string>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * The number of rows an importer reads from the file at a
+         * time, per thread.
+         */
+        static const int HEIGHT_IMPORT_ROWS = 4;
+
+        /**
+         * Importers of 8 and 16 bit heightmaps into LUMINANCE32F
+         * textures, with the file's rows as the texture's rows, for
+         * HeightMapNode. The samples are converted to floats times
+         * the scale, without going through an 8 bit texture.
+         *
+         * The files are decoded a few rows at a time straight into
+         * the texture, so the only full size allocation is the
+         * texture itself. The rows of RAW and PGM files have a fixed
+         * size, so they are decoded in bands by the given number of
+         * threads, each reading it's own part of the file.
+         *
+         * The importers return an empty pointer if the file can't
+         * be read.
+         */
+
+        /**
+         * Imports a headerless file of columns times rows 16 bit
+         * samples, like SRTM's .hgt files, which are signed and big
+         * endian.
+         */
+        FloatTexture2DPtr ImportRaw16Heights(const std::string& file, int columns, int rows,
+                                             bool bigEndian = false, bool isSigned = false, 
+                                             float scale = 1, int threads = 1);
+        /**
+         * Imports a binary (P5) PGM file, which is 16 bit big endian
+         * when it's maximum value is above 255.
+         */
+        FloatTexture2DPtr ImportPGMHeights(const std::string& file, float scale = 1, int threads = 1);
+        /**
+         * Imports a grey scale PNG file of 8 or 16 bits, ignoring
+         * the alpha channel. PNG rows are compressed as one stream,
+         * so they are decoded by a single thread.
+         *
+         * Only available when built with libpng, where
+         * HEIGHTMAP_PNG is defined.
+         */
+        FloatTexture2DPtr ImportPNGHeights(const std::string& file, float scale = 1);
+
+        /**
+         * Imports a PGM or PNG file by it's extension.
+         */
+        FloatTexture2DPtr ImportHeights(const std::string& file, float scale = 1, int threads = 1);
+
+        /**
+         * Converts count 16 bit samples to heights times the scale,
+         * for streaming files too large to import.
+         */
+        void ConvertRaw16Heights(const unsigned char* samples, int count, bool bigEndian, 
+                                 bool isSigned, float scale, float* heights);
+
+    }
+}
+
+#endif
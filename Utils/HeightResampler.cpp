@@ -0,0 +1,278 @@
+// Height resampling util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Utils/HeightResampler.h>
+
+#include <Core/Thread.h>
+#include <Logging/Logger.h>
+
+#include <algorithm>
+#include <vector>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        static const float PI = 3.14159265358979f;
+
+        static inline float FilterSupport(HeightFilter filter){
+            switch (filter){
+            case HEIGHT_FILTER_BICUBIC: return 2;
+            case HEIGHT_FILTER_LANCZOS: return 3;
+            default: return 1;
+            }
+        }
+
+        static inline float Sinc(float x){
+            if (x == 0) return 1;
+            x *= PI;
+            return sin(x) / x;
+        }
+
+        static inline float FilterWeight(HeightFilter filter, float x){
+            x = fabs(x);
+            switch (filter){
+            case HEIGHT_FILTER_BICUBIC:
+                if (x < 1) return (1.5f * x - 2.5f) * x * x + 1;
+                if (x < 2) return ((-0.5f * x + 2.5f) * x - 4) * x + 2;
+                return 0;
+            case HEIGHT_FILTER_LANCZOS:
+                return x < 3 ? Sinc(x) * Sinc(x / 3) : 0;
+            default:
+                return x < 1 ? 1 - x : 0;
+            }
+        }
+
+        /**
+         * The source heights and weights of each destination height
+         * along an axis. Destination i is the sum of weights[i *
+         * taps + k] times source first[i] + k, for k below count[i].
+         */
+        struct ResampleWeights {
+            std::vector<int> first, count;
+            std::vector<float> weights;
+            int taps;
+        };
+
+        static void CalcWeights(int sourceSize, int size, float step, HeightFilter filter, 
+                                ResampleWeights& w){
+            float scale = step > 1 ? step : 1;
+            float radius = FilterSupport(filter) * scale;
+            w.taps = (int)ceil(2 * radius) + 1;
+            w.first.resize(size);
+            w.count.resize(size);
+            w.weights.assign(size * w.taps, 0.0f);
+
+            for (int i = 0; i < size; ++i){
+                float center = i * step;
+                int lo = (int)ceil(center - radius);
+                int hi = (int)floor(center + radius);
+                // Extend the edges by moving the weights outside the
+                // source onto the edge.
+                int first = lo < 0 ? 0 : (lo >= sourceSize ? sourceSize - 1 : lo);
+                float* weights = &w.weights[i * w.taps];
+                float sum = 0;
+                for (int j = lo; j <= hi; ++j){
+                    int s = j < 0 ? 0 : (j >= sourceSize ? sourceSize - 1 : j);
+                    float weight = FilterWeight(filter, (j - center) / scale);
+                    weights[s - first] += weight;
+                    sum += weight;
+                }
+                if (sum != 0)
+                    for (int k = 0; k < w.taps; ++k)
+                        weights[k] /= sum;
+                else{
+                    int nearest = (int)floor(center + 0.5f);
+                    first = nearest < 0 ? 0 : (nearest >= sourceSize ? sourceSize - 1 : nearest);
+                    for (int k = 0; k < w.taps; ++k)
+                        weights[k] = 0;
+                    weights[0] = 1;
+                }
+                w.first[i] = first;
+                // The taps inside the source.
+                w.count[i] = std::min(w.taps, sourceSize - first);
+            }
+        }
+
+        /**
+         * A pass over bands of rows, run by the resampling threads.
+         */
+        class ResamplePass {
+        public:
+            virtual ~ResamplePass() {}
+            virtual void Run(int rowStart, int rowEnd) = 0;
+        };
+
+        /**
+         * Filters the source rows into the intermediate rows.
+         */
+        class RowPass : public ResamplePass {
+        public:
+            const float* source;
+            int sourceColumns, stride;
+            float* dest;
+            int columns;
+            const ResampleWeights* weights;
+
+            void Run(int rowStart, int rowEnd){
+                int taps = weights->taps;
+                for (int r = rowStart; r < rowEnd; ++r){
+                    const float* in = source + r * sourceColumns * stride;
+                    float* out = dest + r * columns;
+                    for (int c = 0; c < columns; ++c){
+                        const float* h = in + weights->first[c] * stride;
+                        const float* w = &weights->weights[c * taps];
+                        int count = weights->count[c];
+                        float sum = 0;
+                        for (int k = 0; k < count; ++k)
+                            sum += w[k] * h[k * stride];
+                        out[c] = sum;
+                    }
+                }
+            }
+        };
+
+        /**
+         * Filters the intermediate rows into the destination rows,
+         * all the columns of a row at once.
+         */
+        class ColumnPass : public ResamplePass {
+        public:
+            const float* source;
+            float* dest;
+            int columns;
+            const ResampleWeights* weights;
+
+            void Run(int rowStart, int rowEnd){
+                int taps = weights->taps;
+                for (int r = rowStart; r < rowEnd; ++r){
+                    const float* in = source + weights->first[r] * columns;
+                    const float* w = &weights->weights[r * taps];
+                    int count = weights->count[r];
+                    float* out = dest + r * columns;
+                    int c = 0;
+#ifdef __SSE2__
+                    for (; c + 4 <= columns; c += 4){
+                        __m128 sum = _mm_setzero_ps();
+                        for (int k = 0; k < count; ++k)
+                            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[k]), 
+                                                             _mm_loadu_ps(in + k * columns + c)));
+                        _mm_storeu_ps(out + c, sum);
+                    }
+#endif
+                    for (; c < columns; ++c){
+                        float sum = 0;
+                        for (int k = 0; k < count; ++k)
+                            sum += w[k] * in[k * columns + c];
+                        out[c] = sum;
+                    }
+                }
+            }
+        };
+
+        class ResampleWorker : public Core::Thread {
+        private:
+            ResamplePass* pass;
+            int rowStart, rowEnd;
+        public:
+            ResampleWorker(ResamplePass* pass, int rowStart, int rowEnd)
+                : pass(pass), rowStart(rowStart), rowEnd(rowEnd) {}
+            void Run() { pass->Run(rowStart, rowEnd); }
+        };
+
+        /**
+         * Runs the pass over the rows in a band per thread.
+         */
+        static void RunBands(ResamplePass& pass, int rows, int threads){
+            if (threads > rows) threads = rows;
+            if (threads <= 1){
+                pass.Run(0, rows);
+                return;
+            }
+            std::vector<ResampleWorker*> workers;
+            for (int t = 1; t < threads; ++t){
+                workers.push_back(new ResampleWorker(&pass, rows * t / threads, rows * (t + 1) / threads));
+                workers.back()->Start();
+            }
+            // The first band on this thread.
+            pass.Run(0, rows / threads);
+            for (unsigned int t = 0; t < workers.size(); ++t){
+                workers[t]->Wait();
+                delete workers[t];
+            }
+        }
+
+        void ResampleHeights(const float* source, int sourceColumns, int sourceRows, int sourceStride,
+                             float* dest, int columns, int rows, float columnStep, float rowStep,
+                             HeightFilter filter, int threads){
+            if (sourceColumns <= 0 || sourceRows <= 0 || columns <= 0 || rows <= 0) return;
+
+            ResampleWeights columnWeights, rowWeights;
+            CalcWeights(sourceColumns, columns, columnStep, filter, columnWeights);
+            CalcWeights(sourceRows, rows, rowStep, filter, rowWeights);
+            
+            // Only the source rows used by the destination are
+            // filtered.
+            int firstRow = rowWeights.first[0];
+            int lastRow = rowWeights.first[rows - 1] + rowWeights.count[rows - 1];
+            for (int r = 0; r < rows; ++r)
+                rowWeights.first[r] -= firstRow;
+            std::vector<float> filtered((lastRow - firstRow) * columns);
+
+            RowPass rowPass;
+            rowPass.source = source + firstRow * sourceColumns * sourceStride;
+            rowPass.sourceColumns = sourceColumns;
+            rowPass.stride = sourceStride;
+            rowPass.dest = &filtered[0];
+            rowPass.columns = columns;
+            rowPass.weights = &columnWeights;
+            RunBands(rowPass, lastRow - firstRow, threads);
+
+            ColumnPass columnPass;
+            columnPass.source = &filtered[0];
+            columnPass.dest = dest;
+            columnPass.columns = columns;
+            columnPass.weights = &rowWeights;
+            RunBands(columnPass, rows, threads);
+        }
+
+        FloatTexture2DPtr ResampleHeights(FloatTexture2DPtr tex, int columns, int rows, 
+                                          float columnStep, float rowStep,
+                                          HeightFilter filter, int threads){
+            if (columns <= 0 || rows <= 0){
+                logger.error << "Can't resample heights to " << columns << " by " << rows << "." << logger.end;
+                return FloatTexture2DPtr();
+            }
+            tex->Load();
+            FloatTexture2DPtr result = FloatTexture2DPtr(new Texture2D<float>(columns, rows, LUMINANCE32F));
+            result->SetWrapping(tex->GetWrapping());
+            result->Load();
+            ResampleHeights(tex->GetData(), tex->GetWidth(), tex->GetHeight(), tex->GetChannels(),
+                            result->GetData(), columns, rows, columnStep, rowStep, filter, threads);
+            return result;
+        }
+
+        FloatTexture2DPtr ResampleHeights(FloatTexture2DPtr tex, int columns, int rows, 
+                                          HeightFilter filter, int threads){
+            float columnStep = columns > 1 ? (tex->GetWidth() - 1) / (float)(columns - 1) : 0;
+            float rowStep = rows > 1 ? (tex->GetHeight() - 1) / (float)(rows - 1) : 0;
+            return ResampleHeights(tex, columns, rows, columnStep, rowStep, filter, threads);
+        }
+
+        int CalcPatchAlignedSize(int size, int squares){
+            int patches = (int)floor((size - 1) / (float)squares + 0.5f);
+            return (patches < 1 ? 1 : patches) * squares + 1;
+        }
+
+    }
+}
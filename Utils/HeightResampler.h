@@ -0,0 +1,69 @@
+// Height resampling util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHT_RESAMPLER_UTIL_FUNCTIONS_H_
+#define _HEIGHT_RESAMPLER_UTIL_FUNCTIONS_H_
+
+#include <Resources/Texture2D.h>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * The filters heights are resampled with. Bicubic is
+         * Catmull-Rom and Lanczos has three lobes. Both keep
+         * ridges sharper than bilinear, but overshoot at cliffs.
+         */
+        enum HeightFilter { HEIGHT_FILTER_BILINEAR, HEIGHT_FILTER_BICUBIC, HEIGHT_FILTER_LANCZOS };
+
+        /**
+         * Resamples a grid of heights with a separable filter, the
+         * rows first and then the columns. The destination height
+         * at (c, r) is the source at (c * columnStep, r * rowStep),
+         * with the edges of the source extended. When the steps are
+         * larger than one the filter is widened by the step, so
+         * downsampling averages the heights instead of skipping
+         * them.
+         *
+         * The rows are split into bands resampled by the given
+         * number of threads. The columns are filtered four at a
+         * time with SSE2 when available.
+         *
+         * @param sourceStride The distance between the heights of a
+         * source row, which follow each other.
+         */
+        void ResampleHeights(const float* source, int sourceColumns, int sourceRows, int sourceStride,
+                             float* dest, int columns, int rows, float columnStep, float rowStep,
+                             HeightFilter filter, int threads = 1);
+
+        /**
+         * Resamples the first channel of the texture into a new
+         * LUMINANCE32F texture, see above.
+         */
+        FloatTexture2DPtr ResampleHeights(FloatTexture2DPtr tex, int columns, int rows, 
+                                          float columnStep, float rowStep,
+                                          HeightFilter filter, int threads = 1);
+        /**
+         * Resamples the texture to the size, keeping the corners.
+         */
+        FloatTexture2DPtr ResampleHeights(FloatTexture2DPtr tex, int columns, int rows, 
+                                          HeightFilter filter, int threads = 1);
+
+        /**
+         * The size of the form n * squares + 1 nearest the size,
+         * with n at least one.
+         */
+        int CalcPatchAlignedSize(int size, int squares);
+
+    }
+}
+
+#endif
@@ -0,0 +1,515 @@
+// Height tile pyramid util classes
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Utils/HeightTiles.h>
+
+#include <Utils/HeightCodec.h>
+#include <Utils/NormalEncoding.h>
+#include <Core/Thread.h>
+#include <Logging/Logger.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        // The header is the magic, the version, three reserved
+        // bytes, the columns, rows, tile squares, levels and tiles,
+        // the spacing and the height bounds.
+        static const unsigned char MAGIC[4] = { 'O', 'E', 'H', 'T' };
+        static const unsigned char VERSION = 1;
+
+        static inline void WriteUInt(unsigned char* p, unsigned int v){
+            p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+        }
+
+        static inline unsigned int ReadUInt(const unsigned char* p){
+            return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+        }
+
+        static inline unsigned int FloatBits(float f){
+            unsigned int u;
+            memcpy(&u, &f, sizeof(u));
+            return u;
+        }
+
+        static inline float BitsFloat(unsigned int u){
+            float f;
+            memcpy(&f, &u, sizeof(f));
+            return f;
+        }
+
+        /**
+         * The samples across the level above, every other sample
+         * and the last one.
+         */
+        static inline int CalcLevelSamples(const int samples){
+            return samples / 2 + 1;
+        }
+
+        static inline int CalcTiles(const int samples, const int tileSquares){
+            return samples <= 1 ? 1 : (samples - 2) / tileSquares + 1;
+        }
+
+        static int CalcLevels(int columns, int rows, const int tileSquares){
+            int levels = 1;
+            while (CalcTiles(columns, tileSquares) > 1 || CalcTiles(rows, tileSquares) > 1){
+                columns = CalcLevelSamples(columns);
+                rows = CalcLevelSamples(rows);
+                ++levels;
+            }
+            return levels;
+        }
+
+        /**
+         * A level of the pyramid being baked, holding the rows of
+         * it's current band of tiles, the row above it and the row
+         * below it. The rows are padded with their last sample to
+         * the width of the tiles.
+         */
+        class HeightTileLevel {
+        public:
+            int columns, rows, tileSquares;
+            int tilesAcross, tilesDown;
+            int paddedColumns, paddedRows;
+            float spacing;
+            unsigned int firstTile;
+
+            std::deque<std::vector<float> > buffer;
+            int firstRow, rowsAdded, rowsPassed, band;
+            // The last row filtered for the level above.
+            std::vector<float> temp, filtered;
+
+            HeightTileLevel(int columns, int rows, int tileSquares, float spacing, unsigned int firstTile)
+                : columns(columns), rows(rows), tileSquares(tileSquares),
+                  tilesAcross(CalcTiles(columns, tileSquares)), tilesDown(CalcTiles(rows, tileSquares)),
+                  paddedColumns(tilesAcross * tileSquares + 1), paddedRows(tilesDown * tileSquares + 1),
+                  spacing(spacing), firstTile(firstTile),
+                  firstRow(0), rowsAdded(0), rowsPassed(0), band(0),
+                  temp(columns), filtered(CalcLevelSamples(columns)) {}
+
+            void AddRow(const float* heights){
+                buffer.push_back(std::vector<float>(paddedColumns));
+                float* row = &buffer.back()[0];
+                memcpy(row, heights, sizeof(float) * columns);
+                std::fill(row + columns, row + paddedColumns, heights[columns-1]);
+                ++rowsAdded;
+            }
+
+            void AddPaddingRow(){
+                buffer.push_back(buffer.back());
+                ++rowsAdded;
+            }
+
+            inline const float* Row(const int r) const {
+                return &buffer[r - firstRow][0];
+            }
+
+            bool IsBandReady() const {
+                return band < tilesDown &&
+                    rowsAdded > std::min((band + 1) * tileSquares + 1, paddedRows - 1);
+            }
+
+            /**
+             * Drops the rows only the current band needed and moves
+             * on to the next band.
+             */
+            void NextBand(){
+                ++band;
+                while (firstRow < band * tileSquares - 1){
+                    buffer.pop_front();
+                    ++firstRow;
+                }
+            }
+
+            /**
+             * Filters row r of the level above, from rows 2r - 1 to
+             * 2r + 1 of this level, with a tent filter, into
+             * filtered.
+             */
+            void FilterRow(const int r){
+                const float* above = Row(std::max(2 * r - 1, 0));
+                const float* center = Row(std::min(2 * r, rows - 1));
+                const float* below = Row(std::min(2 * r + 1, rows - 1));
+                for (int c = 0; c < columns; ++c)
+                    temp[c] = 0.25f * above[c] + 0.5f * center[c] + 0.25f * below[c];
+                for (int c = 0; c < (int)filtered.size(); ++c)
+                    filtered[c] = 0.25f * temp[std::max(2 * c - 1, 0)] + 0.5f * temp[std::min(2 * c, columns - 1)]
+                        + 0.25f * temp[std::min(2 * c + 1, columns - 1)];
+            }
+        };
+
+        /**
+         * The neighbours of sample i of n used for the slope, one
+         * sided at the edge and flat in the padding.
+         */
+        static inline void SlopeNeighbours(const int i, const int n, int& low, int& high){
+            low = std::max(i - 1, 0);
+            high = i < n - 1 ? i + 1 : i;
+        }
+
+        /**
+         * Appends the encoded heights and normals of the tile in
+         * the level's current band to data.
+         */
+        static void BakeTile(const HeightTileLevel& level, const int column, const float maxError,
+                             std::vector<unsigned char>& data, float& minHeight, float& maxHeight){
+            int side = level.tileSquares + 1;
+            int columnStart = column * level.tileSquares;
+            int rowStart = level.band * level.tileSquares;
+
+            std::vector<float> heights(side * side);
+            std::vector<float> normals(side * side * 3);
+            minHeight = maxHeight = level.Row(rowStart)[columnStart];
+            for (int r = 0; r < side; ++r){
+                int rr = rowStart + r;
+                const float* row = level.Row(rr) + columnStart;
+                float* h = &heights[r * side];
+                memcpy(h, row, sizeof(float) * side);
+                for (int c = 0; c < side; ++c){
+                    minHeight = std::min(minHeight, h[c]);
+                    maxHeight = std::max(maxHeight, h[c]);
+                }
+
+                int up, down;
+                SlopeNeighbours(rr, level.rows, up, down);
+                const float* upRow = level.Row(up);
+                const float* downRow = level.Row(down);
+                float zSpan = down > up ? 1.0f / ((down - up) * level.spacing) : 0;
+                float* n = &normals[r * side * 3];
+                for (int c = 0; c < side; ++c, n += 3){
+                    int cc = columnStart + c;
+                    int left, right;
+                    SlopeNeighbours(cc, level.columns, left, right);
+                    float xSpan = right > left ? 1.0f / ((right - left) * level.spacing) : 0;
+                    const float* fullRow = level.Row(rr);
+                    n[0] = (fullRow[left] - fullRow[right]) * xSpan;
+                    n[1] = 1;
+                    n[2] = (upRow[cc] - downRow[cc]) * zSpan;
+                    float invLength = 1.0f / sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                    n[0] *= invLength; n[1] *= invLength; n[2] *= invLength;
+                }
+            }
+
+            EncodeHeights(&heights[0], side, side, 1, side, maxError, data);
+            // The decoded heights may be off by the error, the
+            // bounds must still hold them for culling.
+            minHeight -= maxError;
+            maxHeight += maxError;
+            unsigned int start = data.size();
+            data.resize(start + side * side * 2);
+            EncodeNormals(&normals[0], side * side, &data[start], NORMAL_OCT8);
+        }
+
+        struct HeightTileBand {
+            std::vector<std::vector<unsigned char> > data;
+            std::vector<float> minHeights, maxHeights;
+        };
+
+        static void BakeTiles(const HeightTileLevel& level, int first, int step,
+                              float maxError, HeightTileBand& band){
+            for (int c = first; c < level.tilesAcross; c += step)
+                BakeTile(level, c, maxError, band.data[c], band.minHeights[c], band.maxHeights[c]);
+        }
+
+        class HeightTileWorker : public Core::Thread {
+        private:
+            const HeightTileLevel& level;
+            int first, step;
+            float maxError;
+            HeightTileBand& band;
+        public:
+            HeightTileWorker(const HeightTileLevel& level, int first, int step,
+                             float maxError, HeightTileBand& band)
+                : level(level), first(first), step(step), maxError(maxError), band(band) {}
+            void Run() { BakeTiles(level, first, step, maxError, band); }
+        };
+
+        HeightTileBaker::HeightTileBaker(int columns, int rows, int tileSquares,
+                                         float spacing, float maxError, int threads)
+            : columns(columns), rows(rows), tileSquares(tileSquares),
+              spacing(spacing), maxError(maxError), threads(threads < 1 ? 1 : threads),
+              offset(0), rowsAdded(0), minHeight(0), maxHeight(0) {
+            if (columns <= 0 || rows <= 0 || tileSquares < 2 || tileSquares % 2 != 0){
+                logger.error << "Can't bake " << columns << " by " << rows
+                             << " heights into tiles of " << tileSquares << " squares." << logger.end;
+                return;
+            }
+            int levelCount = CalcLevels(columns, rows, tileSquares);
+            unsigned int tileCount = 0;
+            for (int l = 0; l < levelCount; ++l){
+                HeightTileLevel* level = new HeightTileLevel(columns, rows, tileSquares,
+                                                             spacing * (1 << l), tileCount);
+                levels.push_back(level);
+                tileCount += level->tilesAcross * level->tilesDown;
+                columns = CalcLevelSamples(columns);
+                rows = CalcLevelSamples(rows);
+            }
+            tiles.resize(tileCount);
+        }
+
+        HeightTileBaker::~HeightTileBaker(){
+            for (unsigned int l = 0; l < levels.size(); ++l)
+                delete levels[l];
+        }
+
+        bool HeightTileBaker::Open(const std::string& file){
+            if (levels.empty()) return false;
+            out.open(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!out){
+                logger.error << "Can't write tiles to " << file << logger.end;
+                return false;
+            }
+            // Room for the header and index, written when closing.
+            offset = HEIGHT_TILES_HEADER_SIZE + HEIGHT_TILES_INDEX_ENTRY_SIZE * (unsigned long long)tiles.size();
+            std::vector<char> zeros(offset);
+            out.write(&zeros[0], zeros.size());
+            return out.good();
+        }
+
+        bool HeightTileBaker::AddRow(const float* heights){
+            if (!out.is_open() || rowsAdded >= rows){
+                logger.error << "Can't add row " << rowsAdded << " of " << rows << " to the tiles." << logger.end;
+                return false;
+            }
+            ++rowsAdded;
+            return AddLevelRow(0, heights);
+        }
+
+        /**
+         * Adds the row to the level and passes the filtered row it
+         * completes, if any, up to the next level. The row is
+         * filtered before the band is written, which drops the rows
+         * above it.
+         */
+        bool HeightTileBaker::AddLevelRow(const unsigned int l, const float* heights){
+            HeightTileLevel* level = levels[l];
+            level->AddRow(heights);
+            int r = level->rowsAdded - 1;
+            bool pass = l + 1 < levels.size() && r % 2 == 1;
+            if (pass)
+                level->FilterRow(level->rowsPassed++);
+            while (level->IsBandReady())
+                if (!WriteBand(level)) return false;
+            return !pass || AddLevelRow(l + 1, &level->filtered[0]);
+        }
+
+        bool HeightTileBaker::WriteBand(HeightTileLevel* level){
+            HeightTileBand band;
+            band.data.resize(level->tilesAcross);
+            band.minHeights.resize(level->tilesAcross);
+            band.maxHeights.resize(level->tilesAcross);
+
+            int workerCount = std::min(threads, level->tilesAcross);
+            std::vector<HeightTileWorker*> workers;
+            for (int t = 1; t < workerCount; ++t){
+                workers.push_back(new HeightTileWorker(*level, t, workerCount, maxError, band));
+                workers.back()->Start();
+            }
+            BakeTiles(*level, 0, workerCount, maxError, band);
+            for (unsigned int t = 0; t < workers.size(); ++t){
+                workers[t]->Wait();
+                delete workers[t];
+            }
+
+            for (int c = 0; c < level->tilesAcross; ++c){
+                HeightTileInfo& info = tiles[level->firstTile + level->band * level->tilesAcross + c];
+                info.offset = offset;
+                info.size = band.data[c].size();
+                info.minHeight = band.minHeights[c];
+                info.maxHeight = band.maxHeights[c];
+                out.write((const char*)&band.data[c][0], info.size);
+                offset += info.size;
+
+                if (level == levels[0]){
+                    bool first = level->band == 0 && c == 0;
+                    minHeight = first ? info.minHeight : std::min(minHeight, info.minHeight);
+                    maxHeight = first ? info.maxHeight : std::max(maxHeight, info.maxHeight);
+                }
+            }
+            level->NextBand();
+
+            if (!out){
+                logger.error << "Can't write tiles." << logger.end;
+                return false;
+            }
+            return true;
+        }
+
+        bool HeightTileBaker::Close(){
+            if (!out.is_open()) return false;
+            if (rowsAdded != rows){
+                logger.error << "Only " << rowsAdded << " of " << rows << " rows were added to the tiles." << logger.end;
+                out.close();
+                return false;
+            }
+
+            for (unsigned int l = 0; l < levels.size(); ++l){
+                HeightTileLevel* level = levels[l];
+                // The last filtered rows need rows past the edge.
+                if (l + 1 < levels.size())
+                    while (level->rowsPassed < levels[l+1]->rows){
+                        level->FilterRow(level->rowsPassed++);
+                        if (!AddLevelRow(l + 1, &level->filtered[0])) return false;
+                    }
+                while (level->rowsAdded < level->paddedRows){
+                    level->AddPaddingRow();
+                    while (level->IsBandReady())
+                        if (!WriteBand(level)) return false;
+                }
+            }
+
+            std::vector<unsigned char> header(HEIGHT_TILES_HEADER_SIZE + HEIGHT_TILES_INDEX_ENTRY_SIZE * tiles.size());
+            unsigned char* p = &header[0];
+            memcpy(p, MAGIC, 4);
+            p[4] = VERSION;
+            p[5] = p[6] = p[7] = 0;
+            WriteUInt(p + 8, columns);
+            WriteUInt(p + 12, rows);
+            WriteUInt(p + 16, tileSquares);
+            WriteUInt(p + 20, levels.size());
+            WriteUInt(p + 24, tiles.size());
+            WriteUInt(p + 28, FloatBits(spacing));
+            WriteUInt(p + 32, FloatBits(minHeight));
+            WriteUInt(p + 36, FloatBits(maxHeight));
+            p += HEIGHT_TILES_HEADER_SIZE;
+            for (unsigned int t = 0; t < tiles.size(); ++t, p += HEIGHT_TILES_INDEX_ENTRY_SIZE){
+                WriteUInt(p, tiles[t].offset);
+                WriteUInt(p + 4, tiles[t].offset >> 32);
+                WriteUInt(p + 8, tiles[t].size);
+                WriteUInt(p + 12, FloatBits(tiles[t].minHeight));
+                WriteUInt(p + 16, FloatBits(tiles[t].maxHeight));
+            }
+            out.seekp(0);
+            out.write((const char*)&header[0], header.size());
+            out.close();
+            if (out.fail()){
+                logger.error << "Can't write the tile index." << logger.end;
+                return false;
+            }
+            return true;
+        }
+
+        HeightTileFile::HeightTileFile()
+            : columns(0), rows(0), tileSquares(0), levels(0),
+              spacing(0), minHeight(0), maxHeight(0) {}
+
+        bool HeightTileFile::Open(const std::string& file){
+            if (in.is_open()) in.close();
+            in.clear();
+            in.open(file.c_str(), std::ios::in | std::ios::binary);
+            unsigned char header[HEIGHT_TILES_HEADER_SIZE];
+            if (!in || !in.read((char*)header, HEIGHT_TILES_HEADER_SIZE) ||
+                memcmp(header, MAGIC, 4) != 0 || header[4] != VERSION){
+                logger.error << file << " is not a height tile file." << logger.end;
+                in.close();
+                return false;
+            }
+            columns = ReadUInt(header + 8);
+            rows = ReadUInt(header + 12);
+            tileSquares = ReadUInt(header + 16);
+            levels = ReadUInt(header + 20);
+            unsigned int tileCount = ReadUInt(header + 24);
+            spacing = BitsFloat(ReadUInt(header + 28));
+            minHeight = BitsFloat(ReadUInt(header + 32));
+            maxHeight = BitsFloat(ReadUInt(header + 36));
+
+            // Check the sizes before allocating the index.
+            bool valid = columns > 0 && rows > 0 && tileSquares >= 2 && tileSquares % 2 == 0 &&
+                levels == CalcLevels(columns, rows, tileSquares);
+            levelStart.clear();
+            unsigned int expected = 0;
+            for (int l = 0; valid && l < levels; ++l){
+                levelStart.push_back(expected);
+                expected += GetTilesAcross(l) * GetTilesDown(l);
+            }
+            if (!valid || tileCount != expected){
+                logger.error << file << " has a corrupt header." << logger.end;
+                in.close();
+                return false;
+            }
+
+            std::vector<unsigned char> index(HEIGHT_TILES_INDEX_ENTRY_SIZE * tileCount);
+            if (!in.read((char*)&index[0], index.size())){
+                logger.error << file << " has a corrupt index." << logger.end;
+                in.close();
+                return false;
+            }
+            tiles.resize(tileCount);
+            const unsigned char* p = &index[0];
+            for (unsigned int t = 0; t < tileCount; ++t, p += HEIGHT_TILES_INDEX_ENTRY_SIZE){
+                tiles[t].offset = ReadUInt(p) | ((unsigned long long)ReadUInt(p + 4) << 32);
+                tiles[t].size = ReadUInt(p + 8);
+                tiles[t].minHeight = BitsFloat(ReadUInt(p + 12));
+                tiles[t].maxHeight = BitsFloat(ReadUInt(p + 16));
+            }
+            return true;
+        }
+
+        int HeightTileFile::GetTilesAcross(const int level) const {
+            int samples = columns;
+            for (int l = 0; l < level; ++l)
+                samples = CalcLevelSamples(samples);
+            return CalcTiles(samples, tileSquares);
+        }
+
+        int HeightTileFile::GetTilesDown(const int level) const {
+            int samples = rows;
+            for (int l = 0; l < level; ++l)
+                samples = CalcLevelSamples(samples);
+            return CalcTiles(samples, tileSquares);
+        }
+
+        const HeightTileInfo& HeightTileFile::GetTileInfo(const int level, const int column, const int row) const {
+            return tiles[levelStart[level] + row * GetTilesAcross(level) + column];
+        }
+
+        bool HeightTileFile::ReadTile(const int level, const int column, const int row,
+                                      float* heights, float* normals){
+            if (!in.is_open() || level < 0 || level >= levels ||
+                column < 0 || column >= GetTilesAcross(level) || row < 0 || row >= GetTilesDown(level)){
+                logger.error << "Can't read tile " << column << ", " << row << " of level " << level << logger.end;
+                return false;
+            }
+            const HeightTileInfo& info = GetTileInfo(level, column, row);
+            int side = tileSquares + 1;
+            unsigned int normalsSize = side * side * 2;
+            data.resize(info.size);
+            in.clear();
+            in.seekg(info.offset);
+            int encodedColumns, encodedRows;
+            if (info.size < normalsSize || !in.read((char*)&data[0], info.size) ||
+                !GetEncodedHeightsSize(&data[0], info.size - normalsSize, encodedColumns, encodedRows) ||
+                encodedColumns != side || encodedRows != side ||
+                !DecodeHeights(&data[0], info.size - normalsSize, heights, 1, side)){
+                logger.error << "Tile " << column << ", " << row << " of level " << level << " is corrupt." << logger.end;
+                return false;
+            }
+            if (normals){
+                const unsigned char* encoded = &data[info.size - normalsSize];
+                for (int i = 0; i < side * side; ++i)
+                    DecodeNormal(encoded + 2 * i, normals + 3 * i, NORMAL_OCT8);
+            }
+            return true;
+        }
+
+        FloatTexture2DPtr HeightTileFile::ReadTileHeights(const int level, const int column, const int row){
+            int side = tileSquares + 1;
+            FloatTexture2DPtr tex = FloatTexture2DPtr(new Texture2D<float>(side, side, LUMINANCE32F));
+            tex->Load();
+            if (!ReadTile(level, column, row, tex->GetData()))
+                return FloatTexture2DPtr();
+            return tex;
+        }
+
+    }
+}
@@ -0,0 +1,172 @@
+// Height tile pyramid util classes
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHT_TILES_UTIL_CLASSES_H_
+#define _HEIGHT_TILES_UTIL_CLASSES_H_
+
+#include <Resources/Texture2D.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * A height tile file holds a heightmap too large to load as
+         * a pyramid of tiles, which can be paged in one at a time.
+         *
+         * Level 0 holds the heightmap's samples and each level above
+         * holds every other sample of the one below, tent filtered,
+         * up to the first level covered by a single tile. The tiles
+         * of a level are tileSquares + 1 samples on each side and
+         * share their edge samples with their neighbours, so a tile
+         * of 256 squares is a HeightMapNode of 8 by 8 patches and
+         * neighbouring tiles meet without cracks. Tiles past the
+         * edges of the map repeat the edge samples.
+         *
+         * A tile is stored as it's heights encoded by EncodeHeights,
+         * followed by it's OCT8 encoded normals, which are computed
+         * across the tile edges. The index after the header holds
+         * the offset, size and height bounds of every tile, level
+         * by level and row by row, so tiles can be culled before
+         * they are read. Everything is little endian.
+         */
+        static const unsigned int HEIGHT_TILES_HEADER_SIZE = 40;
+        static const unsigned int HEIGHT_TILES_INDEX_ENTRY_SIZE = 20;
+        static const int DEFAULT_TILE_SQUARES = 256;
+
+        struct HeightTileInfo {
+            unsigned long long offset;
+            unsigned int size;
+            float minHeight, maxHeight;
+        };
+
+        class HeightTileLevel;
+
+        /**
+         * Bakes a heightmap streamed a row at a time into a height
+         * tile file.
+         *
+         * Each level only keeps the rows of it's current band of
+         * tiles and the rows around it, so the memory used grows
+         * with the width of the heightmap, not it's size. A level
+         * passes it's filtered rows up to the next level as they
+         * arrive, so the whole pyramid is built in a single pass.
+         * The tiles of a band are encoded by the given number of
+         * threads.
+         */
+        class HeightTileBaker {
+        protected:
+            int columns, rows, tileSquares;
+            float spacing, maxError;
+            int threads;
+
+            std::vector<HeightTileLevel*> levels;
+            std::vector<HeightTileInfo> tiles;
+            std::ofstream out;
+            unsigned long long offset;
+            int rowsAdded;
+            float minHeight, maxHeight;
+
+        public:
+            /**
+             * @param tileSquares The squares across a tile, even and
+             * preferably a multiple of the patch size.
+             * @param spacing The distance between the samples of
+             * level 0, for the normals.
+             * @param maxError The maximum error of the encoded
+             * heights, or zero for lossless.
+             */
+            HeightTileBaker(int columns, int rows, int tileSquares = DEFAULT_TILE_SQUARES,
+                            float spacing = 1, float maxError = 0, int threads = 1);
+            ~HeightTileBaker();
+
+            bool Open(const std::string& file);
+            /**
+             * Adds the next row of columns heights.
+             */
+            bool AddRow(const float* heights);
+            /**
+             * Bakes the last tiles and writes the index. All rows
+             * must have been added.
+             */
+            bool Close();
+
+            int GetNumberOfLevels() const { return levels.size(); }
+            unsigned int GetNumberOfTiles() const { return tiles.size(); }
+            unsigned long long GetBytesWritten() const { return offset; }
+
+        protected:
+            bool AddLevelRow(const unsigned int l, const float* heights);
+            bool WriteBand(HeightTileLevel* level);
+        };
+
+        /**
+         * Reads the tiles of a height tile file.
+         *
+         * The file stays open between reads, so a file should only
+         * be read by one thread at a time.
+         */
+        class HeightTileFile {
+        protected:
+            std::ifstream in;
+            int columns, rows, tileSquares, levels;
+            float spacing, minHeight, maxHeight;
+            std::vector<HeightTileInfo> tiles;
+            std::vector<unsigned int> levelStart;
+            std::vector<unsigned char> data;
+
+        public:
+            HeightTileFile();
+
+            bool Open(const std::string& file);
+            bool IsOpen() const { return in.is_open(); }
+
+            /**
+             * The size of level 0.
+             */
+            int GetColumns() const { return columns; }
+            int GetRows() const { return rows; }
+            int GetTileSquares() const { return tileSquares; }
+            int GetNumberOfLevels() const { return levels; }
+            int GetTilesAcross(const int level) const;
+            int GetTilesDown(const int level) const;
+            /**
+             * The distance between the samples of the level.
+             */
+            float GetSpacing(const int level) const { return spacing * (1 << level); }
+            float GetMinHeight() const { return minHeight; }
+            float GetMaxHeight() const { return maxHeight; }
+
+            const HeightTileInfo& GetTileInfo(const int level, const int column, const int row) const;
+
+            /**
+             * Reads the tile's (tileSquares + 1)^2 heights, row by
+             * row, and it's normals as 3 floats each, if normals is
+             * not NULL.
+             */
+            bool ReadTile(const int level, const int column, const int row,
+                          float* heights, float* normals = NULL);
+            /**
+             * Reads the tile's heights into a LUMINANCE32F texture
+             * for a HeightMapNode.
+             *
+             * @return An empty pointer if the tile can't be read.
+             */
+            FloatTexture2DPtr ReadTileHeights(const int level, const int column, const int row);
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,141 @@
+// Normal encoding util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Utils/NormalEncoding.h>
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        static inline unsigned char Quantize(float v){
+            float q = floor(v * 127.5f + 128.0f);
+            return q < 0 ? 0 : (q > 255 ? 255 : (unsigned char)q);
+        }
+
+        static inline float Dequantize(unsigned char q){
+            return q / 127.5f - 1.0f;
+        }
+
+        static inline void EncodeNormal(const float* n, unsigned char* e, NormalEncoding encoding){
+            float x = n[0], y = n[1], z = n[2];
+            if (encoding == NORMAL_OCT8){
+                float l = fabs(x) + fabs(y) + fabs(z);
+                x /= l; z /= l;
+                if (y < 0){
+                    // Fold the lower half over the diagonals.
+                    float fx = (1 - fabs(z)) * (x < 0 ? -1 : 1);
+                    float fz = (1 - fabs(x)) * (z < 0 ? -1 : 1);
+                    x = fx; z = fz;
+                }
+            }
+            e[0] = Quantize(x);
+            e[1] = Quantize(z);
+        }
+
+        void DecodeNormal(const unsigned char* e, float* n, NormalEncoding encoding){
+            float x = Dequantize(e[0]), z = Dequantize(e[1]), y;
+            if (encoding == NORMAL_OCT8){
+                y = 1 - fabs(x) - fabs(z);
+                if (y < 0){
+                    float fx = (1 - fabs(z)) * (x < 0 ? -1 : 1);
+                    float fz = (1 - fabs(x)) * (z < 0 ? -1 : 1);
+                    x = fx; z = fz;
+                }
+            }else{
+                y = 1 - x * x - z * z;
+                y = y > 0 ? sqrt(y) : 0;
+            }
+            float l = sqrt(x * x + y * y + z * z);
+            n[0] = x / l; n[1] = y / l; n[2] = z / l;
+        }
+
+#ifdef __SSE2__
+        /**
+         * Encodes 4 normals.
+         */
+        static inline void EncodeNormals4(const float* n, unsigned char* e, NormalEncoding encoding){
+            // Transpose x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3.
+            __m128 a = _mm_loadu_ps(n);
+            __m128 b = _mm_loadu_ps(n + 4);
+            __m128 c = _mm_loadu_ps(n + 8);
+            __m128 x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+            __m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), 
+                                      _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+            if (encoding == NORMAL_OCT8){
+                __m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), 
+                                          _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+                const __m128 sign = _mm_set1_ps(-0.0f);
+                const __m128 one = _mm_set1_ps(1.0f);
+                __m128 ax = _mm_andnot_ps(sign, x);
+                __m128 az = _mm_andnot_ps(sign, z);
+                __m128 l = _mm_add_ps(_mm_add_ps(ax, _mm_andnot_ps(sign, y)), az);
+                x = _mm_div_ps(x, l);
+                z = _mm_div_ps(z, l);
+                ax = _mm_andnot_ps(sign, x);
+                az = _mm_andnot_ps(sign, z);
+                // Fold where y < 0.
+                __m128 fx = _mm_or_ps(_mm_sub_ps(one, az), _mm_and_ps(sign, x));
+                __m128 fz = _mm_or_ps(_mm_sub_ps(one, ax), _mm_and_ps(sign, z));
+                __m128 lower = _mm_cmplt_ps(y, _mm_setzero_ps());
+                x = _mm_or_ps(_mm_and_ps(lower, fx), _mm_andnot_ps(lower, x));
+                z = _mm_or_ps(_mm_and_ps(lower, fz), _mm_andnot_ps(lower, z));
+            }
+
+            // Quantize, rounding down like the scalar version.
+            const __m128 scale = _mm_set1_ps(127.5f);
+            const __m128 bias = _mm_set1_ps(128.0f);
+            __m128i qx = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, scale), bias));
+            __m128i qz = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(z, scale), bias));
+            // Interleave to x0 z0 x1 z1 ... and saturate to bytes.
+            __m128i q = _mm_packs_epi32(_mm_unpacklo_epi32(qx, qz), _mm_unpackhi_epi32(qx, qz));
+            q = _mm_packus_epi16(q, q);
+            _mm_storel_epi64((__m128i*)e, q);
+        }
+#endif
+
+        void EncodeNormals(const float* normals, unsigned int count, 
+                           unsigned char* encoded, NormalEncoding encoding){
+            unsigned int i = 0;
+#ifdef __SSE2__
+            for (; i + 4 <= count; i += 4)
+                EncodeNormals4(normals + i * 3, encoded + i * 2, encoding);
+#endif
+            for (; i < count; ++i)
+                EncodeNormal(normals + i * 3, encoded + i * 2, encoding);
+        }
+
+        NormalEncodingError CalcNormalEncodingError(const float* normals, unsigned int count,
+                                                    const unsigned char* encoded, NormalEncoding encoding){
+            NormalEncodingError error;
+            error.mean = error.max = 0;
+            if (count == 0) return error;
+
+            double sum = 0;
+            for (unsigned int i = 0; i < count; ++i){
+                const float* n = normals + i * 3;
+                float d[3];
+                DecodeNormal(encoded + i * 2, d, encoding);
+                float cosine = n[0] * d[0] + n[1] * d[1] + n[2] * d[2];
+                cosine = cosine > 1 ? 1 : (cosine < -1 ? -1 : cosine);
+                float angle = acos(cosine) * 180.0f / M_PI;
+                sum += angle;
+                if (angle > error.max) error.max = angle;
+            }
+            error.mean = sum / count;
+            return error;
+        }
+
+    }
+}
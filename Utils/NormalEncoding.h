@@ -0,0 +1,52 @@
+// Normal encoding util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _NORMAL_ENCODING_UTIL_FUNCTIONS_H_
+#define _NORMAL_ENCODING_UTIL_FUNCTIONS_H_
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * Two channel 8 bit normal encodings, where y is up.
+         *
+         * XZ8 stores x and z and reconstructs y as sqrt(1 - x^2 -
+         * z^2), so it only holds normals pointing up. OCT8 stores
+         * the normal projected onto an octahedron unfolded to a
+         * square, which holds any normal and spreads the precision
+         * more evenly.
+         *
+         * Both map [-1, 1] to [0, 255].
+         */
+        enum NormalEncoding { NORMAL_XZ8, NORMAL_OCT8 };
+
+        struct NormalEncodingError {
+            // In degrees
+            float mean, max;
+        };
+
+        /**
+         * Encodes count normals, given as 3 floats each, into 2
+         * bytes each. Uses SSE2 when available.
+         */
+        void EncodeNormals(const float* normals, unsigned int count, 
+                           unsigned char* encoded, NormalEncoding encoding);
+        void DecodeNormal(const unsigned char* encoded, float* normal, NormalEncoding encoding);
+
+        /**
+         * The angle between the normals and their decoded
+         * encodings.
+         */
+        NormalEncodingError CalcNormalEncodingError(const float* normals, unsigned int count,
+                                                    const unsigned char* encoded, NormalEncoding encoding);
+
+    }
+}
+
+#endif
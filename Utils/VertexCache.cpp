@@ -0,0 +1,186 @@
+// Vertex cache util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#include <Utils/VertexCache.h>
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <math.h>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        int ConvertStripToList(const unsigned int* strip, int count, unsigned int* list){
+            int i = 0;
+            for (int t = 2; t < count; ++t){
+                unsigned int a = strip[t-2], b = strip[t-1], c = strip[t];
+                if (a == b || b == c || a == c) continue;
+                // Every other triangle in a strip is wound backwards.
+                if (t % 2 == 0){
+                    list[i++] = a; list[i++] = b; list[i++] = c;
+                }else{
+                    list[i++] = b; list[i++] = a; list[i++] = c;
+                }
+            }
+            return i;
+        }
+
+        /**
+         * The scoring from
+         * http://home.comcast.net/~tom_forsyth/papers/fast_vert_cache_opt.html
+         */
+        static float CalcVertexScore(int cachePosition, int remaining, int cacheSize){
+            if (remaining == 0) return -1;
+
+            float score = 0;
+            if (cachePosition >= 0){
+                if (cachePosition < 3)
+                    // The last triangle's vertices are scored lower,
+                    // so it's neighbours don't only extend a strip.
+                    score = 0.75f;
+                else
+                    score = pow(1.0f - float(cachePosition - 3) / float(cacheSize - 3), 1.5f);
+            }
+            // Favor vertices with few triangles left, so lone
+            // triangles are not left behind.
+            score += 2.0f / sqrt(float(remaining));
+            return score;
+        }
+
+        void OptimizeVertexCache(unsigned int* indices, int count, int cacheSize){
+            int triangles = count / 3;
+            if (triangles < 2 || cacheSize < 4) return;
+
+            // Map the indices to consecutive vertices.
+            std::map<unsigned int, int> vertexMap;
+            std::vector<int> corners(count);
+            for (int i = 0; i < count; ++i){
+                std::map<unsigned int, int>::iterator itr = vertexMap.find(indices[i]);
+                if (itr == vertexMap.end())
+                    itr = vertexMap.insert(std::make_pair(indices[i], (int)vertexMap.size())).first;
+                corners[i] = itr->second;
+            }
+            int vertices = vertexMap.size();
+
+            // The triangles using each vertex.
+            std::vector<int> remaining(vertices, 0);
+            for (int i = 0; i < count; ++i)
+                ++remaining[corners[i]];
+            std::vector<int> firstTriangle(vertices + 1, 0);
+            for (int v = 0; v < vertices; ++v)
+                firstTriangle[v+1] = firstTriangle[v] + remaining[v];
+            std::vector<int> vertexTriangles(count);
+            std::vector<int> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+            for (int i = 0; i < count; ++i)
+                vertexTriangles[fill[corners[i]]++] = i / 3;
+
+            std::vector<int> cachePosition(vertices, -1);
+            std::vector<float> vertexScore(vertices);
+            for (int v = 0; v < vertices; ++v)
+                vertexScore[v] = CalcVertexScore(-1, remaining[v], cacheSize);
+
+            std::vector<float> triangleScore(triangles);
+            std::vector<bool> emitted(triangles, false);
+            for (int t = 0; t < triangles; ++t)
+                triangleScore[t] = vertexScore[corners[3*t]] + vertexScore[corners[3*t+1]] + vertexScore[corners[3*t+2]];
+
+            // The cache holds three extra entries for the vertices
+            // pushed out by the last triangle.
+            std::vector<int> cache, newCache;
+            cache.reserve(cacheSize + 3);
+            newCache.reserve(cacheSize + 3);
+
+            std::vector<unsigned int> result(count);
+            int next = 0;
+            int best = std::max_element(triangleScore.begin(), triangleScore.end()) - triangleScore.begin();
+            while (best >= 0){
+                emitted[best] = true;
+                for (int c = 0; c < 3; ++c){
+                    int v = corners[3*best+c];
+                    result[next++] = indices[3*best+c];
+                    --remaining[v];
+                    // Remove the triangle from the vertex's list.
+                    int* begin = &vertexTriangles[firstTriangle[v]];
+                    int* end = begin + remaining[v] + 1;
+                    *std::find(begin, end, best) = *(end - 1);
+                }
+
+                // Move the triangle's vertices to the front.
+                newCache.clear();
+                for (int c = 0; c < 3; ++c)
+                    newCache.push_back(corners[3*best+c]);
+                for (unsigned int i = 0; i < cache.size(); ++i)
+                    if (std::find(newCache.begin(), newCache.begin() + 3, cache[i]) == newCache.begin() + 3)
+                        newCache.push_back(cache[i]);
+                cache.swap(newCache);
+
+                // Rescore the vertices in the cache and their
+                // triangles, and pick the best one among them.
+                for (unsigned int i = 0; i < cache.size(); ++i){
+                    int v = cache[i];
+                    cachePosition[v] = (int)i < cacheSize ? i : -1;
+                    vertexScore[v] = CalcVertexScore(cachePosition[v], remaining[v], cacheSize);
+                }
+                best = -1;
+                float bestScore = -1;
+                for (unsigned int i = 0; i < cache.size(); ++i){
+                    int v = cache[i];
+                    for (int j = 0; j < remaining[v]; ++j){
+                        int t = vertexTriangles[firstTriangle[v] + j];
+                        float score = vertexScore[corners[3*t]] + vertexScore[corners[3*t+1]] + vertexScore[corners[3*t+2]];
+                        triangleScore[t] = score;
+                        if (score > bestScore){
+                            bestScore = score;
+                            best = t;
+                        }
+                    }
+                }
+                if ((int)cache.size() > cacheSize)
+                    cache.resize(cacheSize);
+
+                // Nothing left in the cache, start over from the best
+                // remaining triangle.
+                if (best < 0 && next < count){
+                    for (int t = 0; t < triangles; ++t)
+                        if (!emitted[t] && triangleScore[t] > bestScore){
+                            bestScore = triangleScore[t];
+                            best = t;
+                        }
+                }
+            }
+
+            std::copy(result.begin(), result.end(), indices);
+        }
+
+        float CalcACMR(const unsigned int* indices, int count, int cacheSize, bool fifo){
+            int triangles = count / 3;
+            if (triangles == 0) return 0;
+
+            std::vector<unsigned int> cache;
+            cache.reserve(cacheSize + 1);
+            int misses = 0;
+            for (int i = 0; i < triangles * 3; ++i){
+                std::vector<unsigned int>::iterator itr = std::find(cache.begin(), cache.end(), indices[i]);
+                if (itr == cache.end()){
+                    ++misses;
+                    cache.insert(cache.begin(), indices[i]);
+                    if ((int)cache.size() > cacheSize)
+                        cache.pop_back();
+                }else if (!fifo){
+                    // Move the hit to the front.
+                    cache.erase(itr);
+                    cache.insert(cache.begin(), indices[i]);
+                }
+            }
+            return float(misses) / float(triangles);
+        }
+
+    }
+}
@@ -0,0 +1,48 @@
+// Vertex cache util functions
+// -------------------------------------------------------------------
+// Copyright (C) 2007 OpenEngine.dk (See AUTHORS) 
+// 
+// This program is free software; It is covered by the GNU General 
+// Public License version 2 or any later version. 
+// See the GNU General Public License for more details (see LICENSE). 
+//--------------------------------------------------------------------
+
+#ifndef _VERTEX_CACHE_UTIL_FUNCTIONS_H_
+#define _VERTEX_CACHE_UTIL_FUNCTIONS_H_
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * Converts a triangle strip to a triangle list with the same
+         * winding, dropping the degenerate triangles. The list must
+         * have room for 3 * (count - 2) indices.
+         *
+         * @return The number of indices in the list.
+         */
+        int ConvertStripToList(const unsigned int* strip, int count, unsigned int* list);
+
+        /**
+         * Reorders the triangles of a triangle list in place to
+         * reuse the post transform vertex cache, using Tom Forsyth's
+         * linear speed vertex cache optimisation. The order of the
+         * triangles' corners is kept.
+         */
+        void OptimizeVertexCache(unsigned int* indices, int count, int cacheSize = 32);
+
+        /**
+         * Simulates a vertex cache of the given size on a triangle
+         * list.
+         *
+         * @param fifo Replace the oldest entry on a miss if true,
+         * otherwise the least recently used.
+         *
+         * @return The average cache miss ratio, the number of
+         * vertices transformed per triangle.
+         */
+        float CalcACMR(const unsigned int* indices, int count, int cacheSize, bool fifo = true);
+
+    }
+}
+
+#endif